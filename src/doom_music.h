@@ -26,6 +26,10 @@
 // MIDI channels
 #define MIDI_CHANNELS_PER_TRACK 16
 
+// mus_player_render_parallel failures
+#define MUS_RENDER_ERR_PARAM -1
+#define MUS_RENDER_ERR_MEMORY -2
+
 // GENMIDI operator structure (from Chocolate Doom)
 typedef struct {
     Bit8u tremolo;       // Tremolo/vibrato/sustain/KSR/multiplier
@@ -63,19 +67,37 @@ typedef enum {
 // MUS player forward declaration
 typedef struct mus_player_s mus_player_t;
 
+// Parsed GENMIDI bank, musdoom_genmidi_t in the public API. Reference
+// counted with shared_retain/shared_release (shared.h).
+typedef struct musdoom_genmidi genmidi_bank_t;
+
 // MUS player functions
 mus_player_t* mus_player_create(int sample_rate);
+mus_player_t* mus_player_clone(const mus_player_t* player);
 void mus_player_destroy(mus_player_t* player);
 int mus_player_load(mus_player_t* player, const uint8_t* data, size_t size);
+int mus_player_load_midi(mus_player_t* player, const uint8_t* data, size_t size);
 int mus_player_load_instruments(mus_player_t* player, const uint8_t* data, size_t size);
+genmidi_bank_t* genmidi_bank_create(const uint8_t* data, size_t size);
+void mus_player_set_instruments(mus_player_t* player, genmidi_bank_t* bank);
 void mus_player_start(mus_player_t* player, int looping);
 void mus_player_stop(mus_player_t* player);
 int mus_player_is_playing(mus_player_t* player);
 size_t mus_player_generate(mus_player_t* player, int16_t* buffer, size_t num_samples);
 uint32_t mus_player_get_position_ms(mus_player_t* player);
+void mus_player_seek(mus_player_t* player, uint64_t sample);
+int mus_player_render_parallel(mus_player_t* player, int16_t* buffer, size_t num_samples, int workers);
+uint32_t mus_player_get_length_ticks(mus_player_t* player);
+uint64_t mus_player_get_length_samples(mus_player_t* player);
+uint32_t mus_player_get_length_ms(mus_player_t* player);
 void mus_player_set_master_volume(mus_player_t* player, int volume);
 void mus_player_set_driver_version(mus_player_t* player, opl_driver_ver_t version);
 void mus_player_set_opl3_mode(mus_player_t* player, int opl3_mode);
+int mus_player_set_resampler(mus_player_t* player, int quality);
+void mus_player_get_write_stats(mus_player_t* player, uint64_t* writes, uint64_t* suppressed);
+void mus_player_reset_write_stats(mus_player_t* player);
+void mus_player_save_state(mus_player_t* player, state_writer_t* w);
+int mus_player_load_state(mus_player_t* player, state_reader_t* r);
 
 // Channel data
 typedef struct {
@@ -116,8 +138,6 @@ struct musdoom_emulator {
     opl3_chip opl_chip;
     
     // Instruments
-    genmidi_instr_t *main_instrs;
-    genmidi_instr_t *perc_instrs;
     int instruments_loaded;
     
     // MUS player
@@ -144,9 +164,8 @@ struct musdoom_emulator {
     uint64_t current_time_us;
     uint64_t song_length_us;
     
-    // Music data
-    const uint8_t *music_data;
-    size_t music_size;
+    // Music loaded
+    int loaded;
 };
 
 // Volume table
@@ -40,8 +40,6 @@ typedef bool boolean;
 #define MUS_PERCUSSION_CHAN 15
 
 // OPL constants
-#define OPL_NUM_OPERATORS 21
-#define OPL_NUM_VOICES 9
 #define OPL_WRITEBUF_SIZE 1024
 #define OPL_WRITEBUF_DELAY 2
 
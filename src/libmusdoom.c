@@ -11,9 +11,16 @@
 
 #include "libmusdoom.h"
 #include "doom_music.h"
+#include "threadpool.h"
+#include "shared.h"
+#include "mus2mid.h"
 
 // Version string
-#define MUSDOOM_VERSION "1.0.0"
+#define MUSDOOM_VERSION "2.0.0"
+
+// State snapshots: "MDST", and the format version
+#define MUSDOOM_STATE_MAGIC   0x5453444dU
+#define MUSDOOM_STATE_VERSION 1
 
 // Library version
 const char* musdoom_version(void) {
@@ -35,6 +42,8 @@ const char* musdoom_error_string(musdoom_error_t error) {
             return "Not initialized";
         case MUSDOOM_ERR_ALREADY_INITIALIZED:
             return "Already initialized";
+        case MUSDOOM_ERR_ABORTED:
+            return "Aborted";
         default:
             return "Unknown error";
     }
@@ -50,10 +59,21 @@ musdoom_error_t musdoom_config_init(musdoom_config_t* config) {
     config->opl_type = MUSDOOM_OPL3;
     config->doom_version = MUSDOOM_DOOM_1_9;
     config->initial_volume = 100;
+    config->resampler = MUSDOOM_RESAMPLER_LINEAR;
     
     return MUSDOOM_OK;
 }
 
+// Check a configuration's fields against their allowed values
+static int config_is_valid(const musdoom_config_t* config) {
+    return config->sample_rate > 0
+        && ((int)config->opl_type == MUSDOOM_OPL2 || (int)config->opl_type == MUSDOOM_OPL3)
+        && (int)config->doom_version >= MUSDOOM_DOOM_1_1_666
+        && (int)config->doom_version <= MUSDOOM_DOOM_1_9
+        && (int)config->resampler >= MUSDOOM_RESAMPLER_LINEAR
+        && (int)config->resampler <= MUSDOOM_RESAMPLER_HALFBAND;
+}
+
 // Create emulator instance
 musdoom_emulator_t* musdoom_create(const musdoom_config_t* config) {
     musdoom_emulator_t* emu;
@@ -63,6 +83,9 @@ musdoom_emulator_t* musdoom_create(const musdoom_config_t* config) {
         musdoom_config_init(&default_config);
         config = &default_config;
     }
+    if (!config_is_valid(config)) {
+        return NULL;
+    }
     
     emu = (musdoom_emulator_t*)calloc(1, sizeof(musdoom_emulator_t));
     if (!emu) {
@@ -82,6 +105,12 @@ musdoom_emulator_t* musdoom_create(const musdoom_config_t* config) {
         return NULL;
     }
 
+    if (mus_player_set_resampler(emu->mus_player, (int)config->resampler) != 0) {
+        mus_player_destroy(emu->mus_player);
+        free(emu);
+        return NULL;
+    }
+
     mus_player_set_driver_version(emu->mus_player, emu->driver_version);
     mus_player_set_opl3_mode(emu->mus_player, emu->opl3_mode);
     mus_player_set_master_volume(emu->mus_player, emu->current_volume);
@@ -89,6 +118,29 @@ musdoom_emulator_t* musdoom_create(const musdoom_config_t* config) {
     return emu;
 }
 
+// Copy an emulator, sharing its music and instruments
+musdoom_emulator_t* musdoom_clone(const musdoom_emulator_t* emu) {
+    musdoom_emulator_t* copy;
+    
+    if (!emu) {
+        return NULL;
+    }
+    
+    copy = (musdoom_emulator_t*)malloc(sizeof(musdoom_emulator_t));
+    if (!copy) {
+        return NULL;
+    }
+    
+    *copy = *emu;
+    copy->mus_player = mus_player_clone(emu->mus_player);
+    if (!copy->mus_player) {
+        free(copy);
+        return NULL;
+    }
+    
+    return copy;
+}
+
 // Destroy emulator
 void musdoom_destroy(musdoom_emulator_t* emu) {
     if (!emu) return;
@@ -100,8 +152,6 @@ void musdoom_destroy(musdoom_emulator_t* emu) {
         mus_player_destroy(emu->mus_player);
     }
     
-    free(emu->main_instrs);
-    free(emu->perc_instrs);
     free(emu);
 }
 
@@ -119,9 +169,24 @@ musdoom_error_t musdoom_load(musdoom_emulator_t* emu, const uint8_t* data, size_
         return MUSDOOM_ERR_INVALID_DATA;
     }
     
-    // Store the data reference
-    emu->music_data = data;
-    emu->music_size = size;
+    emu->loaded = 1;
+    
+    return MUSDOOM_OK;
+}
+
+// Load MIDI music
+musdoom_error_t musdoom_load_midi(musdoom_emulator_t* emu, const uint8_t* data, size_t size) {
+    if (!emu || !data || size == 0) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    
+    musdoom_unload(emu);
+    
+    if (mus_player_load_midi(emu->mus_player, data, size) != 0) {
+        return MUSDOOM_ERR_INVALID_DATA;
+    }
+    
+    emu->loaded = 1;
     
     return MUSDOOM_OK;
 }
@@ -134,13 +199,12 @@ void musdoom_unload(musdoom_emulator_t* emu) {
         mus_player_stop(emu->mus_player);
     }
     
-    emu->music_data = NULL;
-    emu->music_size = 0;
+    emu->loaded = 0;
 }
 
 // Start playback
 musdoom_error_t musdoom_start(musdoom_emulator_t* emu, int looping) {
-    if (!emu || !emu->music_data) {
+    if (!emu || !emu->loaded) {
         return MUSDOOM_ERR_INVALID_PARAM;
     }
     
@@ -237,37 +301,442 @@ uint32_t musdoom_get_position_ms(musdoom_emulator_t* emu) {
 
 // Get length in milliseconds
 uint32_t musdoom_get_length_ms(musdoom_emulator_t* emu) {
-    if (!emu) return 0;
-    // Approximate length - would need to parse entire file for exact length
-    return 180000;  // 3 minutes default
+    if (!emu || !emu->loaded) return 0;
+    return mus_player_get_length_ms(emu->mus_player);
+}
+
+// Get length in output samples
+uint64_t musdoom_get_length_samples(musdoom_emulator_t* emu) {
+    if (!emu || !emu->loaded) return 0;
+    return mus_player_get_length_samples(emu->mus_player);
+}
+
+// Get length in MUS ticks
+uint32_t musdoom_get_length_ticks(musdoom_emulator_t* emu) {
+    if (!emu || !emu->loaded) return 0;
+    return mus_player_get_length_ticks(emu->mus_player);
 }
 
 // Seek to position
 musdoom_error_t musdoom_seek_ms(musdoom_emulator_t* emu, uint32_t position_ms) {
-    if (!emu) {
+    if (!emu || !emu->loaded) {
         return MUSDOOM_ERR_INVALID_PARAM;
     }
     
-    // For now, just restart from beginning
-    // Full implementation would need to parse events to seek
-    musdoom_stop(emu);
-    musdoom_start(emu, emu->looping);
+    // A stopped or finished song plays again from the new position; the
+    // pause state is kept
+    mus_player_seek(emu->mus_player,
+                    (uint64_t)position_ms * (uint64_t)emu->sample_rate / 1000);
+    
+    emu->playing = mus_player_is_playing(emu->mus_player);
+    emu->current_time_us = mus_player_get_position_ms(emu->mus_player) * 1000ULL;
+    
+    return MUSDOOM_OK;
+}
+
+// Render the start of the song on several threads
+musdoom_error_t musdoom_render_parallel(musdoom_emulator_t* emu, int16_t* buffer,
+                                        size_t num_samples, int num_threads) {
+    if (!emu || !emu->loaded || (!buffer && num_samples > 0) || num_threads < 0) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    
+    if (num_threads == 0) {
+        num_threads = thread_pool_cpu_count();
+    }
+    switch (mus_player_render_parallel(emu->mus_player, buffer, num_samples, num_threads)) {
+        case 0:
+            break;
+        case MUS_RENDER_ERR_MEMORY:
+            return MUSDOOM_ERR_OUT_OF_MEMORY;
+        default:
+            return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    
+    emu->playing = 0;
+    emu->current_time_us = 0;
     
     return MUSDOOM_OK;
 }
 
+// Save the playback state: a header, the emulator's flags, then the player
+musdoom_error_t musdoom_save_state(musdoom_emulator_t* emu, void* buffer,
+                                   size_t buffer_size, size_t* state_size) {
+    state_writer_t w;
+    
+    if (!emu || !emu->loaded || !state_size) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    
+    w.data = (uint8_t*)buffer;
+    w.size = buffer ? buffer_size : 0;
+    w.pos = 0;
+    state_put_u32(&w, MUSDOOM_STATE_MAGIC);
+    state_put_u16(&w, MUSDOOM_STATE_VERSION);
+    state_put_u8(&w, emu->playing);
+    state_put_u8(&w, emu->looping);
+    state_put_u8(&w, emu->paused);
+    state_put_u8(&w, emu->current_volume);
+    state_put_u8(&w, emu->start_volume);
+    state_put_u64(&w, emu->current_time_us);
+    mus_player_save_state(emu->mus_player, &w);
+    
+    *state_size = w.pos;
+    if (buffer && w.pos > buffer_size) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    return MUSDOOM_OK;
+}
+
+// Restore the playback state
+musdoom_error_t musdoom_load_state(musdoom_emulator_t* emu, const void* state,
+                                   size_t state_size) {
+    state_reader_t r;
+    int playing, looping, paused, current_volume, start_volume;
+    uint64_t current_time_us;
+    
+    if (!emu || !emu->loaded || !state) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    
+    r.data = (const uint8_t*)state;
+    r.size = state_size;
+    r.pos = 0;
+    r.error = 0;
+    if (state_get_u32(&r) != MUSDOOM_STATE_MAGIC
+     || state_get_u16(&r) != MUSDOOM_STATE_VERSION) {
+        return MUSDOOM_ERR_INVALID_DATA;
+    }
+    playing = state_get_u8(&r);
+    looping = state_get_u8(&r);
+    paused = state_get_u8(&r);
+    current_volume = state_get_u8(&r);
+    start_volume = state_get_u8(&r);
+    current_time_us = state_get_u64(&r);
+    if (current_volume > 127 || start_volume > 127
+     || mus_player_load_state(emu->mus_player, &r) != 0) {
+        return MUSDOOM_ERR_INVALID_DATA;
+    }
+    
+    emu->playing = playing;
+    emu->looping = looping;
+    emu->paused = paused;
+    emu->current_volume = current_volume;
+    emu->start_volume = start_volume;
+    emu->current_time_us = current_time_us;
+    
+    return MUSDOOM_OK;
+}
+
+// Get register write counts
+musdoom_error_t musdoom_get_write_stats(musdoom_emulator_t* emu, uint64_t* writes, uint64_t* suppressed) {
+    if (!emu) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    mus_player_get_write_stats(emu->mus_player, writes, suppressed);
+    return MUSDOOM_OK;
+}
+
+// Reset register write counts
+void musdoom_reset_write_stats(musdoom_emulator_t* emu) {
+    if (!emu) return;
+    mus_player_reset_write_stats(emu->mus_player);
+}
+
 // Load GENMIDI instruments
 musdoom_error_t musdoom_load_genmidi(musdoom_emulator_t* emu, const uint8_t* data, size_t size) {
+    musdoom_genmidi_t* genmidi;
+    
     if (!emu || !data || size < 8) {
         return MUSDOOM_ERR_INVALID_PARAM;
     }
     
-    // Load into MUS player
-    if (mus_player_load_instruments(emu->mus_player, data, size) != 0) {
+    genmidi = musdoom_genmidi_create(data, size);
+    if (!genmidi) {
         return MUSDOOM_ERR_INVALID_DATA;
     }
     
+    musdoom_set_genmidi(emu, genmidi);
+    musdoom_genmidi_release(genmidi);
+    
+    return MUSDOOM_OK;
+}
+
+// Parse a GENMIDI lump into a shareable bank
+musdoom_genmidi_t* musdoom_genmidi_create(const uint8_t* data, size_t size) {
+    return genmidi_bank_create(data, size);
+}
+
+musdoom_genmidi_t* musdoom_genmidi_retain(musdoom_genmidi_t* genmidi) {
+    return (musdoom_genmidi_t*)shared_retain(genmidi);
+}
+
+void musdoom_genmidi_release(musdoom_genmidi_t* genmidi) {
+    shared_release(genmidi);
+}
+
+// Use a parsed GENMIDI bank
+musdoom_error_t musdoom_set_genmidi(musdoom_emulator_t* emu, musdoom_genmidi_t* genmidi) {
+    if (!emu || !genmidi) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    
+    mus_player_set_instruments(emu->mus_player, genmidi);
     emu->instruments_loaded = 1;
     
     return MUSDOOM_OK;
 }
+
+// Initialize batch options with defaults
+musdoom_error_t musdoom_batch_options_init(musdoom_batch_options_t* options) {
+    if (!options) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    
+    options->num_workers = 0;
+    options->block_frames = 4096;
+    options->on_complete = NULL;
+    options->callback_user = NULL;
+    
+    return MUSDOOM_OK;
+}
+
+// Shared state of a running batch
+typedef struct {
+    musdoom_batch_job_t* jobs;
+    const musdoom_batch_options_t* options;
+    thread_pool_lock_t* lock;
+    musdoom_batch_stats_t stats;
+} batch_t;
+
+// Render one job's song to its sink
+static musdoom_error_t render_job(musdoom_batch_job_t* job, size_t block_frames) {
+    musdoom_emulator_t* emu;
+    musdoom_error_t err = MUSDOOM_OK;
+    int16_t* buffer;
+    uint64_t remaining;
+    
+    if (!job->mus_data || (job->config && !config_is_valid(job->config))) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    
+    // With the config checked, creation only fails for lack of memory
+    emu = musdoom_create(job->config);
+    buffer = (int16_t*)malloc(block_frames * 2 * sizeof(int16_t));
+    if (!emu || !buffer) {
+        musdoom_destroy(emu);
+        free(buffer);
+        return MUSDOOM_ERR_OUT_OF_MEMORY;
+    }
+    
+    if (job->genmidi_data) {
+        err = musdoom_load_genmidi(emu, job->genmidi_data, job->genmidi_size);
+    }
+    if (err == MUSDOOM_OK) {
+        err = musdoom_load(emu, job->mus_data, job->mus_size);
+    }
+    if (err == MUSDOOM_OK) {
+        err = musdoom_start(emu, 0);
+    }
+    
+    // Exactly the song, from the start to the end of score
+    remaining = err == MUSDOOM_OK ? musdoom_get_length_samples(emu) : 0;
+    while (remaining > 0) {
+        size_t frames = remaining < block_frames ? (size_t)remaining : block_frames;
+        
+        musdoom_generate_samples(emu, buffer, frames);
+        if (job->sink && job->sink(job->sink_user, buffer, frames) != 0) {
+            err = MUSDOOM_ERR_ABORTED;
+            break;
+        }
+        job->frames_rendered += frames;
+        remaining -= frames;
+    }
+    
+    musdoom_destroy(emu);
+    free(buffer);
+    return err;
+}
+
+static void run_batch_job(void* arg, size_t index, int worker) {
+    batch_t* batch = (batch_t*)arg;
+    musdoom_batch_job_t* job = &batch->jobs[index];
+    double start = thread_pool_time();
+    
+    (void)worker;
+    job->frames_rendered = 0;
+    job->result = render_job(job, batch->options->block_frames);
+    job->seconds = thread_pool_time() - start;
+    
+    thread_pool_lock(batch->lock);
+    if (job->result == MUSDOOM_OK) {
+        batch->stats.jobs_completed++;
+    } else {
+        batch->stats.jobs_failed++;
+    }
+    batch->stats.frames_rendered += job->frames_rendered;
+    if (batch->options->on_complete) {
+        batch->options->on_complete(batch->options->callback_user, index, job);
+    }
+    thread_pool_unlock(batch->lock);
+}
+
+// Render many songs on a pool of worker threads
+musdoom_error_t musdoom_render_batch(musdoom_batch_job_t* jobs, size_t num_jobs,
+                                     const musdoom_batch_options_t* options,
+                                     musdoom_batch_stats_t* stats) {
+    musdoom_batch_options_t default_options;
+    batch_t batch;
+    double start;
+    int workers;
+    
+    if (!jobs && num_jobs > 0) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    if (!options) {
+        musdoom_batch_options_init(&default_options);
+        options = &default_options;
+    }
+    if (options->num_workers < 0 || options->block_frames == 0) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    
+    memset(&batch, 0, sizeof(batch));
+    batch.jobs = jobs;
+    batch.options = options;
+    batch.lock = thread_pool_lock_create();
+    if (!batch.lock) {
+        return MUSDOOM_ERR_OUT_OF_MEMORY;
+    }
+    
+    workers = options->num_workers > 0 ? options->num_workers : thread_pool_cpu_count();
+    start = thread_pool_time();
+    thread_pool_run(workers, num_jobs, run_batch_job, &batch);
+    batch.stats.seconds = thread_pool_time() - start;
+    if (batch.stats.seconds > 0.0) {
+        batch.stats.frames_per_second = (double)batch.stats.frames_rendered / batch.stats.seconds;
+    }
+    
+    thread_pool_lock_destroy(batch.lock);
+    if (stats) {
+        *stats = batch.stats;
+    }
+    return MUSDOOM_OK;
+}
+
+// Output buffer to start a conversion with, from the MUS score length:
+// headers, an all-notes-off per channel, and half as much again as the
+// score
+#define MIDI_SIZE_HINT(score_len) (22 + 16 * 4 + 4 + (score_len) * 3 / 2)
+
+// MUS to MIDI converter: conversion state and a reusable output buffer
+struct musdoom_midi_converter {
+    mus2mid_t state;
+    MEMFILE* output;
+    int has_result;                 // output holds a finished conversion
+};
+
+// Is this a MUS lump the converter can read?
+static int is_mus_data(const uint8_t* mus, size_t mus_size) {
+    return mus && mus_size >= 14
+        && mus[0] == 'M' && mus[1] == 'U' && mus[2] == 'S' && mus[3] == 0x1a;
+}
+
+// Convert MUS to MIDI into a caller's buffer
+musdoom_error_t musdoom_mus_to_midi(const uint8_t* mus, size_t mus_size, void* buffer,
+                                    size_t buffer_size, size_t* midi_size) {
+    mus2mid_t converter;
+    
+    if (!mus || !midi_size) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    if (!is_mus_data(mus, mus_size)) {
+        return MUSDOOM_ERR_INVALID_DATA;
+    }
+    
+    mus2mid_init(&converter, NULL, (uint8_t*)buffer, buffer_size);
+    if (mus2mid_convert(&converter, mus, mus_size)) {
+        return MUSDOOM_ERR_INVALID_DATA;
+    }
+    
+    *midi_size = converter.length;
+    if (buffer && converter.length > buffer_size) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    return MUSDOOM_OK;
+}
+
+musdoom_midi_converter_t* musdoom_midi_converter_create(void) {
+    return (musdoom_midi_converter_t*)calloc(1, sizeof(musdoom_midi_converter_t));
+}
+
+void musdoom_midi_converter_destroy(musdoom_midi_converter_t* converter) {
+    if (!converter) return;
+    
+    if (converter->output) {
+        mem_fclose(converter->output);
+    }
+    free(converter);
+}
+
+// Convert MUS to MIDI into the converter's own buffer
+musdoom_error_t musdoom_midi_converter_convert(musdoom_midi_converter_t* converter,
+                                               const uint8_t* mus, size_t mus_size,
+                                               const uint8_t** midi, size_t* midi_size) {
+    void* data;
+    size_t size, hint;
+    
+    if (!converter || !mus || !midi || !midi_size) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    if (!is_mus_data(mus, mus_size)) {
+        return MUSDOOM_ERR_INVALID_DATA;
+    }
+    
+    // Reserve half as much again as the MUS score; the previous result is
+    // dropped but its buffer is kept
+    converter->has_result = 0;
+    hint = MIDI_SIZE_HINT((size_t)(mus[4] | (mus[5] << 8)));
+    if (!converter->output) {
+        converter->output = mem_fopen_write_size(hint);
+        if (!converter->output) {
+            return MUSDOOM_ERR_OUT_OF_MEMORY;
+        }
+    } else {
+        mem_reset(converter->output);
+        if (mem_reserve(converter->output, hint) != 0) {
+            return MUSDOOM_ERR_OUT_OF_MEMORY;
+        }
+    }
+    
+    mus2mid_init(&converter->state, converter->output, NULL, 0);
+    if (mus2mid_convert(&converter->state, mus, mus_size)) {
+        return MUSDOOM_ERR_INVALID_DATA;
+    }
+    
+    mem_get_buf(converter->output, &data, &size);
+    *midi = (const uint8_t*)data;
+    *midi_size = size;
+    converter->has_result = 1;
+    return MUSDOOM_OK;
+}
+
+// Hand the last conversion's buffer to the caller without copying it
+musdoom_error_t musdoom_midi_converter_take(musdoom_midi_converter_t* converter,
+                                            uint8_t** midi, size_t* midi_size) {
+    if (!converter || !midi || !midi_size) {
+        return MUSDOOM_ERR_INVALID_PARAM;
+    }
+    if (!converter->has_result) {
+        return MUSDOOM_ERR_NOT_INITIALIZED;
+    }
+    
+    // The stream is left empty; the next conversion allocates a new buffer
+    *midi = (uint8_t*)mem_take_buf(converter->output, midi_size);
+    converter->has_result = 0;
+    return MUSDOOM_OK;
+}
+
+void musdoom_free(void* ptr) {
+    free(ptr);
+}
@@ -36,6 +36,7 @@ typedef enum {
     MUSDOOM_ERR_INVALID_DATA = -3,
     MUSDOOM_ERR_NOT_INITIALIZED = -4,
     MUSDOOM_ERR_ALREADY_INITIALIZED = -5,
+    MUSDOOM_ERR_ABORTED = -6,
 } musdoom_error_t;
 
 /**
@@ -56,14 +57,33 @@ typedef enum {
     MUSDOOM_DOOM_1_9 = 2,       // Doom v1.9 (default)
 } musdoom_doom_version_t;
 
+/**
+ * Native OPL3 sample rate. Using it as sample_rate renders the chip
+ * output directly, with no resampling. Without the resampler's delay,
+ * register writes take effect one chip sample earlier, so the output
+ * differs from that of versions before 2.0 at this rate.
+ */
+#define MUSDOOM_NATIVE_RATE 49716
+
+/**
+ * Resampler quality used to convert the native 49716 Hz OPL output
+ * to the configured sample rate.
+ */
+typedef enum {
+    MUSDOOM_RESAMPLER_LINEAR = 0,   // Linear interpolation (default, original output)
+    MUSDOOM_RESAMPLER_SINC = 1,     // Windowed-sinc, alias-free
+    MUSDOOM_RESAMPLER_HALFBAND = 2, // Half-band lowpass + linear, cheap anti-aliasing
+} musdoom_resampler_t;
+
 /**
  * Configuration structure for the music emulator.
  */
 typedef struct {
-    int sample_rate;                // Audio sample rate in Hz (default: 44100)
+    int sample_rate;                // Audio sample rate in Hz, or MUSDOOM_NATIVE_RATE (default: 44100)
     musdoom_opl_type_t opl_type;    // OPL chip type (default: OPL3)
     musdoom_doom_version_t doom_version;  // Doom version emulation (default: 1.9)
     int initial_volume;             // Initial volume 0-127 (default: 100)
+    musdoom_resampler_t resampler;  // Resampler quality (default: linear)
 } musdoom_config_t;
 
 /**
@@ -71,6 +91,16 @@ typedef struct {
  */
 typedef struct musdoom_emulator musdoom_emulator_t;
 
+/**
+ * Opaque handle to a parsed GENMIDI instrument bank.
+ * 
+ * A bank is parsed once and can be used by any number of emulators, which
+ * hold references to it rather than copies. It is never modified, and
+ * its reference count is atomic, so emulators on different threads may
+ * share it.
+ */
+typedef struct musdoom_genmidi musdoom_genmidi_t;
+
 /**
  * Get the library version string.
  * 
@@ -98,10 +128,25 @@ musdoom_error_t musdoom_config_init(musdoom_config_t* config);
  * Create a new music emulator instance.
  * 
  * @param config Configuration for the emulator, or NULL for defaults
- * @return Handle to the emulator instance, or NULL on failure
+ * @return Handle to the emulator instance, or NULL if a config value is
+ *         out of range or memory runs out
  */
 musdoom_emulator_t* musdoom_create(const musdoom_config_t* config);
 
+/**
+ * Copy an emulator, including its playback position and state.
+ * 
+ * The copy continues exactly where the original is and is independent of
+ * it from then on: either can be played, reconfigured or destroyed
+ * without affecting the other. The decoded music and the instruments are
+ * shared rather than copied, which makes cloning much cheaper than
+ * creating an emulator and playing up to the same position.
+ * 
+ * @param emulator Handle to the emulator instance to copy
+ * @return Handle to the new emulator instance, or NULL on failure
+ */
+musdoom_emulator_t* musdoom_clone(const musdoom_emulator_t* emulator);
+
 /**
  * Destroy a music emulator instance and free all resources.
  * 
@@ -112,8 +157,8 @@ void musdoom_destroy(musdoom_emulator_t* emulator);
 /**
  * Load MUS music data into the emulator.
  * 
- * The data buffer must remain valid until musdoom_unload is called
- * or the emulator is destroyed.
+ * The score is decoded when it is loaded, so the data buffer may be
+ * freed as soon as this returns.
  * 
  * @param emulator Handle to the emulator instance
  * @param data Pointer to MUS file data
@@ -124,6 +169,28 @@ musdoom_error_t musdoom_load(musdoom_emulator_t* emulator,
                               const uint8_t* data, 
                               size_t size);
 
+/**
+ * Load a Standard MIDI File (format 0 or 1) into the emulator.
+ * 
+ * The file is played through the same DMX driver and GENMIDI instruments
+ * as MUS music. Its tracks are merged and its tempo changes resolved when
+ * it is loaded, with event times rounded to the 140 Hz ticks of the DMX
+ * timer, so that lengths and ticks are reported as for MUS music. Notes,
+ * program changes, pitch bends and the volume, pan, all notes off and
+ * reset controllers are played; other events are ignored.
+ * 
+ * The data buffer may be freed as soon as this returns.
+ * 
+ * @param emulator Handle to the emulator instance
+ * @param data Pointer to MIDI file data
+ * @param size Size of the MIDI data in bytes
+ * @return MUSDOOM_OK on success, MUSDOOM_ERR_INVALID_DATA if the data is
+ *         not a MIDI file the player supports
+ */
+musdoom_error_t musdoom_load_midi(musdoom_emulator_t* emulator,
+                                   const uint8_t* data,
+                                   size_t size);
+
 /**
  * Unload the current music data from the emulator.
  * 
@@ -212,16 +279,47 @@ uint32_t musdoom_get_position_ms(musdoom_emulator_t* emulator);
 /**
  * Get the total length of the current music in milliseconds.
  * 
+ * The length is exact: it is computed from the score when the music is
+ * loaded, and equals the playback position when a non-looping song ends.
+ * 
  * @param emulator Handle to the emulator instance
  * @return Total length in milliseconds, or 0 if no music is loaded
  */
 uint32_t musdoom_get_length_ms(musdoom_emulator_t* emulator);
 
+/**
+ * Get the total length of the current music in output samples.
+ * 
+ * This is the number of samples a non-looping song generates before
+ * playback ends.
+ * 
+ * @param emulator Handle to the emulator instance
+ * @return Total length in samples, or 0 if no music is loaded
+ */
+uint64_t musdoom_get_length_samples(musdoom_emulator_t* emulator);
+
+/**
+ * Get the total length of the current music in MUS ticks (140 per second).
+ * 
+ * @param emulator Handle to the emulator instance
+ * @return Total length in ticks, or 0 if no music is loaded
+ */
+uint32_t musdoom_get_length_ticks(musdoom_emulator_t* emulator);
+
 /**
  * Seek to a position in the music.
  * 
- * Note: Seeking in FM-synthesized music is approximate and may
- * not be sample-accurate.
+ * The score is replayed up to the position without synthesis, advancing
+ * each voice's envelope and phase over the skipped time exactly as
+ * rendering would, and the last few milliseconds are rendered to refill
+ * the resampler. From the position on, the audio is that of playing the
+ * song through on a new emulator, except that operators modulating
+ * themselves through feedback start from a different waveform history;
+ * the cost is a small fraction of rendering the skipped audio.
+ * 
+ * Playback (re)starts at the position if the music was stopped or had
+ * finished; a paused emulator stays paused. Looping music wraps positions
+ * past the end, otherwise the position is clamped to the end.
  * 
  * @param emulator Handle to the emulator instance
  * @param position_ms Position to seek to in milliseconds
@@ -229,6 +327,96 @@ uint32_t musdoom_get_length_ms(musdoom_emulator_t* emulator);
  */
 musdoom_error_t musdoom_seek_ms(musdoom_emulator_t* emulator, uint32_t position_ms);
 
+/**
+ * Render the start of the music on several threads at once.
+ * 
+ * The song is split into time segments. A fast pass over the score
+ * captures the complete player and chip state at each segment boundary,
+ * as a seek would, and the segments are then synthesized in parallel.
+ * The output is identical to playing the song once through (not looping)
+ * on a new emulator with the same configuration and volume, and takes a
+ * fraction of the wall-clock time for long songs.
+ * 
+ * Playback is left stopped; call musdoom_start to play the song again.
+ * 
+ * @param emulator Handle to the emulator instance
+ * @param buffer Output buffer for interleaved stereo samples (L, R, L, R, ...)
+ * @param num_samples Number of stereo sample frames to render from the
+ *                    start; frames past the end of the song hold the
+ *                    decaying tail, then silence
+ * @param num_threads Threads to use, 0 for one per processor
+ * @return MUSDOOM_OK on success, error code otherwise
+ */
+musdoom_error_t musdoom_render_parallel(musdoom_emulator_t* emulator,
+                                        int16_t* buffer,
+                                        size_t num_samples,
+                                        int num_threads);
+
+/**
+ * Save the complete playback state to a buffer.
+ * 
+ * The state covers the position in the score, the driver's channels and
+ * voices, the OPL chip and the resampler, in a versioned, portable format
+ * of a few kilobytes. It does not include the music or instruments: it
+ * can be restored into any emulator with the same configuration and the
+ * same music loaded.
+ * 
+ * Call with a NULL buffer to get the size needed.
+ * 
+ * @param emulator Handle to the emulator instance
+ * @param buffer Destination, or NULL to only query the size
+ * @param buffer_size Size of buffer in bytes
+ * @param state_size Receives the size of the state in bytes
+ * @return MUSDOOM_OK on success, MUSDOOM_ERR_INVALID_PARAM if no music is
+ *         loaded or the buffer is too small
+ */
+musdoom_error_t musdoom_save_state(musdoom_emulator_t* emulator,
+                                   void* buffer,
+                                   size_t buffer_size,
+                                   size_t* state_size);
+
+/**
+ * Restore playback state saved by musdoom_save_state.
+ * 
+ * Rendering then continues exactly as it would have from the point the
+ * state was saved, including the playing, paused and looping flags and
+ * the volume.
+ * 
+ * @param emulator Handle to the emulator instance
+ * @param state State data
+ * @param state_size Size of the state in bytes
+ * @return MUSDOOM_OK on success, MUSDOOM_ERR_INVALID_DATA if the state is
+ *         damaged, from another version, or was saved with different
+ *         music or configuration; the emulator is then unchanged
+ */
+musdoom_error_t musdoom_load_state(musdoom_emulator_t* emulator,
+                                   const void* state,
+                                   size_t state_size);
+
+/**
+ * Get the OPL register write counts.
+ * 
+ * Every register write the driver issues is counted; writes that would
+ * store the value a register already holds are suppressed and also
+ * counted separately. The counts run from emulator creation or the last
+ * musdoom_reset_write_stats, and are part of the saved state.
+ * 
+ * @param emulator Handle to the emulator instance
+ * @param writes Receives the writes issued, or NULL
+ * @param suppressed Receives the writes suppressed, or NULL
+ * @return MUSDOOM_OK on success, MUSDOOM_ERR_INVALID_PARAM if emulator is NULL
+ */
+musdoom_error_t musdoom_get_write_stats(musdoom_emulator_t* emulator,
+                                        uint64_t* writes,
+                                        uint64_t* suppressed);
+
+/**
+ * Reset the OPL register write counts to zero.
+ * 
+ * @param emulator Handle to the emulator instance
+ */
+void musdoom_reset_write_stats(musdoom_emulator_t* emulator);
+
 /**
  * Load GENMIDI instrument data from a WAD file.
  * 
@@ -244,6 +432,237 @@ musdoom_error_t musdoom_load_genmidi(musdoom_emulator_t* emulator,
                                       const uint8_t* data,
                                       size_t size);
 
+/**
+ * Parse GENMIDI instrument data into a bank that emulators can share.
+ * 
+ * The data is copied, so it need not stay valid afterwards. The bank
+ * starts with one reference, owned by the caller.
+ * 
+ * @param data Pointer to GENMIDI lump data (from WAD file)
+ * @param size Size of the GENMIDI data in bytes
+ * @return Handle to the bank, or NULL if the data is invalid or memory
+ *         runs out
+ */
+musdoom_genmidi_t* musdoom_genmidi_create(const uint8_t* data, size_t size);
+
+/**
+ * Take another reference to a GENMIDI bank.
+ * 
+ * @param genmidi Handle to the bank
+ * @return The same handle
+ */
+musdoom_genmidi_t* musdoom_genmidi_retain(musdoom_genmidi_t* genmidi);
+
+/**
+ * Drop a reference to a GENMIDI bank, freeing it with the last one.
+ * Emulators using the bank hold their own references.
+ * 
+ * @param genmidi Handle to the bank, or NULL
+ */
+void musdoom_genmidi_release(musdoom_genmidi_t* genmidi);
+
+/**
+ * Use a parsed GENMIDI bank for an emulator's instruments.
+ * 
+ * The emulator takes a reference to the bank and drops the one to its
+ * previous bank. Notes already playing keep sounding with the same
+ * instrument numbers of the new bank.
+ * 
+ * @param emulator Handle to the emulator instance
+ * @param genmidi Handle to the bank
+ * @return MUSDOOM_OK on success, error code otherwise
+ */
+musdoom_error_t musdoom_set_genmidi(musdoom_emulator_t* emulator,
+                                    musdoom_genmidi_t* genmidi);
+
+/**
+ * Output sink for a batch job. Called with each block of rendered
+ * interleaved stereo frames, in order, from a worker thread.
+ * 
+ * @param user The job's sink_user pointer
+ * @param samples Interleaved stereo samples
+ * @param frames Number of stereo frames in the block
+ * @return 0 to continue, nonzero to abort the job
+ */
+typedef int (*musdoom_sink_t)(void* user, const int16_t* samples, size_t frames);
+
+/**
+ * One song to render with musdoom_render_batch. The input fields are
+ * read-only during the batch; the result fields are filled in by it.
+ */
+typedef struct {
+    // Input
+    const uint8_t* mus_data;        // MUS lump
+    size_t mus_size;
+    const uint8_t* genmidi_data;    // GENMIDI lump (NULL renders silence)
+    size_t genmidi_size;
+    const musdoom_config_t* config; // Emulator configuration (NULL for defaults)
+    musdoom_sink_t sink;            // Receives the audio (NULL to discard it)
+    void* sink_user;                // Passed to sink
+
+    // Result
+    musdoom_error_t result;         // MUSDOOM_OK, or why the job failed
+    uint64_t frames_rendered;       // Stereo frames passed to the sink
+    double seconds;                 // Wall-clock time spent on the job
+} musdoom_batch_job_t;
+
+/**
+ * Called once per finished job, successful or not. Calls are serialized
+ * but come from worker threads, in completion order.
+ * 
+ * @param user The options' callback_user pointer
+ * @param index Index of the job in the batch
+ * @param job The finished job, with its result fields set
+ */
+typedef void (*musdoom_batch_callback_t)(void* user, size_t index, const musdoom_batch_job_t* job);
+
+/**
+ * Options for musdoom_render_batch.
+ */
+typedef struct {
+    int num_workers;                // Worker threads, 0 for one per processor (default: 0)
+    size_t block_frames;            // Frames per sink call (default: 4096)
+    musdoom_batch_callback_t on_complete;  // Per-job completion callback (default: NULL)
+    void* callback_user;            // Passed to on_complete
+} musdoom_batch_options_t;
+
+/**
+ * Totals for a batch.
+ */
+typedef struct {
+    size_t jobs_completed;          // Jobs that rendered to the end
+    size_t jobs_failed;             // Jobs with an error or aborted by their sink
+    uint64_t frames_rendered;       // Stereo frames rendered by all jobs
+    double seconds;                 // Wall-clock time for the whole batch
+    double frames_per_second;       // Throughput: frames_rendered / seconds
+} musdoom_batch_stats_t;
+
+/**
+ * Initialize batch options with defaults.
+ * 
+ * @param options Pointer to options structure to initialize
+ * @return MUSDOOM_OK on success, error code otherwise
+ */
+musdoom_error_t musdoom_batch_options_init(musdoom_batch_options_t* options);
+
+/**
+ * Render many songs at once on a set of worker threads.
+ * 
+ * Each job renders its song once, from the start to the end of score,
+ * on its own emulator. Workers start with an equal share of the jobs and
+ * steal from each other once their share is done, so songs of different
+ * lengths still keep every worker busy. The call returns when all jobs
+ * have finished; per-job outcomes are in the jobs' result fields. A job
+ * whose config holds an out-of-range value fails with
+ * MUSDOOM_ERR_INVALID_PARAM.
+ * 
+ * The worker threads are started by each call and joined before it
+ * returns; no threads are kept between calls. Starting them costs far
+ * less than rendering a song, but callers rendering many tiny batches
+ * should group them into one call.
+ * 
+ * @param jobs Array of jobs
+ * @param num_jobs Number of jobs
+ * @param options Batch options (NULL for defaults)
+ * @param stats Receives the batch totals (may be NULL)
+ * @return MUSDOOM_OK if the batch ran (even if some jobs failed),
+ *         error code otherwise
+ */
+musdoom_error_t musdoom_render_batch(musdoom_batch_job_t* jobs,
+                                     size_t num_jobs,
+                                     const musdoom_batch_options_t* options,
+                                     musdoom_batch_stats_t* stats);
+
+/**
+ * Opaque handle to a MUS to MIDI converter.
+ * 
+ * A converter holds the state of one conversion and a buffer for its
+ * output that is reused from one conversion to the next. Converters are
+ * independent, so threads can convert at the same time with one each.
+ */
+typedef struct musdoom_midi_converter musdoom_midi_converter_t;
+
+/**
+ * Convert a MUS lump to a type 0 Standard MIDI File in a caller's buffer.
+ * 
+ * This function keeps no state between calls and may be called from
+ * several threads at once. Call with a NULL buffer to get the size
+ * needed.
+ * 
+ * @param mus Pointer to MUS file data
+ * @param mus_size Size of the MUS data in bytes
+ * @param buffer Destination, or NULL to only query the size
+ * @param buffer_size Size of buffer in bytes
+ * @param midi_size Receives the size of the MIDI file in bytes
+ * @return MUSDOOM_OK on success, MUSDOOM_ERR_INVALID_DATA if the MUS
+ *         data is damaged, MUSDOOM_ERR_INVALID_PARAM if the buffer is too
+ *         small
+ */
+musdoom_error_t musdoom_mus_to_midi(const uint8_t* mus,
+                                    size_t mus_size,
+                                    void* buffer,
+                                    size_t buffer_size,
+                                    size_t* midi_size);
+
+/**
+ * Create a MUS to MIDI converter.
+ * 
+ * @return Handle to the converter, or NULL on failure
+ */
+musdoom_midi_converter_t* musdoom_midi_converter_create(void);
+
+/**
+ * Destroy a converter, and the output of its last conversion.
+ * 
+ * @param converter Handle to the converter
+ */
+void musdoom_midi_converter_destroy(musdoom_midi_converter_t* converter);
+
+/**
+ * Convert a MUS lump to a type 0 Standard MIDI File in the converter's
+ * own buffer, which grows as needed.
+ * 
+ * The output stays valid until the next conversion with the same
+ * converter, or until the converter is destroyed.
+ * 
+ * @param converter Handle to the converter
+ * @param mus Pointer to MUS file data
+ * @param mus_size Size of the MUS data in bytes
+ * @param midi Receives a pointer to the MIDI file
+ * @param midi_size Receives the size of the MIDI file in bytes
+ * @return MUSDOOM_OK on success, MUSDOOM_ERR_INVALID_DATA if the MUS
+ *         data is damaged, error code otherwise
+ */
+musdoom_error_t musdoom_midi_converter_convert(musdoom_midi_converter_t* converter,
+                                               const uint8_t* mus,
+                                               size_t mus_size,
+                                               const uint8_t** midi,
+                                               size_t* midi_size);
+
+/**
+ * Take ownership of the output of the converter's last conversion.
+ * 
+ * The buffer is handed over without copying; free it with musdoom_free().
+ * The converter keeps working, and its next conversion allocates a new
+ * buffer.
+ * 
+ * @param converter Handle to the converter
+ * @param midi Receives the MIDI file
+ * @param midi_size Receives the size of the MIDI file in bytes
+ * @return MUSDOOM_OK on success, MUSDOOM_ERR_NOT_INITIALIZED if there is
+ *         no conversion result to take, error code otherwise
+ */
+musdoom_error_t musdoom_midi_converter_take(musdoom_midi_converter_t* converter,
+                                            uint8_t** midi,
+                                            size_t* midi_size);
+
+/**
+ * Free memory the library handed over to the caller.
+ * 
+ * @param ptr Memory from musdoom_midi_converter_take, or NULL
+ */
+void musdoom_free(void* ptr);
+
 #ifdef __cplusplus
 }
 #endif
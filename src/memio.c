@@ -43,6 +43,11 @@ MEMFILE *mem_fopen_read(void *buf, size_t buflen)
 
 	file = (MEMFILE *)malloc(sizeof(MEMFILE));
 
+	if (file == NULL)
+	{
+		return NULL;
+	}
+
 	file->buf = (unsigned char *) buf;
 	file->buflen = buflen;
 	file->position = 0;
@@ -83,23 +88,82 @@ size_t mem_fread(void *buf, size_t size, size_t nmemb, MEMFILE *stream)
 	return items;
 }
 
-// Open a memory area for writing
+// Open a memory area for writing, with room for size_hint bytes before
+// it has to grow
 
-MEMFILE *mem_fopen_write(void)
+MEMFILE *mem_fopen_write_size(size_t size_hint)
 {
 	MEMFILE *file;
 
 	file = (MEMFILE *)malloc(sizeof(MEMFILE));
 
-	file->alloced = 1024;
-	file->buf = (unsigned char *)malloc(file->alloced);
+	if (file == NULL)
+	{
+		return NULL;
+	}
+
+	file->buf = NULL;
+	file->alloced = 0;
 	file->buflen = 0;
 	file->position = 0;
 	file->mode = MODE_WRITE;
 
+	if (mem_reserve(file, size_hint < 1024 ? 1024 : size_hint) != 0)
+	{
+		free(file);
+		return NULL;
+	}
+
 	return file;
 }
 
+MEMFILE *mem_fopen_write(void)
+{
+	return mem_fopen_write_size(1024);
+}
+
+// Make room for at least size bytes in a write stream. The buffer at
+// least doubles each time, so that writes take amortized constant time.
+
+int mem_reserve(MEMFILE *stream, size_t size)
+{
+	unsigned char *newbuf;
+	size_t alloced;
+
+	if (stream->mode != MODE_WRITE)
+	{
+		return -1;
+	}
+
+	if (size <= stream->alloced)
+	{
+		return 0;
+	}
+
+	alloced = stream->alloced;
+
+	if (alloced > ((size_t)-1) / 2 || alloced * 2 < size)
+	{
+		alloced = size;
+	}
+	else
+	{
+		alloced *= 2;
+	}
+
+	newbuf = (unsigned char *)realloc(stream->buf, alloced);
+
+	if (newbuf == NULL)
+	{
+		return -1;
+	}
+
+	stream->buf = newbuf;
+	stream->alloced = alloced;
+
+	return 0;
+}
+
 // Write bytes to stream
 
 size_t mem_fwrite(const void *ptr, size_t size, size_t nmemb, MEMFILE *stream)
@@ -114,17 +178,20 @@ size_t mem_fwrite(const void *ptr, size_t size, size_t nmemb, MEMFILE *stream)
 	// More bytes than can fit in the buffer?
 	// If so, reallocate bigger.
 
-	bytes = size * nmemb;
-	
-	while (bytes > stream->alloced - stream->position)
+	if (size > 1 && nmemb > ((size_t)-1) / size)
 	{
-		unsigned char *newbuf;
+		return 0;
+	}
 
-		newbuf = (unsigned char *)malloc(stream->alloced * 2);
-		memcpy(newbuf, stream->buf, stream->alloced);
-		free(stream->buf);
-		stream->buf = newbuf;
-		stream->alloced *= 2;
+	bytes = size * nmemb;
+
+	if (bytes > stream->alloced - stream->position)
+	{
+		if (bytes > ((size_t)-1) - stream->position
+		 || mem_reserve(stream, stream->position + bytes) != 0)
+		{
+			return 0;
+		}
 	}
 
 	// Copy into buffer
@@ -144,6 +211,37 @@ void mem_get_buf(MEMFILE *stream, void **buf, size_t *buflen)
 	*buflen = stream->buflen;
 }
 
+// Hand the contents of a write stream over to the caller, who frees
+// them with free(). The stream is left empty, to be written again.
+
+void *mem_take_buf(MEMFILE *stream, size_t *buflen)
+{
+	void *buf = stream->buf;
+
+	*buflen = stream->buflen;
+
+	if (stream->mode == MODE_WRITE)
+	{
+		stream->buf = NULL;
+		stream->alloced = 0;
+		stream->buflen = 0;
+		stream->position = 0;
+	}
+
+	return buf;
+}
+
+// Empty a write stream, keeping its buffer for the next writes
+
+void mem_reset(MEMFILE *stream)
+{
+	if (stream->mode == MODE_WRITE)
+	{
+		stream->buflen = 0;
+		stream->position = 0;
+	}
+}
+
 void mem_fclose(MEMFILE *stream)
 {
 	if (stream->mode == MODE_WRITE)
@@ -34,8 +34,12 @@ typedef enum
 MEMFILE *mem_fopen_read(void *buf, size_t buflen);
 size_t mem_fread(void *buf, size_t size, size_t nmemb, MEMFILE *stream);
 MEMFILE *mem_fopen_write(void);
+MEMFILE *mem_fopen_write_size(size_t size_hint);
+int mem_reserve(MEMFILE *stream, size_t size);
 size_t mem_fwrite(const void *ptr, size_t size, size_t nmemb, MEMFILE *stream);
 void mem_get_buf(MEMFILE *stream, void **buf, size_t *buflen);
+void *mem_take_buf(MEMFILE *stream, size_t *buflen);
+void mem_reset(MEMFILE *stream);
 void mem_fclose(MEMFILE *stream);
 long mem_ftell(MEMFILE *stream);
 int mem_fseek(MEMFILE *stream, signed long offset, mem_rel_t whence);
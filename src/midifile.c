@@ -26,36 +26,18 @@
 
 #define HEADER_CHUNK_ID "MThd"
 #define TRACK_CHUNK_ID  "MTrk"
-#define MAX_BUFFER_SIZE 0x10000
 
-// Byte swapping macros
-#define SHORT(x) ((uint16_t)(x))
-#define PACKED_STRUCT struct
+// Size of a chunk header: four byte id and big-endian length
 
-// Packing required
-#ifdef _MSC_VER
-#pragma pack(push, 1)
-#endif
-
-typedef struct
-{
-    uint8_t chunk_id[4];
-    uint32_t chunk_size;
-} chunk_header_t;
+#define CHUNK_HEADER_SIZE 8
 
 typedef struct
 {
-    chunk_header_t chunk_header;
-    uint16_t format_type;
-    uint16_t num_tracks;
-    uint16_t time_division;
+    unsigned int format_type;
+    unsigned int num_tracks;
+    unsigned int time_division;
 } midi_header_t;
 
-// haleyjd 09/09/10: packing off.
-#ifdef _MSC_VER
-#pragma pack(pop)
-#endif
-
 typedef struct
 {
     // Length in bytes:
@@ -65,7 +47,7 @@ typedef struct
     // Events in this track:
 
     midi_event_t *events;
-    int num_events;
+    unsigned int num_events;
 } midi_track_t;
 
 struct midi_track_iter_s
@@ -83,56 +65,76 @@ struct midi_file_s
     midi_track_t *tracks;
     unsigned int num_tracks;
 
-    // Data buffer used to store data read for SysEx or meta events:
+    // File contents, when read by MIDI_LoadFile; SysEx and meta event
+    // data point into them
     uint8_t *buffer;
     unsigned int buffer_size;
 };
 
-// Check the header of a chunk:
+// Position in the MIDI data being parsed
 
-static boolean CheckChunkHeader(chunk_header_t *chunk,
-                                const char *expected_id)
+typedef struct
 {
-    boolean result;
-    
-    result = (memcmp((char *) chunk->chunk_id, expected_id, 4) == 0);
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+} midi_reader_t;
 
-    if (!result)
+// Read a big-endian value of 'bytes' bytes.  Returns false on error.
+
+static boolean ReadBE(midi_reader_t *reader, unsigned int bytes,
+                      unsigned int *result)
+{
+    unsigned int i;
+
+    if (reader->size - reader->pos < bytes)
     {
-        fprintf(stderr, "CheckChunkHeader: Expected '%s' chunk header, "
-                        "got '%c%c%c%c'\n",
-                        expected_id,
-                        chunk->chunk_id[0], chunk->chunk_id[1],
-                        chunk->chunk_id[2], chunk->chunk_id[3]);
+        return false;
     }
 
-    return result;
+    *result = 0;
+
+    for (i=0; i<bytes; ++i)
+    {
+        *result = (*result << 8) | reader->data[reader->pos++];
+    }
+
+    return true;
 }
 
-// Read a single byte.  Returns false on error.
+// Read and check the header of a chunk:
 
-static boolean ReadByte(uint8_t *result, FILE *stream)
+static boolean ReadChunkHeader(midi_reader_t *reader, const char *expected_id,
+                               unsigned int *chunk_size)
 {
-    int c;
+    if (reader->size - reader->pos < CHUNK_HEADER_SIZE
+     || memcmp(reader->data + reader->pos, expected_id, 4) != 0)
+    {
+        return false;
+    }
+
+    reader->pos += 4;
 
-    c = fgetc(stream);
+    return ReadBE(reader, 4, chunk_size);
+}
+
+// Read a single byte.  Returns false on error.
 
-    if (c == EOF)
+static boolean ReadByte(uint8_t *result, midi_reader_t *reader)
+{
+    if (reader->pos >= reader->size)
     {
-        fprintf(stderr, "ReadByte: Unexpected end of file\n");
         return false;
     }
-    else
-    {
-        *result = (uint8_t) c;
 
-        return true;
-    }
+    *result = reader->data[reader->pos++];
+
+    return true;
 }
 
 // Read a variable-length value.
 
-static boolean ReadVariableLength(unsigned int *result, FILE *stream)
+static boolean ReadVariableLength(unsigned int *result, midi_reader_t *reader)
 {
     int i;
     uint8_t b = 0;
@@ -141,10 +143,8 @@ static boolean ReadVariableLength(unsigned int *result, FILE *stream)
 
     for (i=0; i<4; ++i)
     {
-        if (!ReadByte(&b, stream))
+        if (!ReadByte(&b, reader))
         {
-            fprintf(stderr, "ReadVariableLength: Error while reading "
-                            "variable-length value\n");
             return false;
         }
 
@@ -161,41 +161,25 @@ static boolean ReadVariableLength(unsigned int *result, FILE *stream)
         }
     }
 
-    fprintf(stderr, "ReadVariableLength: Variable-length value too "
-                    "long: maximum of four bytes\n");
+    // Variable-length value too long: maximum of four bytes
+
     return false;
 }
 
-// Read a uint8_t sequence into the data buffer.
+// Point to a byte sequence in the data, and skip over it.
 
-static void *ReadByteSequence(unsigned int num_bytes, FILE *stream)
+static const uint8_t *ReadByteSequence(unsigned int num_bytes,
+                                       midi_reader_t *reader)
 {
-    unsigned int i;
-    uint8_t *result;
+    const uint8_t *result;
 
-    // Allocate a buffer. Allocate one extra byte, as malloc(0) is
-    // non-portable.
-
-    result = malloc(num_bytes + 1);
-
-    if (result == NULL)
+    if (reader->size - reader->pos < num_bytes)
     {
-        fprintf(stderr, "ReadByteSequence: Failed to allocate buffer\n");
         return NULL;
     }
 
-    // Read the data:
-
-    for (i=0; i<num_bytes; ++i)
-    {
-        if (!ReadByte(&result[i], stream))
-        {
-            fprintf(stderr, "ReadByteSequence: Error while reading uint8_t %u\n",
-                            i);
-            free(result);
-            return NULL;
-        }
-    }
+    result = reader->data + reader->pos;
+    reader->pos += num_bytes;
 
     return result;
 }
@@ -206,7 +190,7 @@ static void *ReadByteSequence(unsigned int num_bytes, FILE *stream)
 
 static boolean ReadChannelEvent(midi_event_t *event,
                                 uint8_t event_type, boolean two_param,
-                                FILE *stream)
+                                midi_reader_t *reader)
 {
     uint8_t b = 0;
 
@@ -217,10 +201,8 @@ static boolean ReadChannelEvent(midi_event_t *event,
 
     // Read parameters:
 
-    if (!ReadByte(&b, stream))
+    if (!ReadByte(&b, reader))
     {
-        fprintf(stderr, "ReadChannelEvent: Error while reading channel "
-                        "event parameters\n");
         return false;
     }
 
@@ -230,15 +212,17 @@ static boolean ReadChannelEvent(midi_event_t *event,
 
     if (two_param)
     {
-        if (!ReadByte(&b, stream))
+        if (!ReadByte(&b, reader))
         {
-            fprintf(stderr, "ReadChannelEvent: Error while reading channel "
-                            "event parameters\n");
             return false;
         }
 
         event->data.channel.param2 = b;
     }
+    else
+    {
+        event->data.channel.param2 = 0;
+    }
 
     return true;
 }
@@ -246,33 +230,25 @@ static boolean ReadChannelEvent(midi_event_t *event,
 // Read sysex event:
 
 static boolean ReadSysExEvent(midi_event_t *event, int event_type,
-                              FILE *stream)
+                              midi_reader_t *reader)
 {
     event->event_type = event_type;
 
-    if (!ReadVariableLength(&event->data.sysex.length, stream))
+    if (!ReadVariableLength(&event->data.sysex.length, reader))
     {
-        fprintf(stderr, "ReadSysExEvent: Failed to read length of "
-                                        "SysEx block\n");
         return false;
     }
 
     // Read the uint8_t sequence:
 
-    event->data.sysex.data = ReadByteSequence(event->data.sysex.length, stream);
-
-    if (event->data.sysex.data == NULL)
-    {
-        fprintf(stderr, "ReadSysExEvent: Failed while reading SysEx event\n");
-        return false;
-    }
+    event->data.sysex.data = ReadByteSequence(event->data.sysex.length, reader);
 
-    return true;
+    return event->data.sysex.data != NULL;
 }
 
 // Read meta event:
 
-static boolean ReadMetaEvent(midi_event_t *event, FILE *stream)
+static boolean ReadMetaEvent(midi_event_t *event, midi_reader_t *reader)
 {
     uint8_t b = 0;
 
@@ -280,9 +256,8 @@ static boolean ReadMetaEvent(midi_event_t *event, FILE *stream)
 
     // Read meta event type:
 
-    if (!ReadByte(&b, stream))
+    if (!ReadByte(&b, reader))
     {
-        fprintf(stderr, "ReadMetaEvent: Failed to read meta event type\n");
         return false;
     }
 
@@ -290,40 +265,30 @@ static boolean ReadMetaEvent(midi_event_t *event, FILE *stream)
 
     // Read length of meta event data:
 
-    if (!ReadVariableLength(&event->data.meta.length, stream))
+    if (!ReadVariableLength(&event->data.meta.length, reader))
     {
-        fprintf(stderr, "ReadSysExEvent: Failed to read length of "
-                                        "SysEx block\n");
         return false;
     }
 
     // Read the uint8_t sequence:
 
-    event->data.meta.data = ReadByteSequence(event->data.meta.length, stream);
-
-    if (event->data.meta.data == NULL)
-    {
-        fprintf(stderr, "ReadSysExEvent: Failed while reading SysEx event\n");
-        return false;
-    }
+    event->data.meta.data = ReadByteSequence(event->data.meta.length, reader);
 
-    return true;
+    return event->data.meta.data != NULL;
 }
 
 static boolean ReadEvent(midi_event_t *event, unsigned int *last_event_type,
-                         FILE *stream)
+                         midi_reader_t *reader)
 {
     uint8_t event_type = 0;
 
-    if (!ReadVariableLength(&event->delta_time, stream))
+    if (!ReadVariableLength(&event->delta_time, reader))
     {
-        fprintf(stderr, "ReadEvent: Failed to read event timestamp\n");
         return false;
     }
 
-    if (!ReadByte(&event_type, stream))
+    if (!ReadByte(&event_type, reader))
     {
-        fprintf(stderr, "ReadEvent: Failed to read event type\n");
         return false;
     }
 
@@ -335,12 +300,7 @@ static boolean ReadEvent(midi_event_t *event, unsigned int *last_event_type,
     if ((event_type & 0x80) == 0)
     {
         event_type = *last_event_type;
-
-        if (fseek(stream, -1, SEEK_CUR) < 0)
-        {
-            fprintf(stderr, "ReadEvent: Unable to seek in stream\n");
-            return false;
-        }
+        --reader->pos;
     }
     else
     {
@@ -358,13 +318,13 @@ static boolean ReadEvent(midi_event_t *event, unsigned int *last_event_type,
         case MIDI_EVENT_AFTERTOUCH:
         case MIDI_EVENT_CONTROLLER:
         case MIDI_EVENT_PITCH_BEND:
-            return ReadChannelEvent(event, event_type, true, stream);
+            return ReadChannelEvent(event, event_type, true, reader);
 
         // Single parameter channel events:
 
         case MIDI_EVENT_PROGRAM_CHANGE:
         case MIDI_EVENT_CHAN_AFTERTOUCH:
-            return ReadChannelEvent(event, event_type, false, stream);
+            return ReadChannelEvent(event, event_type, false, reader);
 
         default:
             break;
@@ -376,151 +336,112 @@ static boolean ReadEvent(midi_event_t *event, unsigned int *last_event_type,
     {
         case MIDI_EVENT_SYSEX:
         case MIDI_EVENT_SYSEX_SPLIT:
-            return ReadSysExEvent(event, event_type, stream);
+            return ReadSysExEvent(event, event_type, reader);
 
         case MIDI_EVENT_META:
-            return ReadMetaEvent(event, stream);
+            return ReadMetaEvent(event, reader);
 
         default:
             break;
     }
 
-    fprintf(stderr, "ReadEvent: Unknown MIDI event type: 0x%x\n", event_type);
+    // Unknown MIDI event type
+
     return false;
 }
 
-// Free an event:
+// Read the events of a track up to its end marker.  With events NULL
+// they are only counted, so that the track can then be read into an
+// array of the right size.
 
-static void FreeEvent(midi_event_t *event)
+static boolean ReadTrackEvents(midi_event_t *events, unsigned int *num_events,
+                               midi_reader_t *reader)
 {
-    // Some event types have dynamically allocated buffers assigned
-    // to them that must be freed.
-
-    switch (event->event_type)
-    {
-        case MIDI_EVENT_SYSEX:
-        case MIDI_EVENT_SYSEX_SPLIT:
-            free(event->data.sysex.data);
-            break;
-
-        case MIDI_EVENT_META:
-            free(event->data.meta.data);
-            break;
+    midi_event_t scratch;
+    midi_event_t *event;
+    unsigned int last_event_type;
 
-        default:
-            // Nothing to do.
-            break;
-    }
-}
+    last_event_type = 0;
+    *num_events = 0;
 
-// Read and check the track chunk header
+    for (;;)
+    {
+        event = events != NULL ? &events[*num_events] : &scratch;
 
-static boolean ReadTrackHeader(midi_track_t *track, FILE *stream)
-{
-    size_t records_read;
-    chunk_header_t chunk_header;
+        if (!ReadEvent(event, &last_event_type, reader))
+        {
+            return false;
+        }
 
-    records_read = fread(&chunk_header, sizeof(chunk_header_t), 1, stream);
+        ++*num_events;
 
-    if (records_read < 1)
-    {
-        return false;
-    }
+        // End of track?
 
-    if (!CheckChunkHeader(&chunk_header, TRACK_CHUNK_ID))
-    {
-        return false;
+        if (event->event_type == MIDI_EVENT_META
+         && event->data.meta.type == MIDI_META_END_OF_TRACK)
+        {
+            return true;
+        }
     }
-
-    track->data_len = SDL_SwapBE32(chunk_header.chunk_size);
-
-    return true;
 }
 
-static boolean ReadTrack(midi_track_t *track, FILE *stream)
+static boolean ReadTrack(midi_track_t *track, midi_reader_t *reader)
 {
-    midi_event_t *new_events;
-    midi_event_t *event;
-    unsigned int last_event_type;
+    size_t start;
+    unsigned int num_events;
 
     track->num_events = 0;
     track->events = NULL;
 
     // Read the header:
 
-    if (!ReadTrackHeader(track, stream))
+    if (!ReadChunkHeader(reader, TRACK_CHUNK_ID, &track->data_len))
     {
         return false;
     }
 
-    // Then the events:
+    // Count the events, then read them into one allocation.  Like
+    // vanilla, the next track follows the end of track marker, whatever
+    // the chunk length says.
 
-    last_event_type = 0;
+    start = reader->pos;
 
-    for (;;)
+    if (!ReadTrackEvents(NULL, &num_events, reader))
     {
-        // Resize the track slightly larger to hold another event:
-
-        new_events = I_Realloc(track->events, 
-                             sizeof(midi_event_t) * (track->num_events + 1));
-        track->events = new_events;
-
-        // Read the next event:
-
-        event = &track->events[track->num_events];
-        if (!ReadEvent(event, &last_event_type, stream))
-        {
-            return false;
-        }
-
-        ++track->num_events;
-
-        // End of track?
-
-        if (event->event_type == MIDI_EVENT_META
-         && event->data.meta.type == MIDI_META_END_OF_TRACK)
-        {
-            break;
-        }
+        return false;
     }
 
-    return true;
-}
-
-// Free a track:
-
-static void FreeTrack(midi_track_t *track)
-{
-    unsigned int i;
+    track->events = malloc(sizeof(midi_event_t) * num_events);
 
-    for (i=0; i<track->num_events; ++i)
+    if (track->events == NULL)
     {
-        FreeEvent(&track->events[i]);
+        return false;
     }
 
-    free(track->events);
+    reader->pos = start;
+    ReadTrackEvents(track->events, &track->num_events, reader);
+
+    return true;
 }
 
-static boolean ReadAllTracks(midi_file_t *file, FILE *stream)
+static boolean ReadAllTracks(midi_file_t *file, midi_reader_t *reader)
 {
     unsigned int i;
 
     // Allocate list of tracks and read each track:
 
-    file->tracks = malloc(sizeof(midi_track_t) * file->num_tracks);
+    file->tracks = calloc(file->num_tracks, sizeof(midi_track_t));
 
     if (file->tracks == NULL)
     {
         return false;
     }
 
-    memset(file->tracks, 0, sizeof(midi_track_t) * file->num_tracks);
-
     // Read each track:
 
     for (i=0; i<file->num_tracks; ++i)
     {
-        if (!ReadTrack(&file->tracks[i], stream))
+        if (!ReadTrack(&file->tracks[i], reader))
         {
             return false;
         }
@@ -531,35 +452,26 @@ static boolean ReadAllTracks(midi_file_t *file, FILE *stream)
 
 // Read and check the header chunk.
 
-static boolean ReadFileHeader(midi_file_t *file, FILE *stream)
+static boolean ReadFileHeader(midi_file_t *file, midi_reader_t *reader)
 {
-    size_t records_read;
-    unsigned int format_type;
-
-    records_read = fread(&file->header, sizeof(midi_header_t), 1, stream);
+    unsigned int chunk_size;
 
-    if (records_read < 1)
+    if (!ReadChunkHeader(reader, HEADER_CHUNK_ID, &chunk_size)
+     || chunk_size != 6
+     || !ReadBE(reader, 2, &file->header.format_type)
+     || !ReadBE(reader, 2, &file->header.num_tracks)
+     || !ReadBE(reader, 2, &file->header.time_division))
     {
         return false;
     }
 
-    if (!CheckChunkHeader(&file->header.chunk_header, HEADER_CHUNK_ID)
-     || SDL_SwapBE32(file->header.chunk_header.chunk_size) != 6)
-    {
-        fprintf(stderr, "ReadFileHeader: Invalid MIDI chunk header! "
-                        "chunk_size=%i\n",
-                        SDL_SwapBE32(file->header.chunk_header.chunk_size));
-        return false;
-    }
+    file->num_tracks = file->header.num_tracks;
 
-    format_type = SDL_SwapBE16(file->header.format_type);
-    file->num_tracks = SDL_SwapBE16(file->header.num_tracks);
+    // Only type 0/1 MIDI files supported
 
-    if ((format_type != 0 && format_type != 1)
+    if ((file->header.format_type != 0 && file->header.format_type != 1)
      || file->num_tracks < 1)
     {
-        fprintf(stderr, "ReadFileHeader: Only type 0/1 "
-                                         "MIDI files supported!\n");
         return false;
     }
 
@@ -568,25 +480,26 @@ static boolean ReadFileHeader(midi_file_t *file, FILE *stream)
 
 void MIDI_FreeFile(midi_file_t *file)
 {
-    int i;
+    unsigned int i;
 
     if (file->tracks != NULL)
     {
         for (i=0; i<file->num_tracks; ++i)
         {
-            FreeTrack(&file->tracks[i]);
+            free(file->tracks[i].events);
         }
 
         free(file->tracks);
     }
 
+    free(file->buffer);
     free(file);
 }
 
-midi_file_t *MIDI_LoadFile(char *filename)
+midi_file_t *MIDI_LoadData(const uint8_t *data, size_t size)
 {
     midi_file_t *file;
-    FILE *stream;
+    midi_reader_t reader;
 
     file = malloc(sizeof(midi_file_t));
 
@@ -600,37 +513,75 @@ midi_file_t *MIDI_LoadFile(char *filename)
     file->buffer = NULL;
     file->buffer_size = 0;
 
-    // Open file
+    reader.data = data;
+    reader.size = size;
+    reader.pos = 0;
 
-    stream = M_fopen(filename, "rb");
+    // Read MIDI file header
 
-    if (stream == NULL)
+    if (data == NULL || !ReadFileHeader(file, &reader))
     {
-        fprintf(stderr, "MIDI_LoadFile: Failed to open '%s'\n", filename);
         MIDI_FreeFile(file);
         return NULL;
     }
 
-    // Read MIDI file header
+    // Read all tracks:
 
-    if (!ReadFileHeader(file, stream))
+    if (!ReadAllTracks(file, &reader))
     {
-        fclose(stream);
         MIDI_FreeFile(file);
         return NULL;
     }
 
-    // Read all tracks:
+    return file;
+}
+
+midi_file_t *MIDI_LoadFile(char *filename)
+{
+    midi_file_t *file;
+    FILE *stream;
+    uint8_t *buffer;
+    long size;
+
+    // Read the whole file, for the events to point into
+
+    stream = fopen(filename, "rb");
+
+    if (stream == NULL)
+    {
+        return NULL;
+    }
 
-    if (!ReadAllTracks(file, stream))
+    if (fseek(stream, 0, SEEK_END) != 0
+     || (size = ftell(stream)) < 0
+     || fseek(stream, 0, SEEK_SET) != 0)
     {
         fclose(stream);
-        MIDI_FreeFile(file);
+        return NULL;
+    }
+
+    buffer = malloc(size > 0 ? (size_t)size : 1);
+
+    if (buffer == NULL || fread(buffer, 1, (size_t)size, stream) != (size_t)size)
+    {
+        free(buffer);
+        fclose(stream);
         return NULL;
     }
 
     fclose(stream);
 
+    file = MIDI_LoadData(buffer, (size_t)size);
+
+    if (file == NULL)
+    {
+        free(buffer);
+        return NULL;
+    }
+
+    file->buffer = buffer;
+    file->buffer_size = (unsigned int)size;
+
     return file;
 }
 
@@ -650,6 +601,12 @@ midi_track_iter_t *MIDI_IterateTrack(midi_file_t *file, unsigned int track)
     assert(track < file->num_tracks);
 
     iter = malloc(sizeof(*iter));
+
+    if (iter == NULL)
+    {
+        return NULL;
+    }
+
     iter->track = &file->tracks[track];
     iter->position = 0;
     iter->loop_point = 0;
@@ -699,7 +656,7 @@ int MIDI_GetNextEvent(midi_track_iter_t *iter, midi_event_t **event)
 
 unsigned int MIDI_GetFileTimeDivision(midi_file_t *file)
 {
-    short result = SDL_SwapBE16(file->header.time_division);
+    short result = (short)file->header.time_division;
 
     // Negative time division indicates SMPTE time and must be handled
     // differently.
@@ -18,6 +18,9 @@
 #ifndef MIDIFILE_H
 #define MIDIFILE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct midi_file_s midi_file_t;
 typedef struct midi_track_iter_s midi_track_iter_t;
 
@@ -140,9 +143,9 @@ typedef struct
 
     unsigned int length;
 
-    // Meta event data:
+    // Meta event data, in the file's data:
 
-    uint8_t *data;
+    const uint8_t *data;
 } midi_meta_event_data_t;
 
 typedef struct
@@ -151,9 +154,9 @@ typedef struct
 
     unsigned int length;
 
-    // Event data:
+    // Event data, in the file's data:
 
-    uint8_t *data;
+    const uint8_t *data;
 } midi_sysex_event_data_t;
 
 typedef struct
@@ -215,6 +218,11 @@ typedef struct
 
 midi_file_t *MIDI_LoadFile(char *filename);
 
+// Load MIDI file data from memory.  SysEx and meta event data point into
+// it, so it must outlive the midi_file_t.
+
+midi_file_t *MIDI_LoadData(const uint8_t *data, size_t size);
+
 // Free a MIDI file.
 
 void MIDI_FreeFile(midi_file_t *file);
@@ -26,10 +26,7 @@
 #include "memio.h"
 #include "mus2mid.h"
 
-// Byte swapping macros
-#define SHORT(x) ((uint16_t)(x))
-
-#define NUM_CHANNELS 16
+#define NUM_CHANNELS MUS2MID_CHANNELS
 
 #define MIDI_PERCUSSION_CHAN 9
 #define MUS_PERCUSSION_CHAN 15
@@ -80,32 +77,46 @@ static const uint8_t midiheader[] =
     0x00, 0x00, 0x00, 0x00  // Placeholder for track length
 };
 
-// Cached channel velocities
-static uint8_t channelvelocities[] =
+static const uint8_t controller_map[] =
 {
-    127, 127, 127, 127, 127, 127, 127, 127,
-    127, 127, 127, 127, 127, 127, 127, 127
+    0x00, 0x20, 0x01, 0x07, 0x0A, 0x0B, 0x5B, 0x5D,
+    0x40, 0x43, 0x78, 0x7B, 0x7E, 0x7F, 0x79
 };
 
-// Timestamps between sequences of MUS events
+// Append bytes to the output. A caller's buffer takes what fits; the
+// rest is still counted, so that the caller learns the size needed.
 
-static unsigned int queuedtime = 0;
+static bool WriteData(mus2mid_t *converter, const void *data, size_t len)
+{
+    if (converter->stream != NULL)
+    {
+        if (mem_fwrite(data, 1, len, converter->stream) != len)
+        {
+            return true;
+        }
+    }
+    else if (converter->length < converter->buffer_size)
+    {
+        size_t room = converter->buffer_size - converter->length;
 
-// Counter for the length of the track
+        memcpy(converter->buffer + converter->length, data,
+               len < room ? len : room);
+    }
 
-static unsigned int tracksize;
+    converter->length += len;
+    return false;
+}
 
-static const uint8_t controller_map[] =
-{
-    0x00, 0x20, 0x01, 0x07, 0x0A, 0x0B, 0x5B, 0x5D,
-    0x40, 0x43, 0x78, 0x7B, 0x7E, 0x7F, 0x79
-};
+// Write one byte of a track event
 
-static int channel_map[NUM_CHANNELS];
+static bool WriteByte(mus2mid_t *converter, uint8_t value)
+{
+    return WriteData(converter, &value, 1);
+}
 
 // Write timestamp to a MIDI file.
 
-static bool WriteTime(unsigned int time, MEMFILE *midioutput)
+static bool WriteTime(mus2mid_t *converter, unsigned int time)
 {
     unsigned int buffer = time & 0x7F;
     uint8_t writeval;
@@ -120,12 +131,12 @@ static bool WriteTime(unsigned int time, MEMFILE *midioutput)
     {
         writeval = (byte)(buffer & 0xFF);
 
-        if (mem_fwrite(&writeval, 1, 1, midioutput) != 1)
+        if (WriteByte(converter, writeval))
         {
             return true;
         }
 
-        ++tracksize;
+        ++converter->tracksize;
 
         if ((buffer & 0x80) != 0)
         {
@@ -133,7 +144,7 @@ static bool WriteTime(unsigned int time, MEMFILE *midioutput)
         }
         else
         {
-            queuedtime = 0;
+            converter->queuedtime = 0;
             return false;
         }
     }
@@ -141,178 +152,122 @@ static bool WriteTime(unsigned int time, MEMFILE *midioutput)
 
 
 // Write the end of track marker
-static bool WriteEndTrack(MEMFILE *midioutput)
+static bool WriteEndTrack(mus2mid_t *converter)
 {
     uint8_t endtrack[] = {0xFF, 0x2F, 0x00};
 
-    if (WriteTime(queuedtime, midioutput))
+    if (WriteTime(converter, converter->queuedtime))
     {
         return true;
     }
 
-    if (mem_fwrite(endtrack, 1, 3, midioutput) != 3)
+    if (WriteData(converter, endtrack, 3))
     {
         return true;
     }
 
-    tracksize += 3;
+    converter->tracksize += 3;
     return false;
 }
 
 // Write a key press event
-static bool WritePressKey(uint8_t channel, uint8_t key,
-                             uint8_t velocity, MEMFILE *midioutput)
+static bool WritePressKey(mus2mid_t *converter, uint8_t channel,
+                          uint8_t key, uint8_t velocity)
 {
-    uint8_t working = midi_presskey | channel;
-
-    if (WriteTime(queuedtime, midioutput))
-    {
-        return true;
-    }
-
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
-    {
-        return true;
-    }
-
-    working = key & 0x7F;
-
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
+    if (WriteTime(converter, converter->queuedtime))
     {
         return true;
     }
 
-    working = velocity & 0x7F;
-
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
+    if (WriteByte(converter, midi_presskey | channel)
+     || WriteByte(converter, key & 0x7F)
+     || WriteByte(converter, velocity & 0x7F))
     {
         return true;
     }
 
-    tracksize += 3;
+    converter->tracksize += 3;
 
     return false;
 }
 
 // Write a key release event
-static bool WriteReleaseKey(uint8_t channel, uint8_t key,
-                               MEMFILE *midioutput)
+static bool WriteReleaseKey(mus2mid_t *converter, uint8_t channel,
+                            uint8_t key)
 {
-    uint8_t working = midi_releasekey | channel;
-
-    if (WriteTime(queuedtime, midioutput))
-    {
-        return true;
-    }
-
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
-    {
-        return true;
-    }
-
-    working = key & 0x7F;
-
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
+    if (WriteTime(converter, converter->queuedtime))
     {
         return true;
     }
 
-    working = 0;
-
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
+    if (WriteByte(converter, midi_releasekey | channel)
+     || WriteByte(converter, key & 0x7F)
+     || WriteByte(converter, 0))
     {
         return true;
     }
 
-    tracksize += 3;
+    converter->tracksize += 3;
 
     return false;
 }
 
 // Write a pitch wheel/bend event
-static bool WritePitchWheel(uint8_t channel, short wheel,
-                               MEMFILE *midioutput)
+static bool WritePitchWheel(mus2mid_t *converter, uint8_t channel,
+                            short wheel)
 {
-    uint8_t working = midi_pitchwheel | channel;
-
-    if (WriteTime(queuedtime, midioutput))
+    if (WriteTime(converter, converter->queuedtime))
     {
         return true;
     }
 
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
+    if (WriteByte(converter, midi_pitchwheel | channel)
+     || WriteByte(converter, wheel & 0x7F)
+     || WriteByte(converter, (wheel >> 7) & 0x7F))
     {
         return true;
     }
 
-    working = wheel & 0x7F;
-
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
-    {
-        return true;
-    }
-
-    working = (wheel >> 7) & 0x7F;
-
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
-    {
-        return true;
-    }
-
-    tracksize += 3;
+    converter->tracksize += 3;
     return false;
 }
 
 // Write a patch change event
-static bool WriteChangePatch(uint8_t channel, uint8_t patch,
-                                MEMFILE *midioutput)
+static bool WriteChangePatch(mus2mid_t *converter, uint8_t channel,
+                             uint8_t patch)
 {
-    uint8_t working = midi_changepatch | channel;
-
-    if (WriteTime(queuedtime, midioutput))
+    if (WriteTime(converter, converter->queuedtime))
     {
         return true;
     }
 
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
+    if (WriteByte(converter, midi_changepatch | channel)
+     || WriteByte(converter, patch & 0x7F))
     {
         return true;
     }
 
-    working = patch & 0x7F;
-
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
-    {
-        return true;
-    }
-
-    tracksize += 2;
+    converter->tracksize += 2;
 
     return false;
 }
 
 // Write a valued controller change event
 
-static bool WriteChangeController_Valued(uint8_t channel,
-                                            uint8_t control,
-                                            uint8_t value,
-                                            MEMFILE *midioutput)
+static bool WriteChangeController_Valued(mus2mid_t *converter,
+                                         uint8_t channel,
+                                         uint8_t control,
+                                         uint8_t value)
 {
-    uint8_t working = midi_changecontroller | channel;
-
-    if (WriteTime(queuedtime, midioutput))
-    {
-        return true;
-    }
+    uint8_t working;
 
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
+    if (WriteTime(converter, converter->queuedtime))
     {
         return true;
     }
 
-    working = control & 0x7F;
-
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
+    if (WriteByte(converter, midi_changecontroller | channel)
+     || WriteByte(converter, control & 0x7F))
     {
         return true;
     }
@@ -330,28 +285,27 @@ static bool WriteChangeController_Valued(uint8_t channel,
         working = 0x7F;
     }
 
-    if (mem_fwrite(&working, 1, 1, midioutput) != 1)
+    if (WriteByte(converter, working))
     {
         return true;
     }
 
-    tracksize += 3;
+    converter->tracksize += 3;
 
     return false;
 }
 
 // Write a valueless controller change event
-static bool WriteChangeController_Valueless(uint8_t channel,
-                                               uint8_t control,
-                                               MEMFILE *midioutput)
+static bool WriteChangeController_Valueless(mus2mid_t *converter,
+                                            uint8_t channel,
+                                            uint8_t control)
 {
-    return WriteChangeController_Valued(channel, control, 0,
-                                             midioutput);
+    return WriteChangeController_Valued(converter, channel, control, 0);
 }
 
 // Allocate a free MIDI channel.
 
-static int AllocateMIDIChannel(void)
+static int AllocateMIDIChannel(mus2mid_t *converter)
 {
     int result;
     int max;
@@ -363,9 +317,9 @@ static int AllocateMIDIChannel(void)
 
     for (i=0; i<NUM_CHANNELS; ++i)
     {
-        if (channel_map[i] > max)
+        if (converter->channel_map[i] > max)
         {
-            max = channel_map[i];
+            max = converter->channel_map[i];
         }
     }
 
@@ -388,7 +342,7 @@ static int AllocateMIDIChannel(void)
 // Given a MUS channel number, get the MIDI channel number to use
 // in the outputted file.
 
-static int GetMIDIChannel(int mus_channel, MEMFILE *midioutput)
+static int GetMIDIChannel(mus2mid_t *converter, int mus_channel)
 {
     // Find the MIDI channel to use for this MUS channel.
     // MUS channel 15 is the percusssion channel.
@@ -402,51 +356,86 @@ static int GetMIDIChannel(int mus_channel, MEMFILE *midioutput)
         // If a MIDI channel hasn't been allocated for this MUS channel
         // yet, allocate the next free MIDI channel.
 
-        if (channel_map[mus_channel] == -1)
+        if (converter->channel_map[mus_channel] == -1)
         {
-            channel_map[mus_channel] = AllocateMIDIChannel();
+            converter->channel_map[mus_channel] =
+                AllocateMIDIChannel(converter);
 
             // First time using the channel, send an "all notes off"
             // event. This fixes "The D_DDTBLU disease" described here:
             // https://www.doomworld.com/vb/source-ports/66802-the
-            WriteChangeController_Valueless(channel_map[mus_channel], 0x7b,
-                                            midioutput);
+            WriteChangeController_Valueless(converter,
+                                            converter->channel_map[mus_channel],
+                                            0x7b);
         }
 
-        return channel_map[mus_channel];
+        return converter->channel_map[mus_channel];
     }
 }
 
-static bool ReadMusHeader(MEMFILE *file, musheader *header)
+// Read the next byte of the MUS lump
+
+static bool ReadByte(mus2mid_t *converter, uint8_t *value)
 {
-    bool result;
+    if (converter->input_pos >= converter->input_size)
+    {
+        return true;
+    }
 
-    result = mem_fread(&header->id, sizeof(byte), 4, file) == 4
-          && mem_fread(&header->scorelength, sizeof(short), 1, file) == 1
-          && mem_fread(&header->scorestart, sizeof(short), 1, file) == 1
-          && mem_fread(&header->primarychannels, sizeof(short), 1, file) == 1
-          && mem_fread(&header->secondarychannels, sizeof(short), 1, file) == 1
-          && mem_fread(&header->instrumentcount, sizeof(short), 1, file) == 1;
+    *value = converter->input[converter->input_pos++];
+    return false;
+}
+
+static bool ReadMusHeader(mus2mid_t *converter, musheader *header)
+{
+    const uint8_t *data = converter->input;
 
-    if (result)
+    if (converter->input_size < 14)
     {
-        header->scorelength = SHORT(header->scorelength);
-        header->scorestart = SHORT(header->scorestart);
-        header->primarychannels = SHORT(header->primarychannels);
-        header->secondarychannels = SHORT(header->secondarychannels);
-        header->instrumentcount = SHORT(header->instrumentcount);
+        return true;
     }
 
-    return result;
+    memcpy(header->id, data, 4);
+    header->scorelength = data[4] | (data[5] << 8);
+    header->scorestart = data[6] | (data[7] << 8);
+    header->primarychannels = data[8] | (data[9] << 8);
+    header->secondarychannels = data[10] | (data[11] << 8);
+    header->instrumentcount = data[12] | (data[13] << 8);
+    converter->input_pos = 14;
+
+    return false;
 }
 
 
-// Read a MUS file from a stream (musinput) and output a MIDI file to
-// a stream (midioutput).
+// Start a conversion into a growable stream, or into a caller's buffer
+// when stream is NULL (buffer may be NULL too, to only count the size).
+
+void mus2mid_init(mus2mid_t *converter, MEMFILE *stream,
+                  uint8_t *buffer, size_t buffer_size)
+{
+    int channel;
+
+    converter->stream = stream;
+    converter->buffer = buffer;
+    converter->buffer_size = buffer != NULL ? buffer_size : 0;
+    converter->length = 0;
+    converter->queuedtime = 0;
+    converter->tracksize = 0;
+
+    for (channel=0; channel<NUM_CHANNELS; ++channel)
+    {
+        converter->channelvelocities[channel] = 127;
+        converter->channel_map[channel] = -1;
+    }
+}
+
+// Convert a MUS lump held in memory. All the state lives in the
+// converter, so conversions may run on several threads at once.
 //
-// Returns 0 on success or 1 on failure.
+// Returns false on success or true on failure.
 
-bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
+bool mus2mid_convert(mus2mid_t *converter, const uint8_t *mus,
+                     size_t mus_size)
 {
     // Header for the MUS file
     musheader musfileheader;
@@ -465,6 +454,9 @@ bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
     // Buffer used for MIDI track size record
     uint8_t tracksizebuffer[4];
 
+    // Offset of the track size record in the output
+    size_t tracksizepos;
+
     // Flag for when the score end marker is hit.
     int hitscoreend = 0;
 
@@ -473,16 +465,13 @@ bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
     // Used in building up time delays
     unsigned int timedelay;
 
-    // Initialise channel map to mark all channels as unused.
-
-    for (channel=0; channel<NUM_CHANNELS; ++channel)
-    {
-        channel_map[channel] = -1;
-    }
+    converter->input = mus;
+    converter->input_size = mus_size;
+    converter->input_pos = 0;
 
     // Grab the header
 
-    if (!ReadMusHeader(musinput, &musfileheader))
+    if (ReadMusHeader(converter, &musfileheader))
     {
         return true;
     }
@@ -499,17 +488,27 @@ bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
 #endif
 
     // Seek to where the data is held
-    if (mem_fseek(musinput, (long)musfileheader.scorestart,
-                  MEM_SEEK_SET) != 0)
+    if (musfileheader.scorestart >= mus_size)
     {
         return true;
     }
 
+    converter->input_pos = musfileheader.scorestart;
+
     // So, we can assume the MUS file is faintly legit. Let's start
     // writing MIDI data...
 
-    mem_fwrite(midiheader, 1, sizeof(midiheader), midioutput);
-    tracksize = 0;
+    tracksizepos = sizeof(midiheader) - 4;
+
+    if (converter->stream != NULL)
+    {
+        tracksizepos += (size_t)mem_ftell(converter->stream);
+    }
+
+    if (WriteData(converter, midiheader, sizeof(midiheader)))
+    {
+        return true;
+    }
 
     // Now, process the MUS file:
     while (!hitscoreend)
@@ -520,23 +519,23 @@ bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
         {
             // Fetch channel number and event code:
 
-            if (mem_fread(&eventdescriptor, 1, 1, musinput) != 1)
+            if (ReadByte(converter, &eventdescriptor))
             {
                 return true;
             }
 
-            channel = GetMIDIChannel(eventdescriptor & 0x0F, midioutput);
+            channel = GetMIDIChannel(converter, eventdescriptor & 0x0F);
             event = eventdescriptor & 0x70;
 
             switch (event)
             {
                 case mus_releasekey:
-                    if (mem_fread(&key, 1, 1, musinput) != 1)
+                    if (ReadByte(converter, &key))
                     {
                         return true;
                     }
 
-                    if (WriteReleaseKey(channel, key, midioutput))
+                    if (WriteReleaseKey(converter, channel, key))
                     {
                         return true;
                     }
@@ -544,23 +543,23 @@ bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
                     break;
 
                 case mus_presskey:
-                    if (mem_fread(&key, 1, 1, musinput) != 1)
+                    if (ReadByte(converter, &key))
                     {
                         return true;
                     }
 
                     if (key & 0x80)
                     {
-                        if (mem_fread(&channelvelocities[channel], 1, 1, musinput) != 1)
+                        if (ReadByte(converter, &converter->channelvelocities[channel]))
                         {
                             return true;
                         }
 
-                        channelvelocities[channel] &= 0x7F;
+                        converter->channelvelocities[channel] &= 0x7F;
                     }
 
-                    if (WritePressKey(channel, key,
-                                      channelvelocities[channel], midioutput))
+                    if (WritePressKey(converter, channel, key,
+                                      converter->channelvelocities[channel]))
                     {
                         return true;
                     }
@@ -568,11 +567,11 @@ bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
                     break;
 
                 case mus_pitchwheel:
-                    if (mem_fread(&key, 1, 1, musinput) != 1)
+                    if (ReadByte(converter, &key))
                     {
                         break;
                     }
-                    if (WritePitchWheel(channel, (short)(key * 64), midioutput))
+                    if (WritePitchWheel(converter, channel, (short)(key * 64)))
                     {
                         return true;
                     }
@@ -580,7 +579,7 @@ bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
                     break;
 
                 case mus_systemevent:
-                    if (mem_fread(&controllernumber, 1, 1, musinput) != 1)
+                    if (ReadByte(converter, &controllernumber))
                     {
                         return true;
                     }
@@ -589,9 +588,8 @@ bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
                         return true;
                     }
 
-                    if (WriteChangeController_Valueless(channel,
-                                                        controller_map[controllernumber],
-                                                        midioutput))
+                    if (WriteChangeController_Valueless(converter, channel,
+                                                        controller_map[controllernumber]))
                     {
                         return true;
                     }
@@ -599,20 +597,20 @@ bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
                     break;
 
                 case mus_changecontroller:
-                    if (mem_fread(&controllernumber, 1, 1, musinput) != 1)
+                    if (ReadByte(converter, &controllernumber))
                     {
                         return true;
                     }
 
-                    if (mem_fread(&controllervalue, 1, 1, musinput) != 1)
+                    if (ReadByte(converter, &controllervalue))
                     {
                         return true;
                     }
 
                     if (controllernumber == 0)
                     {
-                        if (WriteChangePatch(channel, controllervalue,
-                                             midioutput))
+                        if (WriteChangePatch(converter, channel,
+                                             controllervalue))
                         {
                             return true;
                         }
@@ -624,10 +622,9 @@ bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
                             return true;
                         }
 
-                        if (WriteChangeController_Valued(channel,
+                        if (WriteChangeController_Valued(converter, channel,
                                                          controller_map[controllernumber],
-                                                         controllervalue,
-                                                         midioutput))
+                                                         controllervalue))
                         {
                             return true;
                         }
@@ -655,7 +652,7 @@ bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
             timedelay = 0;
             for (;;)
             {
-                if (mem_fread(&working, 1, 1, musinput) != 1)
+                if (ReadByte(converter, &working))
                 {
                     return true;
                 }
@@ -666,35 +663,57 @@ bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
                     break;
                 }
             }
-            queuedtime += timedelay;
+            converter->queuedtime += timedelay;
         }
     }
 
     // End of track
-    if (WriteEndTrack(midioutput))
+    if (WriteEndTrack(converter))
     {
         return true;
     }
 
     // Write the track size into the stream
-    if (mem_fseek(midioutput, 18, MEM_SEEK_SET))
+    tracksizebuffer[0] = (converter->tracksize >> 24) & 0xff;
+    tracksizebuffer[1] = (converter->tracksize >> 16) & 0xff;
+    tracksizebuffer[2] = (converter->tracksize >> 8) & 0xff;
+    tracksizebuffer[3] = converter->tracksize & 0xff;
+
+    if (converter->stream != NULL)
     {
-        return true;
+        if (mem_fseek(converter->stream, (long)tracksizepos, MEM_SEEK_SET)
+         || mem_fwrite(tracksizebuffer, 1, 4, converter->stream) != 4)
+        {
+            return true;
+        }
     }
-
-    tracksizebuffer[0] = (tracksize >> 24) & 0xff;
-    tracksizebuffer[1] = (tracksize >> 16) & 0xff;
-    tracksizebuffer[2] = (tracksize >> 8) & 0xff;
-    tracksizebuffer[3] = tracksize & 0xff;
-
-    if (mem_fwrite(tracksizebuffer, 1, 4, midioutput) != 4)
+    else if (tracksizepos + 4 <= converter->buffer_size)
     {
-        return true;
+        memcpy(converter->buffer + tracksizepos, tracksizebuffer, 4);
     }
 
     return false;
 }
 
+// Read a MUS file from a stream (musinput) and output a MIDI file to
+// a stream (midioutput).
+//
+// Returns 0 on success or 1 on failure.
+
+bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput)
+{
+    mus2mid_t converter;
+    void *mus;
+    size_t mus_size;
+    long pos = mem_ftell(musinput);
+
+    mem_get_buf(musinput, &mus, &mus_size);
+    mus2mid_init(&converter, midioutput, NULL, 0);
+
+    return mus2mid_convert(&converter, (const uint8_t *)mus + pos,
+                           mus_size - (size_t)pos);
+}
+
 #ifdef STANDALONE
 
 #include "m_misc.h"
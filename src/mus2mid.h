@@ -21,12 +21,49 @@
 #define MUS2MID_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include "memio.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define MUS2MID_CHANNELS 16
+
+// Conversion state. Each conversion owns one, so that several can run
+// at once.
+typedef struct
+{
+    // MUS lump being read
+    const uint8_t *input;
+    size_t input_size;
+    size_t input_pos;
+
+    // Output: a growable stream, or else a caller's buffer of
+    // buffer_size bytes (which may be NULL to only count)
+    MEMFILE *stream;
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t length;              // Bytes written, or needed
+
+    // Timestamps between sequences of MUS events
+    unsigned int queuedtime;
+
+    // Counter for the length of the track
+    unsigned int tracksize;
+
+    // Cached channel velocities
+    uint8_t channelvelocities[MUS2MID_CHANNELS];
+
+    // MIDI channel of each MUS channel, or -1 until used
+    int channel_map[MUS2MID_CHANNELS];
+} mus2mid_t;
+
+void mus2mid_init(mus2mid_t *converter, MEMFILE *stream,
+                  uint8_t *buffer, size_t buffer_size);
+bool mus2mid_convert(mus2mid_t *converter, const uint8_t *mus,
+                     size_t mus_size);
 bool mus2mid(MEMFILE *musinput, MEMFILE *midioutput);
 
 #ifdef __cplusplus
@@ -14,6 +14,11 @@
 
 #include "doom_music.h"
 #include "opl3.h"
+#include "resampler.h"
+#include "threadpool.h"
+#include "state.h"
+#include "shared.h"
+#include "midifile.h"
 
 // MUS file header
 typedef struct {
@@ -33,6 +38,32 @@ typedef struct {
 #define MUS_EVENT_CONTROLLER      0x40
 #define MUS_EVENT_END_OF_SCORE    0x60
 
+// Play note without a volume byte: use the channel's last volume
+#define MUS_EVENT_NO_VOLUME       0xff
+
+// Decoded event types
+typedef enum {
+    mus_ev_none,         // No effect (dropped at compile time)
+    mus_ev_release,      // data[0]: key
+    mus_ev_play,         // data[0]: note, data[1]: volume or MUS_EVENT_NO_VOLUME
+    mus_ev_bend,         // data[0]: bend
+    mus_ev_notes_off,    // All sounds/notes off
+    mus_ev_reset_ctrl,   // Reset all controllers
+    mus_ev_program,      // data[0]: instrument
+    mus_ev_volume,       // data[0]: volume
+    mus_ev_pan,          // data[0]: pan
+    mus_ev_end,          // End of score (loops when looping)
+    mus_ev_stop          // Truncated score (always stops)
+} mus_event_type_t;
+
+// Decoded MUS event
+typedef struct {
+    uint32_t tick;           // Absolute time in 140 Hz ticks
+    uint8_t type;            // mus_event_type_t
+    uint8_t channel;         // MIDI channel (MUS 15 and 9 swapped)
+    uint8_t data[2];         // Event data, see mus_event_type_t
+} mus_event_t;
+
 // OPL register base addresses (from Chocolate Doom)
 #define OPL_REGS_TREMOLO      0x20
 #define OPL_REGS_LEVEL        0x40
@@ -43,6 +74,29 @@ typedef struct {
 #define OPL_REGS_FREQ_1       0xA0
 #define OPL_REGS_FREQ_2       0xB0
 
+// Shadow register file size (two register arrays) and the marker for a
+// register whose chip value is not known
+#define OPL_NUM_REGS          0x200
+#define OPL_REG_UNKNOWN       0xffff
+
+// Audio rendered before a seek target so that envelopes settle
+#define SEEK_SETTLE_MS        3
+
+// MIDI tempo until the first tempo event: 120 beats per minute, in
+// microseconds per beat
+#define MIDI_DEFAULT_TEMPO    500000
+
+// Events between seek keyframes
+#define SEEK_KEYFRAME_EVENTS  256
+
+// Parallel rendering: segments per worker thread, so that workers that
+// finish early can take over others' segments, and the shortest segment
+#define RENDER_SEGMENTS_PER_WORKER  4
+#define RENDER_SEGMENT_MIN_MS       1000
+
+// Entries in each of the main and percussion instrument tables
+#define INSTR_TABLE_SIZE      256
+
 // GENMIDI flags
 #define GENMIDI_FLAG_FIXED    0x0001
 #define GENMIDI_FLAG_2VOICE   0x0004
@@ -216,14 +270,32 @@ typedef struct {
     int note;            // Current note
     int key;             // MIDI key number
     int velocity;        // Last velocity for note-on (0-127)
+    uint32_t voice_mask; // Allocated voices playing this channel, by index
 } channel_state_t;
 
+// Register values for one instrument voice, compiled at GENMIDI load
+#define INSTR_BLOB_OP_REGS 5
+typedef struct {
+    uint8_t car[INSTR_BLOB_OP_REGS];  // Carrier level/tremolo/attack/sustain/waveform
+    uint8_t mod[INSTR_BLOB_OP_REGS];  // Modulator registers, same order
+    uint8_t feedback;                 // Feedback/connection, before pan bits
+    unsigned int priority;            // Voice priority
+} instr_blob_t;
+
+// GENMIDI bank: the instruments and their compiled voices, built once and
+// then only read, so players share it. Percussion follows the main table
+// in the same array, so any instrument pointer indexes the blobs.
+struct musdoom_genmidi {
+    genmidi_instr_t instruments[2 * INSTR_TABLE_SIZE];
+    instr_blob_t blobs[2 * INSTR_TABLE_SIZE][2];
+};
+
 // Voice state
 typedef struct {
     int index;           // Voice index (0-17)
     int op1, op2;        // Operator indices
     int array;           // OPL array (0 or 0x100)
-    genmidi_instr_t* current_instr;  // Current instrument
+    const genmidi_instr_t* current_instr;  // Current instrument
     unsigned int current_instr_voice; // Voice number in instrument
     channel_state_t* channel;        // Channel using this voice
     unsigned int key;    // MIDI key
@@ -235,90 +307,173 @@ typedef struct {
     unsigned int reg_pan;     // Pan register value
     int in_use;          // Is this voice in use?
     unsigned int priority;    // Voice priority
+    int prev, next;      // Neighbours in the free or allocated list (-1 at the ends)
+    unsigned int alloc_seq;   // Allocation order, to release a channel's voices in list order
 } voice_state_t;
 
+// Playback state before an event, captured by the seek index. The chip is
+// restored from the shadow registers plus its envelopes and phases.
+typedef struct {
+    size_t event_pos;
+    uint64_t next_event_sample;
+    uint64_t timing_remainder;
+    channel_state_t channels[16];
+    voice_state_t voices[18];
+    int voice_free_head, voice_free_tail;
+    int voice_alloced_head, voice_alloced_tail;
+    int voice_free_num;
+    int voice_alloced_num;
+    unsigned int voice_alloc_seq;
+    uint16_t opl_regs[OPL_NUM_REGS];
+    uint64_t opl_aged[18];
+    Bit16s eg_rout[36];
+    Bit8u eg_gen[36];
+    Bit32u pg_phase[36];
+} seek_keyframe_t;
+
 // MUS player state
 struct mus_player_s {
     opl3_chip opl;                    // OPL3 chip state
-    const uint8_t* data;              // MUS data pointer
-    size_t data_size;                 // MUS data size
-    const uint8_t* score;             // Score pointer
-    size_t score_size;                // Score size
-    const uint8_t* position;          // Current position in score
+    int loaded;                       // A score has been compiled
+    mus_event_t* events;              // Decoded score
+    size_t num_events;                // Number of decoded events
+    uint32_t score_hash;              // Identifies the score in state snapshots
+    size_t event_pos;                 // Next event to process
     int playing;                      // Is playing?
     int looping;                      // Loop enabled?
     uint64_t current_sample;          // Current sample index
     uint64_t next_event_sample;       // Sample index for next event
     uint64_t timing_remainder;        // Remainder for tick->sample conversion
     int sample_rate;                  // Sample rate
+    opl_resampler_t* resampler;       // Native rate to sample rate conversion
+    int native_rate;                  // Rendering at the chip rate, no resampler?
     channel_state_t channels[16];     // MIDI channel states
     voice_state_t voices[18];         // OPL voice states
-    voice_state_t* voice_free_list[18];
-    voice_state_t* voice_alloced_list[18];
+    int voice_free_head, voice_free_tail;        // Free voices, next allocated first
+    int voice_alloced_head, voice_alloced_tail;  // Allocated voices, oldest first
     int voice_free_num;
     int voice_alloced_num;
-    genmidi_instr_t* instruments;     // Instrument definitions (main)
-    genmidi_instr_t* percussion;      // Percussion instruments
-    int instruments_loaded;           // Are instruments loaded?
+    unsigned int voice_alloc_seq;     // Allocations so far
+    genmidi_bank_t* genmidi;          // Shared instrument bank, NULL until loaded
     int opl3_mode;                    // OPL3 enabled?
+    opl_block_generator_t generate_block;  // OPL3 or OPL2 block generator
     int num_voices;                   // 9 (OPL2) or 18 (OPL3)
     opl_driver_ver_t driver_version;  // DMX behavior version
     int master_volume;                // Current music volume (0-127)
     int start_volume;                 // Start volume for clip behavior
+    uint16_t opl_regs[OPL_NUM_REGS];  // Last value written to each register
+    int opl_4op;                      // 4-op pairs enabled (shadow bypassed)?
+    uint64_t opl_writes;              // Register writes issued
+    uint64_t opl_writes_suppressed;   // ... of which dropped as redundant
+    seek_keyframe_t* keyframes;       // Seek index, every SEEK_KEYFRAME_EVENTS
+    size_t num_keyframes;
+    int keyframes_valid;              // Index built for the current settings?
+    int replaying;                    // Seek replay: writes age their channel
+    int replay_feedback;              // ... rendering feedback modulators?
+    uint64_t opl_aged[18];            // Native sample each channel is aged to
 };
 
 // Forward declarations
 static void write_opl_reg(mus_player_t* player, int reg, int value);
-static void load_operator(mus_player_t* player, int operator_idx, genmidi_op_t* data, int max_level, unsigned int* volume);
-static void set_voice_instrument(mus_player_t* player, voice_state_t* voice, genmidi_instr_t* instr, unsigned int instr_voice);
+static void set_voice_instrument(mus_player_t* player, voice_state_t* voice, const genmidi_instr_t* instr, unsigned int instr_voice);
 static void set_voice_volume(mus_player_t* player, voice_state_t* voice, unsigned int volume);
 static void set_voice_pan(mus_player_t* player, voice_state_t* voice, unsigned int reg_pan);
 static void update_voice_frequency(mus_player_t* player, voice_state_t* voice);
-static void voice_key_on(mus_player_t* player, channel_state_t* channel, genmidi_instr_t* instrument, unsigned int instrument_voice, unsigned int note, unsigned int key, unsigned int volume);
+static void voice_key_on(mus_player_t* player, channel_state_t* channel, const genmidi_instr_t* instrument, unsigned int instrument_voice, unsigned int note, unsigned int key, unsigned int volume);
 static void voice_key_off(mus_player_t* player, voice_state_t* voice);
 static voice_state_t* get_free_voice(mus_player_t* player);
-static void release_voice_index(mus_player_t* player, int index);
 static void replace_existing_voice(mus_player_t* player);
 static void replace_existing_voice_doom1(mus_player_t* player);
 static void replace_existing_voice_doom2(mus_player_t* player, channel_state_t* for_channel);
 static void release_voice(mus_player_t* player, voice_state_t* voice);
+static void reset_voice_lists(mus_player_t* player);
 static void release_all_voices_for_channel(mus_player_t* player, channel_state_t* channel);
 static unsigned int frequency_for_voice(mus_player_t* player, voice_state_t* voice);
 static void set_channel_volume(mus_player_t* player, channel_state_t* channel, unsigned int volume, int clip_start);
 static void set_channel_pan(mus_player_t* player, channel_state_t* channel, unsigned int pan);
 static void reset_playback_state(mus_player_t* player);
+static mus_event_t* compile_score(const uint8_t* score, size_t size, size_t* num_events);
+static mus_event_t* compile_midi(const uint8_t* data, size_t size, size_t* num_events);
+
+// Forget the shadow register file
+static void reset_opl_shadow(mus_player_t* player) {
+    int r;
+    for (r = 0; r < OPL_NUM_REGS; r++) {
+        player->opl_regs[r] = OPL_REG_UNKNOWN;
+    }
+}
+
+static void age_opl_reg(mus_player_t* player, int reg);
 
-// Write OPL register
+// Write OPL register, dropping writes that would not change chip state
 static void write_opl_reg(mus_player_t* player, int reg, int value) {
+    reg &= OPL_NUM_REGS - 1;
+    value &= 0xff;
+    player->opl_writes++;
+
+    if (player->opl_regs[reg] == value) {
+        player->opl_writes_suppressed++;
+        return;
+    }
+
+    if (player->replaying) {
+        age_opl_reg(player, reg);
+    }
     OPL3_WriteReg(&player->opl, (Bit16u)reg, (Bit8u)value);
+
+    // Note select, rhythm, 4-op and OPL3 mode change how the other
+    // registers are decoded, so a write to one of them invalidates the
+    // whole shadow.
+    // With 4-op pairs a frequency write also updates the paired channel,
+    // so nothing is shadowed while they are enabled.
+    if (reg == 0x08 || reg == 0xbd || reg == 0x104 || reg == 0x105) {
+        reset_opl_shadow(player);
+        if (reg == 0x104) {
+            player->opl_4op = (value & 0x3f) != 0;
+        }
+        return;
+    }
+    if (!player->opl_4op) {
+        player->opl_regs[reg] = (uint16_t)value;
+    }
 }
 
-// Load operator data to OPL registers (from Chocolate Doom)
-static void load_operator(mus_player_t* player, int operator_idx, genmidi_op_t* data, int max_level, unsigned int* volume) {
-    int level;
-    
+// Operator registers in blob order
+static const int instr_blob_regs[INSTR_BLOB_OP_REGS] = {
+    OPL_REGS_LEVEL, OPL_REGS_TREMOLO, OPL_REGS_ATTACK, OPL_REGS_SUSTAIN, OPL_REGS_WAVEFORM
+};
+
+// Compile operator data to register values (from Chocolate Doom)
+static void compile_operator(uint8_t* regs, const genmidi_op_t* data, int max_level) {
     // The scale and level fields must be combined for the level register
-    level = data->scale;
-    
-    if (max_level) {
-        level |= 0x3f;
-    } else {
-        level |= data->level;
-    }
-    
-    *volume = level;
-    
-    write_opl_reg(player, OPL_REGS_LEVEL + operator_idx, level);
-    write_opl_reg(player, OPL_REGS_TREMOLO + operator_idx, data->tremolo);
-    write_opl_reg(player, OPL_REGS_ATTACK + operator_idx, data->attack);
-    write_opl_reg(player, OPL_REGS_SUSTAIN + operator_idx, data->sustain);
-    write_opl_reg(player, OPL_REGS_WAVEFORM + operator_idx, data->waveform);
+    regs[0] = data->scale | (max_level ? 0x3f : data->level);
+    regs[1] = data->tremolo;
+    regs[2] = data->attack;
+    regs[3] = data->sustain;
+    regs[4] = data->waveform;
+}
+
+// Compile an instrument voice into its register blob
+static void compile_instr_blob(instr_blob_t* blob, const genmidi_voice_t* data) {
+    // Are we using modulated feedback mode?
+    int modulating = (data->feedback & 0x01) == 0;
+
+    // The carrier is set to minimum volume until the voice volume is set
+    compile_operator(blob->car, &data->carrier, 1);
+    compile_operator(blob->mod, &data->modulator, !modulating);
+    blob->feedback = data->feedback;
+
+    // Calculate voice priority (matches Chocolate Doom)
+    blob->priority = 0x0f - (data->carrier.attack >> 4)
+                   + 0x0f - (data->carrier.sustain & 0x0f);
 }
 
 // Set the instrument for a voice (from Chocolate Doom)
-static void set_voice_instrument(mus_player_t* player, voice_state_t* voice, genmidi_instr_t* instr, unsigned int instr_voice) {
-    genmidi_voice_t* data;
-    unsigned int modulating;
+static void set_voice_instrument(mus_player_t* player, voice_state_t* voice, const genmidi_instr_t* instr, unsigned int instr_voice) {
+    const instr_blob_t* blob;
+    int op2 = voice->op2 | voice->array;
+    int op1 = voice->op1 | voice->array;
+    int i;
     
     // Instrument already set?
     if (voice->current_instr == instr && voice->current_instr_voice == instr_voice) {
@@ -328,27 +483,27 @@ static void set_voice_instrument(mus_player_t* player, voice_state_t* voice, gen
     voice->current_instr = instr;
     voice->current_instr_voice = instr_voice;
     
-    data = &instr->voices[instr_voice];
-    
-    // Are we using modulated feedback mode?
-    modulating = (data->feedback & 0x01) == 0;
+    blob = &player->genmidi->blobs[instr - player->genmidi->instruments][instr_voice];
     
     // Doom loads the second operator first, then the first
-    // The carrier is set to minimum volume until the voice volume is set
-    load_operator(player, voice->op2 | voice->array, &data->carrier, 1, &voice->car_volume);
-    load_operator(player, voice->op1 | voice->array, &data->modulator, !modulating, &voice->mod_volume);
+    for (i = 0; i < INSTR_BLOB_OP_REGS; i++) {
+        write_opl_reg(player, instr_blob_regs[i] + op2, blob->car[i]);
+    }
+    for (i = 0; i < INSTR_BLOB_OP_REGS; i++) {
+        write_opl_reg(player, instr_blob_regs[i] + op1, blob->mod[i]);
+    }
+    voice->car_volume = blob->car[0];
+    voice->mod_volume = blob->mod[0];
     
     // Set feedback register
-    write_opl_reg(player, (OPL_REGS_FEEDBACK + voice->index) | voice->array, data->feedback | voice->reg_pan);
+    write_opl_reg(player, (OPL_REGS_FEEDBACK + voice->index) | voice->array, blob->feedback | voice->reg_pan);
 
-    // Calculate voice priority (matches Chocolate Doom)
-    voice->priority = 0x0f - (data->carrier.attack >> 4)
-                    + 0x0f - (data->carrier.sustain & 0x0f);
+    voice->priority = blob->priority;
 }
 
 // Set voice volume (from Chocolate Doom)
 static void set_voice_volume(mus_player_t* player, voice_state_t* voice, unsigned int volume) {
-    genmidi_voice_t* opl_voice;
+    const genmidi_voice_t* opl_voice;
     unsigned int midi_volume;
     unsigned int full_volume;
     unsigned int car_volume;
@@ -395,7 +550,7 @@ static void set_voice_volume(mus_player_t* player, voice_state_t* voice, unsigne
 
 // Set voice pan (OPL3 only; uses reg_pan bits in feedback register)
 static void set_voice_pan(mus_player_t* player, voice_state_t* voice, unsigned int reg_pan) {
-    genmidi_voice_t* data;
+    const genmidi_voice_t* data;
 
     if (voice->reg_pan == reg_pan || !voice->current_instr) {
         return;
@@ -408,7 +563,22 @@ static void set_voice_pan(mus_player_t* player, voice_state_t* voice, unsigned i
                   data->feedback | voice->reg_pan);
 }
 
+// Index of the lowest voice in a voice mask
+static int lowest_voice(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
 static void set_channel_volume(mus_player_t* player, channel_state_t* channel, unsigned int volume, int clip_start) {
+    uint32_t mask;
     int i;
 
     if (volume > 127) {
@@ -427,16 +597,15 @@ static void set_channel_volume(mus_player_t* player, channel_state_t* channel, u
     channel->volume = (int)volume;
 
     // Update all voices that this channel is using.
-    for (i = 0; i < 18; i++) {
-        if (player->voices[i].in_use && player->voices[i].channel == channel) {
-            set_voice_volume(player, &player->voices[i], player->voices[i].note_volume);
-        }
+    for (mask = channel->voice_mask; mask; mask &= mask - 1) {
+        i = lowest_voice(mask);
+        set_voice_volume(player, &player->voices[i], player->voices[i].note_volume);
     }
 }
 
 static void set_channel_pan(mus_player_t* player, channel_state_t* channel, unsigned int pan) {
     unsigned int reg_pan;
-    int i;
+    uint32_t mask;
 
     // DMX pan mapping: left <= 48, center 49-95, right >= 96
     if (pan >= 96) {
@@ -453,10 +622,8 @@ static void set_channel_pan(mus_player_t* player, channel_state_t* channel, unsi
 
     channel->pan = (int)reg_pan;
 
-    for (i = 0; i < 18; i++) {
-        if (player->voices[i].in_use && player->voices[i].channel == channel) {
-            set_voice_pan(player, &player->voices[i], reg_pan);
-        }
+    for (mask = channel->voice_mask; mask; mask &= mask - 1) {
+        set_voice_pan(player, &player->voices[lowest_voice(mask)], reg_pan);
     }
 }
 
@@ -467,106 +634,165 @@ static int channel_index_for_voice(mus_player_t* player, voice_state_t* voice) {
     return (int)(voice->channel - player->channels);
 }
 
+// Unlink a voice from the allocated list
+static void unlink_alloced_voice(mus_player_t* player, voice_state_t* voice) {
+    if (voice->prev >= 0) {
+        player->voices[voice->prev].next = voice->next;
+    } else {
+        player->voice_alloced_head = voice->next;
+    }
+    if (voice->next >= 0) {
+        player->voices[voice->next].prev = voice->prev;
+    } else {
+        player->voice_alloced_tail = voice->prev;
+    }
+}
+
+// Append a voice to the end of the allocated list
+static void append_alloced_voice(mus_player_t* player, voice_state_t* voice) {
+    int index = (int)(voice - player->voices);
+
+    voice->prev = player->voice_alloced_tail;
+    voice->next = -1;
+    if (player->voice_alloced_tail >= 0) {
+        player->voices[player->voice_alloced_tail].next = index;
+    } else {
+        player->voice_alloced_head = index;
+    }
+    player->voice_alloced_tail = index;
+}
+
+// Take the channel's oldest allocated voice out of a mask of its voices.
+// A channel's voices keep their allocation order in the allocated list.
+static voice_state_t* oldest_voice(mus_player_t* player, uint32_t* mask) {
+    voice_state_t* result = NULL;
+    uint32_t m;
+
+    for (m = *mask; m; m &= m - 1) {
+        voice_state_t* voice = &player->voices[lowest_voice(m)];
+        if (!result || (int)(voice->alloc_seq - result->alloc_seq) < 0) {
+            result = voice;
+        }
+    }
+    *mask &= ~((uint32_t)1 << (result - player->voices));
+    return result;
+}
+
 // Get a free voice from the freelist
 static voice_state_t* get_free_voice(mus_player_t* player) {
-    int i;
     voice_state_t* result;
 
     if (player->voice_free_num == 0) {
         return NULL;
     }
 
-    result = player->voice_free_list[0];
-    player->voice_free_num--;
-
-    for (i = 0; i < player->voice_free_num; i++) {
-        player->voice_free_list[i] = player->voice_free_list[i + 1];
+    result = &player->voices[player->voice_free_head];
+    player->voice_free_head = result->next;
+    if (player->voice_free_head < 0) {
+        player->voice_free_tail = -1;
     }
+    player->voice_free_num--;
 
-    player->voice_alloced_list[player->voice_alloced_num++] = result;
+    append_alloced_voice(player, result);
+    player->voice_alloced_num++;
+    result->alloc_seq = player->voice_alloc_seq++;
     result->in_use = 1;
     return result;
 }
 
-static void release_voice_index(mus_player_t* player, int index) {
-    voice_state_t* voice;
-    int i;
-
-    if (index < 0 || index >= player->voice_alloced_num) {
-        return;
-    }
+// Release an allocated voice to the end of the freelist
+static void release_voice(mus_player_t* player, voice_state_t* voice) {
+    int index = (int)(voice - player->voices);
 
-    voice = player->voice_alloced_list[index];
+    if (!voice->in_use) return;
 
     voice_key_off(player, voice);
+    if (voice->channel) {
+        voice->channel->voice_mask &= ~((uint32_t)1 << index);
+    }
     voice->channel = NULL;
     voice->note = 0;
     voice->current_instr = NULL;
     voice->in_use = 0;
 
+    unlink_alloced_voice(player, voice);
     player->voice_alloced_num--;
-    for (i = index; i < player->voice_alloced_num; i++) {
-        player->voice_alloced_list[i] = player->voice_alloced_list[i + 1];
-    }
 
-    player->voice_free_list[player->voice_free_num++] = voice;
+    voice->next = -1;
+    if (player->voice_free_tail >= 0) {
+        player->voices[player->voice_free_tail].next = index;
+    } else {
+        player->voice_free_head = index;
+    }
+    player->voice_free_tail = index;
+    player->voice_free_num++;
 }
 
 static void replace_existing_voice(mus_player_t* player) {
+    voice_state_t* result = NULL;
     int i;
-    int result = 0;
 
-    for (i = 0; i < player->voice_alloced_num; i++) {
-        int chan_i = channel_index_for_voice(player, player->voice_alloced_list[i]);
-        int chan_r = channel_index_for_voice(player, player->voice_alloced_list[result]);
+    for (i = player->voice_alloced_head; i >= 0; i = player->voices[i].next) {
+        voice_state_t* voice = &player->voices[i];
 
-        if (player->voice_alloced_list[i]->current_instr_voice != 0
-            || chan_i >= chan_r) {
-            result = i;
+        if (!result || voice->current_instr_voice != 0
+            || channel_index_for_voice(player, voice) >= channel_index_for_voice(player, result)) {
+            result = voice;
         }
     }
 
-    release_voice_index(player, result);
+    if (result) {
+        release_voice(player, result);
+    }
 }
 
 // Doom 1.666 behavior
 static void replace_existing_voice_doom1(mus_player_t* player) {
+    voice_state_t* result = NULL;
     int i;
-    int result = 0;
 
-    for (i = 0; i < player->voice_alloced_num; i++) {
-        int chan_i = channel_index_for_voice(player, player->voice_alloced_list[i]);
-        int chan_r = channel_index_for_voice(player, player->voice_alloced_list[result]);
+    for (i = player->voice_alloced_head; i >= 0; i = player->voices[i].next) {
+        voice_state_t* voice = &player->voices[i];
 
-        if (chan_i > chan_r) {
-            result = i;
+        if (!result
+            || channel_index_for_voice(player, voice) > channel_index_for_voice(player, result)) {
+            result = voice;
         }
     }
 
-    release_voice_index(player, result);
+    if (result) {
+        release_voice(player, result);
+    }
 }
 
 // Doom 2 1.666 behavior
 static void replace_existing_voice_doom2(mus_player_t* player, channel_state_t* for_channel) {
-    int i;
-    int result = 0;
+    voice_state_t* result;
     int priority = 0x8000;
     int channel_idx = (int)(for_channel - player->channels);
+    int n;
+    int i;
 
-    for (i = 0; i < player->voice_alloced_num - 3; i++) {
-        int chan_i = channel_index_for_voice(player, player->voice_alloced_list[i]);
-        if (player->voice_alloced_list[i]->priority < (unsigned int)priority
-            && chan_i >= channel_idx) {
-            priority = (int)player->voice_alloced_list[i]->priority;
-            result = i;
+    if (player->voice_alloced_head < 0) return;
+    result = &player->voices[player->voice_alloced_head];
+
+    // The three most recent voices are never stolen
+    for (i = player->voice_alloced_head, n = 0;
+         n < player->voice_alloced_num - 3; i = player->voices[i].next, n++) {
+        voice_state_t* voice = &player->voices[i];
+        if (voice->priority < (unsigned int)priority
+            && channel_index_for_voice(player, voice) >= channel_idx) {
+            priority = (int)voice->priority;
+            result = voice;
         }
     }
 
-    release_voice_index(player, result);
+    release_voice(player, result);
 }
+
 // Calculate frequency for a voice (from Chocolate Doom)
 static unsigned int frequency_for_voice(mus_player_t* player, voice_state_t* voice) {
-    genmidi_voice_t* gm_voice;
+    const genmidi_voice_t* gm_voice;
     signed int freq_index;
     unsigned int octave;
     unsigned int sub_index;
@@ -635,7 +861,7 @@ static void update_voice_frequency(mus_player_t* player, voice_state_t* voice) {
 // Turn on a voice (from Chocolate Doom)
 // Note: Chocolate Doom does NOT release the previous voice when a new note is played
 // The old voice continues until it receives a note off or is stolen
-static void voice_key_on(mus_player_t* player, channel_state_t* channel, genmidi_instr_t* instrument, unsigned int instrument_voice, unsigned int note, unsigned int key, unsigned int volume) {
+static void voice_key_on(mus_player_t* player, channel_state_t* channel, const genmidi_instr_t* instrument, unsigned int instrument_voice, unsigned int note, unsigned int key, unsigned int volume) {
     voice_state_t* voice;
 
     // Allocate a voice; allocation policy handled by caller
@@ -646,6 +872,7 @@ static void voice_key_on(mus_player_t* player, channel_state_t* channel, genmidi
 
     voice->channel = channel;
     voice->key = key;
+    channel->voice_mask |= (uint32_t)1 << (voice - player->voices);
 
     // Work out the note to use - normally same as key, unless fixed pitch
     if ((instrument->flags & GENMIDI_FLAG_FIXED) != 0) {
@@ -673,30 +900,31 @@ static void voice_key_off(mus_player_t* player, voice_state_t* voice) {
     write_opl_reg(player, (OPL_REGS_FREQ_2 + voice->index) | voice->array, voice->freq >> 8);
 }
 
-// Replace an existing voice (voice stealing) - from Chocolate Doom
-// Release a voice
-static void release_voice(mus_player_t* player, voice_state_t* voice) {
-    if (!voice || !voice->in_use) return;
-    {
-        int i;
-        for (i = 0; i < player->voice_alloced_num; i++) {
-            if (player->voice_alloced_list[i] == voice) {
-                release_voice_index(player, i);
-                return;
-            }
-        }
+// Release all voices for a channel (for double-voice instruments)
+static void release_all_voices_for_channel(mus_player_t* player, channel_state_t* channel) {
+    uint32_t mask = channel->voice_mask;
+
+    while (mask) {
+        release_voice(player, oldest_voice(player, &mask));
     }
 }
 
-// Release all voices for a channel (for double-voice instruments)
-static void release_all_voices_for_channel(mus_player_t* player, channel_state_t* channel) {
+// Put every voice on the freelist in index order
+static void reset_voice_lists(mus_player_t* player) {
     int i;
-    
-    for (i = 0; i < player->voice_alloced_num; i++) {
-        if (player->voice_alloced_list[i]->channel == channel) {
-            release_voice_index(player, i);
-            i--;
-        }
+
+    player->voice_free_num = player->num_voices;
+    player->voice_alloced_num = 0;
+    player->voice_free_head = player->num_voices > 0 ? 0 : -1;
+    player->voice_free_tail = player->num_voices - 1;
+    player->voice_alloced_head = -1;
+    player->voice_alloced_tail = -1;
+    for (i = 0; i < player->num_voices; i++) {
+        player->voices[i].prev = -1;
+        player->voices[i].next = i + 1 < player->num_voices ? i + 1 : -1;
+    }
+    for (i = 0; i < 16; i++) {
+        player->channels[i].voice_mask = 0;
     }
 }
 
@@ -739,12 +967,26 @@ static void init_opl_registers(mus_player_t* player) {
         write_opl_reg(player, r | 0x100, 0x00);
     }
     
-    // More registers for second array
+    // More registers for second array. As in the driver, this clears 0x105
+    // (NEW) again, so the chip always runs with the OPL3 extensions off and
+    // pan bits are ignored in both modes
     for (r = 1; r < OPL_REGS_LEVEL; ++r) {
         write_opl_reg(player, r | 0x100, 0x00);
     }
 }
 
+// Reset the chip to power-on state and program it as the driver does
+static void reset_opl(mus_player_t* player) {
+    OPL3_Reset(&player->opl, player->sample_rate);
+    reset_opl_shadow(player);
+    
+    // Initialize OPL registers
+    init_opl_registers(player);
+    
+    // The DMX driver never uses rhythm mode or 4-op pairs
+    OPL3_SetDoomProfile(&player->opl, 1);
+}
+
 // Create MUS player
 mus_player_t* mus_player_create(int sample_rate) {
     mus_player_t* player;
@@ -754,17 +996,16 @@ mus_player_t* mus_player_create(int sample_rate) {
     if (!player) return NULL;
     
     player->sample_rate = sample_rate;
+    player->native_rate = sample_rate == OPL_NATIVE_RATE;
     player->opl3_mode = 1;
+    player->generate_block = OPL3_GenerateBlock;
     player->num_voices = 18;
     player->driver_version = opl_doom_1_9;
     player->master_volume = 100;
     player->start_volume = 100;
     
     // Initialize OPL3
-    OPL3_Reset(&player->opl, sample_rate);
-    
-    // Initialize OPL registers
-    init_opl_registers(player);
+    reset_opl(player);
     
     // Initialize channels
     for (i = 0; i < 16; i++) {
@@ -793,21 +1034,14 @@ mus_player_t* mus_player_create(int sample_rate) {
     }
 
     // Voice free/alloc lists
-    player->voice_free_num = player->num_voices;
-    player->voice_alloced_num = 0;
-    for (i = 0; i < player->num_voices; i++) {
-        player->voice_free_list[i] = &player->voices[i];
-    }
+    reset_voice_lists(player);
     
-    // Allocate instrument arrays
-    player->instruments = (genmidi_instr_t*)calloc(256, sizeof(genmidi_instr_t));
-    player->percussion = (genmidi_instr_t*)calloc(256, sizeof(genmidi_instr_t));
-    
-    if (!player->instruments || !player->percussion) {
-        free(player->instruments);
-        free(player->percussion);
-        free(player);
-        return NULL;
+    if (!player->native_rate) {
+        player->resampler = opl_resampler_create(opl_resampler_linear, sample_rate);
+        if (!player->resampler) {
+            free(player);
+            return NULL;
+        }
     }
     
     return player;
@@ -816,8 +1050,10 @@ mus_player_t* mus_player_create(int sample_rate) {
 // Destroy MUS player
 void mus_player_destroy(mus_player_t* player) {
     if (!player) return;
-    free(player->instruments);
-    free(player->percussion);
+    shared_release(player->genmidi);
+    shared_release(player->events);
+    free(player->keyframes);
+    opl_resampler_destroy(player->resampler);
     free(player);
 }
 
@@ -832,6 +1068,7 @@ void mus_player_set_master_volume(mus_player_t* player, int volume) {
     }
 
     player->master_volume = volume;
+    player->keyframes_valid = 0;
 
     for (i = 0; i < 16; ++i) {
         if (i == 15) {
@@ -843,20 +1080,87 @@ void mus_player_set_master_volume(mus_player_t* player, int volume) {
     }
 }
 
+void mus_player_get_write_stats(mus_player_t* player, uint64_t* writes, uint64_t* suppressed) {
+    if (!player) return;
+    if (writes) *writes = player->opl_writes;
+    if (suppressed) *suppressed = player->opl_writes_suppressed;
+}
+
+void mus_player_reset_write_stats(mus_player_t* player) {
+    if (!player) return;
+    player->opl_writes = 0;
+    player->opl_writes_suppressed = 0;
+}
+
 void mus_player_set_driver_version(mus_player_t* player, opl_driver_ver_t version) {
     if (!player) return;
     player->driver_version = version;
+    player->keyframes_valid = 0;
+}
+
+int mus_player_set_resampler(mus_player_t* player, int quality) {
+    opl_resampler_t* resampler;
+    if (!player) return -1;
+    if (player->native_rate) {
+        // Nothing to resample; still reject unknown qualities
+        if (quality < opl_resampler_linear || quality > opl_resampler_halfband) {
+            return -1;
+        }
+        return 0;
+    }
+    resampler = opl_resampler_create((opl_resampler_quality_t)quality, player->sample_rate);
+    if (!resampler) return -1;
+    opl_resampler_destroy(player->resampler);
+    player->resampler = resampler;
+    return 0;
 }
 
 void mus_player_set_opl3_mode(mus_player_t* player, int opl3_mode) {
     if (!player) return;
     player->opl3_mode = opl3_mode ? 1 : 0;
     player->num_voices = player->opl3_mode ? 18 : 9;
+    player->keyframes_valid = 0;
+
+    // OPL2 mode only drives the first bank; render it with the bank-0-only
+    // mono generator
+    player->generate_block = player->opl3_mode ? OPL3_GenerateBlock
+                                               : OPL3_GenerateBlockOPL2;
+}
+
+// FNV-1a hash of the music data
+static uint32_t hash_score(const uint8_t* data, size_t size) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+    
+    for (i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Replace the score with compiled events, taking over their reference
+static void set_score(mus_player_t* player, const uint8_t* data, size_t size,
+                      mus_event_t* events, size_t num_events) {
+    shared_release(player->events);
+    
+    player->loaded = 1;
+    player->events = events;
+    player->num_events = num_events;
+    player->score_hash = hash_score(data, size);
+    player->keyframes_valid = 0;
+    player->event_pos = 0;
+    player->playing = 0;
+    player->current_sample = 0;
+    player->next_event_sample = 0;
+    player->timing_remainder = 0;
 }
 
 // Load MUS data
+
 int mus_player_load(mus_player_t* player, const uint8_t* data, size_t size) {
     const mus_header_t* header;
+    mus_event_t* events;
+    size_t num_events;
     
     if (!player || !data || size < sizeof(mus_header_t)) {
         return -1;
@@ -878,26 +1182,40 @@ int mus_player_load(mus_player_t* player, const uint8_t* data, size_t size) {
         return -1;
     }
     
-    player->data = data;
-    player->data_size = size;
-    player->score = data + header->score_start;
-    player->score_size = header->score_len;
-    player->position = player->score;
-    player->playing = 0;
-    player->current_sample = 0;
-    player->next_event_sample = 0;
-    player->timing_remainder = 0;
+    events = compile_score(data + header->score_start, header->score_len, &num_events);
+    if (!events) {
+        return -1;
+    }
+    set_score(player, data, size, events, num_events);
+    return 0;
+}
+
+// Load a MIDI file (format 0 or 1), compiled into the same events as a
+// MUS score
+int mus_player_load_midi(mus_player_t* player, const uint8_t* data, size_t size) {
+    mus_event_t* events;
+    size_t num_events;
+    
+    if (!player || !data) {
+        return -1;
+    }
     
+    events = compile_midi(data, size, &num_events);
+    if (!events) {
+        return -1;
+    }
+    set_score(player, data, size, events, num_events);
     return 0;
 }
 
-// Load GENMIDI instruments
-int mus_player_load_instruments(mus_player_t* player, const uint8_t* data, size_t size) {
+// Parse a GENMIDI lump into a bank holding one reference
+genmidi_bank_t* genmidi_bank_create(const uint8_t* data, size_t size) {
+    genmidi_bank_t* bank;
     const uint8_t* ptr;
     int i;
     
-    if (!player || !data || size < 8) {
-        return -1;
+    if (!data || size < 8) {
+        return NULL;
     }
 
     // Ensure the data is large enough for the full GENMIDI payload.
@@ -905,37 +1223,84 @@ int mus_player_load_instruments(mus_player_t* player, const uint8_t* data, size_
         const size_t instr_count = 128 + 47;
         const size_t required_size = 8 + instr_count * sizeof(genmidi_instr_t);
         if (size < required_size) {
-            return -1;
+            return NULL;
         }
     }
     
     // Check GENMIDI signature
     if (memcmp(data, "#OPL_II#", 8) != 0) {
-        return -1;
+        return NULL;
+    }
+    
+    bank = (genmidi_bank_t*)shared_calloc(1, sizeof(genmidi_bank_t));
+    if (!bank) {
+        return NULL;
     }
     
     ptr = data + 8;  // Skip header
     
     // Load main instruments (128 melodic instruments)
     for (i = 0; i < 128; i++) {
-        memcpy(&player->instruments[i], ptr, sizeof(genmidi_instr_t));
+        memcpy(&bank->instruments[i], ptr, sizeof(genmidi_instr_t));
         ptr += sizeof(genmidi_instr_t);
     }
     
     // Load percussion instruments (47 percussion instruments)
     // Percussion is indexed by note number (35-81 are standard)
     for (i = 0; i < 47; i++) {
-        memcpy(&player->percussion[i], ptr, sizeof(genmidi_instr_t));
+        memcpy(&bank->instruments[INSTR_TABLE_SIZE + i], ptr, sizeof(genmidi_instr_t));
         ptr += sizeof(genmidi_instr_t);
     }
     
-    player->instruments_loaded = 1;
+    // Compile the register writes of every voice, including the unused
+    // (zeroed) table entries
+    for (i = 0; i < 2 * INSTR_TABLE_SIZE; i++) {
+        compile_instr_blob(&bank->blobs[i][0], &bank->instruments[i].voices[0]);
+        compile_instr_blob(&bank->blobs[i][1], &bank->instruments[i].voices[1]);
+    }
+    
+    return bank;
+}
+
+// Switch to another instrument bank, taking a reference to it. Playing
+// voices move to the same instrument in the new bank.
+void mus_player_set_instruments(mus_player_t* player, genmidi_bank_t* bank) {
+    int i;
+    
+    if (!player || !bank) return;
+    
+    shared_retain(bank);
+    for (i = 0; i < 18; i++) {
+        voice_state_t* voice = &player->voices[i];
+        if (voice->current_instr) {
+            voice->current_instr = bank->instruments + (voice->current_instr - player->genmidi->instruments);
+        }
+    }
+    shared_release(player->genmidi);
+    player->genmidi = bank;
+    player->keyframes_valid = 0;
+}
+
+// Load GENMIDI instruments
+int mus_player_load_instruments(mus_player_t* player, const uint8_t* data, size_t size) {
+    genmidi_bank_t* bank;
+    
+    if (!player) {
+        return -1;
+    }
+    
+    bank = genmidi_bank_create(data, size);
+    if (!bank) {
+        return -1;
+    }
+    mus_player_set_instruments(player, bank);
+    shared_release(bank);
     return 0;
 }
 
 // Start playback
 void mus_player_start(mus_player_t* player, int looping) {
-    if (!player || !player->data) return;
+    if (!player || !player->loaded) return;
     
     player->looping = looping;
     player->playing = 1;
@@ -975,284 +1340,509 @@ static int read_varlen_safe(const uint8_t** ptr, const uint8_t* end, uint32_t* o
     return 1;
 }
 
-// Process one MUS event
-static void process_event(mus_player_t* player);
-static void advance_event_time(mus_player_t* player, uint32_t delay_ticks);
-
-static void process_event(mus_player_t* player) {
-    uint8_t event, channel, type;
-    const uint8_t* ptr;
-    const uint8_t* end;
+// Compile a MUS score into decoded events. Channels are remapped,
+// controllers resolved and events with no effect dropped; the array always
+// ends with mus_ev_end (end of score, loops) or mus_ev_stop (truncated
+// score, stops even when looping) at the tick playback reaches it.
+static mus_event_t* compile_score(const uint8_t* score, size_t size, size_t* num_events) {
+    const uint8_t* ptr = score;
+    const uint8_t* end = score + size;
+    mus_event_t* events;
+    size_t count = 0;
+    uint32_t tick = 0;
     uint32_t delay;
-    
-    if (!player->position || player->position >= player->score + player->score_size) {
-        if (player->looping) {
-            reset_playback_state(player);
-        } else {
-            player->playing = 0;
-        }
-        return;
-    }
-    
-    ptr = player->position;
-    end = player->score + player->score_size;
-    if (ptr >= end) {
-        player->playing = 0;
-        return;
-    }
-    
-    // Read event
-    event = *ptr++;
-    channel = event & 0x0f;
-    type = event & 0x70;
-    
-    // MUS channel 15 maps to MIDI channel 9 (percussion)
-    if (channel == 15) channel = 9;
-    else if (channel == 9) channel = 15;  // Avoid conflict
-    
-    switch (type) {
-        case MUS_EVENT_RELEASE_NOTE: {
-            if (ptr >= end) {
-                player->playing = 0;
-                return;
-            }
-            uint8_t note = *ptr++;
-            int i;
-            for (i = 0; i < player->voice_alloced_num; i++) {
-                if (player->voice_alloced_list[i]->channel == &player->channels[channel] &&
-                    player->voice_alloced_list[i]->key == note) {
-                    release_voice_index(player, i);
-                    i--;
-                }
-            }
+
+    // Every event takes at least one byte, plus the terminating event; the
+    // array is shrunk to the events kept once the score is decoded
+    events = (mus_event_t*)shared_alloc((size + 1) * sizeof(mus_event_t));
+    if (!events) return NULL;
+
+    for (;;) {
+        mus_event_t* ev = &events[count];
+        uint8_t event, channel;
+
+        if (ptr >= end) {
+            ev->type = mus_ev_end;
             break;
         }
-        case MUS_EVENT_PLAY_NOTE: {
-            if (ptr >= end) {
-                player->playing = 0;
-                return;
-            }
-            uint8_t note_data = *ptr++;
-            uint8_t note = note_data & 0x7f;
-            uint8_t velocity = (uint8_t)player->channels[channel].velocity;
-            genmidi_instr_t* instr;
-            
-            if (note_data & 0x80) {
+
+        event = *ptr++;
+        channel = event & 0x0f;
+
+        // MUS channel 15 maps to MIDI channel 9 (percussion)
+        if (channel == 15) channel = 9;
+        else if (channel == 9) channel = 15;  // Avoid conflict
+
+        ev->tick = tick;
+        ev->channel = channel;
+        ev->type = mus_ev_none;
+
+        switch (event & 0x70) {
+            case MUS_EVENT_RELEASE_NOTE:
                 if (ptr >= end) {
-                    player->playing = 0;
-                    return;
-                }
-                velocity = *ptr++;
-                velocity &= 0x7f;
-                player->channels[channel].velocity = velocity;
-            }
-            
-            // A volume of zero means key off (from Chocolate Doom)
-            if (velocity <= 0) {
-                // Treat as note off - find voices by channel and key
-                int i;
-                for (i = 0; i < player->voice_alloced_num; i++) {
-                    if (player->voice_alloced_list[i]->channel == &player->channels[channel] &&
-                        player->voice_alloced_list[i]->key == note) {
-                        release_voice_index(player, i);
-                        i--;
-                    }
+                    ev->type = mus_ev_stop;
+                    break;
                 }
+                ev->type = mus_ev_release;
+                ev->data[0] = *ptr++;
                 break;
-            }
-            
-            // Channel 9 is percussion - use note as instrument index
-            if (channel == 9) {
-                // MIDI percussion notes start at 35 (kick drum)
-                int perc_index = note - 35;
-                if (perc_index >= 0 && perc_index < 47) {
-                    instr = &player->percussion[perc_index];
-                } else {
-                    instr = &player->instruments[0];  // Fallback
-                }
-                // Chocolate Doom uses note=60 for percussion, key=actual key
-                // The instrument's fixed_note will be used if GENMIDI_FLAG_FIXED is set
-                if (player->instruments_loaded) {
-                    // Voice allocation policy matches Chocolate Doom
-                    if (player->driver_version == opl_doom1_1_666) {
-                        int voicenum = (instr->flags & GENMIDI_FLAG_2VOICE) ? 2 : 1;
-                        if (!player->opl3_mode) {
-                            voicenum = 1;
-                        }
-                        while (player->voice_alloced_num > player->num_voices - voicenum) {
-                            replace_existing_voice_doom1(player);
-                        }
-                        if (instr->flags & GENMIDI_FLAG_2VOICE) {
-                            voice_key_on(player, &player->channels[channel], instr, 1, 60, note, velocity);
-                        }
-                        voice_key_on(player, &player->channels[channel], instr, 0, 60, note, velocity);
-                    } else if (player->driver_version == opl_doom2_1_666) {
-                        if (player->voice_alloced_num == player->num_voices) {
-                            replace_existing_voice_doom2(player, &player->channels[channel]);
-                        }
-                        if (player->voice_alloced_num == player->num_voices - 1 &&
-                            (instr->flags & GENMIDI_FLAG_2VOICE)) {
-                            replace_existing_voice_doom2(player, &player->channels[channel]);
-                        }
-                        if (instr->flags & GENMIDI_FLAG_2VOICE) {
-                            voice_key_on(player, &player->channels[channel], instr, 1, 60, note, velocity);
-                        }
-                        voice_key_on(player, &player->channels[channel], instr, 0, 60, note, velocity);
-                    } else {
-                        if (player->voice_free_num == 0) {
-                            replace_existing_voice(player);
-                        }
-                        voice_key_on(player, &player->channels[channel], instr, 0, 60, note, velocity);
-                        if (instr->flags & GENMIDI_FLAG_2VOICE) {
-                            voice_key_on(player, &player->channels[channel], instr, 1, 60, note, velocity);
-                        }
-                    }
+            case MUS_EVENT_PLAY_NOTE:
+                if (ptr >= end) {
+                    ev->type = mus_ev_stop;
+                    break;
                 }
-            } else {
-                // Melodic instrument
-                instr = &player->instruments[player->channels[channel].instrument];
-                if (player->instruments_loaded) {
-                    if (player->driver_version == opl_doom1_1_666) {
-                        int voicenum = (instr->flags & GENMIDI_FLAG_2VOICE) ? 2 : 1;
-                        if (!player->opl3_mode) {
-                            voicenum = 1;
-                        }
-                        while (player->voice_alloced_num > player->num_voices - voicenum) {
-                            replace_existing_voice_doom1(player);
-                        }
-                        if (instr->flags & GENMIDI_FLAG_2VOICE) {
-                            voice_key_on(player, &player->channels[channel], instr, 1, note, note, velocity);
-                        }
-                        voice_key_on(player, &player->channels[channel], instr, 0, note, note, velocity);
-                    } else if (player->driver_version == opl_doom2_1_666) {
-                        if (player->voice_alloced_num == player->num_voices) {
-                            replace_existing_voice_doom2(player, &player->channels[channel]);
-                        }
-                        if (player->voice_alloced_num == player->num_voices - 1 &&
-                            (instr->flags & GENMIDI_FLAG_2VOICE)) {
-                            replace_existing_voice_doom2(player, &player->channels[channel]);
-                        }
-                        if (instr->flags & GENMIDI_FLAG_2VOICE) {
-                            voice_key_on(player, &player->channels[channel], instr, 1, note, note, velocity);
-                        }
-                        voice_key_on(player, &player->channels[channel], instr, 0, note, note, velocity);
-                    } else {
-                        if (player->voice_free_num == 0) {
-                            replace_existing_voice(player);
-                        }
-                        voice_key_on(player, &player->channels[channel], instr, 0, note, note, velocity);
-                        if (instr->flags & GENMIDI_FLAG_2VOICE) {
-                            voice_key_on(player, &player->channels[channel], instr, 1, note, note, velocity);
-                        }
+                ev->type = mus_ev_play;
+                ev->data[0] = *ptr & 0x7f;
+                ev->data[1] = MUS_EVENT_NO_VOLUME;
+                if (*ptr++ & 0x80) {
+                    if (ptr >= end) {
+                        ev->type = mus_ev_stop;
+                        break;
                     }
+                    ev->data[1] = *ptr++ & 0x7f;
                 }
-            }
-            break;
-        }
-        case MUS_EVENT_PITCH_BEND: {
-            if (ptr >= end) {
-                player->playing = 0;
-                return;
-            }
-            uint8_t bend = *ptr++;
-            // MUS pitch bend: 0-255, where 128 is center
-            // Chocolate Doom uses: bend - 128 for the offset
-            // But OPL expects bend in range -64 to +64 where 0 is center
-            // So we need to scale: (bend - 128) / 2 = bend/2 - 64
-            player->channels[channel].bend = ((int)(bend) - 128) / 2;
-            
-            // Update all active voices on this channel
-            {
-                int i;
-                voice_state_t* updated[36];
-                int updated_num = 0;
-                voice_state_t* not_updated[36];
-                int not_updated_num = 0;
-
-                for (i = 0; i < player->voice_alloced_num; i++) {
-                    if (player->voice_alloced_list[i]->channel == &player->channels[channel]) {
-                        player->voice_alloced_list[i]->freq = 0;
-                        update_voice_frequency(player, player->voice_alloced_list[i]);
-                        updated[updated_num++] = player->voice_alloced_list[i];
-                    } else {
-                        not_updated[not_updated_num++] = player->voice_alloced_list[i];
-                    }
+                break;
+            case MUS_EVENT_PITCH_BEND:
+                if (ptr >= end) {
+                    ev->type = mus_ev_stop;
+                    break;
                 }
-
-                for (i = 0; i < not_updated_num; i++) {
-                    player->voice_alloced_list[i] = not_updated[i];
+                ev->type = mus_ev_bend;
+                ev->data[0] = *ptr++;
+                break;
+            case MUS_EVENT_SYSTEM_EVENT:
+                if (ptr >= end) {
+                    ev->type = mus_ev_stop;
+                    break;
                 }
-                for (i = 0; i < updated_num; i++) {
-                    player->voice_alloced_list[i + not_updated_num] = updated[i];
+                // Map MUS system events 10-14 to MIDI controllers.
+                // 10: All sounds off (0x78), 11: All notes off (0x7B),
+                // 12: Mono (0x7E), 13: Poly (0x7F), 14: Reset controllers (0x79)
+                switch (*ptr++) {
+                    case 10: // All sounds off
+                    case 11: // All notes off
+                        ev->type = mus_ev_notes_off;
+                        break;
+                    case 14: // Reset all controllers
+                        ev->type = mus_ev_reset_ctrl;
+                        break;
+                    default:
+                        break;
                 }
-            }
+                break;
+            case MUS_EVENT_CONTROLLER:
+                if (ptr + 1 >= end) {
+                    ev->type = mus_ev_stop;
+                    break;
+                }
+                if (ptr[0] < 15) {
+                    int midi_ctrl = mus_to_midi_ctrl[ptr[0]];
+                    if (midi_ctrl == 0 && ptr[0] == 0) {
+                        ev->type = mus_ev_program;
+                    } else if (midi_ctrl == 7) {
+                        ev->type = mus_ev_volume;
+                    } else if (midi_ctrl == 10) {
+                        ev->type = mus_ev_pan;
+                    }
+                }
+                ev->data[0] = ptr[1];
+                ptr += 2;
+                break;
+            case MUS_EVENT_END_OF_SCORE:
+                ev->type = mus_ev_end;
+                break;
+            default:
+                break;
+        }
+
+        if (ev->type == mus_ev_end || ev->type == mus_ev_stop) {
             break;
         }
-        case MUS_EVENT_SYSTEM_EVENT: {
-            if (ptr >= end) {
-                player->playing = 0;
-                return;
+        if (ev->type != mus_ev_none) {
+            count++;
+        }
+
+        // Check for delay
+        if (event & 0x80) {
+            if (!read_varlen_safe(&ptr, end, &delay)) {
+                ev = &events[count];
+                ev->type = mus_ev_stop;
+                break;
             }
-            uint8_t sys_event = *ptr++;
-            // Map MUS system events 10-14 to MIDI controllers.
-            // 10: All sounds off (0x78), 11: All notes off (0x7B),
-            // 12: Mono (0x7E), 13: Poly (0x7F), 14: Reset controllers (0x79)
-            switch (sys_event) {
-                case 10: // All sounds off
-                case 11: // All notes off
-                    release_all_voices_for_channel(player, &player->channels[channel]);
+            tick += delay;
+        }
+    }
+
+    events[count].tick = tick;
+    events[count].channel = 0;
+    *num_events = count + 1;
+    return (mus_event_t*)shared_shrink(events, *num_events * sizeof(mus_event_t));
+}
+
+// A MIDI event with its place in the file, for merging the tracks
+typedef struct {
+    uint64_t time;               // Absolute time in MIDI ticks
+    unsigned int track;
+    unsigned int index;          // Position in the track
+    const midi_event_t* event;
+} midi_timed_event_t;
+
+static int compare_midi_events(const void* a, const void* b) {
+    const midi_timed_event_t* x = (const midi_timed_event_t*)a;
+    const midi_timed_event_t* y = (const midi_timed_event_t*)b;
+    
+    if (x->time != y->time) return x->time < y->time ? -1 : 1;
+    if (x->track != y->track) return x->track < y->track ? -1 : 1;
+    if (x->index != y->index) return x->index < y->index ? -1 : 1;
+    return 0;
+}
+
+// Decode a MIDI channel event; returns 0 for events the driver ignores
+static int decode_midi_event(mus_event_t* ev, const midi_event_t* event) {
+    // Data bytes are 7-bit; a malformed file may carry the top bit, which
+    // would index past the 128-entry volume and instrument tables
+    unsigned int param1 = event->data.channel.param1 & 0x7f;
+    unsigned int param2 = event->data.channel.param2 & 0x7f;
+    
+    ev->channel = (uint8_t)event->data.channel.channel;
+    ev->data[0] = (uint8_t)param1;
+    ev->data[1] = (uint8_t)param2;
+    
+    switch (event->event_type) {
+        case MIDI_EVENT_NOTE_OFF:
+            ev->type = mus_ev_release;
+            return 1;
+        case MIDI_EVENT_NOTE_ON:
+            // A velocity of zero is a note off, not a play with the
+            // channel's last volume
+            ev->type = param2 == 0 ? mus_ev_release : mus_ev_play;
+            return 1;
+        case MIDI_EVENT_PROGRAM_CHANGE:
+            ev->type = mus_ev_program;
+            return 1;
+        case MIDI_EVENT_PITCH_BEND:
+            // 14-bit bend to the MUS 8-bit range, 128 at the centre
+            ev->type = mus_ev_bend;
+            ev->data[0] = (uint8_t)(((param2 << 7) | param1) >> 6);
+            return 1;
+        case MIDI_EVENT_CONTROLLER:
+            switch (param1) {
+                case MIDI_CONTROLLER_VOLUME_MSB:
+                    ev->type = mus_ev_volume;
                     break;
-                case 14: // Reset all controllers
-                    set_channel_volume(player, &player->channels[channel], 100, 0);
-                    set_channel_pan(player, &player->channels[channel], 64);
-                    player->channels[channel].bend = 0;
+                case MIDI_CONTROLLER_PAN:
+                    ev->type = mus_ev_pan;
                     break;
-                default:
+                case MIDI_CONTROLLER_ALL_SOUND_OFF:
+                case MIDI_CONTROLLER_ALL_NOTES_OFF:
+                    ev->type = mus_ev_notes_off;
+                    break;
+                case MIDI_CONTROLLER_RESET_ALL_CTRLS:
+                    ev->type = mus_ev_reset_ctrl;
                     break;
+                default:
+                    return 0;
             }
-            break;
+            ev->data[0] = (uint8_t)param2;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Compile a MIDI file into decoded events. The tracks are merged into one
+// timeline (events at the same time in track order) and tempo changes
+// resolved, so that playback steps through a single array exactly as for
+// a MUS score. Times are rounded to the 140 Hz ticks of the DMX timer,
+// on which the driver handles events; the array ends with mus_ev_end
+// where the last track ends.
+static mus_event_t* compile_midi(const uint8_t* data, size_t size, size_t* num_events) {
+    midi_file_t* file;
+    midi_timed_event_t* timeline = NULL;
+    mus_event_t* events = NULL;
+    unsigned int num_tracks, division, t;
+    size_t total = 0;
+    size_t count = 0;
+    size_t i;
+    uint64_t last_time = 0;
+    uint64_t scaled = 0;         // Microseconds times division
+    uint32_t tempo = MIDI_DEFAULT_TEMPO;
+    uint32_t tick = 0;
+    
+    file = MIDI_LoadData(data, size);
+    if (!file) return NULL;
+    
+    // As in Chocolate Doom, SMPTE divisions are taken as ticks per beat
+    num_tracks = MIDI_NumTracks(file);
+    division = MIDI_GetFileTimeDivision(file);
+    if (division == 0) goto done;
+    
+    // Tag every event with its track and absolute time
+    for (t = 0; t < num_tracks; t++) {
+        midi_track_iter_t* iter = MIDI_IterateTrack(file, t);
+        midi_event_t* event;
+        
+        if (!iter) goto done;
+        while (MIDI_GetNextEvent(iter, &event)) {
+            total++;
         }
-        case MUS_EVENT_CONTROLLER: {
-            if (ptr + 1 >= end) {
-                player->playing = 0;
-                return;
+        MIDI_FreeIterator(iter);
+    }
+    timeline = (midi_timed_event_t*)malloc((total + 1) * sizeof(midi_timed_event_t));
+    events = (mus_event_t*)shared_alloc((total + 1) * sizeof(mus_event_t));
+    if (!timeline || !events) goto fail;
+    
+    for (t = 0; t < num_tracks; t++) {
+        midi_track_iter_t* iter = MIDI_IterateTrack(file, t);
+        midi_event_t* event;
+        uint64_t time = 0;
+        unsigned int index = 0;
+        
+        if (!iter) goto fail;
+        while (MIDI_GetNextEvent(iter, &event)) {
+            midi_timed_event_t* timed = &timeline[count++];
+            time += event->delta_time;
+            timed->time = time;
+            timed->track = t;
+            timed->index = index++;
+            timed->event = event;
+        }
+        MIDI_FreeIterator(iter);
+    }
+    qsort(timeline, total, sizeof(midi_timed_event_t), compare_midi_events);
+    
+    // Walk the merged timeline, converting times with the tempo in effect
+    count = 0;
+    for (i = 0; i < total; i++) {
+        const midi_event_t* event = timeline[i].event;
+        uint64_t us;
+        
+        scaled += (timeline[i].time - last_time) * tempo;
+        last_time = timeline[i].time;
+        us = scaled / division;
+        if (us > (uint64_t)UINT32_MAX / 140 * 1000000) goto fail;
+        tick = (uint32_t)((us * 140 + 500000) / 1000000);
+        
+        if (event->event_type == MIDI_EVENT_META) {
+            if (event->data.meta.type == MIDI_META_SET_TEMPO
+             && event->data.meta.length == 3) {
+                const uint8_t* p = event->data.meta.data;
+                tempo = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+            }
+        } else if (event->event_type != MIDI_EVENT_SYSEX
+                && event->event_type != MIDI_EVENT_SYSEX_SPLIT) {
+            events[count].tick = tick;
+            if (decode_midi_event(&events[count], event)) {
+                count++;
+            }
+        }
+    }
+    
+    events[count].tick = tick;
+    events[count].type = mus_ev_end;
+    events[count].channel = 0;
+    *num_events = count + 1;
+    goto done;
+    
+fail:
+    shared_release(events);
+    events = NULL;
+done:
+    free(timeline);
+    MIDI_FreeFile(file);
+    return events;
+}
+
+// Release the voices playing a key on a channel. The scan only visits the
+// channel's own voices, at most 18 and usually one or two, so a key index
+// would cost more to keep up to date than it saves.
+static void release_channel_key(mus_player_t* player, channel_state_t* channel, unsigned int key) {
+    uint32_t mask = 0;
+    uint32_t m;
+
+    for (m = channel->voice_mask; m; m &= m - 1) {
+        int i = lowest_voice(m);
+        if (player->voices[i].key == key) {
+            mask |= (uint32_t)1 << i;
+        }
+    }
+    while (mask) {
+        release_voice(player, oldest_voice(player, &mask));
+    }
+}
+
+// Process one MUS event
+static void process_event(mus_player_t* player);
+static void advance_event_time(mus_player_t* player, uint32_t delay_ticks);
+
+static void process_event(mus_player_t* player) {
+    const mus_event_t* ev = &player->events[player->event_pos];
+    channel_state_t* channel = &player->channels[ev->channel];
+    
+    switch (ev->type) {
+        case mus_ev_release:
+            release_channel_key(player, channel, ev->data[0]);
+            break;
+        case mus_ev_play: {
+            uint8_t note = ev->data[0];
+            uint8_t velocity = (uint8_t)channel->velocity;
+            const genmidi_instr_t* instr;
+            
+            if (ev->data[1] != MUS_EVENT_NO_VOLUME) {
+                velocity = ev->data[1];
+                channel->velocity = velocity;
+            }
+            
+            // A volume of zero means key off (from Chocolate Doom)
+            if (velocity <= 0) {
+                release_channel_key(player, channel, note);
+                break;
+            }
+            
+            // Without instruments the note is tracked but not played
+            if (!player->genmidi) {
+                break;
+            }
+            
+            // Channel 9 is percussion - use note as instrument index
+            if (ev->channel == 9) {
+                // MIDI percussion notes start at 35 (kick drum)
+                int perc_index = note - 35;
+                if (perc_index >= 0 && perc_index < 47) {
+                    instr = &player->genmidi->instruments[INSTR_TABLE_SIZE + perc_index];
+                } else {
+                    instr = &player->genmidi->instruments[0];  // Fallback
+                }
+                // Chocolate Doom uses note=60 for percussion, key=actual key
+                // The instrument's fixed_note will be used if GENMIDI_FLAG_FIXED is set
+                // Voice allocation policy matches Chocolate Doom
+                if (player->driver_version == opl_doom1_1_666) {
+                    int voicenum = (instr->flags & GENMIDI_FLAG_2VOICE) ? 2 : 1;
+                    if (!player->opl3_mode) {
+                        voicenum = 1;
+                    }
+                    while (player->voice_alloced_num > player->num_voices - voicenum) {
+                        replace_existing_voice_doom1(player);
+                    }
+                    if (instr->flags & GENMIDI_FLAG_2VOICE) {
+                        voice_key_on(player, channel, instr, 1, 60, note, velocity);
+                    }
+                    voice_key_on(player, channel, instr, 0, 60, note, velocity);
+                } else if (player->driver_version == opl_doom2_1_666) {
+                    if (player->voice_alloced_num == player->num_voices) {
+                        replace_existing_voice_doom2(player, channel);
+                    }
+                    if (player->voice_alloced_num == player->num_voices - 1 &&
+                        (instr->flags & GENMIDI_FLAG_2VOICE)) {
+                        replace_existing_voice_doom2(player, channel);
+                    }
+                    if (instr->flags & GENMIDI_FLAG_2VOICE) {
+                        voice_key_on(player, channel, instr, 1, 60, note, velocity);
+                    }
+                    voice_key_on(player, channel, instr, 0, 60, note, velocity);
+                } else {
+                    if (player->voice_free_num == 0) {
+                        replace_existing_voice(player);
+                    }
+                    voice_key_on(player, channel, instr, 0, 60, note, velocity);
+                    if (instr->flags & GENMIDI_FLAG_2VOICE) {
+                        voice_key_on(player, channel, instr, 1, 60, note, velocity);
+                    }
+                }
+            } else {
+                // Melodic instrument
+                instr = &player->genmidi->instruments[channel->instrument];
+                if (player->driver_version == opl_doom1_1_666) {
+                    int voicenum = (instr->flags & GENMIDI_FLAG_2VOICE) ? 2 : 1;
+                    if (!player->opl3_mode) {
+                        voicenum = 1;
+                    }
+                    while (player->voice_alloced_num > player->num_voices - voicenum) {
+                        replace_existing_voice_doom1(player);
+                    }
+                    if (instr->flags & GENMIDI_FLAG_2VOICE) {
+                        voice_key_on(player, channel, instr, 1, note, note, velocity);
+                    }
+                    voice_key_on(player, channel, instr, 0, note, note, velocity);
+                } else if (player->driver_version == opl_doom2_1_666) {
+                    if (player->voice_alloced_num == player->num_voices) {
+                        replace_existing_voice_doom2(player, channel);
+                    }
+                    if (player->voice_alloced_num == player->num_voices - 1 &&
+                        (instr->flags & GENMIDI_FLAG_2VOICE)) {
+                        replace_existing_voice_doom2(player, channel);
+                    }
+                    if (instr->flags & GENMIDI_FLAG_2VOICE) {
+                        voice_key_on(player, channel, instr, 1, note, note, velocity);
+                    }
+                    voice_key_on(player, channel, instr, 0, note, note, velocity);
+                } else {
+                    if (player->voice_free_num == 0) {
+                        replace_existing_voice(player);
+                    }
+                    voice_key_on(player, channel, instr, 0, note, note, velocity);
+                    if (instr->flags & GENMIDI_FLAG_2VOICE) {
+                        voice_key_on(player, channel, instr, 1, note, note, velocity);
+                    }
+                }
             }
-            uint8_t ctrl = *ptr++;
-            uint8_t value = *ptr++;
-            if (ctrl < 15) {
-                int midi_ctrl = mus_to_midi_ctrl[ctrl];
-                if (midi_ctrl == 0 && ctrl == 0) {
-                    // Program change
-                    player->channels[channel].instrument = value;
-                } else if (midi_ctrl == 7) {
-                    // Volume
-                    set_channel_volume(player, &player->channels[channel], value, 1);
-                } else if (midi_ctrl == 10) {
-                    // Pan
-                    set_channel_pan(player, &player->channels[channel], value);
+            break;
+        }
+        case mus_ev_bend: {
+            // MUS pitch bend: 0-255, where 128 is center
+            // Chocolate Doom uses: bend - 128 for the offset
+            // But OPL expects bend in range -64 to +64 where 0 is center
+            // So we need to scale: (bend - 128) / 2 = bend/2 - 64
+            channel->bend = ((int)(ev->data[0]) - 128) / 2;
+            
+            // Update all active voices on this channel; they move to the
+            // end of the allocated list, keeping their order
+            {
+                uint32_t mask = channel->voice_mask;
+
+                while (mask) {
+                    voice_state_t* voice = oldest_voice(player, &mask);
+                    voice->freq = 0;
+                    update_voice_frequency(player, voice);
+                    unlink_alloced_voice(player, voice);
+                    append_alloced_voice(player, voice);
                 }
             }
             break;
         }
-        case MUS_EVENT_END_OF_SCORE:
+        case mus_ev_notes_off:
+            release_all_voices_for_channel(player, channel);
+            break;
+        case mus_ev_reset_ctrl:
+            set_channel_volume(player, channel, 100, 0);
+            set_channel_pan(player, channel, 64);
+            channel->bend = 0;
+            break;
+        case mus_ev_program:
+            channel->instrument = ev->data[0];
+            break;
+        case mus_ev_volume:
+            set_channel_volume(player, channel, ev->data[0], 1);
+            break;
+        case mus_ev_pan:
+            set_channel_pan(player, channel, ev->data[0]);
+            break;
+        case mus_ev_end:
             if (player->looping) {
                 reset_playback_state(player);
             } else {
                 player->playing = 0;
             }
             return;
-    }
-    
-    // Check for delay
-    if (event & 0x80) {
-        if (!read_varlen_safe(&ptr, end, &delay)) {
+        default:
+            // Truncated score
             player->playing = 0;
             return;
-        }
-        advance_event_time(player, delay);
     }
     
-    player->position = ptr;
+    // The next event is due after the delay that followed this one
+    advance_event_time(player, ev[1].tick - ev->tick);
+    player->event_pos++;
 }
 
 // Advance next_event_sample by delay ticks (140 Hz), keeping exact fractional remainder.
@@ -1266,12 +1856,17 @@ static void advance_event_time(mus_player_t* player, uint32_t delay_ticks) {
 static void reset_playback_state(mus_player_t* player) {
     int i;
 
-    player->position = player->score;
+    player->event_pos = 0;
     player->current_sample = 0;
     player->next_event_sample = 0;
     player->timing_remainder = 0;
     player->start_volume = player->master_volume;
 
+    // Dropped events may leave a delay before the first decoded one
+    if (player->events) {
+        advance_event_time(player, player->events[0].tick);
+    }
+
     // Reset channels to default DMX-like state
     for (i = 0; i < 16; i++) {
         player->channels[i].instrument = 0;
@@ -1289,58 +1884,728 @@ static void reset_playback_state(mus_player_t* player) {
     }
 
     // Reset voice lists
-    player->voice_free_num = player->num_voices;
-    player->voice_alloced_num = 0;
     for (i = 0; i < player->num_voices; i++) {
         if (player->voices[i].in_use) {
             voice_key_off(player, &player->voices[i]);
         }
-        player->voice_free_list[i] = &player->voices[i];
         player->voices[i].in_use = 0;
         player->voices[i].current_instr = NULL;
         player->voices[i].channel = NULL;
     }
+    reset_voice_lists(player);
 }
 
 // Generate samples
 size_t mus_player_generate(mus_player_t* player, int16_t* buffer, size_t num_samples) {
     size_t samples_generated = 0;
+    size_t span;
     
     if (!player || !buffer) return 0;
     
     while (samples_generated < num_samples) {
-        // Process all events that are due at or before this sample
+        // Process all events that are due at or before the current sample
         int event_guard = 0;
         const int max_events_per_sample = 10000;
         while (player->playing && player->current_sample >= player->next_event_sample) {
-            const uint8_t* prev_pos = player->position;
+            size_t prev_pos = player->event_pos;
             process_event(player);
             event_guard++;
             // If the event stream doesn't advance or loops too much, avoid a hang.
             if (!player->playing) {
                 break;
             }
-            if (player->position == prev_pos || event_guard > max_events_per_sample) {
+            // A loop back to the first event only advances if that event
+            // is delayed.
+            if ((player->event_pos == prev_pos
+                 && player->current_sample >= player->next_event_sample)
+             || event_guard > max_events_per_sample) {
                 // Force progress to the next sample to keep audio thread alive.
                 player->next_event_sample = player->current_sample + 1;
                 break;
             }
         }
         
-        // Generate one sample at the current time
-        OPL3_GenerateResampled(&player->opl, buffer);
-        buffer += 2;  // Stereo
-        samples_generated++;
+        // Render up to the next event in one block
+        span = num_samples - samples_generated;
+        if (player->playing && player->next_event_sample - player->current_sample < span) {
+            span = (size_t)(player->next_event_sample - player->current_sample);
+        }
+        opl_render_span(&player->opl, player->generate_block,
+                        player->native_rate ? NULL : player->resampler, buffer, span);
+        buffer += 2 * span;  // Stereo
+        samples_generated += span;
 
-        // Advance time after generating the sample
+        // Advance time after generating the span
         if (player->playing) {
-            player->current_sample++;
+            player->current_sample += span;
         }
     }
     
     return samples_generated;
 }
 
+// Restart playback on a reset chip for replaying the score; register
+// writes age their channel until replaying is cleared
+static void restart_replay(mus_player_t* player) {
+    player->playing = 1;
+    player->replaying = 0;
+    reset_playback_state(player);
+    reset_opl(player);
+    if (player->resampler) {
+        opl_resampler_reset(player->resampler);
+    }
+    memset(player->opl_aged, 0, sizeof(player->opl_aged));
+    player->replaying = 1;
+}
+
+// Native chip samples rendered by a sample position; the resampler runs
+// ahead of its output by the frames it interpolates from
+static uint64_t native_samples(mus_player_t* player, uint64_t sample) {
+    if (player->native_rate) return sample;
+    return opl_resampler_native_position(player->resampler, sample);
+}
+
+// Bring a chip channel's envelopes and phases up to a sample position
+static void age_opl_channel(mus_player_t* player, int channum, uint64_t sample) {
+    uint64_t native = native_samples(player, sample);
+    
+    if (native <= player->opl_aged[channum]) return;
+    OPL3_ChannelSkip(&player->opl, (Bit8u)channum, player->opl_aged[channum], native,
+                     (Bit8u)player->replay_feedback);
+    player->opl_aged[channum] = native;
+}
+
+// Age the channel a register belongs to up to the current event, so the
+// envelope runs with the old settings until the write
+static void age_opl_reg(mus_player_t* player, int reg) {
+    int r = reg & 0xff;
+    int bank = (reg >> 8) * 9;
+    int op = r & 0x1f;
+    
+    if (r >= 0xa0 && r < 0xd0) {
+        // Frequency, key on and feedback: 0xbd is the rhythm register
+        if ((r & 0x0f) < 9) {
+            age_opl_channel(player, bank + (r & 0x0f), player->next_event_sample);
+        }
+    } else if (r >= 0x20 && op < 0x16 && (op & 7) < 6) {
+        // Operator registers
+        age_opl_channel(player, bank + (op >> 3) * 3 + (op & 7) % 3,
+                        player->next_event_sample);
+    }
+}
+
+// Capture the playback state before the next event
+static void save_keyframe(mus_player_t* player, seek_keyframe_t* kf) {
+    int i;
+    
+    kf->event_pos = player->event_pos;
+    kf->next_event_sample = player->next_event_sample;
+    kf->timing_remainder = player->timing_remainder;
+    memcpy(kf->channels, player->channels, sizeof(kf->channels));
+    memcpy(kf->voices, player->voices, sizeof(kf->voices));
+    kf->voice_free_head = player->voice_free_head;
+    kf->voice_free_tail = player->voice_free_tail;
+    kf->voice_alloced_head = player->voice_alloced_head;
+    kf->voice_alloced_tail = player->voice_alloced_tail;
+    kf->voice_free_num = player->voice_free_num;
+    kf->voice_alloced_num = player->voice_alloced_num;
+    kf->voice_alloc_seq = player->voice_alloc_seq;
+    memcpy(kf->opl_regs, player->opl_regs, sizeof(kf->opl_regs));
+    memcpy(kf->opl_aged, player->opl_aged, sizeof(kf->opl_aged));
+    for (i = 0; i < 36; i++) {
+        kf->eg_rout[i] = player->opl.slot[i].eg_rout;
+        kf->eg_gen[i] = player->opl.slot[i].eg_gen;
+        kf->pg_phase[i] = player->opl.slot[i].pg_phase;
+    }
+}
+
+// Return to a keyframe; the chip must have just been reset
+static void restore_keyframe(mus_player_t* player, const seek_keyframe_t* kf) {
+    int r;
+    
+    player->event_pos = kf->event_pos;
+    player->next_event_sample = kf->next_event_sample;
+    player->timing_remainder = kf->timing_remainder;
+    memcpy(player->channels, kf->channels, sizeof(kf->channels));
+    memcpy(player->voices, kf->voices, sizeof(kf->voices));
+    player->voice_free_head = kf->voice_free_head;
+    player->voice_free_tail = kf->voice_free_tail;
+    player->voice_alloced_head = kf->voice_alloced_head;
+    player->voice_alloced_tail = kf->voice_alloced_tail;
+    player->voice_free_num = kf->voice_free_num;
+    player->voice_alloced_num = kf->voice_alloced_num;
+    player->voice_alloc_seq = kf->voice_alloc_seq;
+    
+    // Every register the driver had written since the reset, then the
+    // envelope and phase state those writes cannot recreate
+    player->replaying = 0;
+    for (r = 0; r < OPL_NUM_REGS; r++) {
+        if (kf->opl_regs[r] != OPL_REG_UNKNOWN) {
+            write_opl_reg(player, r, kf->opl_regs[r]);
+        }
+    }
+    for (r = 0; r < 36; r++) {
+        player->opl.slot[r].eg_rout = kf->eg_rout[r];
+        player->opl.slot[r].eg_gen = kf->eg_gen[r];
+        player->opl.slot[r].pg_phase = kf->pg_phase[r];
+    }
+    memcpy(player->opl_aged, kf->opl_aged, sizeof(kf->opl_aged));
+    player->replaying = 1;
+}
+
+// Replay the whole score without synthesis, capturing a keyframe every
+// SEEK_KEYFRAME_EVENTS events. Leaves the player at the end of score.
+static void build_seek_index(mus_player_t* player) {
+    size_t count = (player->num_events - 1) / SEEK_KEYFRAME_EVENTS;
+    
+    free(player->keyframes);
+    player->keyframes = NULL;
+    player->num_keyframes = 0;
+    player->keyframes_valid = 1;
+    if (count == 0) return;
+    
+    // Without an index, seeks replay from the start of the score
+    player->keyframes = (seek_keyframe_t*)malloc(count * sizeof(seek_keyframe_t));
+    if (!player->keyframes) return;
+    
+    restart_replay(player);
+    while (player->event_pos + 1 < player->num_events) {
+        process_event(player);
+        if (player->event_pos % SEEK_KEYFRAME_EVENTS == 0) {
+            save_keyframe(player, &player->keyframes[player->num_keyframes++]);
+        }
+    }
+    player->replaying = 0;
+}
+
+// Seek to a sample position. Events before the target are replayed into a
+// freshly reset chip without synthesis, starting from the last keyframe;
+// each channel's envelopes and phases are aged across the time between
+// its register writes, as rendering would. The last SEEK_SETTLE_MS are then
+// rendered (and discarded) to refill the slot outputs and the resampler
+// history, so that from the target on the audio is that of playing from a
+// fresh chip, save for the output history of modulators feeding back on
+// themselves. Looping songs wrap the target; otherwise it is clamped to
+// the end.
+void mus_player_seek(mus_player_t* player, uint64_t sample) {
+    int16_t scratch[2 * 256];
+    uint64_t length;
+    uint64_t settle;
+    uint64_t start;
+    size_t lo, hi;
+    int i;
+    
+    if (!player || !player->events) return;
+    
+    if (!player->keyframes_valid) {
+        build_seek_index(player);
+    }
+    
+    length = mus_player_get_length_samples(player);
+    if (player->looping && length > 0) {
+        sample %= length;
+    } else if (sample > length) {
+        sample = length;
+    }
+    settle = (uint64_t)SEEK_SETTLE_MS * (uint64_t)player->sample_rate / 1000;
+    start = sample > settle ? sample - settle : 0;
+    
+    restart_replay(player);
+    
+    // Find the last keyframe due by the start of the settle window
+    lo = 0;
+    hi = player->num_keyframes;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (player->keyframes[mid].next_event_sample <= start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0) {
+        restore_keyframe(player, &player->keyframes[lo - 1]);
+    }
+    
+    // Replay everything due up to the start of the settle window; the end
+    // of score is never before it, so it is left to the render below
+    while (player->event_pos + 1 < player->num_events
+        && player->next_event_sample <= start) {
+        process_event(player);
+    }
+    player->current_sample = start;
+    for (i = 0; i < 18; i++) {
+        age_opl_channel(player, i, start);
+    }
+    OPL3_SetTime(&player->opl, native_samples(player, start));
+    if (player->resampler) {
+        opl_resampler_set_position(player->resampler, start);
+    }
+    player->replaying = 0;
+    
+    while (player->current_sample < sample && player->playing) {
+        uint64_t left = sample - player->current_sample;
+        mus_player_generate(player, scratch, left < 256 ? (size_t)left : 256);
+    }
+}
+
+// Copy a player's playback state into another player structure, moving
+// the chip's and voices' internal pointers along. Everything else it
+// points to is shared, and dst must not be passed to mus_player_destroy.
+static void copy_player_state(mus_player_t* dst, const mus_player_t* src) {
+    int i;
+    
+    *dst = *src;
+    OPL3_Copy(&dst->opl, &src->opl);
+    for (i = 0; i < 18; i++) {
+        if (src->voices[i].channel) {
+            dst->voices[i].channel = dst->channels + (src->voices[i].channel - src->channels);
+        }
+    }
+    dst->keyframes = NULL;
+    dst->num_keyframes = 0;
+}
+
+// Make an independent copy of a player, sharing the decoded score and the
+// instrument bank, which are never changed in place
+mus_player_t* mus_player_clone(const mus_player_t* player) {
+    mus_player_t* copy;
+    
+    if (!player) return NULL;
+    
+    copy = (mus_player_t*)malloc(sizeof(mus_player_t));
+    if (!copy) return NULL;
+    copy_player_state(copy, player);
+    if (player->resampler) {
+        copy->resampler = opl_resampler_clone(player->resampler);
+        if (!copy->resampler) {
+            free(copy);
+            return NULL;
+        }
+    }
+    if (player->keyframes) {
+        copy->keyframes = (seek_keyframe_t*)malloc(player->num_keyframes * sizeof(seek_keyframe_t));
+        if (!copy->keyframes) {
+            // The clone builds its own index when it first seeks
+            copy->keyframes_valid = 0;
+        } else {
+            memcpy(copy->keyframes, player->keyframes, player->num_keyframes * sizeof(seek_keyframe_t));
+            copy->num_keyframes = player->num_keyframes;
+        }
+    }
+    shared_retain(copy->events);
+    shared_retain(copy->genmidi);
+    return copy;
+}
+
+// One segment of a parallel render: the player state SEEK_SETTLE_MS
+// before the segment, as a seek would leave it
+typedef struct {
+    mus_player_t state;
+    uint64_t first;                   // First sample written
+    uint64_t end;                     // Sample after the last one written
+} render_segment_t;
+
+typedef struct {
+    render_segment_t* segments;
+    mus_player_t** workers;           // A player structure per worker thread
+    opl_resampler_t** resamplers;     // ... and its own resampler
+    int16_t* buffer;
+} parallel_render_t;
+
+static void render_segment(void* arg, size_t index, int worker) {
+    parallel_render_t* render = (parallel_render_t*)arg;
+    const render_segment_t* segment = &render->segments[index];
+    mus_player_t* player = render->workers[worker];
+    int16_t scratch[2 * 256];
+    
+    copy_player_state(player, &segment->state);
+    player->resampler = render->resamplers[worker];
+    if (player->resampler) {
+        opl_resampler_set_position(player->resampler, player->current_sample);
+    }
+    
+    // Settle, as a seek does, then render the segment itself
+    while (player->current_sample < segment->first) {
+        uint64_t left = segment->first - player->current_sample;
+        mus_player_generate(player, scratch, left < 256 ? (size_t)left : 256);
+    }
+    mus_player_generate(player, render->buffer + 2 * segment->first,
+                        (size_t)(segment->end - segment->first));
+}
+
+// Render the first num_samples samples of the song, played once from a
+// fresh chip, on up to `workers` threads. A pre-pass replays the score as
+// a seek does, capturing the state at the start of each segment's settle
+// window; the segments are then rendered independently. Unlike a seek,
+// the pre-pass also renders the modulators that feed back on themselves,
+// whose output history the settle window cannot rebuild, so the output is
+// identical to serial rendering. Leaves playback stopped.
+int mus_player_render_parallel(mus_player_t* player, int16_t* buffer, size_t num_samples, int workers) {
+    parallel_render_t render;
+    uint64_t length, span, settle, min_span;
+    size_t count, k;
+    int result = 0;
+    int looping;
+    int i;
+    
+    if (!player || !player->events || (!buffer && num_samples > 0)) {
+        return MUS_RENDER_ERR_PARAM;
+    }
+    if (num_samples == 0) return 0;
+    if (workers < 1) {
+        workers = 1;
+    }
+    
+    // Segment boundaries are kept inside the song, where the score can be
+    // replayed to them; anything past the end goes to the last segment
+    length = mus_player_get_length_samples(player);
+    span = num_samples < length ? num_samples : length;
+    min_span = (uint64_t)RENDER_SEGMENT_MIN_MS * (uint64_t)player->sample_rate / 1000;
+    // Extra segments only balance the load between workers
+    count = workers > 1 ? (size_t)workers * RENDER_SEGMENTS_PER_WORKER : 1;
+    if (count > span / min_span) {
+        count = (size_t)(span / min_span);
+    }
+    if (count < 1) {
+        count = 1;
+    }
+    if ((size_t)workers > count) {
+        workers = (int)count;
+    }
+    
+    memset(&render, 0, sizeof(render));
+    render.buffer = buffer;
+    render.segments = (render_segment_t*)malloc(count * sizeof(render_segment_t));
+    render.workers = (mus_player_t**)calloc((size_t)workers, sizeof(mus_player_t*));
+    render.resamplers = (opl_resampler_t**)calloc((size_t)workers, sizeof(opl_resampler_t*));
+    if (!render.segments || !render.workers || !render.resamplers) {
+        result = MUS_RENDER_ERR_MEMORY;
+        goto done;
+    }
+    for (i = 0; i < workers; i++) {
+        render.workers[i] = (mus_player_t*)malloc(sizeof(mus_player_t));
+        if (player->resampler) {
+            render.resamplers[i] = opl_resampler_clone(player->resampler);
+        }
+        if (!render.workers[i] || (player->resampler && !render.resamplers[i])) {
+            result = MUS_RENDER_ERR_MEMORY;
+            goto done;
+        }
+    }
+    
+    // Pre-pass: replay the score once, stopping at each segment. The
+    // segments render the song once through; the caller's looping flag is
+    // put back afterwards.
+    settle = (uint64_t)SEEK_SETTLE_MS * (uint64_t)player->sample_rate / 1000;
+    looping = player->looping;
+    player->looping = 0;
+    restart_replay(player);
+    player->replay_feedback = 1;
+    for (k = 0; k < count; k++) {
+        render_segment_t* segment = &render.segments[k];
+        uint64_t start;
+        
+        segment->first = span * k / count;
+        segment->end = k + 1 < count ? span * (k + 1) / count : num_samples;
+        start = segment->first > settle ? segment->first - settle : 0;
+        
+        while (player->event_pos + 1 < player->num_events
+            && player->next_event_sample <= start) {
+            process_event(player);
+        }
+        player->current_sample = start;
+        for (i = 0; i < 18; i++) {
+            age_opl_channel(player, i, start);
+        }
+        copy_player_state(&segment->state, player);
+        OPL3_SetTime(&segment->state.opl, native_samples(player, start));
+        segment->state.replaying = 0;
+        segment->state.replay_feedback = 0;
+    }
+    player->replaying = 0;
+    player->replay_feedback = 0;
+    player->playing = 0;
+    player->looping = looping;
+    
+    thread_pool_run(workers, count, render_segment, &render);
+    
+done:
+    if (render.workers) {
+        for (i = 0; i < workers; i++) {
+            free(render.workers[i]);
+            opl_resampler_destroy(render.resamplers[i]);
+        }
+    }
+    free(render.segments);
+    free(render.workers);
+    free(render.resamplers);
+    return result;
+}
+
+// Write the playback state to a snapshot: the score position, the driver's
+// channels and voices, the shadow registers, the chip and the resampler.
+// Pointers are stored as indices. The score, instruments and settings
+// are not included; they are checked on loading instead.
+void mus_player_save_state(mus_player_t* player, state_writer_t* w) {
+    int i;
+    
+    state_put_u32(w, player->score_hash);
+    state_put_u64(w, player->num_events);
+    state_put_u32(w, player->sample_rate);
+    state_put_u8(w, player->opl3_mode);
+    state_put_u8(w, player->driver_version);
+    state_put_u8(w, player->resampler != NULL);
+    
+    state_put_u64(w, player->event_pos);
+    state_put_u8(w, player->playing);
+    state_put_u8(w, player->looping);
+    state_put_u64(w, player->current_sample);
+    state_put_u64(w, player->next_event_sample);
+    state_put_u64(w, player->timing_remainder);
+    for (i = 0; i < 16; i++) {
+        const channel_state_t* channel = &player->channels[i];
+        state_put_u8(w, channel->voice);
+        state_put_u8(w, channel->instrument);
+        state_put_u8(w, channel->volume);
+        state_put_u8(w, channel->volume_base);
+        state_put_u8(w, channel->pan);
+        state_put_u8(w, channel->bend);
+        state_put_u8(w, channel->active);
+        state_put_u8(w, channel->note);
+        state_put_u8(w, channel->key);
+        state_put_u8(w, channel->velocity);
+        state_put_u32(w, channel->voice_mask);
+    }
+    for (i = 0; i < 18; i++) {
+        const voice_state_t* voice = &player->voices[i];
+        state_put_u16(w, voice->current_instr
+                         ? (uint16_t)(voice->current_instr - player->genmidi->instruments) : 0xffff);
+        state_put_u8(w, voice->current_instr_voice);
+        state_put_u8(w, voice->channel ? (int)(voice->channel - player->channels) : 0xff);
+        state_put_u8(w, voice->key);
+        state_put_u8(w, voice->note);
+        state_put_u16(w, voice->freq);
+        state_put_u8(w, voice->car_volume);
+        state_put_u8(w, voice->mod_volume);
+        state_put_u8(w, voice->note_volume);
+        state_put_u8(w, voice->reg_pan);
+        state_put_u8(w, voice->in_use);
+        state_put_u32(w, voice->priority);
+        state_put_u8(w, voice->prev);
+        state_put_u8(w, voice->next);
+        state_put_u32(w, voice->alloc_seq);
+    }
+    state_put_u8(w, player->voice_free_head);
+    state_put_u8(w, player->voice_free_tail);
+    state_put_u8(w, player->voice_alloced_head);
+    state_put_u8(w, player->voice_alloced_tail);
+    state_put_u8(w, player->voice_free_num);
+    state_put_u8(w, player->voice_alloced_num);
+    state_put_u32(w, player->voice_alloc_seq);
+    state_put_u8(w, player->master_volume);
+    state_put_u8(w, player->start_volume);
+    for (i = 0; i < OPL_NUM_REGS; i++) {
+        state_put_u16(w, player->opl_regs[i]);
+    }
+    state_put_u8(w, player->opl_4op);
+    state_put_u64(w, player->opl_writes);
+    state_put_u64(w, player->opl_writes_suppressed);
+    
+    OPL3_SaveState(&player->opl, w);
+    if (player->resampler) {
+        opl_resampler_save_state(player->resampler, w);
+    }
+}
+
+// Check that a voice list runs from head to tail over `num` voices not
+// in `seen`, and mark them. The allocated list is also linked backwards.
+static int check_voice_list(const mus_player_t* player, int head, int tail, int num,
+                            int backwards, uint32_t* seen) {
+    int prev = -1;
+    int i = head;
+    int n;
+    
+    for (n = 0; n < num; n++) {
+        if (i < 0 || i >= player->num_voices || (*seen & (1u << i))
+         || (backwards && player->voices[i].prev != prev)) {
+            return -1;
+        }
+        *seen |= 1u << i;
+        prev = i;
+        i = player->voices[i].next;
+    }
+    return i == -1 && prev == tail ? 0 : -1;
+}
+
+// Check that the lists hold every voice once, that list membership agrees
+// with in_use, that allocated voices have an instrument and a channel, and
+// that each channel's voice mask is exactly its allocated voices
+static int check_voice_states(const mus_player_t* player, uint32_t seen) {
+    uint32_t masks[16];
+    int i;
+    
+    if (seen != (1u << player->num_voices) - 1) {
+        return -1;
+    }
+    memset(masks, 0, sizeof(masks));
+    for (i = player->voice_alloced_head; i != -1; i = player->voices[i].next) {
+        const voice_state_t* voice = &player->voices[i];
+        if (!voice->in_use || !voice->current_instr || !voice->channel) {
+            return -1;
+        }
+        masks[voice->channel - player->channels] |= 1u << i;
+    }
+    for (i = player->voice_free_head; i != -1; i = player->voices[i].next) {
+        if (player->voices[i].in_use) {
+            return -1;
+        }
+    }
+    for (i = 0; i < 16; i++) {
+        if (player->channels[i].voice_mask != masks[i]) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Restore a snapshot written by mus_player_save_state for the same score
+// and settings. Returns -1 without changing the player if the snapshot is
+// invalid or does not match.
+int mus_player_load_state(mus_player_t* player, state_reader_t* r) {
+    mus_player_t* state;
+    seek_keyframe_t* keyframes;
+    size_t num_keyframes;
+    uint32_t seen = 0;
+    int i;
+    
+    if (!player->events
+     || state_get_u32(r) != player->score_hash
+     || state_get_u64(r) != player->num_events
+     || state_get_u32(r) != (uint32_t)player->sample_rate
+     || state_get_u8(r) != player->opl3_mode
+     || state_get_u8(r) != player->driver_version
+     || state_get_u8(r) != (player->resampler != NULL)) {
+        return -1;
+    }
+    
+    // Read into a copy, which is only kept if the whole snapshot is good
+    state = (mus_player_t*)malloc(sizeof(mus_player_t));
+    if (!state) return -1;
+    copy_player_state(state, player);
+    
+    state->event_pos = (size_t)state_get_u64(r);
+    state->playing = state_get_u8(r);
+    state->looping = state_get_u8(r);
+    state->current_sample = state_get_u64(r);
+    state->next_event_sample = state_get_u64(r);
+    state->timing_remainder = state_get_u64(r);
+    if (state->event_pos >= state->num_events) goto fail;
+    for (i = 0; i < 16; i++) {
+        channel_state_t* channel = &state->channels[i];
+        channel->voice = state_get_s8(r);
+        channel->instrument = state_get_u8(r);
+        channel->volume = state_get_u8(r);
+        channel->volume_base = state_get_u8(r);
+        channel->pan = state_get_u8(r);
+        channel->bend = state_get_s8(r);
+        channel->active = state_get_u8(r);
+        channel->note = state_get_u8(r);
+        channel->key = state_get_u8(r);
+        channel->velocity = state_get_u8(r);
+        channel->voice_mask = state_get_u32(r);
+        if (channel->voice < -1 || channel->voice >= state->num_voices || channel->volume > 127
+         || (channel->voice_mask >> state->num_voices) != 0) {
+            goto fail;
+        }
+    }
+    for (i = 0; i < 18; i++) {
+        voice_state_t* voice = &state->voices[i];
+        uint16_t instr = state_get_u16(r);
+        uint8_t channel;
+        voice->current_instr = state->genmidi && instr < 2 * INSTR_TABLE_SIZE
+                             ? state->genmidi->instruments + instr : NULL;
+        voice->current_instr_voice = state_get_u8(r);
+        channel = state_get_u8(r);
+        voice->channel = channel < 16 ? &state->channels[channel] : NULL;
+        voice->key = state_get_u8(r);
+        voice->note = state_get_u8(r);
+        voice->freq = state_get_u16(r);
+        voice->car_volume = state_get_u8(r);
+        voice->mod_volume = state_get_u8(r);
+        voice->note_volume = state_get_u8(r);
+        voice->reg_pan = state_get_u8(r);
+        voice->in_use = state_get_u8(r);
+        voice->priority = state_get_u32(r);
+        voice->prev = state_get_s8(r);
+        voice->next = state_get_s8(r);
+        voice->alloc_seq = state_get_u32(r);
+        if ((instr != 0xffff && !voice->current_instr) || voice->current_instr_voice > 1
+         || (channel != 0xff && !voice->channel) || voice->note_volume > 127) {
+            goto fail;
+        }
+    }
+    state->voice_free_head = state_get_s8(r);
+    state->voice_free_tail = state_get_s8(r);
+    state->voice_alloced_head = state_get_s8(r);
+    state->voice_alloced_tail = state_get_s8(r);
+    state->voice_free_num = state_get_u8(r);
+    state->voice_alloced_num = state_get_u8(r);
+    state->voice_alloc_seq = state_get_u32(r);
+    state->master_volume = state_get_u8(r);
+    state->start_volume = state_get_u8(r);
+    if (check_voice_list(state, state->voice_free_head, state->voice_free_tail,
+                         state->voice_free_num, 0, &seen) != 0
+     || check_voice_list(state, state->voice_alloced_head, state->voice_alloced_tail,
+                         state->voice_alloced_num, 1, &seen) != 0
+     || check_voice_states(state, seen) != 0
+     || state->master_volume > 127 || state->start_volume > 127) {
+        goto fail;
+    }
+    for (i = 0; i < OPL_NUM_REGS; i++) {
+        state->opl_regs[i] = state_get_u16(r);
+    }
+    state->opl_4op = state_get_u8(r);
+    state->opl_writes = state_get_u64(r);
+    state->opl_writes_suppressed = state_get_u64(r);
+    
+    if (OPL3_LoadState(&state->opl, r) != 0) goto fail;
+    if (r->error) goto fail;
+    if (state->resampler && opl_resampler_load_state(state->resampler, r) != 0) goto fail;
+    
+    // The seek index still describes the score and settings
+    keyframes = player->keyframes;
+    num_keyframes = player->num_keyframes;
+    copy_player_state(player, state);
+    player->keyframes = keyframes;
+    player->num_keyframes = num_keyframes;
+    free(state);
+    return 0;
+    
+fail:
+    free(state);
+    return -1;
+}
+
+// Get song length in ticks: the time the end of score (or the point a
+// truncated score stops) is reached, from the decoded event stream
+uint32_t mus_player_get_length_ticks(mus_player_t* player) {
+    if (!player || !player->events) return 0;
+    return player->events[player->num_events - 1].tick;
+}
+
+// Get song length in output samples, rounded as playback timing is
+uint64_t mus_player_get_length_samples(mus_player_t* player) {
+    if (!player) return 0;
+    return (uint64_t)mus_player_get_length_ticks(player) * (uint64_t)player->sample_rate / 140;
+}
+
+// Get song length in milliseconds, matching the position at the end
+uint32_t mus_player_get_length_ms(mus_player_t* player) {
+    if (!player) return 0;
+    return (uint32_t)((mus_player_get_length_samples(player) * 1000ULL) / player->sample_rate);
+}
+
 // Get position in milliseconds
 uint32_t mus_player_get_position_ms(mus_player_t* player) {
     if (!player) return 0;
@@ -178,7 +178,6 @@ static const Bit8u ch_slot[18] = {
 // Envelope generator
 //
 
-typedef Bit16s(*envelope_sinfunc)(Bit16u phase, Bit16u envelope);
 typedef void(*envelope_genfunc)(opl3_slot *slott);
 
 static Bit16s OPL3_EnvelopeCalcExp(Bit32u level)
@@ -190,154 +189,67 @@ static Bit16s OPL3_EnvelopeCalcExp(Bit32u level)
     return (exprom[level & 0xff] << 1) >> (level >> 8);
 }
 
-static Bit16s OPL3_EnvelopeCalcSin0(Bit16u phase, Bit16u envelope)
-{
-    Bit16u out = 0;
-    Bit16u neg = 0;
-    phase &= 0x3ff;
-    if (phase & 0x200)
-    {
-        neg = 0xffff;
-    }
-    if (phase & 0x100)
-    {
-        out = logsinrom[(phase & 0xff) ^ 0xff];
-    }
-    else
-    {
-        out = logsinrom[phase & 0xff];
-    }
-    return OPL3_EnvelopeCalcExp(out + (envelope << 3)) ^ neg;
-}
+//
+// Waveforms
+//
+// Each waveform is a logsin lookup (at double speed for 4 and 5), a linear
+// ramp or a constant level, with fixed parts of the phase muted or
+// negated. Describing them with masks lets one branchless expression
+// replace a function per waveform.
+//
 
-static Bit16s OPL3_EnvelopeCalcSin1(Bit16u phase, Bit16u envelope)
-{
-    Bit16u out = 0;
-    phase &= 0x3ff;
-    if (phase & 0x200)
-    {
-        out = 0x1000;
-    }
-    else if (phase & 0x100)
-    {
-        out = logsinrom[(phase & 0xff) ^ 0xff];
-    }
-    else
-    {
-        out = logsinrom[phase & 0xff];
-    }
-    return OPL3_EnvelopeCalcExp(out + (envelope << 3));
-}
+typedef struct {
+    Bit8u shift;        // 1 for the double-speed waveforms
+    Bit8u mirror;       // Index xor on the falling half of a sine lobe
+    Bit16u sine;        // Mask for the logsin level
+    Bit16u ramp;        // Mask for the linear ramp level
+    Bit16u mute;        // Phase bits that force full attenuation
+    Bit16u negmask;     // Output is negated where (phase & negmask) == negval
+    Bit16u negval;
+} opl3_waveform;
+
+static const opl3_waveform waveforms[8] = {
+    { 0, 0xff, 0xffff, 0x0000, 0x000, 0x200, 0x200 },   // sine
+    { 0, 0xff, 0xffff, 0x0000, 0x200, 0x000, 0xffff },  // half sine
+    { 0, 0xff, 0xffff, 0x0000, 0x000, 0x000, 0xffff },  // absolute sine
+    { 0, 0x00, 0xffff, 0x0000, 0x100, 0x000, 0xffff },  // pulse sine
+    { 1, 0xfe, 0xffff, 0x0000, 0x200, 0x300, 0x100 },   // alternating sine
+    { 1, 0xfe, 0xffff, 0x0000, 0x200, 0x000, 0xffff },  // camel sine
+    { 0, 0x00, 0x0000, 0x0000, 0x000, 0x200, 0x200 },   // square
+    { 0, 0x00, 0x0000, 0xffff, 0x000, 0x200, 0x200 }    // logarithmic sawtooth
+};
 
-static Bit16s OPL3_EnvelopeCalcSin2(Bit16u phase, Bit16u envelope)
+static inline Bit16u OPL3_EnvelopeCalcNeg(Bit16u phase, const opl3_waveform *wave)
 {
-    Bit16u out = 0;
-    phase &= 0x3ff;
-    if (phase & 0x100)
-    {
-        out = logsinrom[(phase & 0xff) ^ 0xff];
-    }
-    else
-    {
-        out = logsinrom[phase & 0xff];
-    }
-    return OPL3_EnvelopeCalcExp(out + (envelope << 3));
+    return (Bit16u)-((phase & 0x3ff & wave->negmask) == wave->negval);
 }
 
-static Bit16s OPL3_EnvelopeCalcSin3(Bit16u phase, Bit16u envelope)
+static inline Bit16s OPL3_EnvelopeCalcWave(Bit16u phase, Bit16u envelope, Bit8u wf)
 {
-    Bit16u out = 0;
-    phase &= 0x3ff;
-    if (phase & 0x100)
-    {
-        out = 0x1000;
-    }
-    else
-    {
-        out = logsinrom[phase & 0xff];
-    }
-    return OPL3_EnvelopeCalcExp(out + (envelope << 3));
-}
+    const opl3_waveform *wave = &waveforms[wf];
+    Bit16u index, level, mute;
 
-static Bit16s OPL3_EnvelopeCalcSin4(Bit16u phase, Bit16u envelope)
-{
-    Bit16u out = 0;
-    Bit16u neg = 0;
     phase &= 0x3ff;
-    if ((phase & 0x300) == 0x100)
-    {
-        neg = 0xffff;
-    }
-    if (phase & 0x200)
-    {
-        out = 0x1000;
-    }
-    else if (phase & 0x80)
-    {
-        out = logsinrom[((phase ^ 0xff) << 1) & 0xff];
-    }
-    else
-    {
-        out = logsinrom[(phase << 1) & 0xff];
-    }
-    return OPL3_EnvelopeCalcExp(out + (envelope << 3)) ^ neg;
+    index = (Bit16u)(phase << wave->shift);
+    level = logsinrom[(index & 0xff) ^ (wave->mirror & -((index >> 8) & 1))] & wave->sine;
+    level |= (((phase & 0x1ff) ^ (0x1ff & -(phase >> 9))) << 3) & wave->ramp;
+    mute = (Bit16u)-((phase & wave->mute) != 0);
+    level = (level & ~mute) | (0x1000 & mute);
+    return OPL3_EnvelopeCalcExp(level + (envelope << 3)) ^ OPL3_EnvelopeCalcNeg(phase, wave);
 }
 
-static Bit16s OPL3_EnvelopeCalcSin5(Bit16u phase, Bit16u envelope)
-{
-    Bit16u out = 0;
-    phase &= 0x3ff;
-    if (phase & 0x200)
-    {
-        out = 0x1000;
-    }
-    else if (phase & 0x80)
-    {
-        out = logsinrom[((phase ^ 0xff) << 1) & 0xff];
-    }
-    else
-    {
-        out = logsinrom[(phase << 1) & 0xff];
-    }
-    return OPL3_EnvelopeCalcExp(out + (envelope << 3));
-}
+//
+// At an attenuation of 0x1a0 or more the exp lookup shifts every level out,
+// so a waveform only contributes the sign of its negative half.
+//
 
-static Bit16s OPL3_EnvelopeCalcSin6(Bit16u phase, Bit16u envelope)
-{
-    Bit16u neg = 0;
-    phase &= 0x3ff;
-    if (phase & 0x200)
-    {
-        neg = 0xffff;
-    }
-    return OPL3_EnvelopeCalcExp(envelope << 3) ^ neg;
-}
+#define OPL3_ENVELOPE_SILENT 0x1a0
 
-static Bit16s OPL3_EnvelopeCalcSin7(Bit16u phase, Bit16u envelope)
+static inline Bit16s OPL3_EnvelopeCalcSign(Bit16u phase, Bit8u wf)
 {
-    Bit16u out = 0;
-    Bit16u neg = 0;
-    phase &= 0x3ff;
-    if (phase & 0x200)
-    {
-        neg = 0xffff;
-        phase = (phase & 0x1ff) ^ 0x1ff;
-    }
-    out = phase << 3;
-    return OPL3_EnvelopeCalcExp(out + (envelope << 3)) ^ neg;
+    return (Bit16s)OPL3_EnvelopeCalcNeg(phase, &waveforms[wf]);
 }
 
-static const envelope_sinfunc envelope_sin[8] = {
-    OPL3_EnvelopeCalcSin0,
-    OPL3_EnvelopeCalcSin1,
-    OPL3_EnvelopeCalcSin2,
-    OPL3_EnvelopeCalcSin3,
-    OPL3_EnvelopeCalcSin4,
-    OPL3_EnvelopeCalcSin5,
-    OPL3_EnvelopeCalcSin6,
-    OPL3_EnvelopeCalcSin7
-};
-
 enum envelope_gen_num
 {
     envelope_gen_num_attack = 0,
@@ -504,6 +416,15 @@ static void OPL3_EnvelopeCalc(opl3_slot *slot)
     }
 }
 
+// Fully released slot with the key off: the envelope stays at 0x1ff, so only
+// the attenuation output needs refreshing for the current tremolo value.
+static void OPL3_EnvelopeCalcIdle(opl3_slot *slot)
+{
+    slot->eg_out = 0x1ff + (slot->reg_tl << 2)
+                 + (slot->eg_ksl >> kslshift[slot->reg_ksl]) + *slot->trem;
+    slot->pg_reset = 0;
+}
+
 static void OPL3_EnvelopeKeyOn(opl3_slot *slot, Bit8u type)
 {
     slot->key |= type;
@@ -514,665 +435,1774 @@ static void OPL3_EnvelopeKeyOff(opl3_slot *slot, Bit8u type)
     slot->key &= ~type;
 }
 
-//
-// Phase Generator
-//
-
-static void OPL3_PhaseGenerate(opl3_slot *slot)
+// Effective rate for a rate register, split as in OPL3_EnvelopeCalc
+static void OPL3_EnvelopeRate(const opl3_slot *slot, Bit8u reg_rate,
+                              Bit8u *rate_hi, Bit8u *rate_lo)
 {
-    opl3_chip *chip;
-    Bit16u f_num;
-    Bit32u basefreq;
-    Bit8u rm_xor, n_bit;
-    Bit32u noise;
-    Bit16u phase;
+    Bit8u ks = slot->channel->ksv >> ((slot->reg_ksr ^ 1) << 1);
+    Bit8u rate = ks + (reg_rate << 2);
 
-    chip = slot->chip;
-    f_num = slot->channel->f_num;
-    if (slot->reg_vib)
+    *rate_hi = rate >> 2;
+    *rate_lo = rate & 0x03;
+    if (*rate_hi & 0x10)
     {
-        Bit8s range;
-        Bit8u vibpos;
-
-        range = (f_num >> 7) & 7;
-        vibpos = slot->chip->vibpos;
+        *rate_hi = 0x0f;
+    }
+}
 
-        if (!(vibpos & 3))
-        {
-            range = 0;
-        }
-        else if (vibpos & 1)
-        {
-            range >>= 1;
-        }
-        range >>= slot->chip->vibshift;
+// eg_add as OPL3_UpdateTimers leaves it for the sample `time` samples after
+// a reset
+static Bit8u OPL3_EnvelopeAddAt(Bit64u time)
+{
+    Bit64u eg_timer;
+    Bit8u shift = 0;
 
-        if (vibpos & 4)
-        {
-            range = -range;
-        }
-        f_num += range;
-    }
-    basefreq = (f_num << slot->channel->block) >> 1;
-    phase = (Bit16u)(slot->pg_phase >> 9);
-    if (slot->pg_reset)
+    if (time < 3)
     {
-        slot->pg_phase = 0;
-    }
-    slot->pg_phase += (basefreq * mt[slot->reg_mult]) >> 1;
-    // Rhythm mode
-    noise = chip->noise;
-    slot->pg_phase_out = phase;
-    if (slot->slot_num == 13) // hh
-    {
-        chip->rm_hh_bit2 = (phase >> 2) & 1;
-        chip->rm_hh_bit3 = (phase >> 3) & 1;
-        chip->rm_hh_bit7 = (phase >> 7) & 1;
-        chip->rm_hh_bit8 = (phase >> 8) & 1;
+        return 0;
     }
-    if (slot->slot_num == 17 && (chip->rhy & 0x20)) // tc
+    eg_timer = (time - 1) >> 1;
+    while (shift < 36 && ((eg_timer >> shift) & 1) == 0)
     {
-        chip->rm_tc_bit3 = (phase >> 3) & 1;
-        chip->rm_tc_bit5 = (phase >> 5) & 1;
+        shift++;
     }
-    if (chip->rhy & 0x20)
+    return shift > 12 ? 0 : shift + 1;
+}
+
+// Shift selected by OPL3_EnvelopeCalc at sample `time` after a reset
+static Bit8u OPL3_EnvelopeShiftAt(Bit8u rate_hi, Bit8u rate_lo, Bit64u time)
+{
+    Bit8u shift = 0;
+
+    if (rate_hi < 12)
     {
-        rm_xor = (chip->rm_hh_bit2 ^ chip->rm_hh_bit7)
-               | (chip->rm_hh_bit3 ^ chip->rm_tc_bit5)
-               | (chip->rm_tc_bit3 ^ chip->rm_tc_bit5);
-        switch (slot->slot_num)
+        if (time & 1)
         {
-        case 13: // hh
-            slot->pg_phase_out = rm_xor << 9;
-            if (rm_xor ^ (noise & 1))
-            {
-                slot->pg_phase_out |= 0xd0;
-            }
-            else
+            switch (rate_hi + OPL3_EnvelopeAddAt(time))
             {
-                slot->pg_phase_out |= 0x34;
+            case 12:
+                shift = 1;
+                break;
+            case 13:
+                shift = (rate_lo >> 1) & 0x01;
+                break;
+            case 14:
+                shift = rate_lo & 0x01;
+                break;
+            default:
+                break;
             }
-            break;
-        case 16: // sd
-            slot->pg_phase_out = (chip->rm_hh_bit8 << 9)
-                               | ((chip->rm_hh_bit8 ^ (noise & 1)) << 8);
-            break;
-        case 17: // tc
-            slot->pg_phase_out = (rm_xor << 9) | 0x80;
-            break;
-        default:
-            break;
         }
+        return shift;
     }
-    n_bit = ((noise >> 14) ^ noise) & 0x01;
-    chip->noise = (noise >> 1) | (n_bit << 22);
-}
-
-//
-// Slot
-//
-
-static void OPL3_SlotWrite20(opl3_slot *slot, Bit8u data)
-{
-    if ((data >> 7) & 0x01)
+    shift = (rate_hi & 0x03) + eg_incstep[rate_lo][time & 0x03];
+    if (shift & 0x04)
     {
-        slot->trem = &slot->chip->tremolo;
+        shift = 0x03;
     }
-    else
+    if (!shift)
     {
-        slot->trem = (Bit8u*)&slot->chip->zeromod;
+        shift = time & 0x01;
     }
-    slot->reg_vib = (data >> 6) & 0x01;
-    slot->reg_type = (data >> 5) & 0x01;
-    slot->reg_ksr = (data >> 4) & 0x01;
-    slot->reg_mult = data & 0x0f;
+    return shift;
 }
 
-static void OPL3_SlotWrite40(opl3_slot *slot, Bit8u data)
-{
-    slot->reg_ksl = (data >> 6) & 0x03;
-    slot->reg_tl = data & 0x3f;
-    OPL3_EnvelopeUpdateKSL(slot);
-}
-
-static void OPL3_SlotWrite60(opl3_slot *slot, Bit8u data)
+// Odd samples before `time` whose eg_timer has exactly k trailing zeros
+static Bit64u OPL3_EnvelopeTicks(Bit8u k, Bit64u time)
 {
-    slot->reg_ar = (data >> 4) & 0x0f;
-    slot->reg_dr = data & 0x0f;
-}
+    Bit64u j = time >> 1;
 
-static void OPL3_SlotWrite80(opl3_slot *slot, Bit8u data)
-{
-    slot->reg_sl = (data >> 4) & 0x0f;
-    if (slot->reg_sl == 0x0f)
+    if (j < 2)
     {
-        slot->reg_sl = 0x1f;
+        return 0;
     }
-    slot->reg_rr = data & 0x0f;
+    return ((j - 1) >> k) - ((j - 1) >> (k + 1));
 }
 
-static void OPL3_SlotWriteE0(opl3_slot *slot, Bit8u data)
+// Total decay steps taken at a rate over samples [from, to)
+static Bit64u OPL3_EnvelopeSteps(Bit8u rate_hi, Bit8u rate_lo, Bit64u from, Bit64u to)
 {
-    slot->reg_wf = data & 0x07;
-    if (slot->chip->newm == 0x00)
+    Bit64u steps = 0;
+    Bit8u k, r, shift;
+
+    if (rate_hi < 12)
     {
-        slot->reg_wf &= 0x03;
+        // Steps fall on odd samples where rate_hi + eg_add selects a shift
+        for (k = 0; k < 3; k++)
+        {
+            if (k == 0 || (rate_lo & (4 >> k)))
+            {
+                steps += OPL3_EnvelopeTicks(11 - rate_hi + k, to)
+                       - OPL3_EnvelopeTicks(11 - rate_hi + k, from);
+            }
+        }
+        return steps;
+    }
+    // The fast rates repeat every four samples
+    for (r = 0; r < 4; r++)
+    {
+        shift = OPL3_EnvelopeShiftAt(rate_hi, rate_lo, r);
+        if (shift)
+        {
+            steps += (Bit64u)(1 << (shift - 1))
+                   * (((to + 3 - r) >> 2) - ((from + 3 - r) >> 2));
+        }
     }
+    return steps;
 }
 
-static void OPL3_SlotGenerate(opl3_slot *slot)
+// Run one sample of OPL3_EnvelopeCalc on a level and phase at `time`
+static void OPL3_EnvelopeClock(const opl3_slot *slot, Bit16u *level, Bit8u *gen, Bit64u time)
 {
-    slot->out = envelope_sin[slot->reg_wf](slot->pg_phase_out + *slot->mod, slot->eg_out);
-}
+    Bit8u reg_rate = 0;
+    Bit8u rate_hi, rate_lo, shift = 0;
+    Bit16u eg_rout = *level;
+    Bit16s eg_inc = 0;
+    Bit8u eg_off = (*level & 0x1f8) == 0x1f8;
+    Bit8u reset = slot->key && *gen == envelope_gen_num_release;
 
-static void OPL3_SlotCalcFB(opl3_slot *slot)
-{
-    if (slot->channel->fb != 0x00)
+    if (reset || *gen == envelope_gen_num_attack)
     {
-        slot->fbmod = (slot->prout + slot->out) >> (0x09 - slot->channel->fb);
+        reg_rate = slot->reg_ar;
     }
-    else
+    else if (*gen == envelope_gen_num_decay)
     {
-        slot->fbmod = 0;
+        reg_rate = slot->reg_dr;
+    }
+    else if (*gen == envelope_gen_num_release || !slot->reg_type)
+    {
+        reg_rate = slot->reg_rr;
+    }
+    OPL3_EnvelopeRate(slot, reg_rate, &rate_hi, &rate_lo);
+    if (reg_rate)
+    {
+        shift = OPL3_EnvelopeShiftAt(rate_hi, rate_lo, time);
+    }
+    if (reset && rate_hi == 0x0f)
+    {
+        eg_rout = 0x00;
+    }
+    if (*gen != envelope_gen_num_attack && !reset && eg_off)
+    {
+        eg_rout = 0x1ff;
+    }
+    switch (*gen)
+    {
+    case envelope_gen_num_attack:
+        if (!*level)
+        {
+            *gen = envelope_gen_num_decay;
+        }
+        else if (slot->key && shift > 0 && rate_hi != 0x0f)
+        {
+            eg_inc = ((~*level) << shift) >> 4;
+        }
+        break;
+    case envelope_gen_num_decay:
+        if ((*level >> 4) == slot->reg_sl)
+        {
+            *gen = envelope_gen_num_sustain;
+        }
+        else if (!eg_off && !reset && shift > 0)
+        {
+            eg_inc = 1 << (shift - 1);
+        }
+        break;
+    default:
+        if (!eg_off && !reset && shift > 0)
+        {
+            eg_inc = 1 << (shift - 1);
+        }
+        break;
+    }
+    *level = (eg_rout + eg_inc) & 0x1ff;
+    if (reset)
+    {
+        *gen = envelope_gen_num_attack;
+    }
+    if (!slot->key)
+    {
+        *gen = envelope_gen_num_release;
     }
-    slot->prout = slot->out;
+}
+
+// Raise a level at a decay rate from `*time` until it reaches limit or the
+// time reaches `to`; the crossing sample is found by bisection
+static void OPL3_EnvelopeSkipLinear(const opl3_slot *slot, Bit8u reg_rate, Bit16u *level,
+                                    Bit16u limit, Bit64u *time, Bit64u to)
+{
+    Bit8u rate_hi, rate_lo;
+    Bit64u need, lo, hi, mid;
+
+    if (!reg_rate)
+    {
+        *time = to;
+        return;
+    }
+    OPL3_EnvelopeRate(slot, reg_rate, &rate_hi, &rate_lo);
+    need = limit - *level;
+    if (OPL3_EnvelopeSteps(rate_hi, rate_lo, *time, to) < need)
+    {
+        *level += (Bit16u)OPL3_EnvelopeSteps(rate_hi, rate_lo, *time, to);
+        *time = to;
+        return;
+    }
+    lo = *time + 1;
+    hi = to;
+    while (lo < hi)
+    {
+        mid = lo + ((hi - lo) >> 1);
+        if (OPL3_EnvelopeSteps(rate_hi, rate_lo, *time, mid) >= need)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+    *level += (Bit16u)OPL3_EnvelopeSteps(rate_hi, rate_lo, *time, lo);
+    *time = lo;
+}
+
+// Attack from `*time` until the level reaches 0 or the time reaches `to`.
+// Slow rates step from one eg_timer event to the next.
+static void OPL3_EnvelopeSkipAttack(const opl3_slot *slot, Bit16u *level, Bit8u *gen,
+                                    Bit64u *time, Bit64u to)
+{
+    Bit8u rate_hi, rate_lo, k;
+    Bit64u j, q, next, event;
+
+    OPL3_EnvelopeRate(slot, slot->reg_ar, &rate_hi, &rate_lo);
+    if (!slot->reg_ar || rate_hi == 0x0f)
+    {
+        // The level is held
+        *time = to;
+        return;
+    }
+    if (rate_hi >= 12)
+    {
+        while (*time < to && *level)
+        {
+            OPL3_EnvelopeClock(slot, level, gen, (*time)++);
+        }
+        return;
+    }
+    while (*level)
+    {
+        // First odd sample at or after *time with a shift 1 event
+        j = *time >> 1;
+        if (j < 1)
+        {
+            j = 1;
+        }
+        next = UINT64_MAX;
+        for (k = 0; k < 3; k++)
+        {
+            if (k == 0 || (rate_lo & (4 >> k)))
+            {
+                q = (j + ((Bit64u)1 << (11 - rate_hi + k)) - 1) >> (11 - rate_hi + k);
+                if (!(q & 1))
+                {
+                    q++;
+                }
+                event = ((q << (11 - rate_hi + k)) << 1) + 1;
+                if (event < next)
+                {
+                    next = event;
+                }
+            }
+        }
+        if (next >= to)
+        {
+            *time = to;
+            return;
+        }
+        *level = (*level + (((~*level) << 1) >> 4)) & 0x1ff;
+        *time = next + 1;
+    }
+}
+
+// Advance a slot's envelope over samples [from, to) after a reset
+static void OPL3_EnvelopeSkip(opl3_slot *slot, Bit64u from, Bit64u to)
+{
+    Bit16u level = slot->eg_rout;
+    Bit8u gen = slot->eg_gen;
+    Bit64u time = from;
+    Bit16u limit;
+
+    while (time < to)
+    {
+        // Key changes and phase transitions take a sample each
+        if ((slot->key != 0) == (gen == envelope_gen_num_release)
+         || (gen == envelope_gen_num_attack && !level)
+         || (gen == envelope_gen_num_decay && (level >> 4) == slot->reg_sl))
+        {
+            OPL3_EnvelopeClock(slot, &level, &gen, time++);
+            continue;
+        }
+        if (gen == envelope_gen_num_attack)
+        {
+            OPL3_EnvelopeSkipAttack(slot, &level, &gen, &time, to);
+            continue;
+        }
+        // Envelope off
+        if ((level & 0x1f8) == 0x1f8)
+        {
+            if (level == 0x1ff)
+            {
+                break;
+            }
+            OPL3_EnvelopeClock(slot, &level, &gen, time++);
+            continue;
+        }
+        if (gen == envelope_gen_num_decay)
+        {
+            limit = 0x1f8;
+            if ((level >> 4) < slot->reg_sl && (slot->reg_sl << 4) < limit)
+            {
+                limit = slot->reg_sl << 4;
+            }
+            OPL3_EnvelopeSkipLinear(slot, slot->reg_dr, &level, limit, &time, to);
+        }
+        else if (gen == envelope_gen_num_sustain && slot->reg_type)
+        {
+            break;
+        }
+        else
+        {
+            OPL3_EnvelopeSkipLinear(slot, slot->reg_rr, &level, 0x1f8, &time, to);
+        }
+    }
+    slot->eg_rout = level;
+    slot->eg_gen = gen;
+}
+
+//
+// Phase Generator
+//
+
+// Phase increment of a slot at a vibrato position
+static inline Bit32u OPL3_PhaseIncrementAt(const opl3_slot *slot, Bit8u vibpos)
+{
+    Bit16u f_num;
+    Bit32u basefreq;
+
+    f_num = slot->channel->f_num;
+    if (slot->reg_vib)
+    {
+        Bit8s range;
+
+        range = (f_num >> 7) & 7;
+
+        if (!(vibpos & 3))
+        {
+            range = 0;
+        }
+        else if (vibpos & 1)
+        {
+            range >>= 1;
+        }
+        range >>= slot->chip->vibshift;
+
+        if (vibpos & 4)
+        {
+            range = -range;
+        }
+        f_num += range;
+    }
+    basefreq = (f_num << slot->channel->block) >> 1;
+    return (basefreq * mt[slot->reg_mult]) >> 1;
+}
+
+static Bit32u OPL3_PhaseCalcIncrement(opl3_slot *slot)
+{
+    return OPL3_PhaseIncrementAt(slot, slot->chip->vibpos);
+}
+
+// Samples in [0, time) at a vibrato position: it advances every 1024
+// samples and wraps after eight
+static Bit64u OPL3_VibratoTicks(Bit8u vibpos, Bit64u time)
+{
+    Bit64u start = (Bit64u)vibpos << 10;
+    Bit64u rem = time & 0x1fff;
+
+    rem = rem > start ? rem - start : 0;
+    if (rem > 0x400)
+    {
+        rem = 0x400;
+    }
+    return ((time >> 13) << 10) + rem;
+}
+
+// Phase advance of a slot over samples [from, to), following vibrato
+static Bit32u OPL3_PhaseSkip(const opl3_slot *slot, Bit64u from, Bit64u to)
+{
+    Bit32u phase = 0;
+    Bit8u vibpos;
+
+    if (!slot->reg_vib)
+    {
+        return OPL3_PhaseIncrementAt(slot, 0) * (Bit32u)(to - from);
+    }
+    for (vibpos = 0; vibpos < 8; vibpos++)
+    {
+        phase += OPL3_PhaseIncrementAt(slot, vibpos)
+               * (Bit32u)(OPL3_VibratoTicks(vibpos, to) - OPL3_VibratoTicks(vibpos, from));
+    }
+    return phase;
+}
+
+static void OPL3_PhaseGenerate(opl3_slot *slot)
+{
+    opl3_chip *chip;
+    Bit32u phase_inc;
+    Bit8u rm_xor, n_bit;
+    Bit32u noise;
+    Bit16u phase;
+
+    chip = slot->chip;
+    phase_inc = OPL3_PhaseCalcIncrement(slot);
+    phase = (Bit16u)(slot->pg_phase >> 9);
+    if (slot->pg_reset)
+    {
+        slot->pg_phase = 0;
+    }
+    slot->pg_phase += phase_inc;
+    // Rhythm mode
+    noise = chip->noise;
+    slot->pg_phase_out = phase;
+    if (slot->slot_num == 13) // hh
+    {
+        chip->rm_hh_bit2 = (phase >> 2) & 1;
+        chip->rm_hh_bit3 = (phase >> 3) & 1;
+        chip->rm_hh_bit7 = (phase >> 7) & 1;
+        chip->rm_hh_bit8 = (phase >> 8) & 1;
+    }
+    if (slot->slot_num == 17 && (chip->rhy & 0x20)) // tc
+    {
+        chip->rm_tc_bit3 = (phase >> 3) & 1;
+        chip->rm_tc_bit5 = (phase >> 5) & 1;
+    }
+    if (chip->rhy & 0x20)
+    {
+        rm_xor = (chip->rm_hh_bit2 ^ chip->rm_hh_bit7)
+               | (chip->rm_hh_bit3 ^ chip->rm_tc_bit5)
+               | (chip->rm_tc_bit3 ^ chip->rm_tc_bit5);
+        switch (slot->slot_num)
+        {
+        case 13: // hh
+            slot->pg_phase_out = rm_xor << 9;
+            if (rm_xor ^ (noise & 1))
+            {
+                slot->pg_phase_out |= 0xd0;
+            }
+            else
+            {
+                slot->pg_phase_out |= 0x34;
+            }
+            break;
+        case 16: // sd
+            slot->pg_phase_out = (chip->rm_hh_bit8 << 9)
+                               | ((chip->rm_hh_bit8 ^ (noise & 1)) << 8);
+            break;
+        case 17: // tc
+            slot->pg_phase_out = (rm_xor << 9) | 0x80;
+            break;
+        default:
+            break;
+        }
+    }
+    n_bit = ((noise >> 14) ^ noise) & 0x01;
+    chip->noise = (noise >> 1) | (n_bit << 22);
+}
+
+// Phase generator for the Doom profile: with rhythm mode off the output is
+// the plain phase. The caller latches the hi-hat phase bits and advances
+// the noise LFSR once per sample, so chip state matches OPL3_PhaseGenerate.
+static void OPL3_PhaseGenerateMelodic(opl3_slot *slot)
+{
+    Bit32u phase_inc;
+
+    phase_inc = OPL3_PhaseCalcIncrement(slot);
+    slot->pg_phase_out = (Bit16u)(slot->pg_phase >> 9);
+    if (slot->pg_reset)
+    {
+        slot->pg_phase = 0;
+    }
+    slot->pg_phase += phase_inc;
+}
+
+// Latch the hi-hat phase bits from slot 13, as OPL3_PhaseGenerate does
+// every sample whether or not rhythm mode is on
+static inline void OPL3_PhaseLatchHiHat(opl3_chip *chip)
+{
+    Bit16u phase = chip->slot[13].pg_phase_out;
+
+    chip->rm_hh_bit2 = (phase >> 2) & 1;
+    chip->rm_hh_bit3 = (phase >> 3) & 1;
+    chip->rm_hh_bit7 = (phase >> 7) & 1;
+    chip->rm_hh_bit8 = (phase >> 8) & 1;
+}
+
+//
+// Slot
+//
+
+static void OPL3_SlotWrite20(opl3_slot *slot, Bit8u data)
+{
+    if ((data >> 7) & 0x01)
+    {
+        slot->trem = &slot->chip->tremolo;
+    }
+    else
+    {
+        slot->trem = (Bit8u*)&slot->chip->zeromod;
+    }
+    slot->reg_vib = (data >> 6) & 0x01;
+    slot->reg_type = (data >> 5) & 0x01;
+    slot->reg_ksr = (data >> 4) & 0x01;
+    slot->reg_mult = data & 0x0f;
+}
+
+static void OPL3_SlotWrite40(opl3_slot *slot, Bit8u data)
+{
+    slot->reg_ksl = (data >> 6) & 0x03;
+    slot->reg_tl = data & 0x3f;
+    OPL3_EnvelopeUpdateKSL(slot);
+}
+
+static void OPL3_SlotWrite60(opl3_slot *slot, Bit8u data)
+{
+    slot->reg_ar = (data >> 4) & 0x0f;
+    slot->reg_dr = data & 0x0f;
+}
+
+static void OPL3_SlotWrite80(opl3_slot *slot, Bit8u data)
+{
+    slot->reg_sl = (data >> 4) & 0x0f;
+    if (slot->reg_sl == 0x0f)
+    {
+        slot->reg_sl = 0x1f;
+    }
+    slot->reg_rr = data & 0x0f;
+}
+
+static void OPL3_SlotWriteE0(opl3_slot *slot, Bit8u data)
+{
+    slot->reg_wf = data & 0x07;
+    if (slot->chip->newm == 0x00)
+    {
+        slot->reg_wf &= 0x03;
+    }
+}
+
+static void OPL3_SlotGenerate(opl3_slot *slot)
+{
+    Bit16u phase = slot->pg_phase_out + *slot->mod;
+
+    if (slot->eg_out >= OPL3_ENVELOPE_SILENT)
+    {
+        slot->out = OPL3_EnvelopeCalcSign(phase, slot->reg_wf);
+    }
+    else
+    {
+        slot->out = OPL3_EnvelopeCalcWave(phase, slot->eg_out, slot->reg_wf);
+    }
+}
+
+static void OPL3_SlotCalcFB(opl3_slot *slot)
+{
+    if (slot->channel->fb != 0x00)
+    {
+        slot->fbmod = (slot->prout + slot->out) >> (0x09 - slot->channel->fb);
+    }
+    else
+    {
+        slot->fbmod = 0;
+    }
+    slot->prout = slot->out;
+}
+
+// A slot is idle once its envelope has fully released with the key off;
+// only a key-on can bring it back.
+static Bit8u OPL3_SlotIsIdle(const opl3_slot *slot)
+{
+    return !slot->key && slot->eg_gen == envelope_gen_num_release
+        && slot->eg_rout == 0x1ff;
 }
 
 //
 // Channel
 //
 
-static void OPL3_ChannelSetupAlg(opl3_channel *channel);
+static void OPL3_ChannelSetupAlg(opl3_channel *channel);
+
+static void OPL3_ChannelUpdateRhythm(opl3_chip *chip, Bit8u data)
+{
+    opl3_channel *channel6;
+    opl3_channel *channel7;
+    opl3_channel *channel8;
+    Bit8u chnum;
+
+    chip->rhy = data & 0x3f;
+    if (chip->rhy & 0x20)
+    {
+        channel6 = &chip->channel[6];
+        channel7 = &chip->channel[7];
+        channel8 = &chip->channel[8];
+        channel6->out[0] = &channel6->slots[1]->out;
+        channel6->out[1] = &channel6->slots[1]->out;
+        channel6->out[2] = &chip->zeromod;
+        channel6->out[3] = &chip->zeromod;
+        channel7->out[0] = &channel7->slots[0]->out;
+        channel7->out[1] = &channel7->slots[0]->out;
+        channel7->out[2] = &channel7->slots[1]->out;
+        channel7->out[3] = &channel7->slots[1]->out;
+        channel8->out[0] = &channel8->slots[0]->out;
+        channel8->out[1] = &channel8->slots[0]->out;
+        channel8->out[2] = &channel8->slots[1]->out;
+        channel8->out[3] = &channel8->slots[1]->out;
+        for (chnum = 6; chnum < 9; chnum++)
+        {
+            chip->channel[chnum].chtype = ch_drum;
+        }
+        OPL3_ChannelSetupAlg(channel6);
+        OPL3_ChannelSetupAlg(channel7);
+        OPL3_ChannelSetupAlg(channel8);
+        //hh
+        if (chip->rhy & 0x01)
+        {
+            OPL3_EnvelopeKeyOn(channel7->slots[0], egk_drum);
+        }
+        else
+        {
+            OPL3_EnvelopeKeyOff(channel7->slots[0], egk_drum);
+        }
+        //tc
+        if (chip->rhy & 0x02)
+        {
+            OPL3_EnvelopeKeyOn(channel8->slots[1], egk_drum);
+        }
+        else
+        {
+            OPL3_EnvelopeKeyOff(channel8->slots[1], egk_drum);
+        }
+        //tom
+        if (chip->rhy & 0x04)
+        {
+            OPL3_EnvelopeKeyOn(channel8->slots[0], egk_drum);
+        }
+        else
+        {
+            OPL3_EnvelopeKeyOff(channel8->slots[0], egk_drum);
+        }
+        //sd
+        if (chip->rhy & 0x08)
+        {
+            OPL3_EnvelopeKeyOn(channel7->slots[1], egk_drum);
+        }
+        else
+        {
+            OPL3_EnvelopeKeyOff(channel7->slots[1], egk_drum);
+        }
+        //bd
+        if (chip->rhy & 0x10)
+        {
+            OPL3_EnvelopeKeyOn(channel6->slots[0], egk_drum);
+            OPL3_EnvelopeKeyOn(channel6->slots[1], egk_drum);
+        }
+        else
+        {
+            OPL3_EnvelopeKeyOff(channel6->slots[0], egk_drum);
+            OPL3_EnvelopeKeyOff(channel6->slots[1], egk_drum);
+        }
+    }
+    else
+    {
+        for (chnum = 6; chnum < 9; chnum++)
+        {
+            chip->channel[chnum].chtype = ch_2op;
+            OPL3_ChannelSetupAlg(&chip->channel[chnum]);
+            OPL3_EnvelopeKeyOff(chip->channel[chnum].slots[0], egk_drum);
+            OPL3_EnvelopeKeyOff(chip->channel[chnum].slots[1], egk_drum);
+        }
+    }
+}
+
+static void OPL3_ChannelWriteA0(opl3_channel *channel, Bit8u data)
+{
+    if (channel->chip->newm && channel->chtype == ch_4op2)
+    {
+        return;
+    }
+    channel->f_num = (channel->f_num & 0x300) | data;
+    channel->ksv = (channel->block << 1)
+                 | ((channel->f_num >> (0x09 - channel->chip->nts)) & 0x01);
+    OPL3_EnvelopeUpdateKSL(channel->slots[0]);
+    OPL3_EnvelopeUpdateKSL(channel->slots[1]);
+    if (channel->chip->newm && channel->chtype == ch_4op)
+    {
+        channel->pair->f_num = channel->f_num;
+        channel->pair->ksv = channel->ksv;
+        OPL3_EnvelopeUpdateKSL(channel->pair->slots[0]);
+        OPL3_EnvelopeUpdateKSL(channel->pair->slots[1]);
+    }
+}
+
+static void OPL3_ChannelWriteB0(opl3_channel *channel, Bit8u data)
+{
+    if (channel->chip->newm && channel->chtype == ch_4op2)
+    {
+        return;
+    }
+    channel->f_num = (channel->f_num & 0xff) | ((data & 0x03) << 8);
+    channel->block = (data >> 2) & 0x07;
+    channel->ksv = (channel->block << 1)
+                 | ((channel->f_num >> (0x09 - channel->chip->nts)) & 0x01);
+    OPL3_EnvelopeUpdateKSL(channel->slots[0]);
+    OPL3_EnvelopeUpdateKSL(channel->slots[1]);
+    if (channel->chip->newm && channel->chtype == ch_4op)
+    {
+        channel->pair->f_num = channel->f_num;
+        channel->pair->block = channel->block;
+        channel->pair->ksv = channel->ksv;
+        OPL3_EnvelopeUpdateKSL(channel->pair->slots[0]);
+        OPL3_EnvelopeUpdateKSL(channel->pair->slots[1]);
+    }
+}
+
+static void OPL3_ChannelSetupAlg(opl3_channel *channel)
+{
+    if (channel->chtype == ch_drum)
+    {
+        if (channel->ch_num == 7 || channel->ch_num == 8)
+        {
+            channel->slots[0]->mod = &channel->chip->zeromod;
+            channel->slots[1]->mod = &channel->chip->zeromod;
+            return;
+        }
+        switch (channel->alg & 0x01)
+        {
+        case 0x00:
+            channel->slots[0]->mod = &channel->slots[0]->fbmod;
+            channel->slots[1]->mod = &channel->slots[0]->out;
+            break;
+        case 0x01:
+            channel->slots[0]->mod = &channel->slots[0]->fbmod;
+            channel->slots[1]->mod = &channel->chip->zeromod;
+            break;
+        }
+        return;
+    }
+    if (channel->alg & 0x08)
+    {
+        return;
+    }
+    if (channel->alg & 0x04)
+    {
+        channel->pair->out[0] = &channel->chip->zeromod;
+        channel->pair->out[1] = &channel->chip->zeromod;
+        channel->pair->out[2] = &channel->chip->zeromod;
+        channel->pair->out[3] = &channel->chip->zeromod;
+        switch (channel->alg & 0x03)
+        {
+        case 0x00:
+            channel->pair->slots[0]->mod = &channel->pair->slots[0]->fbmod;
+            channel->pair->slots[1]->mod = &channel->pair->slots[0]->out;
+            channel->slots[0]->mod = &channel->pair->slots[1]->out;
+            channel->slots[1]->mod = &channel->slots[0]->out;
+            channel->out[0] = &channel->slots[1]->out;
+            channel->out[1] = &channel->chip->zeromod;
+            channel->out[2] = &channel->chip->zeromod;
+            channel->out[3] = &channel->chip->zeromod;
+            break;
+        case 0x01:
+            channel->pair->slots[0]->mod = &channel->pair->slots[0]->fbmod;
+            channel->pair->slots[1]->mod = &channel->pair->slots[0]->out;
+            channel->slots[0]->mod = &channel->chip->zeromod;
+            channel->slots[1]->mod = &channel->slots[0]->out;
+            channel->out[0] = &channel->pair->slots[1]->out;
+            channel->out[1] = &channel->slots[1]->out;
+            channel->out[2] = &channel->chip->zeromod;
+            channel->out[3] = &channel->chip->zeromod;
+            break;
+        case 0x02:
+            channel->pair->slots[0]->mod = &channel->pair->slots[0]->fbmod;
+            channel->pair->slots[1]->mod = &channel->chip->zeromod;
+            channel->slots[0]->mod = &channel->pair->slots[1]->out;
+            channel->slots[1]->mod = &channel->slots[0]->out;
+            channel->out[0] = &channel->pair->slots[0]->out;
+            channel->out[1] = &channel->slots[1]->out;
+            channel->out[2] = &channel->chip->zeromod;
+            channel->out[3] = &channel->chip->zeromod;
+            break;
+        case 0x03:
+            channel->pair->slots[0]->mod = &channel->pair->slots[0]->fbmod;
+            channel->pair->slots[1]->mod = &channel->chip->zeromod;
+            channel->slots[0]->mod = &channel->pair->slots[1]->out;
+            channel->slots[1]->mod = &channel->chip->zeromod;
+            channel->out[0] = &channel->pair->slots[0]->out;
+            channel->out[1] = &channel->slots[0]->out;
+            channel->out[2] = &channel->slots[1]->out;
+            channel->out[3] = &channel->chip->zeromod;
+            break;
+        }
+    }
+    else
+    {
+        switch (channel->alg & 0x01)
+        {
+        case 0x00:
+            channel->slots[0]->mod = &channel->slots[0]->fbmod;
+            channel->slots[1]->mod = &channel->slots[0]->out;
+            channel->out[0] = &channel->slots[1]->out;
+            channel->out[1] = &channel->chip->zeromod;
+            channel->out[2] = &channel->chip->zeromod;
+            channel->out[3] = &channel->chip->zeromod;
+            break;
+        case 0x01:
+            channel->slots[0]->mod = &channel->slots[0]->fbmod;
+            channel->slots[1]->mod = &channel->chip->zeromod;
+            channel->out[0] = &channel->slots[0]->out;
+            channel->out[1] = &channel->slots[1]->out;
+            channel->out[2] = &channel->chip->zeromod;
+            channel->out[3] = &channel->chip->zeromod;
+            break;
+        }
+    }
+}
+
+static void OPL3_ChannelWriteC0(opl3_channel *channel, Bit8u data)
+{
+    channel->fb = (data & 0x0e) >> 1;
+    channel->con = data & 0x01;
+    channel->alg = channel->con;
+    if (channel->chip->newm)
+    {
+        if (channel->chtype == ch_4op)
+        {
+            channel->pair->alg = 0x04 | (channel->con << 1) | (channel->pair->con);
+            channel->alg = 0x08;
+            OPL3_ChannelSetupAlg(channel->pair);
+        }
+        else if (channel->chtype == ch_4op2)
+        {
+            channel->alg = 0x04 | (channel->pair->con << 1) | (channel->con);
+            channel->pair->alg = 0x08;
+            OPL3_ChannelSetupAlg(channel);
+        }
+        else
+        {
+            OPL3_ChannelSetupAlg(channel);
+        }
+    }
+    else
+    {
+        OPL3_ChannelSetupAlg(channel);
+    }
+    if (channel->chip->newm)
+    {
+        channel->cha = ((data >> 4) & 0x01) ? ~0 : 0;
+        channel->chb = ((data >> 5) & 0x01) ? ~0 : 0;
+    }
+    else
+    {
+        channel->cha = channel->chb = (Bit16u)~0;
+    }
+}
+
+static void OPL3_ChannelKeyOn(opl3_channel *channel)
+{
+    if (channel->chip->newm)
+    {
+        if (channel->chtype == ch_4op)
+        {
+            OPL3_EnvelopeKeyOn(channel->slots[0], egk_norm);
+            OPL3_EnvelopeKeyOn(channel->slots[1], egk_norm);
+            OPL3_EnvelopeKeyOn(channel->pair->slots[0], egk_norm);
+            OPL3_EnvelopeKeyOn(channel->pair->slots[1], egk_norm);
+        }
+        else if (channel->chtype == ch_2op || channel->chtype == ch_drum)
+        {
+            OPL3_EnvelopeKeyOn(channel->slots[0], egk_norm);
+            OPL3_EnvelopeKeyOn(channel->slots[1], egk_norm);
+        }
+    }
+    else
+    {
+        OPL3_EnvelopeKeyOn(channel->slots[0], egk_norm);
+        OPL3_EnvelopeKeyOn(channel->slots[1], egk_norm);
+    }
+}
 
-static void OPL3_ChannelUpdateRhythm(opl3_chip *chip, Bit8u data)
+static void OPL3_ChannelKeyOff(opl3_channel *channel)
 {
-    opl3_channel *channel6;
-    opl3_channel *channel7;
-    opl3_channel *channel8;
-    Bit8u chnum;
+    if (channel->chip->newm)
+    {
+        if (channel->chtype == ch_4op)
+        {
+            OPL3_EnvelopeKeyOff(channel->slots[0], egk_norm);
+            OPL3_EnvelopeKeyOff(channel->slots[1], egk_norm);
+            OPL3_EnvelopeKeyOff(channel->pair->slots[0], egk_norm);
+            OPL3_EnvelopeKeyOff(channel->pair->slots[1], egk_norm);
+        }
+        else if (channel->chtype == ch_2op || channel->chtype == ch_drum)
+        {
+            OPL3_EnvelopeKeyOff(channel->slots[0], egk_norm);
+            OPL3_EnvelopeKeyOff(channel->slots[1], egk_norm);
+        }
+    }
+    else
+    {
+        OPL3_EnvelopeKeyOff(channel->slots[0], egk_norm);
+        OPL3_EnvelopeKeyOff(channel->slots[1], egk_norm);
+    }
+}
 
-    chip->rhy = data & 0x3f;
-    if (chip->rhy & 0x20)
+static void OPL3_ChannelSet4Op(opl3_chip *chip, Bit8u data)
+{
+    Bit8u bit;
+    Bit8u chnum;
+    for (bit = 0; bit < 6; bit++)
     {
-        channel6 = &chip->channel[6];
-        channel7 = &chip->channel[7];
-        channel8 = &chip->channel[8];
-        channel6->out[0] = &channel6->slots[1]->out;
-        channel6->out[1] = &channel6->slots[1]->out;
-        channel6->out[2] = &chip->zeromod;
-        channel6->out[3] = &chip->zeromod;
-        channel7->out[0] = &channel7->slots[0]->out;
-        channel7->out[1] = &channel7->slots[0]->out;
-        channel7->out[2] = &channel7->slots[1]->out;
-        channel7->out[3] = &channel7->slots[1]->out;
-        channel8->out[0] = &channel8->slots[0]->out;
-        channel8->out[1] = &channel8->slots[0]->out;
-        channel8->out[2] = &channel8->slots[1]->out;
-        channel8->out[3] = &channel8->slots[1]->out;
-        for (chnum = 6; chnum < 9; chnum++)
+        chnum = bit;
+        if (bit >= 3)
         {
-            chip->channel[chnum].chtype = ch_drum;
+            chnum += 9 - 3;
         }
-        OPL3_ChannelSetupAlg(channel6);
-        OPL3_ChannelSetupAlg(channel7);
-        OPL3_ChannelSetupAlg(channel8);
-        //hh
-        if (chip->rhy & 0x01)
+        if ((data >> bit) & 0x01)
         {
-            OPL3_EnvelopeKeyOn(channel7->slots[0], egk_drum);
+            chip->channel[chnum].chtype = ch_4op;
+            chip->channel[chnum + 3].chtype = ch_4op2;
         }
         else
         {
-            OPL3_EnvelopeKeyOff(channel7->slots[0], egk_drum);
+            chip->channel[chnum].chtype = ch_2op;
+            chip->channel[chnum + 3].chtype = ch_2op;
         }
-        //tc
-        if (chip->rhy & 0x02)
+    }
+}
+
+static Bit16s OPL3_ClipSample(Bit32s sample)
+{
+    if (sample > 32767)
+    {
+        sample = 32767;
+    }
+    else if (sample < -32768)
+    {
+        sample = -32768;
+    }
+    return (Bit16s)sample;
+}
+
+//
+// Sample generation
+//
+// The per-slot stages and the mixer are kept as inline helpers so that
+// OPL3_GenerateBlock renders a whole block without per-slot or
+// per-sample function calls. Slot and mix ordering within a sample is
+// unchanged, so output is identical to the reference path.
+//
+// With melodic set (the Doom profile) the slots run without the rhythm
+// and noise work of the phase generator, and the mixer sums only the two
+// outputs a 2-op channel can drive.
+//
+
+static inline void OPL3_ProcessSlots(opl3_chip *chip, Bit8u first, Bit8u last,
+                                     Bit8u melodic)
+{
+    opl3_slot *slot = &chip->slot[first];
+    opl3_slot *end = &chip->slot[last];
+
+    for (; slot < end; slot++)
+    {
+        OPL3_SlotCalcFB(slot);
+        if (OPL3_SlotIsIdle(slot))
         {
-            OPL3_EnvelopeKeyOn(channel8->slots[1], egk_drum);
+            // The phase keeps running: the sign it produces is still
+            // audible, including on the sample that keys the slot on.
+            OPL3_EnvelopeCalcIdle(slot);
+            if (melodic)
+            {
+                OPL3_PhaseGenerateMelodic(slot);
+            }
+            else
+            {
+                OPL3_PhaseGenerate(slot);
+            }
+            slot->out = OPL3_EnvelopeCalcSign(slot->pg_phase_out + *slot->mod,
+                                              slot->reg_wf);
         }
         else
         {
-            OPL3_EnvelopeKeyOff(channel8->slots[1], egk_drum);
+            OPL3_EnvelopeCalc(slot);
+            if (melodic)
+            {
+                OPL3_PhaseGenerateMelodic(slot);
+            }
+            else
+            {
+                OPL3_PhaseGenerate(slot);
+            }
+            OPL3_SlotGenerate(slot);
         }
-        //tom
-        if (chip->rhy & 0x04)
+    }
+}
+
+static inline Bit32s OPL3_MixChannels(opl3_chip *chip, Bit8u right, Bit8u melodic)
+{
+    opl3_channel *channel = chip->channel;
+    Bit32s mix = 0;
+    Bit16s accm;
+    Bit8u ii;
+
+    for (ii = 0; ii < 18; ii++, channel++)
+    {
+        accm = *channel->out[0] + *channel->out[1];
+        if (!melodic)
         {
-            OPL3_EnvelopeKeyOn(channel8->slots[0], egk_drum);
+            accm += *channel->out[2] + *channel->out[3];
         }
-        else
+        mix += (Bit16s)(accm & (right ? channel->chb : channel->cha));
+    }
+    return mix;
+}
+
+static inline void OPL3_UpdateTimers(opl3_chip *chip)
+{
+    Bit8u shift = 0;
+
+    if ((chip->timer & 0x3f) == 0x3f)
+    {
+        chip->tremolopos = (chip->tremolopos + 1) % 210;
+    }
+    if (chip->tremolopos < 105)
+    {
+        chip->tremolo = chip->tremolopos >> chip->tremoloshift;
+    }
+    else
+    {
+        chip->tremolo = (210 - chip->tremolopos) >> chip->tremoloshift;
+    }
+
+    if ((chip->timer & 0x3ff) == 0x3ff)
+    {
+        chip->vibpos = (chip->vibpos + 1) & 7;
+    }
+
+    chip->timer++;
+
+    chip->eg_add = 0;
+    if (chip->eg_timer)
+    {
+        while (shift < 36 && ((chip->eg_timer >> shift) & 1) == 0)
         {
-            OPL3_EnvelopeKeyOff(channel8->slots[0], egk_drum);
+            shift++;
         }
-        //sd
-        if (chip->rhy & 0x08)
+        if (shift > 12)
         {
-            OPL3_EnvelopeKeyOn(channel7->slots[1], egk_drum);
+            chip->eg_add = 0;
         }
         else
         {
-            OPL3_EnvelopeKeyOff(channel7->slots[1], egk_drum);
+            chip->eg_add = shift + 1;
         }
-        //bd
-        if (chip->rhy & 0x10)
+    }
+
+    if (chip->eg_timerrem || chip->eg_state)
+    {
+        if (chip->eg_timer == 0xfffffffff)
         {
-            OPL3_EnvelopeKeyOn(channel6->slots[0], egk_drum);
-            OPL3_EnvelopeKeyOn(channel6->slots[1], egk_drum);
+            chip->eg_timer = 0;
+            chip->eg_timerrem = 1;
         }
         else
         {
-            OPL3_EnvelopeKeyOff(channel6->slots[0], egk_drum);
-            OPL3_EnvelopeKeyOff(channel6->slots[1], egk_drum);
+            chip->eg_timer++;
+            chip->eg_timerrem = 0;
         }
     }
-    else
+
+    chip->eg_state ^= 1;
+}
+
+static inline void OPL3_ProcessWriteBuf(opl3_chip *chip)
+{
+    while (chip->writebuf[chip->writebuf_cur].time <= chip->writebuf_samplecnt)
     {
-        for (chnum = 6; chnum < 9; chnum++)
+        if (!(chip->writebuf[chip->writebuf_cur].reg & 0x200))
         {
-            chip->channel[chnum].chtype = ch_2op;
-            OPL3_ChannelSetupAlg(&chip->channel[chnum]);
-            OPL3_EnvelopeKeyOff(chip->channel[chnum].slots[0], egk_drum);
-            OPL3_EnvelopeKeyOff(chip->channel[chnum].slots[1], egk_drum);
+            break;
         }
+        chip->writebuf[chip->writebuf_cur].reg &= 0x1ff;
+        OPL3_WriteReg(chip, chip->writebuf[chip->writebuf_cur].reg,
+                      chip->writebuf[chip->writebuf_cur].data);
+        chip->writebuf_cur = (chip->writebuf_cur + 1) % OPL_WRITEBUF_SIZE;
     }
+    chip->writebuf_samplecnt++;
 }
 
-static void OPL3_ChannelWriteA0(opl3_channel *channel, Bit8u data)
+// The noise LFSR steps once per slot; advance it by the given number of
+// slots (a multiple of nine), nine steps at a time using the
+// x^23 + x^14 + 1 recurrence.
+static inline Bit32u OPL3_NoiseAdvance(Bit32u noise, Bit8u slots)
 {
-    if (channel->chip->newm && channel->chtype == ch_4op2)
+    Bit8u step;
+
+    for (step = 0; step < slots / 9; step++)
     {
-        return;
+        noise = (noise >> 9) | (((noise ^ (noise >> 14)) & 0x1ff) << 14);
     }
-    channel->f_num = (channel->f_num & 0x300) | data;
-    channel->ksv = (channel->block << 1)
-                 | ((channel->f_num >> (0x09 - channel->chip->nts)) & 0x01);
-    OPL3_EnvelopeUpdateKSL(channel->slots[0]);
-    OPL3_EnvelopeUpdateKSL(channel->slots[1]);
-    if (channel->chip->newm && channel->chtype == ch_4op)
-    {
-        channel->pair->f_num = channel->f_num;
-        channel->pair->ksv = channel->ksv;
-        OPL3_EnvelopeUpdateKSL(channel->pair->slots[0]);
-        OPL3_EnvelopeUpdateKSL(channel->pair->slots[1]);
+    return noise;
+}
+
+static inline void OPL3_GenerateSampleCore(opl3_chip *chip, Bit16s *buf, Bit8u melodic)
+{
+    buf[1] = OPL3_ClipSample(chip->mixbuff[1]);
+
+    OPL3_ProcessSlots(chip, 0, 15, melodic);
+    chip->mixbuff[0] = OPL3_MixChannels(chip, 0, melodic);
+    OPL3_ProcessSlots(chip, 15, 18, melodic);
+
+    buf[0] = OPL3_ClipSample(chip->mixbuff[0]);
+
+    OPL3_ProcessSlots(chip, 18, 33, melodic);
+    chip->mixbuff[1] = OPL3_MixChannels(chip, 1, melodic);
+    OPL3_ProcessSlots(chip, 33, 36, melodic);
+
+    if (melodic)
+    {
+        OPL3_PhaseLatchHiHat(chip);
+        chip->noise = OPL3_NoiseAdvance(chip->noise, 36);
     }
+
+    OPL3_UpdateTimers(chip);
+    OPL3_ProcessWriteBuf(chip);
 }
 
-static void OPL3_ChannelWriteB0(opl3_channel *channel, Bit8u data)
+static inline void OPL3_GenerateSample(opl3_chip *chip, Bit16s *buf)
 {
-    if (channel->chip->newm && channel->chtype == ch_4op2)
+    if (chip->doomprofile)
     {
-        return;
+        OPL3_GenerateSampleCore(chip, buf, 1);
     }
-    channel->f_num = (channel->f_num & 0xff) | ((data & 0x03) << 8);
-    channel->block = (data >> 2) & 0x07;
-    channel->ksv = (channel->block << 1)
-                 | ((channel->f_num >> (0x09 - channel->chip->nts)) & 0x01);
-    OPL3_EnvelopeUpdateKSL(channel->slots[0]);
-    OPL3_EnvelopeUpdateKSL(channel->slots[1]);
-    if (channel->chip->newm && channel->chtype == ch_4op)
+    else
     {
-        channel->pair->f_num = channel->f_num;
-        channel->pair->block = channel->block;
-        channel->pair->ksv = channel->ksv;
-        OPL3_EnvelopeUpdateKSL(channel->pair->slots[0]);
-        OPL3_EnvelopeUpdateKSL(channel->pair->slots[1]);
+        OPL3_GenerateSampleCore(chip, buf, 0);
     }
 }
 
-static void OPL3_ChannelSetupAlg(opl3_channel *channel)
+void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
 {
-    if (channel->chtype == ch_drum)
+    OPL3_GenerateSample(chip, buf);
+}
+
+//
+// Structure-of-arrays slot engine
+//
+// Register state cannot change inside a block, so everything derived from
+// registers (envelope rates per stage, KSL/TL offsets, phase increments for
+// each vibrato position) is computed once per block. The per-sample
+// envelope and phase update then becomes a branch-free loop over flat
+// arrays that the compiler auto-vectorizes. The "SSE2" and "AVX2" kernels
+// below are that same plain C loop compiled for those targets, not
+// hand-written intrinsics; the widest one the CPU supports is picked once
+// at runtime. Waveform generation and
+// mixing still run in slot order, since modulators feed carriers within
+// the same sample.
+//
+// Rhythm mode and pending buffered writes are not handled here; blocks
+// that need them go through the reference path.
+//
+
+#define OPL3_SOA_LANES      40      // 36 slots padded to a multiple of 8
+#define OPL3_SOA_SIG_FBMOD  36
+#define OPL3_SOA_SIG_ZERO   72
+#define OPL3_SOA_MIN_BLOCK  32
+
+typedef struct {
+    // Per-sample state
+    Bit32s eg_rout[OPL3_SOA_LANES];
+    Bit32s eg_gen[OPL3_SOA_LANES];
+    Bit32s eg_out[OPL3_SOA_LANES];
+    Bit32s pg_reset[OPL3_SOA_LANES];
+    Bit32u pg_phase[OPL3_SOA_LANES];
+    Bit32s pg_phase_out[OPL3_SOA_LANES];
+    // Register-derived, constant for the block
+    Bit32s key[OPL3_SOA_LANES];
+    Bit32s eg_base[OPL3_SOA_LANES];
+    Bit32s trem[OPL3_SOA_LANES];
+    Bit32s reg_sl[OPL3_SOA_LANES];
+    Bit32s rate_hi[4][OPL3_SOA_LANES];
+    Bit32s rate_lo[4][OPL3_SOA_LANES];
+    Bit32s nonzero[4][OPL3_SOA_LANES];
+    Bit32u pg_inc[8][OPL3_SOA_LANES];
+    // Waveform/mix stage: slot outputs and feedback live in one signal
+    // array so modulation and channel outputs are plain indices into it.
+    Bit16s sig[OPL3_SOA_SIG_ZERO + 1];
+    Bit16s prout[36];
+    Bit8u fbshift[36];
+    Bit8u reg_wf[36];
+    Bit8u mod[36];
+    Bit8u ch_out[18][4];
+    Bit16u cha[18];
+    Bit16u chb[18];
+} opl3_soa;
+
+typedef struct {
+    Bit32s eg_add;
+    Bit32s eg_state;
+    Bit32s tremolo;
+    Bit32s incstep[4];
+    Bit32u vibpos;
+} opl3_soa_tick;
+
+static Bit8u OPL3_SoASignalIndex(opl3_chip *chip, const Bit16s *ptr)
+{
+    Bit8u i;
+
+    for (i = 0; i < 36; i++)
     {
-        if (channel->ch_num == 7 || channel->ch_num == 8)
+        if (ptr == &chip->slot[i].out)
         {
-            channel->slots[0]->mod = &channel->chip->zeromod;
-            channel->slots[1]->mod = &channel->chip->zeromod;
-            return;
+            return i;
         }
-        switch (channel->alg & 0x01)
+        if (ptr == &chip->slot[i].fbmod)
         {
-        case 0x00:
-            channel->slots[0]->mod = &channel->slots[0]->fbmod;
-            channel->slots[1]->mod = &channel->slots[0]->out;
-            break;
-        case 0x01:
-            channel->slots[0]->mod = &channel->slots[0]->fbmod;
-            channel->slots[1]->mod = &channel->chip->zeromod;
-            break;
+            return OPL3_SOA_SIG_FBMOD + i;
         }
-        return;
-    }
-    if (channel->alg & 0x08)
-    {
-        return;
     }
-    if (channel->alg & 0x04)
-    {
-        channel->pair->out[0] = &channel->chip->zeromod;
-        channel->pair->out[1] = &channel->chip->zeromod;
-        channel->pair->out[2] = &channel->chip->zeromod;
-        channel->pair->out[3] = &channel->chip->zeromod;
-        switch (channel->alg & 0x03)
+    return OPL3_SOA_SIG_ZERO;
+}
+
+static void OPL3_SoALoad(opl3_chip *chip, opl3_soa *soa)
+{
+    Bit8u i, j, state;
+
+    memset(soa, 0, sizeof(*soa));
+
+    for (i = 0; i < 36; i++)
+    {
+        opl3_slot *slot = &chip->slot[i];
+        opl3_channel *channel = slot->channel;
+        Bit8u ks = channel->ksv >> ((slot->reg_ksr ^ 1) << 1);
+        Bit8u reg_rate[4];
+
+        soa->eg_rout[i] = slot->eg_rout;
+        soa->eg_gen[i] = slot->eg_gen;
+        soa->pg_phase[i] = slot->pg_phase;
+        soa->key[i] = slot->key != 0;
+        soa->eg_base[i] = (slot->reg_tl << 2)
+                        + (slot->eg_ksl >> kslshift[slot->reg_ksl]);
+        soa->trem[i] = slot->trem == &chip->tremolo ? -1 : 0;
+        soa->reg_sl[i] = slot->reg_sl;
+
+        // Stage rates; index 0 also covers the key-on reset from release
+        reg_rate[envelope_gen_num_attack] = slot->reg_ar;
+        reg_rate[envelope_gen_num_decay] = slot->reg_dr;
+        reg_rate[envelope_gen_num_sustain] = slot->reg_type ? 0 : slot->reg_rr;
+        reg_rate[envelope_gen_num_release] = slot->reg_rr;
+        for (state = 0; state < 4; state++)
         {
-        case 0x00:
-            channel->pair->slots[0]->mod = &channel->pair->slots[0]->fbmod;
-            channel->pair->slots[1]->mod = &channel->pair->slots[0]->out;
-            channel->slots[0]->mod = &channel->pair->slots[1]->out;
-            channel->slots[1]->mod = &channel->slots[0]->out;
-            channel->out[0] = &channel->slots[1]->out;
-            channel->out[1] = &channel->chip->zeromod;
-            channel->out[2] = &channel->chip->zeromod;
-            channel->out[3] = &channel->chip->zeromod;
-            break;
-        case 0x01:
-            channel->pair->slots[0]->mod = &channel->pair->slots[0]->fbmod;
-            channel->pair->slots[1]->mod = &channel->pair->slots[0]->out;
-            channel->slots[0]->mod = &channel->chip->zeromod;
-            channel->slots[1]->mod = &channel->slots[0]->out;
-            channel->out[0] = &channel->pair->slots[1]->out;
-            channel->out[1] = &channel->slots[1]->out;
-            channel->out[2] = &channel->chip->zeromod;
-            channel->out[3] = &channel->chip->zeromod;
-            break;
-        case 0x02:
-            channel->pair->slots[0]->mod = &channel->pair->slots[0]->fbmod;
-            channel->pair->slots[1]->mod = &channel->chip->zeromod;
-            channel->slots[0]->mod = &channel->pair->slots[1]->out;
-            channel->slots[1]->mod = &channel->slots[0]->out;
-            channel->out[0] = &channel->pair->slots[0]->out;
-            channel->out[1] = &channel->slots[1]->out;
-            channel->out[2] = &channel->chip->zeromod;
-            channel->out[3] = &channel->chip->zeromod;
-            break;
-        case 0x03:
-            channel->pair->slots[0]->mod = &channel->pair->slots[0]->fbmod;
-            channel->pair->slots[1]->mod = &channel->chip->zeromod;
-            channel->slots[0]->mod = &channel->pair->slots[1]->out;
-            channel->slots[1]->mod = &channel->chip->zeromod;
-            channel->out[0] = &channel->pair->slots[0]->out;
-            channel->out[1] = &channel->slots[0]->out;
-            channel->out[2] = &channel->slots[1]->out;
-            channel->out[3] = &channel->chip->zeromod;
-            break;
+            Bit8u rate = ks + (reg_rate[state] << 2);
+            Bit8u rate_hi = rate >> 2;
+            if (rate_hi & 0x10)
+            {
+                rate_hi = 0x0f;
+            }
+            soa->rate_hi[state][i] = rate_hi;
+            soa->rate_lo[state][i] = rate & 0x03;
+            soa->nonzero[state][i] = reg_rate[state] != 0;
+        }
+
+        // Phase increment for every vibrato position
+        for (j = 0; j < 8; j++)
+        {
+            Bit16u f_num = channel->f_num;
+            Bit32u basefreq;
+            if (slot->reg_vib)
+            {
+                Bit8s range = (f_num >> 7) & 7;
+                if (!(j & 3))
+                {
+                    range = 0;
+                }
+                else if (j & 1)
+                {
+                    range >>= 1;
+                }
+                range >>= chip->vibshift;
+                if (j & 4)
+                {
+                    range = -range;
+                }
+                f_num += range;
+            }
+            basefreq = (f_num << channel->block) >> 1;
+            soa->pg_inc[j][i] = (basefreq * mt[slot->reg_mult]) >> 1;
         }
+
+        soa->sig[i] = slot->out;
+        soa->sig[OPL3_SOA_SIG_FBMOD + i] = slot->fbmod;
+        soa->prout[i] = slot->prout;
+        soa->fbshift[i] = channel->fb ? 0x09 - channel->fb : 0;
+        soa->reg_wf[i] = slot->reg_wf;
+        soa->mod[i] = OPL3_SoASignalIndex(chip, slot->mod);
     }
-    else
+
+    // Padding lanes stay silent and keyed off
+    for (i = 36; i < OPL3_SOA_LANES; i++)
     {
-        switch (channel->alg & 0x01)
+        soa->eg_rout[i] = 0x1ff;
+        soa->eg_gen[i] = envelope_gen_num_release;
+    }
+
+    for (i = 0; i < 18; i++)
+    {
+        for (j = 0; j < 4; j++)
         {
-        case 0x00:
-            channel->slots[0]->mod = &channel->slots[0]->fbmod;
-            channel->slots[1]->mod = &channel->slots[0]->out;
-            channel->out[0] = &channel->slots[1]->out;
-            channel->out[1] = &channel->chip->zeromod;
-            channel->out[2] = &channel->chip->zeromod;
-            channel->out[3] = &channel->chip->zeromod;
-            break;
-        case 0x01:
-            channel->slots[0]->mod = &channel->slots[0]->fbmod;
-            channel->slots[1]->mod = &channel->chip->zeromod;
-            channel->out[0] = &channel->slots[0]->out;
-            channel->out[1] = &channel->slots[1]->out;
-            channel->out[2] = &channel->chip->zeromod;
-            channel->out[3] = &channel->chip->zeromod;
-            break;
+            soa->ch_out[i][j] = OPL3_SoASignalIndex(chip, chip->channel[i].out[j]);
         }
+        soa->cha[i] = chip->channel[i].cha;
+        soa->chb[i] = chip->channel[i].chb;
     }
 }
 
-static void OPL3_ChannelWriteC0(opl3_channel *channel, Bit8u data)
+static void OPL3_SoAStore(opl3_chip *chip, const opl3_soa *soa)
 {
-    channel->fb = (data & 0x0e) >> 1;
-    channel->con = data & 0x01;
-    channel->alg = channel->con;
-    if (channel->chip->newm)
+    Bit8u i;
+
+    for (i = 0; i < 36; i++)
     {
-        if (channel->chtype == ch_4op)
-        {
-            channel->pair->alg = 0x04 | (channel->con << 1) | (channel->pair->con);
-            channel->alg = 0x08;
-            OPL3_ChannelSetupAlg(channel->pair);
-        }
-        else if (channel->chtype == ch_4op2)
-        {
-            channel->alg = 0x04 | (channel->pair->con << 1) | (channel->con);
-            channel->pair->alg = 0x08;
-            OPL3_ChannelSetupAlg(channel);
-        }
-        else
-        {
-            OPL3_ChannelSetupAlg(channel);
-        }
+        opl3_slot *slot = &chip->slot[i];
+
+        slot->eg_rout = (Bit16s)soa->eg_rout[i];
+        slot->eg_gen = (Bit8u)soa->eg_gen[i];
+        slot->eg_out = (Bit16s)soa->eg_out[i];
+        slot->pg_reset = (Bit32u)soa->pg_reset[i];
+        slot->pg_phase = soa->pg_phase[i];
+        slot->pg_phase_out = (Bit16u)soa->pg_phase_out[i];
+        slot->out = soa->sig[i];
+        slot->fbmod = soa->sig[OPL3_SOA_SIG_FBMOD + i];
+        slot->prout = soa->prout[i];
     }
-    else
-    {
-        OPL3_ChannelSetupAlg(channel);
+
+    OPL3_PhaseLatchHiHat(chip);
+}
+
+// Lane mask helpers: a condition becomes all-ones or all-zeros
+#define OPL3_MASK(c)        (-(Bit32s)((c) != 0))
+#define OPL3_SEL(m, a, b)   (((m) & (a)) | (~(m) & (b)))
+
+// Envelope and phase update for all slots. This mirrors OPL3_EnvelopeCalc
+// and OPL3_PhaseGenerate, with every branch rewritten as a mask select so
+// the loop has no control flow and vectorizes at whatever width the
+// including kernel is compiled for.
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((always_inline))
+#endif
+static inline void OPL3_SoAEnvelopePhase(opl3_soa *restrict soa,
+                                         const opl3_soa_tick *restrict tick)
+{
+    const Bit32u vibpos = tick->vibpos;
+    const Bit32s eg_add = tick->eg_add;
+    const Bit32s eg_state = OPL3_MASK(tick->eg_state);
+    const Bit32s tremolo = tick->tremolo;
+    const Bit32s step0 = tick->incstep[0];
+    const Bit32s step1 = tick->incstep[1];
+    const Bit32s step2 = tick->incstep[2];
+    const Bit32s step3 = tick->incstep[3];
+    int i;
+
+    for (i = 0; i < OPL3_SOA_LANES; i++)
+    {
+        Bit32s gen = soa->eg_gen[i];
+        Bit32s rout = soa->eg_rout[i];
+        Bit32s key = OPL3_MASK(soa->key[i]);
+        Bit32s g0 = OPL3_MASK(gen == envelope_gen_num_attack);
+        Bit32s g1 = OPL3_MASK(gen == envelope_gen_num_decay);
+        Bit32s g2 = OPL3_MASK(gen == envelope_gen_num_sustain);
+        Bit32s g3 = OPL3_MASK(gen == envelope_gen_num_release);
+        Bit32s reset = key & g3;
+        Bit32s s0 = reset | g0;
+        Bit32s s1 = ~reset & g1;
+        Bit32s s2 = ~reset & g2;
+        Bit32s s3 = ~reset & g3;
+        Bit32s rate_hi, rate_lo, nonzero, eg_shift, step;
+        Bit32s shift_lo, shift_hi, shift, sh1, sh2, sh3, half;
+        Bit32s eg_off, rh15, rout_n, inc_att, inc_dec, reached, rnz;
+        Bit32s inc, gen_new;
+        Bit32u phase;
+
+        soa->eg_out[i] = rout + soa->eg_base[i] + (soa->trem[i] & tremolo);
+
+        // Rate for the current stage; a key-on reset uses the attack rate
+        rate_hi = (s0 & soa->rate_hi[0][i]) | (s1 & soa->rate_hi[1][i])
+                | (s2 & soa->rate_hi[2][i]) | (s3 & soa->rate_hi[3][i]);
+        rate_lo = (s0 & soa->rate_lo[0][i]) | (s1 & soa->rate_lo[1][i])
+                | (s2 & soa->rate_lo[2][i]) | (s3 & soa->rate_lo[3][i]);
+        nonzero = (s0 & soa->nonzero[0][i]) | (s1 & soa->nonzero[1][i])
+                | (s2 & soa->nonzero[2][i]) | (s3 & soa->nonzero[3][i]);
+
+        eg_shift = rate_hi + eg_add;
+        shift_lo = (OPL3_MASK(eg_shift == 12) & 1)
+                 | (OPL3_MASK(eg_shift == 13) & ((rate_lo >> 1) & 0x01))
+                 | (OPL3_MASK(eg_shift == 14) & (rate_lo & 0x01));
+        shift_lo &= eg_state;
+        step = (OPL3_MASK(rate_lo == 0) & step0) | (OPL3_MASK(rate_lo == 1) & step1)
+             | (OPL3_MASK(rate_lo == 2) & step2) | (OPL3_MASK(rate_lo == 3) & step3);
+        shift_hi = (rate_hi & 0x03) + step;
+        shift_hi = OPL3_SEL(OPL3_MASK(shift_hi & 0x04), 0x03, shift_hi);
+        shift_hi = OPL3_SEL(OPL3_MASK(shift_hi == 0), eg_state & 1, shift_hi);
+        shift = OPL3_SEL(OPL3_MASK(rate_hi < 12), shift_lo, shift_hi);
+        shift &= OPL3_MASK(nonzero);
+
+        sh1 = OPL3_MASK(shift == 1);
+        sh2 = OPL3_MASK(shift == 2);
+        sh3 = OPL3_MASK(shift == 3);
+        half = (sh1 & 1) | (sh2 & 2) | (sh3 & 4);
+
+        eg_off = OPL3_MASK((rout & 0x1f8) == 0x1f8);
+        rh15 = OPL3_MASK(rate_hi == 0x0f);
+        rout_n = ~(reset & rh15) & rout;
+        rout_n = OPL3_SEL(~g0 & ~reset & eg_off, 0x1ff, rout_n);
+
+        inc_att = OPL3_SEL(sh1, ~rout * 2, OPL3_SEL(sh2, ~rout * 4, ~rout * 8)) >> 4;
+        inc_att &= key & OPL3_MASK(shift) & ~rh15;
+        inc_dec = ~eg_off & ~reset & half;
+        reached = OPL3_MASK((rout >> 4) == soa->reg_sl[i]);
+        rnz = OPL3_MASK(rout);
+
+        inc = OPL3_SEL(g0, rnz & inc_att, OPL3_SEL(g1, ~reached & inc_dec, inc_dec));
+        gen_new = OPL3_SEL(g0 & ~rnz, envelope_gen_num_decay, gen);
+        gen_new = OPL3_SEL(g1 & reached, envelope_gen_num_sustain, gen_new);
+        gen_new &= ~reset;
+        gen_new = OPL3_SEL(key, gen_new, envelope_gen_num_release);
+
+        soa->eg_rout[i] = (rout_n + inc) & 0x1ff;
+        soa->eg_gen[i] = gen_new;
+        soa->pg_reset[i] = reset & 1;
+
+        phase = soa->pg_phase[i];
+        soa->pg_phase_out[i] = (Bit32s)((phase >> 9) & 0xffff);
+        soa->pg_phase[i] = (phase & (Bit32u)~reset) + soa->pg_inc[vibpos][i];
     }
-    if (channel->chip->newm)
+}
+
+typedef void (*opl3_soa_kernel)(opl3_soa *soa, const opl3_soa_tick *tick);
+
+// Each kernel is the plain C loop above; only the compile target differs
+
+static void OPL3_SoAKernelScalar(opl3_soa *soa, const opl3_soa_tick *tick)
+{
+    OPL3_SoAEnvelopePhase(soa, tick);
+}
+
+#if (defined(__GNUC__) || defined(__clang__)) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define OPL3_SOA_X86
+
+#if defined(__i386__)
+// SSE2 is already the baseline on x86-64, where the plain kernel covers it
+__attribute__((target("sse2")))
+static void OPL3_SoAKernelSSE2(opl3_soa *soa, const opl3_soa_tick *tick)
+{
+    OPL3_SoAEnvelopePhase(soa, tick);
+}
+#endif
+
+__attribute__((target("avx2")))
+static void OPL3_SoAKernelAVX2(opl3_soa *soa, const opl3_soa_tick *tick)
+{
+    OPL3_SoAEnvelopePhase(soa, tick);
+}
+#endif
+
+static opl3_soa_kernel OPL3_SoADetectKernel(void)
+{
+#ifdef OPL3_SOA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
     {
-        channel->cha = ((data >> 4) & 0x01) ? ~0 : 0;
-        channel->chb = ((data >> 5) & 0x01) ? ~0 : 0;
+        return OPL3_SoAKernelAVX2;
     }
-    else
+#if defined(__i386__)
+    if (__builtin_cpu_supports("sse2"))
     {
-        channel->cha = channel->chb = (Bit16u)~0;
+        return OPL3_SoAKernelSSE2;
     }
+#endif
+#endif
+    return OPL3_SoAKernelScalar;
 }
 
-static void OPL3_ChannelKeyOn(opl3_channel *channel)
+// CPU detection runs on the first block only. Blocks render on several
+// threads at once, so the cached kernel is accessed atomically; relaxed
+// order is enough because every thread detects the same kernel.
+static opl3_soa_kernel OPL3_SoASelectKernel(void)
 {
-    if (channel->chip->newm)
-    {
-        if (channel->chtype == ch_4op)
-        {
-            OPL3_EnvelopeKeyOn(channel->slots[0], egk_norm);
-            OPL3_EnvelopeKeyOn(channel->slots[1], egk_norm);
-            OPL3_EnvelopeKeyOn(channel->pair->slots[0], egk_norm);
-            OPL3_EnvelopeKeyOn(channel->pair->slots[1], egk_norm);
-        }
-        else if (channel->chtype == ch_2op || channel->chtype == ch_drum)
-        {
-            OPL3_EnvelopeKeyOn(channel->slots[0], egk_norm);
-            OPL3_EnvelopeKeyOn(channel->slots[1], egk_norm);
-        }
-    }
-    else
+#ifdef OPL3_SOA_X86
+    static opl3_soa_kernel kernel = NULL;
+    opl3_soa_kernel selected = __atomic_load_n(&kernel, __ATOMIC_RELAXED);
+
+    if (!selected)
     {
-        OPL3_EnvelopeKeyOn(channel->slots[0], egk_norm);
-        OPL3_EnvelopeKeyOn(channel->slots[1], egk_norm);
+        selected = OPL3_SoADetectKernel();
+        __atomic_store_n(&kernel, selected, __ATOMIC_RELAXED);
     }
+    return selected;
+#else
+    return OPL3_SoADetectKernel();
+#endif
 }
 
-static void OPL3_ChannelKeyOff(opl3_channel *channel)
+static inline void OPL3_SoAProcessSlots(opl3_soa *soa, Bit8u first, Bit8u last)
 {
-    if (channel->chip->newm)
+    Bit8u i;
+    Bit16u phase;
+
+    for (i = first; i < last; i++)
     {
-        if (channel->chtype == ch_4op)
+        Bit16s out = soa->sig[i];
+        if (soa->fbshift[i])
         {
-            OPL3_EnvelopeKeyOff(channel->slots[0], egk_norm);
-            OPL3_EnvelopeKeyOff(channel->slots[1], egk_norm);
-            OPL3_EnvelopeKeyOff(channel->pair->slots[0], egk_norm);
-            OPL3_EnvelopeKeyOff(channel->pair->slots[1], egk_norm);
+            soa->sig[OPL3_SOA_SIG_FBMOD + i] = (soa->prout[i] + out) >> soa->fbshift[i];
         }
-        else if (channel->chtype == ch_2op || channel->chtype == ch_drum)
+        else
         {
-            OPL3_EnvelopeKeyOff(channel->slots[0], egk_norm);
-            OPL3_EnvelopeKeyOff(channel->slots[1], egk_norm);
+            soa->sig[OPL3_SOA_SIG_FBMOD + i] = 0;
+        }
+        soa->prout[i] = out;
+        phase = (Bit16u)(soa->pg_phase_out[i] + soa->sig[soa->mod[i]]);
+        if (soa->eg_out[i] >= OPL3_ENVELOPE_SILENT)
+        {
+            soa->sig[i] = OPL3_EnvelopeCalcSign(phase, soa->reg_wf[i]);
+        }
+        else
+        {
+            soa->sig[i] = OPL3_EnvelopeCalcWave(phase, (Bit16u)soa->eg_out[i], soa->reg_wf[i]);
         }
     }
-    else
+}
+
+static inline Bit32s OPL3_SoAMixChannels(const opl3_soa *soa, Bit8u right)
+{
+    Bit32s mix = 0;
+    Bit16s accm;
+    Bit8u ii;
+
+    for (ii = 0; ii < 18; ii++)
     {
-        OPL3_EnvelopeKeyOff(channel->slots[0], egk_norm);
-        OPL3_EnvelopeKeyOff(channel->slots[1], egk_norm);
+        accm = soa->sig[soa->ch_out[ii][0]] + soa->sig[soa->ch_out[ii][1]]
+             + soa->sig[soa->ch_out[ii][2]] + soa->sig[soa->ch_out[ii][3]];
+        mix += (Bit16s)(accm & (right ? soa->chb[ii] : soa->cha[ii]));
     }
+    return mix;
 }
 
-static void OPL3_ChannelSet4Op(opl3_chip *chip, Bit8u data)
+static void OPL3_GenerateBlockSoA(opl3_chip *chip, Bit16s *buf, Bit32u numsamples)
 {
-    Bit8u bit;
-    Bit8u chnum;
-    for (bit = 0; bit < 6; bit++)
+    opl3_soa soa;
+    opl3_soa_tick tick;
+    opl3_soa_kernel kernel = OPL3_SoASelectKernel();
+    Bit32u i;
+    Bit8u step;
+    Bit32u noise;
+
+    OPL3_SoALoad(chip, &soa);
+    noise = chip->noise;
+
+    for (i = 0; i < numsamples; i++)
     {
-        chnum = bit;
-        if (bit >= 3)
-        {
-            chnum += 9 - 3;
-        }
-        if ((data >> bit) & 0x01)
-        {
-            chip->channel[chnum].chtype = ch_4op;
-            chip->channel[chnum + 3].chtype = ch_4op2;
-        }
-        else
+        tick.eg_add = chip->eg_add;
+        tick.eg_state = chip->eg_state;
+        tick.tremolo = chip->tremolo;
+        tick.vibpos = chip->vibpos;
+        for (step = 0; step < 4; step++)
         {
-            chip->channel[chnum].chtype = ch_2op;
-            chip->channel[chnum + 3].chtype = ch_2op;
+            tick.incstep[step] = eg_incstep[step][chip->timer & 0x03];
         }
+
+        kernel(&soa, &tick);
+
+        buf[1] = OPL3_ClipSample(chip->mixbuff[1]);
+        OPL3_SoAProcessSlots(&soa, 0, 15);
+        chip->mixbuff[0] = OPL3_SoAMixChannels(&soa, 0);
+        OPL3_SoAProcessSlots(&soa, 15, 18);
+        buf[0] = OPL3_ClipSample(chip->mixbuff[0]);
+        OPL3_SoAProcessSlots(&soa, 18, 33);
+        chip->mixbuff[1] = OPL3_SoAMixChannels(&soa, 1);
+        OPL3_SoAProcessSlots(&soa, 33, 36);
+        buf += 2;
+
+        noise = OPL3_NoiseAdvance(noise, 36);
+        OPL3_UpdateTimers(chip);
     }
+
+    chip->noise = noise;
+    chip->writebuf_samplecnt += numsamples;
+    OPL3_SoAStore(chip, &soa);
 }
 
-static Bit16s OPL3_ClipSample(Bit32s sample)
+//
+// Silent chip
+//
+// With rhythm mode off, every slot idle at frequency zero, all slot
+// outputs and feedback cleared and nothing left in the mixer, each sample
+// reproduces the same all-zero state. Only the timers, LFOs, noise
+// generator and write buffer have to advance until a write changes that.
+//
+
+static Bit8u OPL3_ChipIsSilent(opl3_chip *chip, Bit8u numslots)
 {
-    if (sample > 32767)
+    opl3_slot *slot;
+    Bit8u ii;
+
+    if (chip->rhy & 0x20)
     {
-        sample = 32767;
+        return 0;
     }
-    else if (sample < -32768)
+    for (ii = 0; ii < numslots; ii++)
     {
-        sample = -32768;
+        slot = &chip->slot[ii];
+        if (!OPL3_SlotIsIdle(slot) || slot->pg_reset || slot->channel->f_num
+         || slot->out || slot->prout || slot->fbmod
+         || slot->pg_phase_out != (Bit16u)(slot->pg_phase >> 9)
+         || OPL3_EnvelopeCalcSign(slot->pg_phase_out, slot->reg_wf))
+        {
+            return 0;
+        }
     }
-    return (Bit16s)sample;
+    return 1;
 }
 
-void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
+static Bit32u OPL3_GenerateSilence(opl3_chip *chip, Bit16s *buf, Bit32u numsamples)
 {
-    Bit8u ii;
-    Bit8u jj;
-    Bit16s accm;
-    Bit8u shift = 0;
-
-    buf[1] = OPL3_ClipSample(chip->mixbuff[1]);
+    Bit32u writebuf_cur = chip->writebuf_cur;
+    Bit32u i;
 
-    for (ii = 0; ii < 15; ii++)
+    for (i = 0; i < numsamples && chip->writebuf_cur == writebuf_cur; i++)
     {
-        OPL3_SlotCalcFB(&chip->slot[ii]);
-        OPL3_EnvelopeCalc(&chip->slot[ii]);
-        OPL3_PhaseGenerate(&chip->slot[ii]);
-        OPL3_SlotGenerate(&chip->slot[ii]);
+        buf[0] = 0;
+        buf[1] = 0;
+        buf += 2;
+        chip->noise = OPL3_NoiseAdvance(chip->noise, 36);
+        OPL3_UpdateTimers(chip);
+        OPL3_ProcessWriteBuf(chip);
     }
+    return i;
+}
 
-    chip->mixbuff[0] = 0;
-    for (ii = 0; ii < 18; ii++)
+void OPL3_GenerateBlock(opl3_chip *chip, Bit16s *buf, Bit32u numsamples)
+{
+    Bit32u i;
+
+    if (!chip->mixbuff[0] && !chip->mixbuff[1] && OPL3_ChipIsSilent(chip, 36))
     {
-        accm = 0;
-        for (jj = 0; jj < 4; jj++)
-        {
-            accm += *chip->channel[ii].out[jj];
-        }
-        chip->mixbuff[0] += (Bit16s)(accm & chip->channel[ii].cha);
+        i = OPL3_GenerateSilence(chip, buf, numsamples);
+        buf += 2 * i;
+        numsamples -= i;
     }
 
-    for (ii = 15; ii < 18; ii++)
+    if (numsamples >= OPL3_SOA_MIN_BLOCK && !(chip->rhy & 0x20)
+     && !(chip->writebuf[chip->writebuf_cur].reg & 0x200))
     {
-        OPL3_SlotCalcFB(&chip->slot[ii]);
-        OPL3_EnvelopeCalc(&chip->slot[ii]);
-        OPL3_PhaseGenerate(&chip->slot[ii]);
-        OPL3_SlotGenerate(&chip->slot[ii]);
+        OPL3_GenerateBlockSoA(chip, buf, numsamples);
+        return;
     }
 
-    buf[0] = OPL3_ClipSample(chip->mixbuff[0]);
-
-    for (ii = 18; ii < 33; ii++)
+    for (i = 0; i < numsamples; i++)
     {
-        OPL3_SlotCalcFB(&chip->slot[ii]);
-        OPL3_EnvelopeCalc(&chip->slot[ii]);
-        OPL3_PhaseGenerate(&chip->slot[ii]);
-        OPL3_SlotGenerate(&chip->slot[ii]);
+        OPL3_GenerateSample(chip, buf);
+        buf += 2;
     }
+}
 
-    chip->mixbuff[1] = 0;
-    for (ii = 0; ii < 18; ii++)
+//
+// OPL2 generator
+//
+// Renders only the first register bank as a nine-channel OPL2: the second
+// bank and 4-op channels are never evaluated, and the nine channels are
+// summed into one mono mix written to both outputs. Each channel enters
+// the mix through its right-side pan mask (always open while the OPL3
+// extensions are off) and the mix is latched like the right channel of
+// OPL3_Generate, so while the second bank is silent, output equals that
+// channel exactly. The left output of OPL3_Generate is not reproduced: it
+// skews channels 6-8 by one sample and follows the left pan bits. The
+// noise generator still advances by all 36 slots so the chip state stays
+// interchangeable with the full generator.
+//
+
+static inline Bit32s OPL3_MixChannelsOPL2(opl3_chip *chip, Bit8u melodic)
+{
+    opl3_channel *channel = chip->channel;
+    Bit32s mix = 0;
+    Bit16s accm;
+    Bit8u ii;
+
+    for (ii = 0; ii < 9; ii++, channel++)
     {
-        accm = 0;
-        for (jj = 0; jj < 4; jj++)
+        accm = *channel->out[0] + *channel->out[1];
+        if (!melodic)
         {
-            accm += *chip->channel[ii].out[jj];
+            accm += *channel->out[2] + *channel->out[3];
         }
-        chip->mixbuff[1] += (Bit16s)(accm & chip->channel[ii].chb);
+        mix += (Bit16s)(accm & channel->chb);
     }
+    return mix;
+}
 
-    for (ii = 33; ii < 36; ii++)
-    {
-        OPL3_SlotCalcFB(&chip->slot[ii]);
-        OPL3_EnvelopeCalc(&chip->slot[ii]);
-        OPL3_PhaseGenerate(&chip->slot[ii]);
-        OPL3_SlotGenerate(&chip->slot[ii]);
-    }
+static inline void OPL3_GenerateSampleOPL2Core(opl3_chip *chip, Bit16s *buf, Bit8u melodic)
+{
+    buf[0] = buf[1] = OPL3_ClipSample(chip->mixbuff[1]);
 
-    if ((chip->timer & 0x3f) == 0x3f)
+    OPL3_ProcessSlots(chip, 0, 18, melodic);
+    chip->mixbuff[0] = chip->mixbuff[1] = OPL3_MixChannelsOPL2(chip, melodic);
+    if (melodic)
     {
-        chip->tremolopos = (chip->tremolopos + 1) % 210;
+        OPL3_PhaseLatchHiHat(chip);
     }
-    if (chip->tremolopos < 105)
+    chip->noise = OPL3_NoiseAdvance(chip->noise, melodic ? 36 : 18);
+
+    OPL3_UpdateTimers(chip);
+    OPL3_ProcessWriteBuf(chip);
+}
+
+static inline void OPL3_GenerateSampleOPL2(opl3_chip *chip, Bit16s *buf)
+{
+    if (chip->doomprofile)
     {
-        chip->tremolo = chip->tremolopos >> chip->tremoloshift;
+        OPL3_GenerateSampleOPL2Core(chip, buf, 1);
     }
     else
     {
-        chip->tremolo = (210 - chip->tremolopos) >> chip->tremoloshift;
-    }
-
-    if ((chip->timer & 0x3ff) == 0x3ff)
-    {
-        chip->vibpos = (chip->vibpos + 1) & 7;
+        OPL3_GenerateSampleOPL2Core(chip, buf, 0);
     }
+}
 
-    chip->timer++;
+void OPL3_GenerateOPL2(opl3_chip *chip, Bit16s *buf)
+{
+    OPL3_GenerateSampleOPL2(chip, buf);
+}
 
-    chip->eg_add = 0;
-    if (chip->eg_timer)
-    {
-        while (shift < 36 && ((chip->eg_timer >> shift) & 1) == 0)
-        {
-            shift++;
-        }
-        if (shift > 12)
-        {
-            chip->eg_add = 0;
-        }
-        else
-        {
-            chip->eg_add = shift + 1;
-        }
-    }
+void OPL3_GenerateBlockOPL2(opl3_chip *chip, Bit16s *buf, Bit32u numsamples)
+{
+    Bit32u i;
 
-    if (chip->eg_timerrem || chip->eg_state)
+    if (!chip->mixbuff[1] && OPL3_ChipIsSilent(chip, 18))
     {
-        if (chip->eg_timer == 0xfffffffff)
-        {
-            chip->eg_timer = 0;
-            chip->eg_timerrem = 1;
-        }
-        else
-        {
-            chip->eg_timer++;
-            chip->eg_timerrem = 0;
-        }
+        i = OPL3_GenerateSilence(chip, buf, numsamples);
+        buf += 2 * i;
+        numsamples -= i;
     }
 
-    chip->eg_state ^= 1;
-
-    while (chip->writebuf[chip->writebuf_cur].time <= chip->writebuf_samplecnt)
+    for (i = 0; i < numsamples; i++)
     {
-        if (!(chip->writebuf[chip->writebuf_cur].reg & 0x200))
-        {
-            break;
-        }
-        chip->writebuf[chip->writebuf_cur].reg &= 0x1ff;
-        OPL3_WriteReg(chip, chip->writebuf[chip->writebuf_cur].reg,
-                      chip->writebuf[chip->writebuf_cur].data);
-        chip->writebuf_cur = (chip->writebuf_cur + 1) % OPL_WRITEBUF_SIZE;
+        OPL3_GenerateSampleOPL2(chip, buf);
+        buf += 2;
     }
-    chip->writebuf_samplecnt++;
 }
 
 void OPL3_GenerateResampled(opl3_chip *chip, Bit16s *buf)
@@ -1238,6 +2268,533 @@ void OPL3_Reset(opl3_chip *chip, Bit32u samplerate)
     chip->vibshift = 1;
 }
 
+// Select the Doom profile core: 2-op melodic channels only, as driven by
+// the DMX player. It is only enabled while rhythm mode is off and no 4-op
+// pair is set up; writing either afterwards falls back to the full core.
+void OPL3_SetDoomProfile(opl3_chip *chip, Bit8u enable)
+{
+    Bit8u channum;
+
+    chip->doomprofile = 0;
+    if (!enable || (chip->rhy & 0x20))
+    {
+        return;
+    }
+    for (channum = 0; channum < 18; channum++)
+    {
+        if (chip->channel[channum].chtype != ch_2op)
+        {
+            return;
+        }
+    }
+    chip->doomprofile = 1;
+}
+
+// Seeking support: advance a 2-op channel's envelopes and phases from
+// one register write to the next without clocking the chip, then move the
+// timers, LFOs and noise generator to the target time. The result is the
+// state a rendered chip would have, except for the slot outputs: those of
+// carriers follow within two samples of rendering, but a modulator
+// feeding back on itself carries its output history along, so it is only
+// exact when rendered sample by sample.
+
+// Samples rendered at the end of an idle feedback span
+#define OPL3_FEEDBACK_TAIL 32
+
+// Noise generator state 36 * time LFSR steps after a reset. The nine-step
+// update of OPL3_NoiseAdvance is linear, so it is raised to the power
+// 4 * time as a matrix over GF(2), held as the images of the 23 bits.
+static Bit32u OPL3_NoiseAt(Bit64u time)
+{
+    Bit32u step[23], acc[23], tmp[23];
+    Bit64u count = time * 4;
+    Bit8u i, j;
+
+    for (i = 0; i < 23; i++)
+    {
+        step[i] = OPL3_NoiseAdvance((Bit32u)1 << i, 9);
+        acc[i] = (Bit32u)1 << i;
+    }
+    while (count)
+    {
+        if (count & 1)
+        {
+            for (i = 0; i < 23; i++)
+            {
+                tmp[i] = 0;
+                for (j = 0; j < 23; j++)
+                {
+                    if ((acc[i] >> j) & 1)
+                    {
+                        tmp[i] ^= step[j];
+                    }
+                }
+            }
+            memcpy(acc, tmp, sizeof(acc));
+        }
+        for (i = 0; i < 23; i++)
+        {
+            tmp[i] = 0;
+            for (j = 0; j < 23; j++)
+            {
+                if ((step[i] >> j) & 1)
+                {
+                    tmp[i] ^= step[j];
+                }
+            }
+        }
+        memcpy(step, tmp, sizeof(step));
+        count >>= 1;
+    }
+    // The reset state is bit 0 alone
+    return acc[0];
+}
+
+// Timers and LFOs as rendering leaves them `time` samples after a reset
+static void OPL3_SetTimers(opl3_chip *chip, Bit64u time)
+{
+    Bit64u ticks = time >> 6;
+
+    chip->timer = (Bit16u)time;
+    chip->eg_timer = time >> 1;
+    chip->eg_timerrem = 0;
+    chip->eg_state = time & 0x01;
+    chip->eg_add = OPL3_EnvelopeAddAt(time);
+    chip->tremolopos = ticks % 210;
+    if (chip->tremolopos < 105)
+    {
+        chip->tremolo = chip->tremolopos >> chip->tremoloshift;
+    }
+    else
+    {
+        chip->tremolo = (210 - chip->tremolopos) >> chip->tremoloshift;
+    }
+    chip->vibpos = (time >> 10) & 7;
+}
+
+void OPL3_SetTime(opl3_chip *chip, Bit64u time)
+{
+    OPL3_SetTimers(chip, time);
+    chip->noise = OPL3_NoiseAt(time);
+    chip->writebuf_samplecnt = time;
+}
+
+// Render one slot alone over samples [from, to), as OPL3_ProcessSlots
+// does, on the chip's timers. Returns the first sample (at least from + 2)
+// of two in a row whose output did not depend on the feedback going in,
+// or `to` if there was none.
+static Bit64u OPL3_SlotClock(opl3_slot *slot, Bit64u from, Bit64u to)
+{
+    opl3_chip *chip = slot->chip;
+    Bit64u time, pinned = to;
+    Bit8u fixed = 0;
+    Bit16u phase;
+
+    OPL3_SetTimers(chip, from);
+    for (time = from; time < to; time++)
+    {
+        OPL3_SlotCalcFB(slot);
+        if (OPL3_SlotIsIdle(slot))
+        {
+            OPL3_EnvelopeCalcIdle(slot);
+            OPL3_PhaseGenerateMelodic(slot);
+            phase = slot->pg_phase_out;
+            slot->out = OPL3_EnvelopeCalcSign(phase + *slot->mod, slot->reg_wf);
+            // Once the outputs going back in are signs, the feedback is 0
+            // or -1, and at most phases either gives the same sign
+            if (time >= from + 2 && pinned == to
+             && OPL3_EnvelopeCalcSign(phase, slot->reg_wf)
+                == OPL3_EnvelopeCalcSign(phase - 1, slot->reg_wf))
+            {
+                if (fixed)
+                {
+                    pinned = time - 1;
+                }
+                fixed = 1;
+            }
+            else
+            {
+                fixed = 0;
+            }
+        }
+        else
+        {
+            OPL3_EnvelopeCalc(slot);
+            OPL3_PhaseGenerateMelodic(slot);
+            OPL3_SlotGenerate(slot);
+            fixed = 0;
+        }
+        OPL3_UpdateTimers(chip);
+    }
+    return pinned;
+}
+
+// A modulator feeding back on itself depends on its whole output history,
+// so it is rendered rather than skipped while it sounds. Once idle, its
+// output is a sign that forgets the history within a few samples, so only
+// the end of an idle span is rendered.
+static void OPL3_FeedbackSkip(opl3_slot *slot, Bit64u from, Bit64u to)
+{
+    opl3_slot saved = *slot;
+    Bit64u tail = from;
+
+    if (OPL3_SlotIsIdle(slot) && to - from > OPL3_FEEDBACK_TAIL)
+    {
+        tail = to - OPL3_FEEDBACK_TAIL;
+        slot->pg_phase += OPL3_PhaseSkip(slot, from, tail);
+        if (OPL3_SlotClock(slot, tail, to) < to)
+        {
+            return;
+        }
+        // The sign sat on a phase edge throughout
+        *slot = saved;
+    }
+    OPL3_SlotClock(slot, from, to);
+}
+
+void OPL3_ChannelSkip(opl3_chip *chip, Bit8u channum, Bit64u from, Bit64u to,
+                      Bit8u feedback)
+{
+    opl3_channel *channel;
+    opl3_slot *slot;
+    Bit8u i;
+
+    if (channum >= 18 || to <= from)
+    {
+        return;
+    }
+    channel = &chip->channel[channum];
+    for (i = 0; i < 2; i++)
+    {
+        slot = channel->slots[i];
+        if (feedback && channel->fb && slot->mod == &slot->fbmod)
+        {
+            OPL3_FeedbackSkip(slot, from, to);
+            continue;
+        }
+        // The phase restarts with the attack
+        if (slot->key && slot->eg_gen == envelope_gen_num_release)
+        {
+            slot->pg_phase = 0;
+        }
+        slot->pg_phase += OPL3_PhaseSkip(slot, from, to);
+        OPL3_EnvelopeSkip(slot, from, to);
+    }
+}
+
+// Move a pointer into src to the same place in dst
+#define OPL3_RELOCATE(type, ptr) \
+    ((ptr) = (type)((Bit8u *)dst + ((const Bit8u *)(ptr) - (const Bit8u *)src)))
+
+void OPL3_Copy(opl3_chip *dst, const opl3_chip *src)
+{
+    Bit8u i;
+
+    memcpy(dst, src, sizeof(opl3_chip));
+    for (i = 0; i < 36; i++)
+    {
+        OPL3_RELOCATE(opl3_channel *, dst->slot[i].channel);
+        OPL3_RELOCATE(opl3_chip *, dst->slot[i].chip);
+        OPL3_RELOCATE(Bit16s *, dst->slot[i].mod);
+        OPL3_RELOCATE(Bit8u *, dst->slot[i].trem);
+    }
+    for (i = 0; i < 18; i++)
+    {
+        OPL3_RELOCATE(opl3_slot *, dst->channel[i].slots[0]);
+        OPL3_RELOCATE(opl3_slot *, dst->channel[i].slots[1]);
+        OPL3_RELOCATE(opl3_chip *, dst->channel[i].chip);
+        OPL3_RELOCATE(Bit16s *, dst->channel[i].out[0]);
+        OPL3_RELOCATE(Bit16s *, dst->channel[i].out[1]);
+        OPL3_RELOCATE(Bit16s *, dst->channel[i].out[2]);
+        OPL3_RELOCATE(Bit16s *, dst->channel[i].out[3]);
+        if (dst->channel[i].pair)
+        {
+            OPL3_RELOCATE(opl3_channel *, dst->channel[i].pair);
+        }
+    }
+}
+
+#undef OPL3_RELOCATE
+
+// State snapshots store the links that registers change as small codes:
+// 0 for the zero input, 1 + n for slot n's output, 37 + n for its feedback
+#define OPL3_LINK_CODES (1 + 2 * 36)
+
+static Bit8u OPL3_LinkCode(const opl3_chip *chip, const Bit16s *ptr)
+{
+    Bit8u i;
+
+    for (i = 0; i < 36; i++)
+    {
+        if (ptr == &chip->slot[i].out)
+        {
+            return 1 + i;
+        }
+        if (ptr == &chip->slot[i].fbmod)
+        {
+            return 37 + i;
+        }
+    }
+    return 0;
+}
+
+static Bit16s *OPL3_LinkAt(opl3_chip *chip, Bit8u code)
+{
+    if (code == 0)
+    {
+        return &chip->zeromod;
+    }
+    if (code < 37)
+    {
+        return &chip->slot[code - 1].out;
+    }
+    return &chip->slot[code - 37].fbmod;
+}
+
+void OPL3_SaveState(const opl3_chip *chip, state_writer_t *w)
+{
+    const opl3_slot *slot;
+    const opl3_channel *channel;
+    Bit32u i, pending;
+    Bit8u k;
+
+    for (i = 0; i < 36; i++)
+    {
+        slot = &chip->slot[i];
+        state_put_u16(w, slot->out);
+        state_put_u16(w, slot->fbmod);
+        state_put_u8(w, OPL3_LinkCode(chip, slot->mod));
+        state_put_u16(w, slot->prout);
+        state_put_u16(w, slot->eg_rout);
+        state_put_u16(w, slot->eg_out);
+        state_put_u8(w, slot->eg_inc);
+        state_put_u8(w, slot->eg_gen);
+        state_put_u8(w, slot->eg_rate);
+        state_put_u8(w, slot->eg_ksl);
+        state_put_u8(w, slot->trem == &chip->tremolo);
+        state_put_u8(w, slot->reg_vib);
+        state_put_u8(w, slot->reg_type);
+        state_put_u8(w, slot->reg_ksr);
+        state_put_u8(w, slot->reg_mult);
+        state_put_u8(w, slot->reg_ksl);
+        state_put_u8(w, slot->reg_tl);
+        state_put_u8(w, slot->reg_ar);
+        state_put_u8(w, slot->reg_dr);
+        state_put_u8(w, slot->reg_sl);
+        state_put_u8(w, slot->reg_rr);
+        state_put_u8(w, slot->reg_wf);
+        state_put_u8(w, slot->key);
+        state_put_u32(w, slot->pg_reset);
+        state_put_u32(w, slot->pg_phase);
+        state_put_u16(w, slot->pg_phase_out);
+    }
+    for (i = 0; i < 18; i++)
+    {
+        channel = &chip->channel[i];
+        for (k = 0; k < 4; k++)
+        {
+            state_put_u8(w, OPL3_LinkCode(chip, channel->out[k]));
+        }
+        state_put_u8(w, channel->chtype);
+        state_put_u16(w, channel->f_num);
+        state_put_u8(w, channel->block);
+        state_put_u8(w, channel->fb);
+        state_put_u8(w, channel->con);
+        state_put_u8(w, channel->alg);
+        state_put_u8(w, channel->ksv);
+        state_put_u16(w, channel->cha);
+        state_put_u16(w, channel->chb);
+    }
+    state_put_u16(w, chip->timer);
+    state_put_u64(w, chip->eg_timer);
+    state_put_u8(w, chip->eg_timerrem);
+    state_put_u8(w, chip->eg_state);
+    state_put_u8(w, chip->eg_add);
+    state_put_u8(w, chip->newm);
+    state_put_u8(w, chip->nts);
+    state_put_u8(w, chip->rhy);
+    state_put_u8(w, chip->vibpos);
+    state_put_u8(w, chip->vibshift);
+    state_put_u8(w, chip->tremolo);
+    state_put_u8(w, chip->tremolopos);
+    state_put_u8(w, chip->tremoloshift);
+    state_put_u32(w, chip->noise);
+    state_put_u32(w, chip->mixbuff[0]);
+    state_put_u32(w, chip->mixbuff[1]);
+    state_put_u8(w, chip->rm_hh_bit2);
+    state_put_u8(w, chip->rm_hh_bit3);
+    state_put_u8(w, chip->rm_hh_bit7);
+    state_put_u8(w, chip->rm_hh_bit8);
+    state_put_u8(w, chip->rm_tc_bit3);
+    state_put_u8(w, chip->rm_tc_bit5);
+    state_put_u8(w, chip->doomprofile);
+    state_put_u32(w, chip->rateratio);
+    state_put_u32(w, chip->samplecnt);
+    state_put_u16(w, chip->oldsamples[0]);
+    state_put_u16(w, chip->oldsamples[1]);
+    state_put_u16(w, chip->samples[0]);
+    state_put_u16(w, chip->samples[1]);
+
+    // Only writes still waiting in the buffer affect rendering
+    state_put_u64(w, chip->writebuf_samplecnt);
+    state_put_u16(w, chip->writebuf_cur);
+    state_put_u16(w, chip->writebuf_last);
+    state_put_u64(w, chip->writebuf_lasttime);
+    pending = 0;
+    for (i = 0; i < OPL_WRITEBUF_SIZE; i++)
+    {
+        pending += (chip->writebuf[i].reg & 0x200) != 0;
+    }
+    state_put_u16(w, pending);
+    for (i = 0; i < OPL_WRITEBUF_SIZE; i++)
+    {
+        if (chip->writebuf[i].reg & 0x200)
+        {
+            state_put_u16(w, i);
+            state_put_u64(w, chip->writebuf[i].time);
+            state_put_u16(w, chip->writebuf[i].reg);
+            state_put_u8(w, chip->writebuf[i].data);
+        }
+    }
+}
+
+int OPL3_LoadState(opl3_chip *chip, state_reader_t *r)
+{
+    opl3_slot *slot;
+    opl3_channel *channel;
+    Bit32u i, pending, index;
+    Bit8u k, code;
+
+    for (i = 0; i < 36; i++)
+    {
+        slot = &chip->slot[i];
+        slot->out = state_get_s16(r);
+        slot->fbmod = state_get_s16(r);
+        code = state_get_u8(r);
+        if (code >= OPL3_LINK_CODES)
+        {
+            return -1;
+        }
+        slot->mod = OPL3_LinkAt(chip, code);
+        slot->prout = state_get_s16(r);
+        slot->eg_rout = state_get_s16(r);
+        slot->eg_out = state_get_s16(r);
+        slot->eg_inc = state_get_u8(r);
+        slot->eg_gen = state_get_u8(r);
+        slot->eg_rate = state_get_u8(r);
+        slot->eg_ksl = state_get_u8(r);
+        slot->trem = state_get_u8(r) ? &chip->tremolo : (Bit8u*)&chip->zeromod;
+        slot->reg_vib = state_get_u8(r);
+        slot->reg_type = state_get_u8(r);
+        slot->reg_ksr = state_get_u8(r);
+        slot->reg_mult = state_get_u8(r);
+        slot->reg_ksl = state_get_u8(r);
+        slot->reg_tl = state_get_u8(r);
+        slot->reg_ar = state_get_u8(r);
+        slot->reg_dr = state_get_u8(r);
+        slot->reg_sl = state_get_u8(r);
+        slot->reg_rr = state_get_u8(r);
+        slot->reg_wf = state_get_u8(r);
+        slot->key = state_get_u8(r);
+        slot->pg_reset = state_get_u32(r);
+        slot->pg_phase = state_get_u32(r);
+        slot->pg_phase_out = state_get_u16(r);
+        // Fields used as table indices, in the ranges registers give them
+        if (slot->eg_gen > envelope_gen_num_release || slot->reg_mult > 15
+         || slot->reg_ksl > 3 || slot->reg_ksr > 1 || slot->reg_tl > 63
+         || slot->reg_ar > 15 || slot->reg_dr > 15 || slot->reg_sl > 31
+         || slot->reg_rr > 15 || slot->reg_wf > 7)
+        {
+            return -1;
+        }
+    }
+    for (i = 0; i < 18; i++)
+    {
+        channel = &chip->channel[i];
+        for (k = 0; k < 4; k++)
+        {
+            code = state_get_u8(r);
+            if (code >= OPL3_LINK_CODES)
+            {
+                return -1;
+            }
+            channel->out[k] = OPL3_LinkAt(chip, code);
+        }
+        channel->chtype = state_get_u8(r);
+        channel->f_num = state_get_u16(r);
+        channel->block = state_get_u8(r);
+        channel->fb = state_get_u8(r);
+        channel->con = state_get_u8(r);
+        channel->alg = state_get_u8(r);
+        channel->ksv = state_get_u8(r);
+        channel->cha = state_get_u16(r);
+        channel->chb = state_get_u16(r);
+        if (channel->f_num > 0x3ff || channel->block > 7 || channel->fb > 7
+         || channel->ksv > 15)
+        {
+            return -1;
+        }
+    }
+    chip->timer = state_get_u16(r);
+    chip->eg_timer = state_get_u64(r);
+    chip->eg_timerrem = state_get_u8(r);
+    chip->eg_state = state_get_u8(r);
+    chip->eg_add = state_get_u8(r);
+    chip->newm = state_get_u8(r);
+    chip->nts = state_get_u8(r);
+    chip->rhy = state_get_u8(r);
+    chip->vibpos = state_get_u8(r);
+    chip->vibshift = state_get_u8(r);
+    chip->tremolo = state_get_u8(r);
+    chip->tremolopos = state_get_u8(r);
+    chip->tremoloshift = state_get_u8(r);
+    chip->noise = state_get_u32(r);
+    chip->mixbuff[0] = state_get_s32(r);
+    chip->mixbuff[1] = state_get_s32(r);
+    chip->rm_hh_bit2 = state_get_u8(r);
+    chip->rm_hh_bit3 = state_get_u8(r);
+    chip->rm_hh_bit7 = state_get_u8(r);
+    chip->rm_hh_bit8 = state_get_u8(r);
+    chip->rm_tc_bit3 = state_get_u8(r);
+    chip->rm_tc_bit5 = state_get_u8(r);
+    chip->doomprofile = state_get_u8(r);
+    chip->rateratio = state_get_s32(r);
+    chip->samplecnt = state_get_s32(r);
+    chip->oldsamples[0] = state_get_s16(r);
+    chip->oldsamples[1] = state_get_s16(r);
+    chip->samples[0] = state_get_s16(r);
+    chip->samples[1] = state_get_s16(r);
+    if (chip->vibpos > 7 || chip->tremolopos >= 210
+     || chip->vibshift > 1
+     || (chip->tremoloshift != 2 && chip->tremoloshift != 4))
+    {
+        return -1;
+    }
+
+    chip->writebuf_samplecnt = state_get_u64(r);
+    chip->writebuf_cur = state_get_u16(r);
+    chip->writebuf_last = state_get_u16(r);
+    chip->writebuf_lasttime = state_get_u64(r);
+    if (chip->writebuf_cur >= OPL_WRITEBUF_SIZE || chip->writebuf_last >= OPL_WRITEBUF_SIZE)
+    {
+        return -1;
+    }
+    memset(chip->writebuf, 0, sizeof(chip->writebuf));
+    pending = state_get_u16(r);
+    for (i = 0; i < pending && !r->error; i++)
+    {
+        index = state_get_u16(r);
+        if (index >= OPL_WRITEBUF_SIZE)
+        {
+            return -1;
+        }
+        chip->writebuf[index].time = state_get_u64(r);
+        chip->writebuf[index].reg = state_get_u16(r) | 0x200;
+        chip->writebuf[index].data = state_get_u8(r);
+    }
+    return r->error ? -1 : 0;
+}
+
 void OPL3_WriteReg(opl3_chip *chip, Bit16u reg, Bit8u v)
 {
     Bit8u high = (reg >> 8) & 0x01;
@@ -1250,6 +2807,10 @@ void OPL3_WriteReg(opl3_chip *chip, Bit16u reg, Bit8u v)
             switch (regm & 0x0f)
             {
             case 0x04:
+                if (v & 0x3f)
+                {
+                    chip->doomprofile = 0;
+                }
                 OPL3_ChannelSet4Op(chip, v);
                 break;
             case 0x05:
@@ -1313,6 +2874,10 @@ void OPL3_WriteReg(opl3_chip *chip, Bit16u reg, Bit8u v)
         {
             chip->tremoloshift = (((v >> 7) ^ 1) << 1) + 2;
             chip->vibshift = ((v >> 6) & 0x01) ^ 1;
+            if (v & 0x20)
+            {
+                chip->doomprofile = 0;
+            }
             OPL3_ChannelUpdateRhythm(chip, v);
         }
         else if ((regm & 0x0f) < 9)
@@ -33,6 +33,7 @@
 
 // Use types from internal/types.h to avoid redefinition
 #include "internal/types.h"
+#include "state.h"
 
 #define OPL_WRITEBUF_SIZE   1024
 #define OPL_WRITEBUF_DELAY  2
@@ -120,6 +121,7 @@ struct _opl3_chip {
     Bit8u rm_hh_bit8;
     Bit8u rm_tc_bit3;
     Bit8u rm_tc_bit5;
+    Bit8u doomprofile;
     //OPL3L
     Bit32s rateratio;
     Bit32s samplecnt;
@@ -134,9 +136,32 @@ struct _opl3_chip {
 };
 
 void OPL3_Generate(opl3_chip *chip, Bit16s *buf);
+void OPL3_GenerateBlock(opl3_chip *chip, Bit16s *buf, Bit32u numsamples);
+// First bank only, mixed to mono: both outputs carry what OPL3_Generate
+// writes to the right output while the second bank is silent
+void OPL3_GenerateOPL2(opl3_chip *chip, Bit16s *buf);
+void OPL3_GenerateBlockOPL2(opl3_chip *chip, Bit16s *buf, Bit32u numsamples);
 void OPL3_GenerateResampled(opl3_chip *chip, Bit16s *buf);
 void OPL3_Reset(opl3_chip *chip, Bit32u samplerate);
 void OPL3_WriteReg(opl3_chip *chip, Bit16u reg, Bit8u v);
 void OPL3_WriteRegBuffered(opl3_chip *chip, Bit16u reg, Bit8u v);
+void OPL3_SetDoomProfile(opl3_chip *chip, Bit8u enable);
+// Move the timers, LFOs and noise generator of a freshly reset chip to
+// `time` samples after the reset, as if it had been rendered that long
+void OPL3_SetTime(opl3_chip *chip, Bit64u time);
+// Advance a channel's envelopes and phases over samples [from, to) after a
+// reset without rendering, exactly as rendering would. With `feedback` set
+// a modulator feeding back on itself is rendered instead, so its output
+// history matches too; this runs on the chip's timers, so call
+// OPL3_SetTime after the last skip.
+void OPL3_ChannelSkip(opl3_chip *chip, Bit8u channum, Bit64u from, Bit64u to,
+                      Bit8u feedback);
+// Copy a chip's state into another chip structure
+void OPL3_Copy(opl3_chip *dst, const opl3_chip *src);
+// Write the chip's state to a snapshot, or read it back into a chip that
+// has been reset; links between slots and channels are stored as indices.
+// Loading returns -1 on invalid data, with the chip partly loaded.
+void OPL3_SaveState(const opl3_chip *chip, state_writer_t *w);
+int OPL3_LoadState(opl3_chip *chip, state_reader_t *r);
 void OPL3_GenerateStream(opl3_chip *chip, Bit16s *sndptr, Bit32u numsamples);
 #endif
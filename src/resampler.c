@@ -0,0 +1,500 @@
+/**
+ * OPL Resampler - Converts native OPL output to the output sample rate
+ *
+ * The OPL3 runs at 49716 Hz. The resampler works on blocks of native
+ * samples: opl_resampler_input_frames() tells how many native frames a
+ * span of output frames needs, and opl_resampler_process() converts them.
+ *
+ * Three quality levels are available:
+ *  - linear: two-tap interpolation with the exact arithmetic of
+ *    OPL3_GenerateResampled, so output is unchanged from earlier releases
+ *  - sinc: polyphase windowed-sinc lowpass with its stopband at the lower
+ *    of the two Nyquist frequencies, for alias-free output
+ *  - halfband: a half-band lowpass that decimates the native stream by 2,
+ *    followed by linear interpolation; cheap, but rolls off above ~12 kHz
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "resampler.h"
+#include "shared.h"
+
+// Linear interpolation fraction bits (as RSM_FRAC in opl3.c)
+#define RSM_FRAC 10
+
+// Polyphase sinc filter size
+#define SINC_TAPS 64
+#define SINC_PHASE_BITS 8
+#define SINC_PHASES (1 << SINC_PHASE_BITS)
+
+// Half-band filter size (odd, centre tap at HALFBAND_TAPS / 2). Every
+// other tap away from the centre is zero, leaving HALFBAND_PAIRS
+// symmetric pairs of nonzero taps.
+#define HALFBAND_TAPS 23
+#define HALFBAND_PAIRS ((HALFBAND_TAPS + 1) / 4)
+
+// Native frames rendered per chunk by opl_resampler_render
+#define RENDER_CHUNK 1024
+
+#define FRAC_ONE ((uint64_t)1 << 32)
+
+// Native frames per linear-stage input frame
+#define HALFBAND_STRIDE(rs) ((rs)->quality == opl_resampler_halfband ? 2 : 1)
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+struct opl_resampler_s {
+    opl_resampler_quality_t quality;
+    int sample_rate;
+
+    // Linear stage (also used after the half-band filter, where its input
+    // runs at half the native rate)
+    int32_t rateratio;
+    int32_t samplecnt;
+    int16_t oldsamples[2];
+    int16_t samples[2];
+
+    // Sinc stage: 32.32 position of the next output frame in native frames
+    uint64_t frac;
+    uint64_t step;
+    float* coefs;                        // (SINC_PHASES + 1) rows of SINC_TAPS, shared by clones
+    float history[2][2 * SINC_TAPS];     // Mirrored so a window is contiguous
+    int history_pos;
+
+    // Half-band stage: folded coefficients, nearest pair first
+    float hb_centre;
+    float hb_coefs[HALFBAND_PAIRS];
+    float hb_history[2][2 * HALFBAND_TAPS];
+    int hb_pos;
+
+    // Native scratch buffer for opl_resampler_render
+    int16_t* scratch;
+    size_t scratch_frames;
+    size_t chunk_frames;
+};
+
+static double window_blackman(double x) {
+    // x in [-1, 1]
+    return 0.42 + 0.5 * cos(M_PI * x) + 0.08 * cos(2.0 * M_PI * x);
+}
+
+static double sinc(double x) {
+    if (x == 0.0) return 1.0;
+    return sin(M_PI * x) / (M_PI * x);
+}
+
+static int16_t clip_sample(float value) {
+    if (value >= 32767.0f) return 32767;
+    if (value <= -32768.0f) return -32768;
+    return (int16_t)(value < 0.0f ? value - 0.5f : value + 0.5f);
+}
+
+static int init_sinc(opl_resampler_t* rs) {
+    double ratio = (double)rs->sample_rate / OPL_NATIVE_RATE;
+    double nyquist = ratio < 1.0 ? 0.5 * ratio : 0.5;
+    // Blackman transition width, in cycles per native sample
+    double transition = 5.5 / SINC_TAPS;
+    double cutoff = nyquist - transition / 2.0;
+    int phase, tap;
+
+    rs->coefs = (float*)shared_alloc((SINC_PHASES + 1) * SINC_TAPS * sizeof(float));
+    if (!rs->coefs) return -1;
+
+    if (cutoff < transition / 2.0) {
+        cutoff = transition / 2.0;
+    }
+
+    // Row p holds the taps for an output position p / SINC_PHASES past the
+    // centre of the history window; each row is normalized to unity gain.
+    for (phase = 0; phase <= SINC_PHASES; phase++) {
+        float* row = &rs->coefs[phase * SINC_TAPS];
+        double sum = 0.0;
+
+        for (tap = 0; tap < SINC_TAPS; tap++) {
+            double x = (tap - (SINC_TAPS / 2 - 1)) - (double)phase / SINC_PHASES;
+            double h = 2.0 * cutoff * sinc(2.0 * cutoff * x)
+                     * window_blackman(x / (SINC_TAPS / 2));
+            row[tap] = (float)h;
+            sum += h;
+        }
+        for (tap = 0; tap < SINC_TAPS; tap++) {
+            row[tap] = (float)(row[tap] / sum);
+        }
+    }
+
+    rs->step = ((uint64_t)OPL_NATIVE_RATE << 32) / (uint64_t)rs->sample_rate;
+    return 0;
+}
+
+static void init_halfband(opl_resampler_t* rs) {
+    const int centre = HALFBAND_TAPS / 2;
+    double sum = 0.5;
+    int k;
+
+    // The centre tap of a half-band filter is 0.5 and the taps at even
+    // offsets from it are zero; only the odd offsets are stored
+    for (k = 0; k < HALFBAND_PAIRS; k++) {
+        double x = 2 * k + 1;
+        double h = 0.5 * sinc(0.5 * x) * window_blackman(x / (centre + 1));
+        rs->hb_coefs[k] = (float)h;
+        sum += 2.0 * h;
+    }
+    rs->hb_centre = (float)(0.5 / sum);
+    for (k = 0; k < HALFBAND_PAIRS; k++) {
+        rs->hb_coefs[k] = (float)(rs->hb_coefs[k] / sum);
+    }
+}
+
+// Create a resampler from the native rate to sample_rate
+opl_resampler_t* opl_resampler_create(opl_resampler_quality_t quality, int sample_rate) {
+    opl_resampler_t* rs;
+    size_t max_input;
+
+    if (sample_rate <= 0) return NULL;
+    if (quality != opl_resampler_linear && quality != opl_resampler_sinc
+     && quality != opl_resampler_halfband) {
+        return NULL;
+    }
+
+    rs = (opl_resampler_t*)calloc(1, sizeof(opl_resampler_t));
+    if (!rs) return NULL;
+
+    rs->quality = quality;
+    rs->sample_rate = sample_rate;
+    rs->rateratio = (int32_t)(((uint32_t)sample_rate << RSM_FRAC)
+                            / (OPL_NATIVE_RATE / HALFBAND_STRIDE(rs)));
+    if (rs->rateratio <= 0) {
+        free(rs);
+        return NULL;
+    }
+
+    if (quality == opl_resampler_sinc) {
+        if (init_sinc(rs) != 0) {
+            free(rs);
+            return NULL;
+        }
+    } else if (quality == opl_resampler_halfband) {
+        init_halfband(rs);
+    }
+
+    // Size chunks so that a chunk's native input always fits the scratch
+    max_input = (size_t)(OPL_NATIVE_RATE / sample_rate) + 2 * HALFBAND_STRIDE(rs);
+    rs->scratch_frames = max_input > RENDER_CHUNK ? max_input : RENDER_CHUNK;
+    rs->chunk_frames = rs->scratch_frames / max_input;
+    rs->scratch = (int16_t*)malloc(rs->scratch_frames * 2 * sizeof(int16_t));
+    if (!rs->scratch) {
+        opl_resampler_destroy(rs);
+        return NULL;
+    }
+
+    return rs;
+}
+
+// Destroy a resampler
+void opl_resampler_destroy(opl_resampler_t* rs) {
+    if (!rs) return;
+    shared_release(rs->coefs);
+    free(rs->scratch);
+    free(rs);
+}
+
+// Clear the filter history, as after opl_resampler_create
+void opl_resampler_reset(opl_resampler_t* rs) {
+    rs->samplecnt = 0;
+    memset(rs->oldsamples, 0, sizeof(rs->oldsamples));
+    memset(rs->samples, 0, sizeof(rs->samples));
+    rs->frac = 0;
+    memset(rs->history, 0, sizeof(rs->history));
+    rs->history_pos = 0;
+    memset(rs->hb_history, 0, sizeof(rs->hb_history));
+    rs->hb_pos = 0;
+}
+
+// Copy a resampler, including its position and filter history. The
+// filter coefficients are shared.
+opl_resampler_t* opl_resampler_clone(const opl_resampler_t* rs) {
+    opl_resampler_t* copy = (opl_resampler_t*)malloc(sizeof(opl_resampler_t));
+
+    if (!copy) return NULL;
+    *copy = *rs;
+    copy->scratch = (int16_t*)malloc(rs->scratch_frames * 2 * sizeof(int16_t));
+    if (!copy->scratch) {
+        free(copy);
+        return NULL;
+    }
+    copy->coefs = (float*)shared_retain(rs->coefs);
+    return copy;
+}
+
+// (a * b) >> 32 without overflowing 64 bits
+static uint64_t mul_frac(uint64_t a, uint64_t b) {
+    return a * (b >> 32) + ((a >> 32) * (b & 0xffffffff))
+         + (((a & 0xffffffff) * (b & 0xffffffff)) >> 32);
+}
+
+// Number of native frames consumed by the first `frames` output frames
+// after a reset. Output frame i takes the native frames up to
+// floor(i * ratio), so the count depends only on the last frame. The
+// half-band stage takes native frames in pairs.
+uint64_t opl_resampler_native_position(const opl_resampler_t* rs, uint64_t frames) {
+    if (frames == 0) return 0;
+    if (rs->quality == opl_resampler_sinc) {
+        return mul_frac(frames - 1, rs->step);
+    }
+    return (((frames - 1) << RSM_FRAC) / (uint64_t)rs->rateratio) * HALFBAND_STRIDE(rs);
+}
+
+// Reset, then move to where `frames` output frames from the reset would
+// leave the resampler. The filter history stays clear until enough native
+// frames have been consumed to refill it.
+void opl_resampler_set_position(opl_resampler_t* rs, uint64_t frames) {
+    uint64_t consumed = opl_resampler_native_position(rs, frames);
+
+    opl_resampler_reset(rs);
+    if (rs->quality == opl_resampler_sinc) {
+        rs->frac = frames * rs->step - (consumed << 32);
+        rs->history_pos = (int)(consumed % SINC_TAPS);
+    } else {
+        rs->samplecnt = (int32_t)((frames << RSM_FRAC)
+                                  - consumed / HALFBAND_STRIDE(rs) * (uint64_t)rs->rateratio);
+        rs->hb_pos = (int)(consumed % HALFBAND_TAPS);
+    }
+}
+
+// Write the position and filter history to a snapshot
+void opl_resampler_save_state(const opl_resampler_t* rs, state_writer_t* w) {
+    int ch, tap;
+
+    state_put_u8(w, rs->quality);
+    state_put_u32(w, rs->sample_rate);
+    state_put_u32(w, rs->samplecnt);
+    for (ch = 0; ch < 2; ch++) {
+        state_put_u16(w, rs->oldsamples[ch]);
+        state_put_u16(w, rs->samples[ch]);
+    }
+    // The histories hold native samples, mirrored
+    if (rs->quality == opl_resampler_sinc) {
+        state_put_u64(w, rs->frac);
+        state_put_u8(w, rs->history_pos);
+        for (ch = 0; ch < 2; ch++) {
+            for (tap = 0; tap < SINC_TAPS; tap++) {
+                state_put_u16(w, (int16_t)rs->history[ch][tap]);
+            }
+        }
+    } else if (rs->quality == opl_resampler_halfband) {
+        state_put_u8(w, rs->hb_pos);
+        for (ch = 0; ch < 2; ch++) {
+            for (tap = 0; tap < HALFBAND_TAPS; tap++) {
+                state_put_u16(w, (int16_t)rs->hb_history[ch][tap]);
+            }
+        }
+    }
+}
+
+// Read a snapshot written by a resampler of the same quality and rate.
+// Returns -1 without changing the resampler if it is invalid.
+int opl_resampler_load_state(opl_resampler_t* rs, state_reader_t* r) {
+    opl_resampler_t state = *rs;
+    int ch, tap;
+
+    if (state_get_u8(r) != rs->quality || state_get_u32(r) != (uint32_t)rs->sample_rate) {
+        return -1;
+    }
+    opl_resampler_reset(&state);
+    state.samplecnt = state_get_s32(r);
+    for (ch = 0; ch < 2; ch++) {
+        state.oldsamples[ch] = state_get_s16(r);
+        state.samples[ch] = state_get_s16(r);
+    }
+    // Positions stay within a step of the next input frame
+    if (state.samplecnt < 0 || state.samplecnt > state.rateratio + (1 << RSM_FRAC)) return -1;
+    if (state.quality == opl_resampler_sinc) {
+        state.frac = state_get_u64(r);
+        state.history_pos = state_get_u8(r);
+        if (state.frac > FRAC_ONE + state.step || state.history_pos >= SINC_TAPS) return -1;
+        for (ch = 0; ch < 2; ch++) {
+            for (tap = 0; tap < SINC_TAPS; tap++) {
+                state.history[ch][tap] = state.history[ch][tap + SINC_TAPS] = state_get_s16(r);
+            }
+        }
+    } else if (state.quality == opl_resampler_halfband) {
+        state.hb_pos = state_get_u8(r);
+        if (state.hb_pos >= HALFBAND_TAPS) return -1;
+        for (ch = 0; ch < 2; ch++) {
+            for (tap = 0; tap < HALFBAND_TAPS; tap++) {
+                state.hb_history[ch][tap] = state.hb_history[ch][tap + HALFBAND_TAPS] = state_get_s16(r);
+            }
+        }
+    }
+    if (r->error) return -1;
+    *rs = state;
+    return 0;
+}
+
+// Number of native frames consumed by the next `frames` output frames
+size_t opl_resampler_input_frames(const opl_resampler_t* rs, size_t frames) {
+    size_t count = 0;
+    size_t i;
+
+    if (rs->quality == opl_resampler_sinc) {
+        uint64_t frac = rs->frac;
+        for (i = 0; i < frames; i++) {
+            count += (size_t)(frac >> 32);
+            frac = (frac & (FRAC_ONE - 1)) + rs->step;
+        }
+    } else {
+        int32_t samplecnt = rs->samplecnt;
+        for (i = 0; i < frames; i++) {
+            if (samplecnt >= rs->rateratio) {
+                int32_t steps = samplecnt / rs->rateratio;
+                count += (size_t)steps * HALFBAND_STRIDE(rs);
+                samplecnt -= steps * rs->rateratio;
+            }
+            samplecnt += 1 << RSM_FRAC;
+        }
+    }
+    return count;
+}
+
+// Push two native frames through the half-band filter and return the
+// one decimated frame it produces
+static void halfband_push(opl_resampler_t* rs, const int16_t* in, int16_t* out) {
+    const int centre = HALFBAND_TAPS / 2;
+    int pos = rs->hb_pos;
+    int ch, k;
+
+    for (ch = 0; ch < 2; ch++) {
+        float* history = rs->hb_history[ch];
+        const float* window;
+        float acc;
+
+        history[pos] = history[pos + HALFBAND_TAPS] = in[ch];
+        pos = (pos + 1) % HALFBAND_TAPS;
+        history[pos] = history[pos + HALFBAND_TAPS] = in[2 + ch];
+        window = &history[pos + 1];
+        pos = rs->hb_pos;
+
+        acc = rs->hb_centre * window[centre];
+        for (k = 0; k < HALFBAND_PAIRS; k++) {
+            acc += rs->hb_coefs[k] * (window[centre - 1 - 2 * k] + window[centre + 1 + 2 * k]);
+        }
+        out[ch] = clip_sample(acc);
+    }
+    rs->hb_pos = (pos + 2) % HALFBAND_TAPS;
+}
+
+static void process_linear(opl_resampler_t* rs, const int16_t* in, int16_t* out, size_t frames) {
+    const int stride = HALFBAND_STRIDE(rs);
+    int16_t filtered[2];
+    size_t i;
+
+    for (i = 0; i < frames; i++) {
+        while (rs->samplecnt >= rs->rateratio) {
+            rs->oldsamples[0] = rs->samples[0];
+            rs->oldsamples[1] = rs->samples[1];
+            if (stride == 2) {
+                halfband_push(rs, in, filtered);
+                rs->samples[0] = filtered[0];
+                rs->samples[1] = filtered[1];
+            } else {
+                rs->samples[0] = in[0];
+                rs->samples[1] = in[1];
+            }
+            in += 2 * stride;
+            rs->samplecnt -= rs->rateratio;
+        }
+        out[0] = (int16_t)((rs->oldsamples[0] * (rs->rateratio - rs->samplecnt)
+                          + rs->samples[0] * rs->samplecnt) / rs->rateratio);
+        out[1] = (int16_t)((rs->oldsamples[1] * (rs->rateratio - rs->samplecnt)
+                          + rs->samples[1] * rs->samplecnt) / rs->rateratio);
+        out += 2;
+        rs->samplecnt += 1 << RSM_FRAC;
+    }
+}
+
+static void process_sinc(opl_resampler_t* rs, const int16_t* in, int16_t* out, size_t frames) {
+    size_t i;
+    int ch, tap;
+
+    for (i = 0; i < frames; i++) {
+        uint32_t phase;
+        float t;
+        const float* row0;
+        const float* row1;
+
+        while (rs->frac >= FRAC_ONE) {
+            int pos = rs->history_pos;
+            for (ch = 0; ch < 2; ch++) {
+                rs->history[ch][pos] = in[ch];
+                rs->history[ch][pos + SINC_TAPS] = in[ch];
+            }
+            rs->history_pos = (pos + 1) % SINC_TAPS;
+            in += 2;
+            rs->frac -= FRAC_ONE;
+        }
+
+        // Interpolate between the two nearest filter phases
+        phase = (uint32_t)(rs->frac >> (32 - SINC_PHASE_BITS));
+        t = (float)((rs->frac >> (32 - SINC_PHASE_BITS - 16)) & 0xffff) / 65536.0f;
+        row0 = &rs->coefs[phase * SINC_TAPS];
+        row1 = row0 + SINC_TAPS;
+
+        for (ch = 0; ch < 2; ch++) {
+            const float* window = &rs->history[ch][rs->history_pos];
+            float acc0 = 0.0f;
+            float acc1 = 0.0f;
+            for (tap = 0; tap < SINC_TAPS; tap++) {
+                acc0 += row0[tap] * window[tap];
+                acc1 += row1[tap] * window[tap];
+            }
+            out[ch] = clip_sample(acc0 + t * (acc1 - acc0));
+        }
+        out += 2;
+        rs->frac += rs->step;
+    }
+}
+
+// Convert native input to `frames` output frames. `in` must hold exactly
+// opl_resampler_input_frames(rs, frames) stereo frames.
+void opl_resampler_process(opl_resampler_t* rs, const int16_t* in, int16_t* out, size_t frames) {
+    if (rs->quality == opl_resampler_sinc) {
+        process_sinc(rs, in, out, frames);
+    } else {
+        process_linear(rs, in, out, frames);
+    }
+}
+
+// Render `frames` output frames, generating the native input from the chip
+void opl_resampler_render(opl_resampler_t* rs, opl3_chip* chip, opl_block_generator_t generate,
+                          int16_t* out, size_t frames) {
+    while (frames > 0) {
+        size_t n = frames < rs->chunk_frames ? frames : rs->chunk_frames;
+        size_t in = opl_resampler_input_frames(rs, n);
+
+        if (in > 0) {
+            generate(chip, rs->scratch, (Bit32u)in);
+        }
+        opl_resampler_process(rs, rs->scratch, out, n);
+        out += 2 * n;
+        frames -= n;
+    }
+}
+
+// Render a span of output frames between two register writes
+void opl_render_span(opl3_chip* chip, opl_block_generator_t generate, opl_resampler_t* rs,
+                     int16_t* out, size_t frames) {
+    if (rs) {
+        opl_resampler_render(rs, chip, generate, out, frames);
+        return;
+    }
+    while (frames > 0) {
+        Bit32u n = frames < RENDER_CHUNK ? (Bit32u)frames : RENDER_CHUNK;
+        generate(chip, out, n);
+        out += 2 * n;
+        frames -= n;
+    }
+}
@@ -0,0 +1,49 @@
+/**
+ * OPL Resampler - Internal Header
+ *
+ * Converts blocks of native 49716 Hz OPL output to the output sample rate
+ */
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "opl3.h"
+
+// Native OPL3 sample rate
+#define OPL_NATIVE_RATE 49716
+
+// Resampler quality levels (values match musdoom_resampler_t)
+typedef enum {
+    opl_resampler_linear,     // Two-tap linear, identical to OPL3_GenerateResampled
+    opl_resampler_sinc,       // Polyphase windowed-sinc
+    opl_resampler_halfband    // Half-band lowpass followed by linear
+} opl_resampler_quality_t;
+
+typedef struct opl_resampler_s opl_resampler_t;
+
+// Block generator producing native frames (OPL3_GenerateBlock or
+// OPL3_GenerateBlockOPL2)
+typedef void (*opl_block_generator_t)(opl3_chip* chip, Bit16s* buf, Bit32u numsamples);
+
+// Resampler functions
+opl_resampler_t* opl_resampler_create(opl_resampler_quality_t quality, int sample_rate);
+void opl_resampler_destroy(opl_resampler_t* rs);
+opl_resampler_t* opl_resampler_clone(const opl_resampler_t* rs);
+void opl_resampler_reset(opl_resampler_t* rs);
+uint64_t opl_resampler_native_position(const opl_resampler_t* rs, uint64_t frames);
+void opl_resampler_set_position(opl_resampler_t* rs, uint64_t frames);
+void opl_resampler_save_state(const opl_resampler_t* rs, state_writer_t* w);
+int opl_resampler_load_state(opl_resampler_t* rs, state_reader_t* r);
+size_t opl_resampler_input_frames(const opl_resampler_t* rs, size_t frames);
+void opl_resampler_process(opl_resampler_t* rs, const int16_t* in, int16_t* out, size_t frames);
+void opl_resampler_render(opl_resampler_t* rs, opl3_chip* chip, opl_block_generator_t generate,
+                          int16_t* out, size_t frames);
+
+// Render a span of output frames with no register writes inside it: at the
+// native rate when rs is NULL, otherwise through the resampler
+void opl_render_span(opl3_chip* chip, opl_block_generator_t generate, opl_resampler_t* rs,
+                     int16_t* out, size_t frames);
+
+#endif /* RESAMPLER_H */
@@ -0,0 +1,72 @@
+/**
+ * Shared Blocks - Reference-counted immutable allocations
+ *
+ * The count sits in a header in front of the data, padded so the data
+ * keeps malloc's alignment.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared.h"
+
+#ifdef _WIN32
+#include <windows.h>
+typedef LONG shared_count_t;
+#define shared_increment(count)  InterlockedIncrement(count)
+#define shared_decrement(count)  InterlockedDecrement(count)
+#else
+typedef int shared_count_t;
+#define shared_increment(count)  __atomic_add_fetch(count, 1, __ATOMIC_RELAXED)
+#define shared_decrement(count)  __atomic_sub_fetch(count, 1, __ATOMIC_ACQ_REL)
+#endif
+
+typedef union {
+    shared_count_t refs;
+    long double align_float;
+    void* align_pointer;
+    long long align_integer;
+} shared_header_t;
+
+#define SHARED_HEADER(block) ((shared_header_t*)(block) - 1)
+
+void* shared_alloc(size_t size) {
+    shared_header_t* header;
+
+    if (size > (size_t)-1 - sizeof(shared_header_t)) return NULL;
+    header = (shared_header_t*)malloc(sizeof(shared_header_t) + size);
+    if (!header) return NULL;
+    header->refs = 1;
+    return header + 1;
+}
+
+void* shared_calloc(size_t count, size_t size) {
+    void* block;
+
+    if (size != 0 && count > (size_t)-1 / size) return NULL;
+    block = shared_alloc(count * size);
+    if (block) {
+        memset(block, 0, count * size);
+    }
+    return block;
+}
+
+void* shared_shrink(void* block, size_t size) {
+    shared_header_t* header;
+
+    header = (shared_header_t*)realloc(SHARED_HEADER(block), sizeof(shared_header_t) + size);
+    return header ? header + 1 : block;
+}
+
+void* shared_retain(void* block) {
+    if (block) {
+        shared_increment(&SHARED_HEADER(block)->refs);
+    }
+    return block;
+}
+
+void shared_release(void* block) {
+    if (block && shared_decrement(&SHARED_HEADER(block)->refs) == 0) {
+        free(SHARED_HEADER(block));
+    }
+}
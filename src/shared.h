@@ -0,0 +1,29 @@
+/**
+ * Shared Blocks - Internal Header
+ *
+ * Reference-counted allocations for data that never changes once built,
+ * such as decoded scores and instrument banks, so that several players
+ * can use them without copying. Counts are updated atomically, so
+ * holders may live on different threads.
+ */
+
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <stddef.h>
+
+// Allocate a block holding one reference; shared_calloc zeroes it
+void* shared_alloc(size_t size);
+void* shared_calloc(size_t count, size_t size);
+
+// Shrink a block that has no other references yet to `size` bytes. The
+// block may move; if it cannot, it is returned unchanged.
+void* shared_shrink(void* block, size_t size);
+
+// Take another reference to a block, and return it
+void* shared_retain(void* block);
+
+// Drop a reference, freeing the block with the last one. NULL is ignored.
+void shared_release(void* block);
+
+#endif /* SHARED_H */
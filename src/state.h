@@ -0,0 +1,64 @@
+/**
+ * State Snapshots - Internal Header
+ *
+ * Little-endian byte streams for saving and restoring playback state.
+ * A writer without a buffer only counts bytes, so the same code sizes a
+ * snapshot and fills it; a reader flags an error instead of reading past
+ * the end, and returns zeros from then on.
+ */
+
+#ifndef STATE_H
+#define STATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    uint8_t* data;       // Destination, or NULL to count only
+    size_t size;         // Capacity of data
+    size_t pos;          // Bytes written (or needed) so far
+} state_writer_t;
+
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t pos;
+    int error;           // Read past the end, or invalid contents
+} state_reader_t;
+
+static inline void state_put(state_writer_t* w, uint64_t value, int bytes) {
+    int i;
+    for (i = 0; i < bytes; i++, w->pos++) {
+        if (w->data && w->pos < w->size) {
+            w->data[w->pos] = (uint8_t)(value >> (8 * i));
+        }
+    }
+}
+
+static inline uint64_t state_get(state_reader_t* r, int bytes) {
+    uint64_t value = 0;
+    int i;
+    if (r->error || r->size - r->pos < (size_t)bytes) {
+        r->error = 1;
+        return 0;
+    }
+    for (i = 0; i < bytes; i++) {
+        value |= (uint64_t)r->data[r->pos++] << (8 * i);
+    }
+    return value;
+}
+
+#define state_put_u8(w, v)   state_put((w), (uint64_t)(v), 1)
+#define state_put_u16(w, v)  state_put((w), (uint64_t)(v), 2)
+#define state_put_u32(w, v)  state_put((w), (uint64_t)(v), 4)
+#define state_put_u64(w, v)  state_put((w), (uint64_t)(v), 8)
+
+#define state_get_u8(r)   ((uint8_t)state_get((r), 1))
+#define state_get_u16(r)  ((uint16_t)state_get((r), 2))
+#define state_get_u32(r)  ((uint32_t)state_get((r), 4))
+#define state_get_u64(r)  state_get((r), 8)
+#define state_get_s8(r)   ((int8_t)state_get((r), 1))
+#define state_get_s16(r)  ((int16_t)state_get((r), 2))
+#define state_get_s32(r)  ((int32_t)state_get((r), 4))
+
+#endif /* STATE_H */
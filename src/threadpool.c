@@ -0,0 +1,262 @@
+/**
+ * Thread Pool - Fork-join task execution with work stealing
+ *
+ * Tasks are identified by index. Worker w starts with a contiguous range
+ * of them and takes tasks from the front of that range; a worker whose
+ * range is empty steals the back half of the largest remaining range.
+ * Ranges are guarded by a lock each, which is cheap next to tasks that
+ * render whole songs or song segments.
+ */
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdlib.h>
+
+#include "threadpool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+typedef CRITICAL_SECTION pool_mutex_t;
+#define pool_mutex_init(m)    InitializeCriticalSection(m)
+#define pool_mutex_destroy(m) DeleteCriticalSection(m)
+#define pool_mutex_lock(m)    EnterCriticalSection(m)
+#define pool_mutex_unlock(m)  LeaveCriticalSection(m)
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+typedef pthread_mutex_t pool_mutex_t;
+#define pool_mutex_init(m)    pthread_mutex_init(m, NULL)
+#define pool_mutex_destroy(m) pthread_mutex_destroy(m)
+#define pool_mutex_lock(m)    pthread_mutex_lock(m)
+#define pool_mutex_unlock(m)  pthread_mutex_unlock(m)
+#endif
+
+struct thread_pool_lock_s {
+    pool_mutex_t mutex;
+};
+
+// Tasks [next, end) not yet taken from one worker's share
+typedef struct {
+    pool_mutex_t mutex;
+    size_t next;
+    size_t end;
+} pool_range_t;
+
+typedef struct pool_s pool_t;
+
+typedef struct {
+    pool_t* pool;
+    int index;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+} pool_worker_t;
+
+struct pool_s {
+    thread_pool_task_t task;
+    void* arg;
+    int workers;
+    pool_range_t* ranges;
+    pool_worker_t* threads;
+};
+
+// Take the next task of a worker's own range
+static int take_own(pool_range_t* range, size_t* task) {
+    int found = 0;
+
+    pool_mutex_lock(&range->mutex);
+    if (range->next < range->end) {
+        *task = range->next++;
+        found = 1;
+    }
+    pool_mutex_unlock(&range->mutex);
+    return found;
+}
+
+// Move the back half of the largest other range into an empty one, and
+// take its first task
+static int steal(pool_t* pool, int thief, size_t* task) {
+    while (1) {
+        pool_range_t* victim = NULL;
+        size_t largest = 0;
+        size_t first, end;
+        int i;
+
+        // Sizes may change before the victim is locked again below
+        for (i = 0; i < pool->workers; i++) {
+            pool_range_t* range = &pool->ranges[i];
+            size_t left;
+            if (i == thief) continue;
+            pool_mutex_lock(&range->mutex);
+            left = range->end - range->next;
+            pool_mutex_unlock(&range->mutex);
+            if (left > largest) {
+                largest = left;
+                victim = range;
+            }
+        }
+        if (!victim) return 0;
+
+        pool_mutex_lock(&victim->mutex);
+        if (victim->next >= victim->end) {
+            pool_mutex_unlock(&victim->mutex);
+            continue;
+        }
+        end = victim->end;
+        first = victim->end - (victim->end - victim->next + 1) / 2;
+        victim->end = first;
+        pool_mutex_unlock(&victim->mutex);
+
+        *task = first;
+        if (first + 1 < end) {
+            pool_range_t* own = &pool->ranges[thief];
+            pool_mutex_lock(&own->mutex);
+            own->next = first + 1;
+            own->end = end;
+            pool_mutex_unlock(&own->mutex);
+        }
+        return 1;
+    }
+}
+
+static void run_worker(pool_t* pool, int index) {
+    size_t task;
+
+    while (take_own(&pool->ranges[index], &task) || steal(pool, index, &task)) {
+        pool->task(pool->arg, task, index);
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID param) {
+    pool_worker_t* worker = (pool_worker_t*)param;
+    run_worker(worker->pool, worker->index);
+    return 0;
+}
+#else
+static void* worker_main(void* param) {
+    pool_worker_t* worker = (pool_worker_t*)param;
+    run_worker(worker->pool, worker->index);
+    return NULL;
+}
+#endif
+
+// Run tasks [0, count) on up to `workers` threads
+void thread_pool_run(int workers, size_t count, thread_pool_task_t task, void* arg) {
+    pool_t pool;
+    int started = 0;
+    int i;
+
+    if (count == 0) return;
+    if (workers < 1) {
+        workers = 1;
+    }
+    if ((size_t)workers > count) {
+        workers = (int)count;
+    }
+
+    pool.task = task;
+    pool.arg = arg;
+    pool.workers = workers;
+    pool.ranges = (pool_range_t*)malloc((size_t)workers * sizeof(pool_range_t));
+    pool.threads = (pool_worker_t*)malloc((size_t)workers * sizeof(pool_worker_t));
+    if (!pool.ranges || !pool.threads) {
+        // Run everything on the calling thread
+        size_t t;
+        free(pool.ranges);
+        free(pool.threads);
+        for (t = 0; t < count; t++) {
+            task(arg, t, 0);
+        }
+        return;
+    }
+
+    for (i = 0; i < workers; i++) {
+        pool_mutex_init(&pool.ranges[i].mutex);
+        pool.ranges[i].next = count * (size_t)i / (size_t)workers;
+        pool.ranges[i].end = count * (size_t)(i + 1) / (size_t)workers;
+        pool.threads[i].pool = &pool;
+        pool.threads[i].index = i;
+    }
+
+    // Workers that fail to start leave their share to be stolen
+    for (i = 1; i < workers; i++) {
+#ifdef _WIN32
+        pool.threads[i].thread = CreateThread(NULL, 0, worker_main, &pool.threads[i], 0, NULL);
+        if (!pool.threads[i].thread) break;
+#else
+        if (pthread_create(&pool.threads[i].thread, NULL, worker_main, &pool.threads[i]) != 0) break;
+#endif
+        started++;
+    }
+
+    run_worker(&pool, 0);
+
+    for (i = 1; i <= started; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(pool.threads[i].thread, INFINITE);
+        CloseHandle(pool.threads[i].thread);
+#else
+        pthread_join(pool.threads[i].thread, NULL);
+#endif
+    }
+
+    for (i = 0; i < workers; i++) {
+        pool_mutex_destroy(&pool.ranges[i].mutex);
+    }
+    free(pool.ranges);
+    free(pool.threads);
+}
+
+// Number of processors available
+int thread_pool_cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+// Monotonic time in seconds
+double thread_pool_time(void) {
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+thread_pool_lock_t* thread_pool_lock_create(void) {
+    thread_pool_lock_t* lock = (thread_pool_lock_t*)malloc(sizeof(thread_pool_lock_t));
+    if (lock) {
+        pool_mutex_init(&lock->mutex);
+    }
+    return lock;
+}
+
+void thread_pool_lock_destroy(thread_pool_lock_t* lock) {
+    if (!lock) return;
+    pool_mutex_destroy(&lock->mutex);
+    free(lock);
+}
+
+void thread_pool_lock(thread_pool_lock_t* lock) {
+    pool_mutex_lock(&lock->mutex);
+}
+
+void thread_pool_unlock(thread_pool_lock_t* lock) {
+    pool_mutex_unlock(&lock->mutex);
+}
@@ -0,0 +1,38 @@
+/**
+ * Thread Pool - Internal Header
+ *
+ * Fork-join execution of independent tasks on worker threads. Each worker
+ * starts with its own share of the tasks and steals from the busiest
+ * worker once its share runs out, so uneven tasks still balance.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stddef.h>
+
+// Run one task; worker is in [0, workers) and identifies the calling thread
+typedef void (*thread_pool_task_t)(void* arg, size_t task, int worker);
+
+// Serializes calls made from inside tasks
+typedef struct thread_pool_lock_s thread_pool_lock_t;
+
+// Run tasks [0, count) on `workers` threads, the caller being worker 0.
+// Returns once every task has run. The threads are started for this call
+// and joined before it returns; none are kept between calls. If threads
+// cannot be started the remaining workers run all the tasks.
+void thread_pool_run(int workers, size_t count, thread_pool_task_t task, void* arg);
+
+// Number of processors available, at least 1
+int thread_pool_cpu_count(void);
+
+// Monotonic time in seconds
+double thread_pool_time(void);
+
+// Mutex for task code
+thread_pool_lock_t* thread_pool_lock_create(void);
+void thread_pool_lock_destroy(thread_pool_lock_t* lock);
+void thread_pool_lock(thread_pool_lock_t* lock);
+void thread_pool_unlock(thread_pool_lock_t* lock);
+
+#endif /* THREADPOOL_H */
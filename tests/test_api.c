@@ -1,5 +1,7 @@
 /**
  * API Test for libMusDoom
+ *
+ * The GENMIDI lump path is passed as the first argument.
  */
 
 #include <stdio.h>
@@ -8,6 +10,40 @@
 #include <assert.h>
 #include "libmusdoom.h"
 
+// One-second test song: a note on channel 0 held for 70 ticks, then 70
+// ticks of silence (MUS runs at 140 ticks per second)
+static const uint8_t test_mus[] = {
+    'M', 'U', 'S', 0x1a,
+    8, 0,           // Score length
+    16, 0,          // Score start
+    1, 0,           // Primary channels
+    0, 0,           // Secondary channels
+    0, 0,           // Instrument count
+    0, 0,           // Padding
+    0x90, 0xbc, 100, 70,    // Play note 60, volume 100, delay 70
+    0x80, 60, 70,           // Release note 60, delay 70
+    0x60                    // End of score
+};
+
+// Half-second song: channel 0 panned hard left and channel 1 hard right,
+// each playing a note for 35 ticks
+static const uint8_t panned_mus[] = {
+    'M', 'U', 'S', 0x1a,
+    19, 0,          // Score length
+    16, 0,          // Score start
+    2, 0,           // Primary channels
+    0, 0,           // Secondary channels
+    0, 0,           // Instrument count
+    0, 0,           // Padding
+    0x40, 4, 0,             // Channel 0: pan hard left
+    0x41, 4, 127,           // Channel 1: pan hard right
+    0x10, 0xb0, 100,        // Play note 48 on channel 0, volume 100
+    0x91, 0xbc, 100, 35,    // Play note 60 on channel 1, delay 35
+    0x00, 48,               // Release both notes
+    0x81, 60, 35,           // delay 35
+    0x60                    // End of score
+};
+
 void test_version(void) {
     printf("Testing version... ");
     const char* version = musdoom_version();
@@ -35,6 +71,7 @@ void test_config(void) {
     assert(config.opl_type == MUSDOOM_OPL3);
     assert(config.doom_version == MUSDOOM_DOOM_1_9);
     assert(config.initial_volume == 100);
+    assert(config.resampler == MUSDOOM_RESAMPLER_LINEAR);
     
     // Test with NULL
     err = musdoom_config_init(NULL);
@@ -61,6 +98,23 @@ void test_create_destroy(void) {
     assert(emu != NULL);
     musdoom_destroy(emu);
     
+    // Each resampler quality; unknown values are rejected
+    config.resampler = MUSDOOM_RESAMPLER_SINC;
+    emu = musdoom_create(&config);
+    assert(emu != NULL);
+    musdoom_destroy(emu);
+    config.resampler = MUSDOOM_RESAMPLER_HALFBAND;
+    emu = musdoom_create(&config);
+    assert(emu != NULL);
+    musdoom_destroy(emu);
+    config.resampler = (musdoom_resampler_t)99;
+    emu = musdoom_create(&config);
+    assert(emu == NULL);
+    config.resampler = MUSDOOM_RESAMPLER_LINEAR;
+    config.opl_type = (musdoom_opl_type_t)2;
+    emu = musdoom_create(&config);
+    assert(emu == NULL);
+    
     printf("OK\n");
 }
 
@@ -157,9 +211,787 @@ void test_invalid_load(void) {
     printf("OK\n");
 }
 
-int main(void) {
+void test_native_rate(void) {
+    printf("Testing native rate... ");
+
+    musdoom_config_t config;
+    musdoom_config_init(&config);
+    config.sample_rate = MUSDOOM_NATIVE_RATE;
+
+    musdoom_emulator_t* emu = musdoom_create(&config);
+    assert(emu != NULL);
+    assert(musdoom_load(emu, test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+    assert(musdoom_start(emu, 0) == MUSDOOM_OK);
+
+    // Event timing and position run at exactly 49716 Hz
+    int16_t* buffer = (int16_t*)malloc(MUSDOOM_NATIVE_RATE * 2 * sizeof(int16_t));
+    assert(buffer != NULL);
+    assert(musdoom_generate_samples(emu, buffer, MUSDOOM_NATIVE_RATE / 2) == MUSDOOM_NATIVE_RATE / 2);
+    assert(musdoom_get_position_ms(emu) == 500);
+    assert(musdoom_is_playing(emu));
+    assert(musdoom_generate_samples(emu, buffer, MUSDOOM_NATIVE_RATE / 2) == MUSDOOM_NATIVE_RATE / 2);
+    assert(musdoom_get_position_ms(emu) == 1000);
+    musdoom_generate_samples(emu, buffer, 16);
+    assert(!musdoom_is_playing(emu));
+
+    free(buffer);
+    musdoom_destroy(emu);
+    printf("OK\n");
+}
+
+void test_length(void) {
+    printf("Testing song length... ");
+
+    musdoom_emulator_t* emu = musdoom_create(NULL);
+    assert(emu != NULL);
+    assert(musdoom_get_length_ms(emu) == 0);
+    assert(musdoom_get_length_samples(emu) == 0);
+    assert(musdoom_get_length_ticks(emu) == 0);
+
+    // The score is decoded at load, so its buffer can be freed at once
+    uint8_t* copy = (uint8_t*)malloc(sizeof(test_mus));
+    assert(copy != NULL);
+    memcpy(copy, test_mus, sizeof(test_mus));
+    assert(musdoom_load(emu, copy, sizeof(test_mus)) == MUSDOOM_OK);
+    free(copy);
+    assert(musdoom_get_length_ticks(emu) == 140);
+    assert(musdoom_get_length_samples(emu) == 44100);
+    assert(musdoom_get_length_ms(emu) == 1000);
+
+    // Playback ends exactly at the reported length
+    int16_t* buffer = (int16_t*)malloc(44100 * 2 * sizeof(int16_t));
+    assert(buffer != NULL);
+    assert(musdoom_start(emu, 0) == MUSDOOM_OK);
+    musdoom_generate_samples(emu, buffer, 44100);
+    assert(musdoom_is_playing(emu));
+    musdoom_generate_samples(emu, buffer, 1);
+    assert(!musdoom_is_playing(emu));
+    assert(musdoom_get_position_ms(emu) == musdoom_get_length_ms(emu));
+
+    free(buffer);
+    musdoom_destroy(emu);
+    printf("OK\n");
+}
+
+void test_seek(void) {
+    printf("Testing seek... ");
+
+    musdoom_emulator_t* emu = musdoom_create(NULL);
+    assert(emu != NULL);
+    assert(musdoom_seek_ms(NULL, 0) == MUSDOOM_ERR_INVALID_PARAM);
+    assert(musdoom_seek_ms(emu, 0) == MUSDOOM_ERR_INVALID_PARAM);
+
+    assert(musdoom_load(emu, test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+    assert(musdoom_start(emu, 0) == MUSDOOM_OK);
+    assert(musdoom_seek_ms(emu, 500) == MUSDOOM_OK);
+    assert(musdoom_get_position_ms(emu) == 500);
+    assert(musdoom_is_playing(emu));
+
+    // Clamped to the end; a stopped song plays again from the position
+    assert(musdoom_seek_ms(emu, 5000) == MUSDOOM_OK);
+    assert(musdoom_get_position_ms(emu) == 1000);
+    musdoom_stop(emu);
+    assert(musdoom_seek_ms(emu, 250) == MUSDOOM_OK);
+    assert(musdoom_get_position_ms(emu) == 250);
+    assert(musdoom_is_playing(emu));
+
+    musdoom_destroy(emu);
+    printf("OK\n");
+}
+
+static uint8_t* genmidi;
+static size_t genmidi_size;
+
+static uint8_t* read_file(const char* path, size_t* size) {
+    FILE* fp = fopen(path, "rb");
+    uint8_t* data;
+    long len;
+
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data = (uint8_t*)malloc((size_t)len);
+    if (data && fread(data, 1, (size_t)len, fp) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *size = (size_t)len;
+    return data;
+}
+
+// Hash of the audio a batch job passed to its sink
+typedef struct {
+    uint64_t hash;
+    uint64_t frames;
+    uint64_t abort_after;
+} batch_output_t;
+
+static uint64_t hash_samples(uint64_t hash, const int16_t* samples, size_t count) {
+    size_t i;
+    for (i = 0; i < count; i++) {
+        hash = (hash ^ (uint16_t)samples[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int batch_sink(void* user, const int16_t* samples, size_t frames) {
+    batch_output_t* out = (batch_output_t*)user;
+    out->hash = hash_samples(out->hash, samples, frames * 2);
+    out->frames += frames;
+    return out->abort_after && out->frames >= out->abort_after;
+}
+
+static void batch_done(void* user, size_t index, const musdoom_batch_job_t* job) {
+    int* done = (int*)user;
+    assert(job->result <= MUSDOOM_OK);
+    done[index]++;
+}
+
+#define BATCH_JOBS 12
+
+void test_render_batch(void) {
+    static const int rates[3] = { 44100, 22050, MUSDOOM_NATIVE_RATE };
+    musdoom_config_t configs[BATCH_JOBS];
+    musdoom_batch_job_t jobs[BATCH_JOBS];
+    batch_output_t outputs[BATCH_JOBS];
+    int done[BATCH_JOBS];
+    musdoom_batch_options_t options;
+    musdoom_batch_stats_t stats;
+    int16_t buffer[2 * 1000];
+    uint64_t frames;
+    int i;
+
+    printf("Testing batch rendering... ");
+
+    memset(jobs, 0, sizeof(jobs));
+    memset(outputs, 0, sizeof(outputs));
+    memset(done, 0, sizeof(done));
+    for (i = 0; i < BATCH_JOBS; i++) {
+        musdoom_config_init(&configs[i]);
+        configs[i].sample_rate = rates[i % 3];
+        configs[i].opl_type = (i & 4) ? MUSDOOM_OPL2 : MUSDOOM_OPL3;
+        configs[i].doom_version = (musdoom_doom_version_t)(i % 3);
+        jobs[i].mus_data = test_mus;
+        jobs[i].mus_size = sizeof(test_mus);
+        jobs[i].genmidi_data = genmidi;
+        jobs[i].genmidi_size = genmidi_size;
+        jobs[i].config = &configs[i];
+        jobs[i].sink = batch_sink;
+        jobs[i].sink_user = &outputs[i];
+        outputs[i].hash = 14695981039346656037ULL;
+    }
+    // One job stops early, one has bad data and one discards its audio
+    outputs[3].abort_after = 1000;
+    jobs[5].mus_size = 4;
+    jobs[7].sink = NULL;
+
+    assert(musdoom_batch_options_init(&options) == MUSDOOM_OK);
+    options.num_workers = 4;
+    options.block_frames = 1000;
+    options.on_complete = batch_done;
+    options.callback_user = done;
+    assert(musdoom_render_batch(jobs, BATCH_JOBS, &options, &stats) == MUSDOOM_OK);
+
+    assert(stats.jobs_completed == BATCH_JOBS - 2);
+    assert(stats.jobs_failed == 2);
+    assert(stats.seconds > 0.0);
+    frames = 0;
+    for (i = 0; i < BATCH_JOBS; i++) {
+        musdoom_emulator_t* emu;
+        uint64_t hash = 14695981039346656037ULL;
+        uint64_t left;
+
+        assert(done[i] == 1);
+        frames += jobs[i].frames_rendered;
+        if (i == 3) {
+            assert(jobs[i].result == MUSDOOM_ERR_ABORTED);
+            assert(jobs[i].frames_rendered == 0 && outputs[i].frames == 1000);
+            continue;
+        }
+        if (i == 5) {
+            assert(jobs[i].result == MUSDOOM_ERR_INVALID_DATA);
+            continue;
+        }
+        assert(jobs[i].result == MUSDOOM_OK);
+
+        // Each job renders exactly what one emulator renders on its own
+        emu = musdoom_create(&configs[i]);
+        assert(emu != NULL);
+        assert(musdoom_load_genmidi(emu, genmidi, genmidi_size) == MUSDOOM_OK);
+        assert(musdoom_load(emu, test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+        assert(musdoom_start(emu, 0) == MUSDOOM_OK);
+        assert(jobs[i].frames_rendered == musdoom_get_length_samples(emu));
+        for (left = jobs[i].frames_rendered; left > 0; ) {
+            size_t n = left < 1000 ? (size_t)left : 1000;
+            musdoom_generate_samples(emu, buffer, n);
+            hash = hash_samples(hash, buffer, n * 2);
+            left -= n;
+        }
+        if (i != 7) {
+            assert(outputs[i].hash == hash);
+        }
+        musdoom_destroy(emu);
+    }
+    assert(stats.frames_rendered == frames);
+
+    // Defaults, an empty batch and bad parameters
+    assert(musdoom_render_batch(jobs, 1, NULL, NULL) == MUSDOOM_OK);
+    assert(musdoom_render_batch(NULL, 0, NULL, &stats) == MUSDOOM_OK);
+    assert(stats.jobs_completed == 0 && stats.frames_rendered == 0);
+    assert(musdoom_render_batch(NULL, 1, NULL, NULL) == MUSDOOM_ERR_INVALID_PARAM);
+    options.block_frames = 0;
+    assert(musdoom_render_batch(jobs, 1, &options, NULL) == MUSDOOM_ERR_INVALID_PARAM);
+    assert(musdoom_batch_options_init(NULL) == MUSDOOM_ERR_INVALID_PARAM);
+
+    // A job with a bad config fails as an invalid parameter
+    configs[0].resampler = (musdoom_resampler_t)99;
+    assert(musdoom_render_batch(jobs, 1, NULL, &stats) == MUSDOOM_OK);
+    assert(jobs[0].result == MUSDOOM_ERR_INVALID_PARAM && stats.jobs_failed == 1);
+    configs[0].resampler = MUSDOOM_RESAMPLER_LINEAR;
+    configs[0].sample_rate = 0;
+    assert(musdoom_render_batch(jobs, 1, NULL, NULL) == MUSDOOM_OK);
+    assert(jobs[0].result == MUSDOOM_ERR_INVALID_PARAM);
+
+    printf("OK\n");
+}
+
+void test_render_parallel(void) {
+    musdoom_config_t config;
+    musdoom_emulator_t* serial;
+    musdoom_emulator_t* parallel;
+    int16_t* expected;
+    int16_t* output;
+    size_t frames;
+
+    printf("Testing parallel rendering... ");
+
+    musdoom_config_init(&config);
+    serial = musdoom_create(&config);
+    parallel = musdoom_create(&config);
+    assert(serial != NULL && parallel != NULL);
+    assert(musdoom_render_parallel(parallel, NULL, 0, 1) == MUSDOOM_ERR_INVALID_PARAM);
+
+    assert(musdoom_load_genmidi(serial, genmidi, genmidi_size) == MUSDOOM_OK);
+    assert(musdoom_load(serial, test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+    assert(musdoom_load_genmidi(parallel, genmidi, genmidi_size) == MUSDOOM_OK);
+    assert(musdoom_load(parallel, test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+
+    // Past the end of the song, into the release tail
+    frames = (size_t)musdoom_get_length_samples(serial) + 2000;
+    expected = (int16_t*)malloc(frames * 2 * sizeof(int16_t));
+    output = (int16_t*)malloc(frames * 2 * sizeof(int16_t));
+    assert(expected != NULL && output != NULL);
+
+    assert(musdoom_start(serial, 0) == MUSDOOM_OK);
+    musdoom_generate_samples(serial, expected, frames);
+    assert(musdoom_render_parallel(parallel, output, frames, 2) == MUSDOOM_OK);
+    assert(memcmp(expected, output, frames * 2 * sizeof(int16_t)) == 0);
+    assert(!musdoom_is_playing(parallel));
+
+    assert(musdoom_render_parallel(parallel, output, frames, 0) == MUSDOOM_OK);
+    assert(memcmp(expected, output, frames * 2 * sizeof(int16_t)) == 0);
+    assert(musdoom_render_parallel(parallel, output, 0, 1) == MUSDOOM_OK);
+
+    // The looping flag survives: a seek plays the song again, and it loops
+    assert(musdoom_start(parallel, 1) == MUSDOOM_OK);
+    assert(musdoom_render_parallel(parallel, output, frames, 2) == MUSDOOM_OK);
+    assert(memcmp(expected, output, frames * 2 * sizeof(int16_t)) == 0);
+    assert(musdoom_seek_ms(parallel, 0) == MUSDOOM_OK);
+    musdoom_generate_samples(parallel, output, frames);
+    assert(musdoom_is_playing(parallel));
+
+    // Panned voices render the same as they do serially on a new emulator
+    free(expected);
+    free(output);
+    musdoom_destroy(serial);
+    serial = musdoom_create(&config);
+    assert(serial != NULL);
+    assert(musdoom_load_genmidi(serial, genmidi, genmidi_size) == MUSDOOM_OK);
+    assert(musdoom_load(serial, panned_mus, sizeof(panned_mus)) == MUSDOOM_OK);
+    assert(musdoom_load(parallel, panned_mus, sizeof(panned_mus)) == MUSDOOM_OK);
+    frames = (size_t)musdoom_get_length_samples(serial) + 2000;
+    expected = (int16_t*)malloc(frames * 2 * sizeof(int16_t));
+    output = (int16_t*)malloc(frames * 2 * sizeof(int16_t));
+    assert(expected != NULL && output != NULL);
+    assert(musdoom_start(serial, 0) == MUSDOOM_OK);
+    musdoom_generate_samples(serial, expected, frames);
+    assert(musdoom_render_parallel(parallel, output, frames, 4) == MUSDOOM_OK);
+    assert(memcmp(expected, output, frames * 2 * sizeof(int16_t)) == 0);
+
+    assert(musdoom_render_parallel(parallel, NULL, frames, 1) == MUSDOOM_ERR_INVALID_PARAM);
+    assert(musdoom_render_parallel(parallel, output, frames, -1) == MUSDOOM_ERR_INVALID_PARAM);
+    assert(musdoom_render_parallel(NULL, output, frames, 1) == MUSDOOM_ERR_INVALID_PARAM);
+
+    free(expected);
+    free(output);
+    musdoom_destroy(serial);
+    musdoom_destroy(parallel);
+    printf("OK\n");
+}
+
+// Offsets into a state blob for the player's voice bookkeeping: a 19-byte
+// API header, a 53-byte player header, 16 channels of 14 bytes (voice mask
+// at +10), 18 voices of 23 bytes, then the voice list heads, tails and counts
+#define STATE_CHANNEL(i)    (72 + 14 * (i))
+#define STATE_VOICE(v)      (296 + 23 * (v))
+#define STATE_LISTS         710
+
+// Corrupt one byte of the voice bookkeeping, check the blob is refused,
+// and put the byte back
+static void check_state_byte(musdoom_emulator_t* emu, uint8_t* state, size_t size,
+                             size_t offset, uint8_t value) {
+    uint8_t saved = state[offset];
+    state[offset] = value;
+    assert(musdoom_load_state(emu, state, size) == MUSDOOM_ERR_INVALID_DATA);
+    state[offset] = saved;
+}
+
+// Mid-note, exactly the voices holding the note are allocated. Break each
+// invariant tying the voice lists, voices and channel masks together.
+static void check_state_voices(musdoom_emulator_t* emu, uint8_t* state, size_t size) {
+    int8_t free_head = (int8_t)state[STATE_LISTS];
+    int8_t free_tail = (int8_t)state[STATE_LISTS + 1];
+    int8_t alloced = (int8_t)state[STATE_LISTS + 2];
+    size_t voice, free_voice;
+    int8_t prev;
+    uint8_t saved[3];
+
+    assert(alloced >= 0 && free_head >= 0 && free_head != free_tail);
+    voice = STATE_VOICE(alloced);
+    free_voice = STATE_VOICE(free_head);
+    assert(state[voice + 12] == 1 && state[voice + 3] == 0);
+    assert(state[STATE_CHANNEL(0) + 10] & (1u << alloced));
+
+    check_state_byte(emu, state, size, voice + 12, 0);              // Not in use
+    check_state_byte(emu, state, size, voice + 3, 0xff);            // No channel
+    check_state_byte(emu, state, size, voice + 3, 1);               // Other channel
+    memcpy(saved, state + voice, 2);
+    state[voice] = state[voice + 1] = 0xff;                         // No instrument
+    assert(musdoom_load_state(emu, state, size) == MUSDOOM_ERR_INVALID_DATA);
+    memcpy(state + voice, saved, 2);
+    check_state_byte(emu, state, size, free_voice + 12, 1);         // Free but in use
+    check_state_byte(emu, state, size, STATE_CHANNEL(0) + 10, 0);   // Mask lost
+    check_state_byte(emu, state, size, STATE_CHANNEL(1) + 10, 1u << alloced);
+
+    // Drop the last free voice off its list, so no list holds it
+    for (prev = free_head; (int8_t)state[STATE_VOICE(prev) + 18] != free_tail;
+         prev = (int8_t)state[STATE_VOICE(prev) + 18]) {
+    }
+    saved[0] = state[STATE_VOICE(prev) + 18];
+    saved[1] = state[STATE_LISTS + 1];
+    saved[2] = state[STATE_LISTS + 4];
+    state[STATE_VOICE(prev) + 18] = 0xff;
+    state[STATE_LISTS + 1] = (uint8_t)prev;
+    state[STATE_LISTS + 4]--;
+    assert(musdoom_load_state(emu, state, size) == MUSDOOM_ERR_INVALID_DATA);
+    state[STATE_VOICE(prev) + 18] = saved[0];
+    state[STATE_LISTS + 1] = saved[1];
+    state[STATE_LISTS + 4] = saved[2];
+
+    assert(musdoom_load_state(emu, state, size) == MUSDOOM_OK);
+}
+
+void test_state(void) {
+    static const int resamplers[3] = {
+        MUSDOOM_RESAMPLER_LINEAR, MUSDOOM_RESAMPLER_SINC, MUSDOOM_RESAMPLER_HALFBAND
+    };
+    musdoom_config_t config;
+    musdoom_emulator_t* emu;
+    musdoom_emulator_t* restored;
+    musdoom_emulator_t* other;
+    int16_t expected[2 * 2000], actual[2 * 2000];
+    uint8_t state[16384];
+    size_t size, query;
+    int q;
+
+    printf("Testing state save/load... ");
+
+    for (q = 0; q < 3; q++) {
+        musdoom_config_init(&config);
+        config.resampler = (musdoom_resampler_t)resamplers[q];
+        config.opl_type = q == 1 ? MUSDOOM_OPL2 : MUSDOOM_OPL3;
+        emu = musdoom_create(&config);
+        restored = musdoom_create(&config);
+        assert(emu != NULL && restored != NULL);
+        assert(musdoom_save_state(emu, NULL, 0, &size) == MUSDOOM_ERR_INVALID_PARAM);
+        assert(musdoom_load_genmidi(emu, genmidi, genmidi_size) == MUSDOOM_OK);
+        assert(musdoom_load(emu, test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+        assert(musdoom_load_genmidi(restored, genmidi, genmidi_size) == MUSDOOM_OK);
+        assert(musdoom_load(restored, test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+
+        // Save mid-note, then both carry on identically
+        assert(musdoom_start(emu, 1) == MUSDOOM_OK);
+        musdoom_set_volume(emu, 90);
+        musdoom_generate_samples(emu, expected, 1234);
+        assert(musdoom_save_state(emu, NULL, 0, &query) == MUSDOOM_OK);
+        assert(query > 0 && query <= sizeof(state));
+        assert(musdoom_save_state(emu, state, query - 1, &size) == MUSDOOM_ERR_INVALID_PARAM);
+        assert(musdoom_save_state(emu, state, sizeof(state), &size) == MUSDOOM_OK);
+        assert(size == query);
+
+        assert(musdoom_load_state(restored, state, size) == MUSDOOM_OK);
+        assert(musdoom_is_playing(restored));
+        assert(musdoom_get_volume(restored) == 90);
+        assert(musdoom_get_position_ms(restored) == musdoom_get_position_ms(emu));
+        musdoom_generate_samples(emu, expected, 2000);
+        musdoom_generate_samples(restored, actual, 2000);
+        assert(memcmp(expected, actual, sizeof(expected)) == 0);
+
+        // Loading rewinds an emulator that has moved on
+        assert(musdoom_load_state(emu, state, size) == MUSDOOM_OK);
+        musdoom_generate_samples(emu, expected, 2000);
+        assert(memcmp(expected, actual, sizeof(expected)) == 0);
+
+        // Damaged state, or state for other settings, is refused and
+        // leaves the emulator as it was
+        musdoom_generate_samples(emu, expected, 2000);
+        assert(musdoom_load_state(restored, state, size - 1) == MUSDOOM_ERR_INVALID_DATA);
+        state[4]++;
+        assert(musdoom_load_state(restored, state, size) == MUSDOOM_ERR_INVALID_DATA);
+        state[4]--;
+        other = musdoom_create(&config);
+        assert(musdoom_load_genmidi(other, genmidi, genmidi_size) == MUSDOOM_OK);
+        assert(musdoom_load(other, test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+        check_state_voices(other, state, size);
+        musdoom_destroy(other);
+        config.opl_type = q == 1 ? MUSDOOM_OPL3 : MUSDOOM_OPL2;
+        other = musdoom_create(&config);
+        assert(musdoom_load(other, test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+        assert(musdoom_load_state(other, state, size) == MUSDOOM_ERR_INVALID_DATA);
+        musdoom_destroy(other);
+        musdoom_generate_samples(restored, actual, 2000);
+        assert(memcmp(expected, actual, sizeof(expected)) == 0);
+
+        assert(musdoom_load_state(NULL, state, size) == MUSDOOM_ERR_INVALID_PARAM);
+        assert(musdoom_load_state(restored, NULL, size) == MUSDOOM_ERR_INVALID_PARAM);
+        assert(musdoom_save_state(emu, state, sizeof(state), NULL) == MUSDOOM_ERR_INVALID_PARAM);
+        musdoom_destroy(emu);
+        musdoom_destroy(restored);
+    }
+
+    printf("OK\n");
+}
+
+void test_write_stats(void) {
+    static int16_t buffer[2 * 44100 * 2];
+    musdoom_emulator_t* emu;
+    uint64_t writes, suppressed;
+
+    printf("Testing write stats... ");
+
+    emu = musdoom_create(NULL);
+    assert(emu != NULL);
+    assert(musdoom_load_genmidi(emu, genmidi, genmidi_size) == MUSDOOM_OK);
+    assert(musdoom_load(emu, test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+
+    // Each loop replays the note, rewriting registers with the values
+    // they already hold
+    assert(musdoom_start(emu, 1) == MUSDOOM_OK);
+    musdoom_generate_samples(emu, buffer, 44100 * 2);
+    assert(musdoom_get_write_stats(emu, &writes, &suppressed) == MUSDOOM_OK);
+    assert(suppressed > 0 && suppressed < writes);
+
+    musdoom_reset_write_stats(emu);
+    assert(musdoom_get_write_stats(emu, &writes, &suppressed) == MUSDOOM_OK);
+    assert(writes == 0 && suppressed == 0);
+    assert(musdoom_get_write_stats(emu, NULL, NULL) == MUSDOOM_OK);
+    assert(musdoom_get_write_stats(NULL, &writes, &suppressed) == MUSDOOM_ERR_INVALID_PARAM);
+    musdoom_reset_write_stats(NULL);
+
+    musdoom_destroy(emu);
+    printf("OK\n");
+}
+
+void test_clone(void) {
+    static const int resamplers[2] = { MUSDOOM_RESAMPLER_LINEAR, MUSDOOM_RESAMPLER_SINC };
+    musdoom_config_t config;
+    musdoom_emulator_t* emu;
+    musdoom_emulator_t* reference;
+    musdoom_emulator_t* clone;
+    int16_t expected[2 * 2000], actual[2 * 2000];
+    uint8_t* bank;
+    int q;
+
+    printf("Testing clone... ");
+
+    assert(musdoom_clone(NULL) == NULL);
+    bank = (uint8_t*)malloc(genmidi_size);
+    assert(bank != NULL);
+    memcpy(bank, genmidi, genmidi_size);
+    bank[8 + 4] ^= 0x0f;
+
+    for (q = 0; q < 2; q++) {
+        musdoom_config_init(&config);
+        config.resampler = (musdoom_resampler_t)resamplers[q];
+        emu = musdoom_create(&config);
+        reference = musdoom_create(&config);
+        assert(emu != NULL && reference != NULL);
+        assert(musdoom_load_genmidi(emu, genmidi, genmidi_size) == MUSDOOM_OK);
+        assert(musdoom_load(emu, test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+        assert(musdoom_load_genmidi(reference, genmidi, genmidi_size) == MUSDOOM_OK);
+        assert(musdoom_load(reference, test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+        assert(musdoom_start(emu, 1) == MUSDOOM_OK);
+        assert(musdoom_start(reference, 1) == MUSDOOM_OK);
+        musdoom_generate_samples(emu, expected, 1234);
+        musdoom_generate_samples(reference, expected, 1234);
+
+        // A clone taken mid-note carries on exactly like the original
+        clone = musdoom_clone(emu);
+        assert(clone != NULL);
+        assert(musdoom_is_playing(clone));
+        assert(musdoom_get_position_ms(clone) == musdoom_get_position_ms(emu));
+        musdoom_generate_samples(emu, expected, 2000);
+        musdoom_generate_samples(clone, actual, 2000);
+        assert(memcmp(expected, actual, sizeof(expected)) == 0);
+        musdoom_generate_samples(reference, actual, 2000);
+        assert(memcmp(expected, actual, sizeof(expected)) == 0);
+
+        // New instruments in the clone leave the original alone
+        assert(musdoom_load_genmidi(clone, bank, genmidi_size) == MUSDOOM_OK);
+        musdoom_generate_samples(clone, actual, 2000);
+        musdoom_generate_samples(emu, expected, 2000);
+        musdoom_generate_samples(reference, actual, 2000);
+        assert(memcmp(expected, actual, sizeof(expected)) == 0);
+        musdoom_destroy(clone);
+
+        // A clone outlives its original
+        clone = musdoom_clone(emu);
+        assert(clone != NULL);
+        musdoom_destroy(emu);
+        musdoom_seek_ms(clone, 500);
+        musdoom_seek_ms(reference, 500);
+        musdoom_generate_samples(clone, expected, 2000);
+        musdoom_generate_samples(reference, actual, 2000);
+        assert(memcmp(expected, actual, sizeof(expected)) == 0);
+        musdoom_destroy(clone);
+        musdoom_destroy(reference);
+    }
+
+    free(bank);
+    printf("OK\n");
+}
+
+void test_genmidi_bank(void) {
+    musdoom_genmidi_t* bank;
+    musdoom_emulator_t* emus[3];
+    int16_t expected[2 * 2000], actual[2 * 2000];
+    int i;
+
+    printf("Testing shared GENMIDI bank... ");
+
+    assert(musdoom_genmidi_create(NULL, 0) == NULL);
+    assert(musdoom_genmidi_create(genmidi, 100) == NULL);
+    assert(musdoom_genmidi_create(test_mus, sizeof(test_mus)) == NULL);
+    bank = musdoom_genmidi_create(genmidi, genmidi_size);
+    assert(bank != NULL);
+    assert(musdoom_genmidi_retain(bank) == bank);
+    musdoom_genmidi_release(bank);
+
+    // Emulators sharing a bank play like one that loaded its own copy,
+    // and keep it alive after the caller lets go
+    for (i = 0; i < 3; i++) {
+        emus[i] = musdoom_create(NULL);
+        assert(emus[i] != NULL);
+        assert(musdoom_load(emus[i], test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+    }
+    assert(musdoom_load_genmidi(emus[0], genmidi, genmidi_size) == MUSDOOM_OK);
+    assert(musdoom_set_genmidi(emus[1], bank) == MUSDOOM_OK);
+    assert(musdoom_set_genmidi(emus[2], bank) == MUSDOOM_OK);
+    assert(musdoom_set_genmidi(emus[2], NULL) == MUSDOOM_ERR_INVALID_PARAM);
+    assert(musdoom_set_genmidi(NULL, bank) == MUSDOOM_ERR_INVALID_PARAM);
+    musdoom_genmidi_release(bank);
+    musdoom_genmidi_release(NULL);
+
+    assert(musdoom_start(emus[0], 0) == MUSDOOM_OK);
+    musdoom_generate_samples(emus[0], expected, 2000);
+    for (i = 1; i < 3; i++) {
+        assert(musdoom_start(emus[i], 0) == MUSDOOM_OK);
+        musdoom_generate_samples(emus[i], actual, 2000);
+        assert(memcmp(expected, actual, sizeof(expected)) == 0);
+    }
+
+    // Switching banks mid-note keeps the notes playing
+    musdoom_destroy(emus[1]);
+    assert(musdoom_load_genmidi(emus[2], genmidi, genmidi_size) == MUSDOOM_OK);
+    musdoom_generate_samples(emus[0], expected, 2000);
+    musdoom_generate_samples(emus[2], actual, 2000);
+    assert(memcmp(expected, actual, sizeof(expected)) == 0);
+
+    musdoom_destroy(emus[0]);
+    musdoom_destroy(emus[2]);
+    printf("OK\n");
+}
+
+void test_mus_to_midi(void) {
+    // test_mus as a type 0 MIDI file at 70 ticks per quarter note (MUS
+    // ticks at 120 bpm)
+    static const uint8_t expected[] = {
+        'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 0x46,
+        'M', 'T', 'r', 'k', 0, 0, 0, 16,
+        0, 0xb0, 0x7b, 0,       // All notes off when the channel is first used
+        0, 0x90, 60, 100,       // Note on
+        70, 0x80, 60, 0,        // Note off
+        70, 0xff, 0x2f, 0       // End of track
+    };
+    uint8_t buffer[64];
+    const uint8_t* midi;
+    uint8_t* owned;
+    size_t size;
+    musdoom_midi_converter_t* converter;
+    int i;
+
+    printf("Testing MUS to MIDI... ");
+
+    assert(musdoom_mus_to_midi(test_mus, sizeof(test_mus), NULL, 0, &size) == MUSDOOM_OK);
+    assert(size == sizeof(expected));
+    memset(buffer, 0xaa, sizeof(buffer));
+    assert(musdoom_mus_to_midi(test_mus, sizeof(test_mus), buffer, sizeof(buffer), &size) == MUSDOOM_OK);
+    assert(size == sizeof(expected));
+    assert(memcmp(buffer, expected, sizeof(expected)) == 0);
+
+    // Too small a buffer is left alone past its end
+    memset(buffer, 0xaa, sizeof(buffer));
+    assert(musdoom_mus_to_midi(test_mus, sizeof(test_mus), buffer, 10, &size) == MUSDOOM_ERR_INVALID_PARAM);
+    assert(size == sizeof(expected));
+    assert(memcmp(buffer, expected, 10) == 0 && buffer[10] == 0xaa);
+
+    // A converter reuses its buffer
+    converter = musdoom_midi_converter_create();
+    assert(converter != NULL);
+    for (i = 0; i < 2; i++) {
+        assert(musdoom_midi_converter_convert(converter, test_mus, sizeof(test_mus), &midi, &size) == MUSDOOM_OK);
+        assert(size == sizeof(expected));
+        assert(memcmp(midi, expected, sizeof(expected)) == 0);
+    }
+
+    // Its output can be taken without a copy, once; the next conversion
+    // gets a new buffer
+    assert(musdoom_midi_converter_take(converter, &owned, &size) == MUSDOOM_OK);
+    assert(owned == midi && size == sizeof(expected));
+    assert(musdoom_midi_converter_take(converter, &owned, &size) == MUSDOOM_ERR_NOT_INITIALIZED);
+    assert(musdoom_midi_converter_convert(converter, test_mus, sizeof(test_mus), &midi, &size) == MUSDOOM_OK);
+    assert(midi != owned && memcmp(midi, owned, sizeof(expected)) == 0);
+    musdoom_free(owned);
+
+    // Not MUS, or cut off before the end of the score
+    assert(musdoom_mus_to_midi(expected, sizeof(expected), NULL, 0, &size) == MUSDOOM_ERR_INVALID_DATA);
+    assert(musdoom_mus_to_midi(test_mus, sizeof(test_mus) - 1, NULL, 0, &size) == MUSDOOM_ERR_INVALID_DATA);
+    assert(musdoom_midi_converter_convert(converter, test_mus, 12, &midi, &size) == MUSDOOM_ERR_INVALID_DATA);
+    assert(musdoom_midi_converter_convert(converter, test_mus, sizeof(test_mus) - 1, &midi, &size) == MUSDOOM_ERR_INVALID_DATA);
+    assert(musdoom_midi_converter_take(converter, &owned, &size) == MUSDOOM_ERR_NOT_INITIALIZED);
+    assert(musdoom_midi_converter_take(NULL, &owned, &size) == MUSDOOM_ERR_INVALID_PARAM);
+    assert(musdoom_mus_to_midi(test_mus, sizeof(test_mus), NULL, 0, NULL) == MUSDOOM_ERR_INVALID_PARAM);
+    assert(musdoom_midi_converter_convert(NULL, test_mus, sizeof(test_mus), &midi, &size) == MUSDOOM_ERR_INVALID_PARAM);
+
+    musdoom_midi_converter_destroy(converter);
+    printf("OK\n");
+}
+
+void test_load_midi(void) {
+    // Type 1: the tempo doubles for the first beat and halves for the
+    // second, while another track holds a note through both
+    static const uint8_t tempo_midi[] = {
+        'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, 2, 0, 70,
+        'M', 'T', 'r', 'k', 0, 0, 0, 19,
+        0x00, 0xff, 0x51, 0x03, 0x03, 0xd0, 0x90,          // 250000 us
+        0x46, 0xff, 0x51, 0x03, 0x0f, 0x42, 0x40,          // 1000000 us
+        0x00, 0xff, 0x2f, 0x00,
+        'M', 'T', 'r', 'k', 0, 0, 0, 13,
+        0x00, 0x90, 60, 100,
+        0x81, 0x0c, 0x80, 60, 0,                           // Delay 140
+        0x00, 0xff, 0x2f, 0x00
+    };
+    // A program change, full volume and note 60 held for 96 ticks; the
+    // malformed copy sets the top bit of every data byte
+    static const uint8_t note_midi[] = {
+        'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 70,
+        'M', 'T', 'r', 'k', 0, 0, 0, 19,
+        0x00, 0xc0, 0x1e,
+        0x00, 0xb0, 0x07, 0x7f,
+        0x00, 0x90, 0x3c, 0x70,
+        0x60, 0x80, 0x3c, 0x00,
+        0x00, 0xff, 0x2f, 0x00
+    };
+    static const uint8_t malformed_midi[] = {
+        'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0, 70,
+        'M', 'T', 'r', 'k', 0, 0, 0, 19,
+        0x00, 0xc0, 0x9e,
+        0x00, 0xb0, 0x87, 0xff,
+        0x00, 0x90, 0xbc, 0xf0,
+        0x60, 0x80, 0xbc, 0x80,
+        0x00, 0xff, 0x2f, 0x00
+    };
+    uint8_t midi[64];
+    size_t size;
+    musdoom_emulator_t* emu;
+    musdoom_emulator_t* reference;
+    int16_t expected[2 * 4000], actual[2 * 4000];
+
+    printf("Testing MIDI loading... ");
+
+    // The converted test song plays as the MUS does
+    assert(musdoom_mus_to_midi(test_mus, sizeof(test_mus), midi, sizeof(midi), &size) == MUSDOOM_OK);
+    emu = musdoom_create(NULL);
+    reference = musdoom_create(NULL);
+    assert(emu != NULL && reference != NULL);
+    assert(musdoom_load_genmidi(emu, genmidi, genmidi_size) == MUSDOOM_OK);
+    assert(musdoom_load_genmidi(reference, genmidi, genmidi_size) == MUSDOOM_OK);
+    assert(musdoom_load(reference, test_mus, sizeof(test_mus)) == MUSDOOM_OK);
+    assert(musdoom_load_midi(emu, midi, size) == MUSDOOM_OK);
+    assert(musdoom_get_length_ticks(emu) == musdoom_get_length_ticks(reference));
+    assert(musdoom_start(emu, 1) == MUSDOOM_OK);
+    assert(musdoom_start(reference, 1) == MUSDOOM_OK);
+    musdoom_generate_samples(emu, actual, 4000);
+    musdoom_generate_samples(reference, expected, 4000);
+    assert(memcmp(expected, actual, sizeof(expected)) == 0);
+    musdoom_seek_ms(emu, 900);
+    musdoom_seek_ms(reference, 900);
+    musdoom_generate_samples(emu, actual, 4000);
+    musdoom_generate_samples(reference, expected, 4000);
+    assert(memcmp(expected, actual, sizeof(expected)) == 0);
+
+    // Data bytes with the top bit set are read as their low seven bits
+    musdoom_destroy(emu);
+    musdoom_destroy(reference);
+    emu = musdoom_create(NULL);
+    reference = musdoom_create(NULL);
+    assert(emu != NULL && reference != NULL);
+    assert(musdoom_load_genmidi(emu, genmidi, genmidi_size) == MUSDOOM_OK);
+    assert(musdoom_load_genmidi(reference, genmidi, genmidi_size) == MUSDOOM_OK);
+    assert(musdoom_load_midi(reference, note_midi, sizeof(note_midi)) == MUSDOOM_OK);
+    assert(musdoom_load_midi(emu, malformed_midi, sizeof(malformed_midi)) == MUSDOOM_OK);
+    assert(musdoom_start(emu, 0) == MUSDOOM_OK);
+    assert(musdoom_start(reference, 0) == MUSDOOM_OK);
+    musdoom_generate_samples(emu, actual, 4000);
+    musdoom_generate_samples(reference, expected, 4000);
+    assert(memcmp(expected, actual, sizeof(expected)) == 0);
+
+    // Tempo changes in one track time the others: 250 ms + 1000 ms
+    assert(musdoom_load_midi(emu, tempo_midi, sizeof(tempo_midi)) == MUSDOOM_OK);
+    assert(musdoom_get_length_ticks(emu) == 175);
+    assert(musdoom_get_length_ms(emu) == 1250);
+
+    // Not MIDI
+    assert(musdoom_load_midi(emu, test_mus, sizeof(test_mus)) == MUSDOOM_ERR_INVALID_DATA);
+    assert(musdoom_load_midi(emu, tempo_midi, sizeof(tempo_midi) - 1) == MUSDOOM_ERR_INVALID_DATA);
+    assert(musdoom_start(emu, 0) == MUSDOOM_ERR_INVALID_PARAM);
+    assert(musdoom_load_midi(emu, NULL, 0) == MUSDOOM_ERR_INVALID_PARAM);
+    assert(musdoom_load_midi(NULL, midi, size) == MUSDOOM_ERR_INVALID_PARAM);
+
+    musdoom_destroy(emu);
+    musdoom_destroy(reference);
+    printf("OK\n");
+}
+
+int main(int argc, char** argv) {
     printf("=== libMusDoom API Tests ===\n\n");
     
+    assert(argc > 1);
+    genmidi = read_file(argv[1], &genmidi_size);
+    assert(genmidi != NULL);
+    
     test_version();
     test_error_strings();
     test_config();
@@ -168,7 +1000,19 @@ int main(void) {
     test_generate_samples();
     test_playback_controls();
     test_invalid_load();
-    
+    test_native_rate();
+    test_length();
+    test_seek();
+    test_render_batch();
+    test_render_parallel();
+    test_state();
+    test_write_stats();
+    test_clone();
+    test_genmidi_bank();
+    test_mus_to_midi();
+    test_load_midi();
+    
+    free(genmidi);
     printf("\n=== All tests passed! ===\n");
     return 0;
 }
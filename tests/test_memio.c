@@ -0,0 +1,153 @@
+/**
+ * Memory stream tests for libMusDoom
+ *
+ * Checks that write streams grow past their size hint, can be reset and
+ * reused, hand their buffer over, and refuse writes that would overflow.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "memio.h"
+
+static uint8_t pattern[5000];
+
+void test_growth(void) {
+    MEMFILE* stream;
+    void* buf;
+    size_t size, i;
+
+    printf("Testing write stream growth... ");
+
+    // The hint is only a starting size: writes run well past it
+    stream = mem_fopen_write_size(16);
+    assert(stream != NULL);
+    for (i = 0; i < sizeof(pattern); i += 250) {
+        assert(mem_fwrite(&pattern[i], 1, 250, stream) == 250);
+    }
+    mem_get_buf(stream, &buf, &size);
+    assert(size == sizeof(pattern));
+    assert(memcmp(buf, pattern, sizeof(pattern)) == 0);
+    assert(mem_ftell(stream) == (long)sizeof(pattern));
+
+    // Reserving keeps the contents
+    assert(mem_reserve(stream, 100000) == 0);
+    mem_get_buf(stream, &buf, &size);
+    assert(size == sizeof(pattern));
+    assert(memcmp(buf, pattern, sizeof(pattern)) == 0);
+
+    mem_fclose(stream);
+    printf("OK\n");
+}
+
+void test_reset(void) {
+    MEMFILE* stream;
+    void* first;
+    void* buf;
+    size_t size;
+
+    printf("Testing write stream reset... ");
+
+    stream = mem_fopen_write();
+    assert(stream != NULL);
+    assert(mem_fwrite(pattern, 1, 3000, stream) == 3000);
+    mem_get_buf(stream, &first, &size);
+
+    // A reset stream is empty but writes into the buffer it already has
+    mem_reset(stream);
+    mem_get_buf(stream, &buf, &size);
+    assert(size == 0 && mem_ftell(stream) == 0);
+    assert(mem_fwrite(&pattern[100], 1, 200, stream) == 200);
+    mem_get_buf(stream, &buf, &size);
+    assert(buf == first && size == 200);
+    assert(memcmp(buf, &pattern[100], 200) == 0);
+
+    mem_fclose(stream);
+    printf("OK\n");
+}
+
+void test_take_buf(void) {
+    MEMFILE* stream;
+    void* taken;
+    void* buf;
+    size_t size;
+
+    printf("Testing write stream handoff... ");
+
+    stream = mem_fopen_write_size(64);
+    assert(stream != NULL);
+    assert(mem_fwrite(pattern, 4, 10, stream) == 10);
+
+    // The caller gets the buffer itself and the stream is left empty
+    taken = mem_take_buf(stream, &size);
+    assert(taken != NULL && size == 40);
+    assert(memcmp(taken, pattern, 40) == 0);
+    mem_get_buf(stream, &buf, &size);
+    assert(buf == NULL && size == 0 && mem_ftell(stream) == 0);
+
+    // It can still be written, into a new buffer
+    assert(mem_fwrite(&pattern[40], 1, 1500, stream) == 1500);
+    mem_get_buf(stream, &buf, &size);
+    assert(buf != taken && size == 1500);
+    assert(memcmp(buf, &pattern[40], 1500) == 0);
+    assert(memcmp(taken, pattern, 40) == 0);
+
+    free(taken);
+    mem_fclose(stream);
+    printf("OK\n");
+}
+
+void test_overflow(void) {
+    MEMFILE* stream;
+    uint8_t byte = 0;
+    void* buf;
+    size_t size;
+
+    printf("Testing write stream overflow... ");
+
+    stream = mem_fopen_write();
+    assert(stream != NULL);
+    assert(mem_fwrite(pattern, 1, 10, stream) == 10);
+
+    // Sizes that overflow size_t write nothing and return a short count
+    assert(mem_fwrite(&byte, 2, ((size_t)-1) / 2 + 1, stream) == 0);
+    assert(mem_fwrite(&byte, 1, (size_t)-1, stream) == 0);
+    assert(mem_reserve(stream, (size_t)-1) != 0);
+    mem_get_buf(stream, &buf, &size);
+    assert(size == 10 && mem_ftell(stream) == 10);
+    assert(memcmp(buf, pattern, 10) == 0);
+
+    // Writing still works afterwards
+    assert(mem_fwrite(&pattern[10], 1, 10, stream) == 10);
+    mem_get_buf(stream, &buf, &size);
+    assert(size == 20 && memcmp(buf, pattern, 20) == 0);
+    mem_fclose(stream);
+
+    // Read streams cannot grow
+    stream = mem_fopen_read(pattern, sizeof(pattern));
+    assert(stream != NULL);
+    assert(mem_reserve(stream, 10) != 0);
+    mem_fclose(stream);
+
+    printf("OK\n");
+}
+
+int main(void) {
+    size_t i;
+
+    printf("=== libMusDoom Memory Stream Tests ===\n\n");
+
+    for (i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+
+    test_growth();
+    test_reset();
+    test_take_buf();
+    test_overflow();
+
+    printf("\n=== All tests passed! ===\n");
+    return 0;
+}
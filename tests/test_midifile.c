@@ -0,0 +1,165 @@
+/**
+ * MIDI file parser tests for libMusDoom
+ *
+ * Parses MIDI files held in memory: the converter's output for a MUS
+ * song, and a type 1 file with running status, meta and SysEx events.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "libmusdoom.h"
+#include "midifile.h"
+
+// Note 60 held for 70 ticks, as in test_api
+static const uint8_t test_mus[] = {
+    'M', 'U', 'S', 0x1a,
+    8, 0, 16, 0, 1, 0, 0, 0, 0, 0, 0, 0,
+    0x90, 0xbc, 100, 70,
+    0x80, 60, 70,
+    0x60
+};
+
+// Type 1: a conductor track with tempo and SysEx, and a note track using
+// running status
+static const uint8_t test_midi[] = {
+    'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, 2, 0x01, 0xe0,
+    'M', 'T', 'r', 'k', 0, 0, 0, 19,
+    0x00, 0xff, 0x51, 0x03, 0x07, 0xa1, 0x20,          // Tempo 500000 us
+    0x00, 0xf0, 0x05, 0x7e, 0x7f, 0x09, 0x01, 0xf7,    // GM on
+    0x00, 0xff, 0x2f, 0x00,
+    'M', 'T', 'r', 'k', 0, 0, 0, 19,
+    0x00, 0xc3, 0x1e,                                  // Program 30
+    0x00, 0x93, 0x40, 0x70,                            // Note on 64
+    0x60, 0x43, 0x00,                                  // Running status
+    0x83, 0x60, 0xe3, 0x00, 0x50,                      // Bend, delay 480
+    0x00, 0xff, 0x2f, 0x00
+};
+
+static void test_converted(void) {
+    uint8_t midi[64];
+    size_t size;
+    midi_file_t* file;
+    midi_track_iter_t* iter;
+    midi_event_t* event;
+    unsigned int count = 0;
+
+    printf("Testing converted MUS... ");
+
+    assert(musdoom_mus_to_midi(test_mus, sizeof(test_mus), midi, sizeof(midi), &size) == MUSDOOM_OK);
+    file = MIDI_LoadData(midi, size);
+    assert(file != NULL);
+    assert(MIDI_NumTracks(file) == 1);
+    assert(MIDI_GetFileTimeDivision(file) == 70);
+
+    iter = MIDI_IterateTrack(file, 0);
+    assert(iter != NULL);
+    while (MIDI_GetNextEvent(iter, &event)) {
+        count++;
+    }
+    assert(count == 4);
+    assert(event->event_type == MIDI_EVENT_META);
+    assert(event->data.meta.type == MIDI_META_END_OF_TRACK);
+    assert(event->delta_time == 70);
+
+    MIDI_FreeIterator(iter);
+    MIDI_FreeFile(file);
+    printf("OK\n");
+}
+
+static void test_type1(void) {
+    midi_file_t* file;
+    midi_track_iter_t* iter;
+    midi_event_t* event;
+
+    printf("Testing type 1 file... ");
+
+    file = MIDI_LoadData(test_midi, sizeof(test_midi));
+    assert(file != NULL);
+    assert(MIDI_NumTracks(file) == 2);
+    assert(MIDI_GetFileTimeDivision(file) == 480);
+
+    // Meta and SysEx data point into the file
+    iter = MIDI_IterateTrack(file, 0);
+    assert(MIDI_GetNextEvent(iter, &event));
+    assert(event->event_type == MIDI_EVENT_META);
+    assert(event->data.meta.type == MIDI_META_SET_TEMPO);
+    assert(event->data.meta.length == 3);
+    assert(event->data.meta.data == test_midi + 26);
+    assert(MIDI_GetNextEvent(iter, &event));
+    assert(event->event_type == MIDI_EVENT_SYSEX);
+    assert(event->data.sysex.length == 5);
+    assert(event->data.sysex.data == test_midi + 32);
+    assert(MIDI_GetNextEvent(iter, &event));
+    assert(!MIDI_GetNextEvent(iter, &event));
+    MIDI_FreeIterator(iter);
+
+    iter = MIDI_IterateTrack(file, 1);
+    assert(MIDI_GetNextEvent(iter, &event));
+    assert(event->event_type == MIDI_EVENT_PROGRAM_CHANGE);
+    assert(event->data.channel.channel == 3 && event->data.channel.param1 == 30);
+    MIDI_SetLoopPoint(iter);
+    assert(MIDI_GetNextEvent(iter, &event));
+    assert(event->event_type == MIDI_EVENT_NOTE_ON);
+    assert(event->data.channel.param1 == 64 && event->data.channel.param2 == 0x70);
+    assert(MIDI_GetDeltaTime(iter) == 0x60);
+    assert(MIDI_GetNextEvent(iter, &event));
+    assert(event->event_type == MIDI_EVENT_NOTE_ON);
+    assert(event->data.channel.channel == 3);
+    assert(event->data.channel.param1 == 0x43 && event->data.channel.param2 == 0);
+    assert(MIDI_GetNextEvent(iter, &event));
+    assert(event->event_type == MIDI_EVENT_PITCH_BEND);
+    assert(event->delta_time == 480);
+    assert(event->data.channel.param2 == 0x50);
+    assert(MIDI_GetNextEvent(iter, &event));
+    assert(!MIDI_GetNextEvent(iter, &event));
+    MIDI_RestartAtLoopPoint(iter);
+    assert(MIDI_GetNextEvent(iter, &event));
+    assert(event->event_type == MIDI_EVENT_NOTE_ON && event->data.channel.param2 == 0x70);
+    MIDI_FreeIterator(iter);
+
+    MIDI_FreeFile(file);
+    printf("OK\n");
+}
+
+static void test_invalid(void) {
+    uint8_t data[sizeof(test_midi)];
+    size_t i;
+
+    printf("Testing invalid files... ");
+
+    // Every truncation fails cleanly
+    for (i = 0; i < sizeof(test_midi); i++) {
+        assert(MIDI_LoadData(test_midi, i) == NULL);
+    }
+    assert(MIDI_LoadData(NULL, 0) == NULL);
+
+    // Format 2, bad header length, unknown event, running status with
+    // nothing to repeat
+    memcpy(data, test_midi, sizeof(data));
+    data[9] = 2;
+    assert(MIDI_LoadData(data, sizeof(data)) == NULL);
+    memcpy(data, test_midi, sizeof(data));
+    data[7] = 7;
+    assert(MIDI_LoadData(data, sizeof(data)) == NULL);
+    memcpy(data, test_midi, sizeof(data));
+    data[50] = 0xf4;
+    assert(MIDI_LoadData(data, sizeof(data)) == NULL);
+    memcpy(data, test_midi, sizeof(data));
+    data[23] = 0x10;
+    assert(MIDI_LoadData(data, sizeof(data)) == NULL);
+
+    printf("OK\n");
+}
+
+int main(void) {
+    printf("=== libMusDoom MIDI File Tests ===\n\n");
+
+    test_converted();
+    test_type1();
+    test_invalid();
+
+    printf("\n=== All tests passed! ===\n");
+    return 0;
+}
@@ -0,0 +1,434 @@
+/**
+ * MUS player tests for libMusDoom
+ *
+ * Exercises the player internals directly. The GENMIDI lump path is
+ * passed as the first argument.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "doom_music.h"
+#include "resampler.h"
+
+#define TEST_RATE 44100
+
+// A single note on channel 0, held for 10 ticks
+static const uint8_t note_mus[] = {
+    'M', 'U', 'S', 0x1a,
+    8, 0,           // Score length
+    16, 0,          // Score start
+    1, 0,           // Primary channels
+    0, 0,           // Secondary channels
+    0, 0,           // Instrument count
+    0, 0,           // Padding
+    0x90, 0xbc, 100, 10,    // Play note 60, volume 100, delay 10
+    0x80, 60, 10,           // Release note 60, delay 10
+    0x60                    // End of score
+};
+
+// A score whose only event is an unused type with a one-tick delay
+static const uint8_t delay_mus[] = {
+    'M', 'U', 'S', 0x1a,
+    2, 0,           // Score length
+    16, 0,          // Score start
+    1, 0,           // Primary channels
+    0, 0,           // Secondary channels
+    0, 0,           // Instrument count
+    0, 0,           // Padding
+    0xf2, 1                 // Event type 7, delay 1
+};
+
+// A play note event cut off before its volume byte
+static const uint8_t truncated_mus[] = {
+    'M', 'U', 'S', 0x1a,
+    2, 0,           // Score length
+    16, 0,          // Score start
+    1, 0,           // Primary channels
+    0, 0,           // Secondary channels
+    0, 0,           // Instrument count
+    0, 0,           // Padding
+    0x90, 0xbc              // Play note 60, volume missing
+};
+
+static uint8_t* genmidi;
+static size_t genmidi_size;
+
+static uint8_t* read_file(const char* path, size_t* size) {
+    FILE* fp = fopen(path, "rb");
+    uint8_t* data;
+    long len;
+
+    if (!fp) return NULL;
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data = (uint8_t*)malloc((size_t)len);
+    if (data && fread(data, 1, (size_t)len, fp) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *size = (size_t)len;
+    return data;
+}
+
+// Build a score of `notes` short notes cycling over four channels: each
+// is held for two ticks and followed by a one-tick rest. When `panned`,
+// the channels are first panned hard left and hard right in turn
+static uint8_t* build_long_mus(int notes, int panned, size_t* size) {
+    size_t score_len = (size_t)notes * 7 + (panned ? 4 * 3 : 0) + 1;
+    uint8_t* mus = (uint8_t*)calloc(1, 16 + score_len);
+    uint8_t* p;
+    int i;
+
+    assert(mus != NULL);
+    memcpy(mus, "MUS\x1a", 4);
+    mus[4] = (uint8_t)(score_len & 0xff);
+    mus[5] = (uint8_t)(score_len >> 8);
+    mus[6] = 16;
+    mus[8] = 4;
+    p = mus + 16;
+    for (i = 0; panned && i < 4; i++) {
+        *p++ = (uint8_t)(0x40 | i);         // Change controller: pan
+        *p++ = 4;
+        *p++ = (i & 1) ? 127 : 0;
+    }
+    for (i = 0; i < notes; i++) {
+        uint8_t channel = (uint8_t)(i % 4);
+        uint8_t note = (uint8_t)(48 + (i * 7) % 36);
+
+        *p++ = (uint8_t)(0x90 | channel);   // Play note with volume, delay 2
+        *p++ = (uint8_t)(0x80 | note);
+        *p++ = (uint8_t)(64 + i % 64);
+        *p++ = 2;
+        *p++ = (uint8_t)(0x80 | channel);   // Release note, delay 1
+        *p++ = note;
+        *p++ = 1;
+    }
+    *p = 0x60;                              // End of score
+    *size = 16 + score_len;
+    return mus;
+}
+
+// Three notes on each of eight channels at once, more than there are
+// voices, with pitch bends reordering the voices; all are then released
+static uint8_t* build_chord_mus(size_t* size) {
+    uint8_t* mus = (uint8_t*)calloc(1, 16 + 256);
+    uint8_t* p;
+    int ch, n;
+
+    assert(mus != NULL);
+    memcpy(mus, "MUS\x1a", 4);
+    mus[6] = 16;
+    mus[8] = 8;
+    p = mus + 16;
+    for (ch = 0; ch < 8; ch++) {
+        for (n = 0; n < 3; n++) {
+            *p++ = (uint8_t)(0x10 | ch);                  // Play note
+            *p++ = (uint8_t)(0x80 | (40 + ch * 5 + n * 4));
+            *p++ = 100;
+        }
+        if (ch % 3 == 1) {
+            *p++ = (uint8_t)(0x20 | (ch - 1));            // Pitch bend
+            *p++ = 160;
+        }
+    }
+    *p++ = 0x80 | 0x20 | 7;                               // Pitch bend, delay 20
+    *p++ = 96;
+    *p++ = 20;
+    for (ch = 0; ch < 8; ch++) {
+        for (n = 0; n < 3; n++) {
+            *p++ = (uint8_t)ch;                           // Release note
+            *p++ = (uint8_t)(40 + ch * 5 + n * 4);
+        }
+    }
+    p[-2] |= 0x80;                                        // Delay 200 after the last
+    *p++ = 0x81;
+    *p++ = 0x48;
+    *p++ = 0x60;                                          // End of score
+    mus[4] = (uint8_t)(p - mus - 16);
+    *size = (size_t)(p - mus);
+    return mus;
+}
+
+static mus_player_t* create_player(const uint8_t* mus, size_t mus_size) {
+    mus_player_t* player = mus_player_create(TEST_RATE);
+    assert(player != NULL);
+    assert(mus_player_load_instruments(player, genmidi, genmidi_size) == 0);
+    assert(mus_player_load(player, mus, mus_size) == 0);
+    return player;
+}
+
+void test_write_stats(void) {
+    static int16_t buffer[2 * TEST_RATE];
+    uint64_t writes, suppressed, init_writes;
+    mus_player_t* player;
+
+    printf("Testing register shadow... ");
+
+    player = create_player(note_mus, sizeof(note_mus));
+    mus_player_get_write_stats(player, &init_writes, &suppressed);
+    assert(init_writes > 0);
+
+    // Each loop replays the note on the same voice, reloading its
+    // instrument and frequency with unchanged values
+    mus_player_start(player, 1);
+    mus_player_generate(player, buffer, TEST_RATE);
+    assert(mus_player_is_playing(player));
+
+    mus_player_get_write_stats(player, &writes, &suppressed);
+    assert(writes > init_writes);
+    assert(suppressed > 0);
+    assert(suppressed < writes - init_writes);
+
+    // Either output may be omitted
+    mus_player_get_write_stats(player, NULL, &suppressed);
+    mus_player_get_write_stats(player, &writes, NULL);
+    mus_player_get_write_stats(NULL, &writes, &suppressed);
+
+    mus_player_destroy(player);
+    printf("OK\n");
+}
+
+void test_event_stream(void) {
+    int16_t buffer[2 * 512];
+    mus_player_t* player;
+
+    printf("Testing decoded event stream... ");
+
+    // The delay of a dropped event still holds back the end of score:
+    // one tick is exactly 315 samples at 44100 Hz
+    player = create_player(delay_mus, sizeof(delay_mus));
+    mus_player_start(player, 0);
+    mus_player_generate(player, buffer, 315);
+    assert(mus_player_is_playing(player));
+    mus_player_generate(player, buffer, 1);
+    assert(!mus_player_is_playing(player));
+
+    // Looping replays the delay rather than spinning on the end of score
+    mus_player_start(player, 1);
+    mus_player_generate(player, buffer, 512);
+    assert(mus_player_is_playing(player));
+    assert(mus_player_get_position_ms(player) == (512 - 315) * 1000 / TEST_RATE);
+    mus_player_destroy(player);
+
+    // A truncated score stops, even when looping
+    player = create_player(truncated_mus, sizeof(truncated_mus));
+    mus_player_start(player, 1);
+    mus_player_generate(player, buffer, 16);
+    assert(!mus_player_is_playing(player));
+    mus_player_destroy(player);
+
+    printf("OK\n");
+}
+
+void test_seek(void) {
+    static int16_t expected[2 * 4096], actual[2 * 4096];
+    const uint64_t target = 3 * 315 * 250 + 123;
+    uint8_t* mus;
+    size_t mus_size;
+    uint64_t length;
+    mus_player_t* player;
+    mus_player_t* reference;
+    int i, panned;
+
+    printf("Testing seek... ");
+
+    // 600 notes give 1201 events, enough for several seek keyframes; the
+    // panned score checks that in OPL3 mode a seek leaves the chip as a
+    // fresh start does
+    for (panned = 0; panned <= 1; panned++) {
+        mus = build_long_mus(600, panned, &mus_size);
+        player = create_player(mus, mus_size);
+        reference = create_player(mus, mus_size);
+        mus_player_set_opl3_mode(player, 1);
+        mus_player_set_opl3_mode(reference, 1);
+        length = mus_player_get_length_samples(player);
+        assert(length == 600 * 3 * 315);
+
+        // Seeking to the start sounds exactly like a fresh start
+        mus_player_start(reference, 0);
+        mus_player_generate(reference, expected, 4096);
+        mus_player_start(player, 0);
+        mus_player_generate(player, actual, 1000);
+        mus_player_seek(player, 0);
+        assert(mus_player_get_position_ms(player) == 0);
+        mus_player_generate(player, actual, 4096);
+        assert(memcmp(expected, actual, sizeof(expected)) == 0);
+
+        // A seek lands exactly on the target, whichever way it moves, and
+        // the audio there does not depend on where it came from
+        mus_player_seek(player, target);
+        assert(mus_player_get_position_ms(player) == target * 1000 / TEST_RATE);
+        mus_player_generate(player, expected, 4096);
+        mus_player_seek(player, length - 1000);
+        mus_player_seek(player, target);
+        mus_player_generate(player, actual, 4096);
+        assert(memcmp(expected, actual, sizeof(expected)) == 0);
+
+        // This score's voices carry no feedback history across the seek,
+        // so the seeked audio is exactly that of continuous playback on a
+        // fresh chip, pan and all
+        mus_player_destroy(reference);
+        reference = create_player(mus, mus_size);
+        mus_player_set_opl3_mode(reference, 1);
+        mus_player_start(reference, 0);
+        for (i = 0; i < (int)(target / 4096); i++) {
+            mus_player_generate(reference, expected, 4096);
+        }
+        mus_player_generate(reference, expected, (size_t)(target % 4096));
+        mus_player_generate(reference, expected, 4096);
+        assert(memcmp(expected, actual, sizeof(expected)) == 0);
+
+        // A target past the end is clamped to it, unless looping wraps it
+        mus_player_seek(player, length + 5000);
+        assert(mus_player_get_position_ms(player) == mus_player_get_length_ms(player));
+        mus_player_generate(player, actual, 1);
+        assert(!mus_player_is_playing(player));
+        mus_player_start(player, 1);
+        mus_player_seek(player, length + 5000);
+        assert(mus_player_is_playing(player));
+        assert(mus_player_get_position_ms(player) == 5000 * 1000 / TEST_RATE);
+
+        mus_player_destroy(reference);
+        mus_player_destroy(player);
+        free(mus);
+    }
+    printf("OK\n");
+}
+
+void test_render_parallel(void) {
+    static const struct {
+        int rate;
+        int opl3;
+        int resampler;
+        int panned;
+    } configs[6] = {
+        { TEST_RATE, 1, opl_resampler_linear, 0 },
+        { TEST_RATE, 0, opl_resampler_linear, 0 },
+        { 22050, 1, opl_resampler_sinc, 0 },
+        { 32000, 1, opl_resampler_halfband, 0 },
+        { OPL_NATIVE_RATE, 1, opl_resampler_linear, 0 },
+        { TEST_RATE, 1, opl_resampler_linear, 1 }
+    };
+    uint8_t* mus;
+    size_t mus_size;
+    int16_t* expected;
+    int16_t* actual;
+    size_t frames;
+    int c, workers;
+
+    printf("Testing parallel rendering... ");
+
+    for (c = 0; c < 6; c++) {
+        mus_player_t* player = mus_player_create(configs[c].rate);
+        mus_player_t* reference = mus_player_create(configs[c].rate);
+
+        assert(player != NULL && reference != NULL);
+        mus = build_long_mus(300, configs[c].panned, &mus_size);
+        assert(mus_player_set_resampler(player, configs[c].resampler) == 0);
+        assert(mus_player_set_resampler(reference, configs[c].resampler) == 0);
+        mus_player_set_opl3_mode(player, configs[c].opl3);
+        mus_player_set_opl3_mode(reference, configs[c].opl3);
+        assert(mus_player_load_instruments(player, genmidi, genmidi_size) == 0);
+        assert(mus_player_load_instruments(reference, genmidi, genmidi_size) == 0);
+        assert(mus_player_load(player, mus, mus_size) == 0);
+        assert(mus_player_load(reference, mus, mus_size) == 0);
+
+        // The song and some of the tail after it
+        frames = (size_t)mus_player_get_length_samples(player) + 3000;
+        expected = (int16_t*)malloc(frames * 2 * sizeof(int16_t));
+        actual = (int16_t*)malloc(frames * 2 * sizeof(int16_t));
+        assert(expected != NULL && actual != NULL);
+        mus_player_start(reference, 0);
+        mus_player_generate(reference, expected, frames);
+
+        // Identical to serial rendering however it is split, also after
+        // the player has been used
+        for (workers = 1; workers <= 4; workers += 3) {
+            memset(actual, 0x55, frames * 2 * sizeof(int16_t));
+            assert(mus_player_render_parallel(player, actual, frames, workers) == 0);
+            assert(memcmp(expected, actual, frames * 2 * sizeof(int16_t)) == 0);
+            assert(!mus_player_is_playing(player));
+            mus_player_start(player, 1);
+            mus_player_generate(player, actual, 1000);
+        }
+
+        // Less than the song
+        assert(mus_player_render_parallel(player, actual, frames / 3, 4) == 0);
+        assert(memcmp(expected, actual, frames / 3 * 2 * sizeof(int16_t)) == 0);
+
+        free(expected);
+        free(actual);
+        mus_player_destroy(reference);
+        mus_player_destroy(player);
+        free(mus);
+    }
+    printf("OK\n");
+}
+
+void test_voice_stealing(void) {
+    static int16_t buffer[2 * 4096];
+    static const opl_driver_ver_t versions[3] = {
+        opl_doom1_1_666, opl_doom2_1_666, opl_doom_1_9
+    };
+    uint8_t* mus;
+    size_t mus_size;
+    mus_player_t* player;
+    int v, opl3, i;
+    long peak;
+
+    printf("Testing voice stealing... ");
+
+    mus = build_chord_mus(&mus_size);
+    for (v = 0; v < 3; v++) {
+        for (opl3 = 0; opl3 < 2; opl3++) {
+            player = create_player(mus, mus_size);
+            mus_player_set_driver_version(player, versions[v]);
+            mus_player_set_opl3_mode(player, opl3);
+            mus_player_start(player, 0);
+
+            // The chord sounds on every voice
+            mus_player_generate(player, buffer, 4096);
+            peak = 0;
+            for (i = 0; i < 2 * 4096; i++) {
+                peak = labs((long)buffer[i]) > peak ? labs((long)buffer[i]) : peak;
+            }
+            assert(peak > 1000);
+
+            // Every voice was released: the tail dies away
+            while (mus_player_is_playing(player)) {
+                mus_player_generate(player, buffer, 4096);
+            }
+            peak = 0;
+            for (i = 2 * 3072; i < 2 * 4096; i++) {
+                peak = labs((long)buffer[i]) > peak ? labs((long)buffer[i]) : peak;
+            }
+            assert(peak < 16);
+            mus_player_destroy(player);
+        }
+    }
+    free(mus);
+
+    printf("OK\n");
+}
+
+int main(int argc, char** argv) {
+    printf("=== libMusDoom MUS Player Tests ===\n\n");
+
+    assert(argc > 1);
+    genmidi = read_file(argv[1], &genmidi_size);
+    assert(genmidi != NULL);
+
+    test_write_stats();
+    test_event_stream();
+    test_voice_stealing();
+    test_seek();
+    test_render_parallel();
+
+    free(genmidi);
+    printf("\n=== All tests passed! ===\n");
+    return 0;
+}
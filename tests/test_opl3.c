@@ -0,0 +1,565 @@
+/**
+ * OPL3 core tests for libMusDoom
+ *
+ * Checks that the optimized render paths produce exactly the same
+ * output as the per-sample reference path. The core is compiled into the
+ * test so its waveform generator can be checked directly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "opl3.c"
+
+#define TEST_RATE 49716
+
+// Program a 2-op voice with a spread of waveform/feedback/LFO settings
+static void setup_voice(opl3_chip* chip, int bank, int ch, int seed) {
+    static const int op_offset[9] = { 0x00, 0x01, 0x02, 0x08, 0x09, 0x0a, 0x10, 0x11, 0x12 };
+    int array = bank << 8;
+    int op1 = op_offset[ch];
+    int op2 = op1 + 3;
+    unsigned int freq = 0x158 + (unsigned int)(seed * 37) % 0x2a0;
+
+    OPL3_WriteReg(chip, (Bit16u)(array | (0x20 + op1)), (Bit8u)(0x01 | ((seed & 1) << 7) | ((seed & 2) << 5)));
+    OPL3_WriteReg(chip, (Bit16u)(array | (0x20 + op2)), (Bit8u)(0x01 | ((seed & 4) << 4)));
+    OPL3_WriteReg(chip, (Bit16u)(array | (0x40 + op1)), (Bit8u)(0x10 + seed % 16));
+    OPL3_WriteReg(chip, (Bit16u)(array | (0x40 + op2)), (Bit8u)(seed % 8));
+    OPL3_WriteReg(chip, (Bit16u)(array | (0x60 + op1)), (Bit8u)(0xf0 - seed));
+    OPL3_WriteReg(chip, (Bit16u)(array | (0x60 + op2)), (Bit8u)(0xd4 + seed % 3));
+    OPL3_WriteReg(chip, (Bit16u)(array | (0x80 + op1)), (Bit8u)(0x35 + seed));
+    OPL3_WriteReg(chip, (Bit16u)(array | (0x80 + op2)), (Bit8u)(0x27));
+    OPL3_WriteReg(chip, (Bit16u)(array | (0xe0 + op1)), (Bit8u)(seed % 8));
+    OPL3_WriteReg(chip, (Bit16u)(array | (0xe0 + op2)), (Bit8u)((seed + 3) % 8));
+    OPL3_WriteReg(chip, (Bit16u)(array | (0xc0 + ch)), (Bit8u)(0x30 | ((seed % 8) << 1) | (seed & 1)));
+    OPL3_WriteReg(chip, (Bit16u)(array | (0xa0 + ch)), (Bit8u)(freq & 0xff));
+    OPL3_WriteReg(chip, (Bit16u)(array | (0xb0 + ch)), (Bit8u)(0x20 | ((seed % 8) << 2) | (freq >> 8)));
+}
+
+// Reference waveform generator from Nuked OPL3 1.8
+static Bit16s ref_calc_exp(Bit32u level) {
+    if (level > 0x1fff) {
+        level = 0x1fff;
+    }
+    return (exprom[level & 0xff] << 1) >> (level >> 8);
+}
+
+static Bit16s ref_calc_wave(Bit16u phase, Bit16u envelope, int wf) {
+    Bit16u out = 0;
+    Bit16u neg = 0;
+
+    phase &= 0x3ff;
+    switch (wf) {
+    case 0:
+        neg = (phase & 0x200) ? 0xffff : 0;
+        out = logsinrom[(phase & 0x100) ? (phase & 0xff) ^ 0xff : phase & 0xff];
+        break;
+    case 1:
+        if (phase & 0x200) {
+            out = 0x1000;
+        } else {
+            out = logsinrom[(phase & 0x100) ? (phase & 0xff) ^ 0xff : phase & 0xff];
+        }
+        break;
+    case 2:
+        out = logsinrom[(phase & 0x100) ? (phase & 0xff) ^ 0xff : phase & 0xff];
+        break;
+    case 3:
+        out = (phase & 0x100) ? 0x1000 : logsinrom[phase & 0xff];
+        break;
+    case 4:
+    case 5:
+        if (wf == 4 && (phase & 0x300) == 0x100) {
+            neg = 0xffff;
+        }
+        if (phase & 0x200) {
+            out = 0x1000;
+        } else if (phase & 0x80) {
+            out = logsinrom[((phase ^ 0xff) << 1) & 0xff];
+        } else {
+            out = logsinrom[(phase << 1) & 0xff];
+        }
+        break;
+    case 6:
+        neg = (phase & 0x200) ? 0xffff : 0;
+        break;
+    case 7:
+        if (phase & 0x200) {
+            neg = 0xffff;
+            phase = (phase & 0x1ff) ^ 0x1ff;
+        }
+        out = phase << 3;
+        break;
+    }
+    return ref_calc_exp(out + (envelope << 3)) ^ neg;
+}
+
+static void key_off(opl3_chip* chip, int bank, int ch) {
+    OPL3_WriteReg(chip, (Bit16u)((bank << 8) | (0xb0 + ch)), 0x10);
+}
+
+static void setup_chip(opl3_chip* chip) {
+    OPL3_Reset(chip, TEST_RATE);
+    OPL3_WriteReg(chip, 0x105, 0x01);
+    OPL3_WriteReg(chip, 0x01, 0x20);
+    OPL3_WriteReg(chip, 0xbd, 0xc0);
+}
+
+void test_generate_block(void) {
+    static opl3_chip ref, blk;
+    static Bit16s ref_buf[2 * 4096];
+    static Bit16s blk_buf[2 * 4096];
+    int step, ch, i;
+    Bit32u n;
+
+    printf("Testing OPL3_GenerateBlock... ");
+
+    setup_chip(&ref);
+    setup_chip(&blk);
+
+    for (step = 0; step < 24; step++) {
+        // Change register state between blocks, identically on both chips
+        for (ch = 0; ch < 9; ch++) {
+            if ((ch + step) % 3 == 0) {
+                setup_voice(&ref, step & 1, ch, step + ch);
+                setup_voice(&blk, step & 1, ch, step + ch);
+            } else if ((ch + step) % 3 == 1) {
+                key_off(&ref, step & 1, ch);
+                key_off(&blk, step & 1, ch);
+            }
+        }
+
+        n = 1 + (Bit32u)(step * 397) % 4096;
+        for (i = 0; i < (int)n; i++) {
+            OPL3_Generate(&ref, &ref_buf[2 * i]);
+        }
+        OPL3_GenerateBlock(&blk, blk_buf, n);
+
+        assert(memcmp(ref_buf, blk_buf, n * 2 * sizeof(Bit16s)) == 0);
+    }
+
+    printf("OK\n");
+}
+
+// Render the same span on both chips and compare, sample by sample on ref
+static void compare_span(opl3_chip* ref, opl3_chip* blk, Bit32u n) {
+    static Bit16s ref_buf[2 * 8192];
+    static Bit16s blk_buf[2 * 8192];
+    Bit32u i;
+
+    for (i = 0; i < n; i++) {
+        OPL3_Generate(ref, &ref_buf[2 * i]);
+    }
+    OPL3_GenerateBlock(blk, blk_buf, n);
+
+    assert(memcmp(ref_buf, blk_buf, n * 2 * sizeof(Bit16s)) == 0);
+}
+
+void test_idle_slots(void) {
+    static opl3_chip ref, blk;
+    int ch;
+
+    printf("Testing idle slot skipping... ");
+
+    // A freshly reset chip is silent; a buffered key-on must wake it
+    // mid-block
+    setup_chip(&ref);
+    setup_chip(&blk);
+    compare_span(&ref, &blk, 4096);
+    for (ch = 0; ch < 9; ch++) {
+        OPL3_WriteRegBuffered(&ref, (Bit16u)(0xb0 + ch), 0x31);
+        OPL3_WriteRegBuffered(&blk, (Bit16u)(0xb0 + ch), 0x31);
+    }
+    compare_span(&ref, &blk, 4096);
+
+    // Release every voice until the slots go idle with running phases,
+    // then key them on again
+    for (ch = 0; ch < 9; ch++) {
+        setup_voice(&ref, 0, ch, ch * 5);
+        setup_voice(&blk, 0, ch, ch * 5);
+    }
+    compare_span(&ref, &blk, 2048);
+    for (ch = 0; ch < 9; ch++) {
+        key_off(&ref, 0, ch);
+        key_off(&blk, 0, ch);
+    }
+    compare_span(&ref, &blk, 8192);
+    compare_span(&ref, &blk, 8192);
+    for (ch = 0; ch < 9; ch += 2) {
+        setup_voice(&ref, 0, ch, ch + 1);
+        setup_voice(&blk, 0, ch, ch + 1);
+    }
+    compare_span(&ref, &blk, 4096);
+
+    printf("OK\n");
+}
+
+void test_generate_opl2(void) {
+    static opl3_chip ref, opl2;
+    static Bit16s ref_buf[2 * 4096];
+    static Bit16s opl2_buf[2 * 4096];
+    int step, ch, i;
+    Bit32u n;
+
+    printf("Testing OPL3_GenerateBlockOPL2... ");
+
+    // OPL3 extensions stay disabled, as in the player's OPL2 mode
+    OPL3_Reset(&ref, TEST_RATE);
+    OPL3_Reset(&opl2, TEST_RATE);
+    OPL3_WriteReg(&ref, 0x01, 0x20);
+    OPL3_WriteReg(&opl2, 0x01, 0x20);
+
+    for (step = 0; step < 16; step++) {
+        for (ch = 0; ch < 9; ch++) {
+            if ((ch + step) % 3 == 0) {
+                setup_voice(&ref, 0, ch, step * 3 + ch);
+                setup_voice(&opl2, 0, ch, step * 3 + ch);
+            } else if ((ch + step) % 3 == 1) {
+                key_off(&ref, 0, ch);
+                key_off(&opl2, 0, ch);
+            }
+        }
+        // Rhythm mode on for some steps, keying a few drums
+        OPL3_WriteReg(&ref, 0xbd, (step & 4) ? (Bit8u)(0x20 | (step & 0x1f)) : 0xc0);
+        OPL3_WriteReg(&opl2, 0xbd, (step & 4) ? (Bit8u)(0x20 | (step & 0x1f)) : 0xc0);
+
+        n = 1 + (Bit32u)(step * 563) % 4096;
+        for (i = 0; i < (int)n; i++) {
+            OPL3_Generate(&ref, &ref_buf[2 * i]);
+        }
+        OPL3_GenerateBlockOPL2(&opl2, opl2_buf, n);
+
+        for (i = 0; i < (int)n; i++) {
+            assert(opl2_buf[2 * i] == opl2_buf[2 * i + 1]);
+            assert(opl2_buf[2 * i] == ref_buf[2 * i + 1]);
+        }
+    }
+
+    // With the OPL3 extensions on, channels panned left only drop out of
+    // the mix just as they drop out of the right output
+    OPL3_WriteReg(&ref, 0x105, 0x01);
+    OPL3_WriteReg(&opl2, 0x105, 0x01);
+    for (ch = 0; ch < 9; ch++) {
+        setup_voice(&ref, 0, ch, ch);
+        setup_voice(&opl2, 0, ch, ch);
+        OPL3_WriteReg(&ref, (Bit16u)(0xc0 + ch), (ch & 1) ? 0x10 : 0x20);
+        OPL3_WriteReg(&opl2, (Bit16u)(0xc0 + ch), (ch & 1) ? 0x10 : 0x20);
+    }
+    for (i = 0; i < 4096; i++) {
+        OPL3_Generate(&ref, &ref_buf[2 * i]);
+    }
+    OPL3_GenerateBlockOPL2(&opl2, opl2_buf, 4096);
+    for (i = 0; i < 4096; i++) {
+        assert(opl2_buf[2 * i] == ref_buf[2 * i + 1]);
+    }
+
+    printf("OK\n");
+}
+
+void test_doom_profile(void) {
+    static opl3_chip full, doom;
+    Bit16s full_buf[2], doom_buf[2];
+    int step, ch, i, bank;
+
+    printf("Testing Doom profile core... ");
+
+    setup_chip(&full);
+    setup_chip(&doom);
+    OPL3_SetDoomProfile(&doom, 1);
+    assert(doom.doomprofile);
+
+    // Melodic voices on both banks; rhythm mode is switched on at the end
+    for (step = 0; step < 12; step++) {
+        for (bank = 0; bank < 2; bank++) {
+            for (ch = 0; ch < 9; ch++) {
+                if ((ch + step + bank) % 3 == 0) {
+                    setup_voice(&full, bank, ch, step * 5 + ch);
+                    setup_voice(&doom, bank, ch, step * 5 + ch);
+                } else if ((ch + step + bank) % 3 == 1) {
+                    key_off(&full, bank, ch);
+                    key_off(&doom, bank, ch);
+                }
+            }
+        }
+        if (step == 10) {
+            OPL3_WriteReg(&full, 0xbd, 0x3f);
+            OPL3_WriteReg(&doom, 0xbd, 0x3f);
+            assert(!doom.doomprofile);
+        }
+        if (step < 10) {
+            assert(doom.doomprofile);
+        }
+
+        for (i = 0; i < 1500 + step * 211; i++) {
+            if (step & 1) {
+                OPL3_GenerateOPL2(&full, full_buf);
+                OPL3_GenerateOPL2(&doom, doom_buf);
+            } else {
+                OPL3_Generate(&full, full_buf);
+                OPL3_Generate(&doom, doom_buf);
+            }
+            assert(full_buf[0] == doom_buf[0]);
+            assert(full_buf[1] == doom_buf[1]);
+        }
+        assert(full.noise == doom.noise);
+        assert(full.rm_hh_bit2 == doom.rm_hh_bit2 && full.rm_hh_bit3 == doom.rm_hh_bit3);
+        assert(full.rm_hh_bit7 == doom.rm_hh_bit7 && full.rm_hh_bit8 == doom.rm_hh_bit8);
+    }
+
+    // Refused while rhythm is on; a 4-op pair also forces the full core
+    OPL3_SetDoomProfile(&doom, 1);
+    assert(!doom.doomprofile);
+    OPL3_WriteReg(&doom, 0xbd, 0xc0);
+    OPL3_SetDoomProfile(&doom, 1);
+    assert(doom.doomprofile);
+    OPL3_WriteReg(&doom, 0x104, 0x01);
+    assert(!doom.doomprofile);
+    OPL3_SetDoomProfile(&doom, 1);
+    assert(!doom.doomprofile);
+
+    printf("OK\n");
+}
+
+// Program a key-on 2-op voice on channel 0 with the given envelope, with
+// feedback on most of them
+static void setup_envelope(opl3_chip* chip, int ar, int dr, int sl, int rr, int sustain, int block) {
+    int op;
+
+    OPL3_Reset(chip, TEST_RATE);
+    OPL3_WriteReg(chip, 0x105, 0x01);
+    OPL3_WriteReg(chip, 0x01, 0x20);
+    for (op = 0; op < 6; op += 3) {
+        OPL3_WriteReg(chip, (Bit16u)(0x20 + op), (Bit8u)(0x01 | ((sl + rr + op) & 1) << 6
+                                                        | (sustain << 5) | ((ar + dr) & 1) << 4));
+        OPL3_WriteReg(chip, (Bit16u)(0x40 + op), 0x10);
+        OPL3_WriteReg(chip, (Bit16u)(0x60 + op), (Bit8u)((ar << 4) | dr));
+        OPL3_WriteReg(chip, (Bit16u)(0x80 + op), (Bit8u)((sl << 4) | rr));
+    }
+    OPL3_WriteReg(chip, 0xc0, (Bit8u)(0x30 | ((ar + sl) & 7) << 1));
+    OPL3_WriteReg(chip, 0xa0, 0x81);
+    OPL3_WriteReg(chip, 0xb0, (Bit8u)(0x20 | (block << 2) | 1));
+}
+
+void test_channel_skip(void) {
+    static opl3_chip ref, skip, timers;
+    static const int lengths[3] = { 2000, 12000, 4000 };
+    Bit16s buf[2];
+    Bit64u time;
+    int ar, dr, sl, rr, sustain, part, i, k;
+    unsigned int seed = 1;
+
+    printf("Testing channel skip... ");
+
+    // Attack, hold, release and a retrigger, skipped in uneven pieces
+    for (ar = 1; ar < 16; ar += 5) {
+        for (dr = 0; dr < 16; dr += 7) {
+            for (sl = 0; sl < 16; sl += 9) {
+                for (rr = 2; rr < 16; rr += 6) {
+                    for (sustain = 0; sustain < 2; sustain++) {
+                        int block = (ar * 3 + rr) % 8;
+
+                        setup_envelope(&ref, ar, dr, sl, rr, sustain, block);
+                        setup_envelope(&skip, ar, dr, sl, rr, sustain, block);
+                        time = 0;
+                        for (part = 0; part < 3; part++) {
+                            int left = lengths[part] + ar * 37;
+                            Bit8u key = part == 1 ? 0 : 0x20;
+
+                            if (part > 0) {
+                                OPL3_WriteReg(&ref, 0xb0, (Bit8u)(key | (block << 2) | 1));
+                                OPL3_WriteReg(&skip, 0xb0, (Bit8u)(key | (block << 2) | 1));
+                            }
+                            for (i = 0; i < left; i++) {
+                                OPL3_Generate(&ref, buf);
+                            }
+                            while (left > 0) {
+                                int n = 1 + (int)((seed = seed * 1103515245u + 12345u) >> 16)
+                                                  % (part == 1 ? 3000 : 50);
+                                if (n > left) {
+                                    n = left;
+                                }
+                                OPL3_ChannelSkip(&skip, 0, time, time + n, 1);
+                                time += n;
+                                left -= n;
+                            }
+                            for (k = 0; k < 2; k++) {
+                                const opl3_slot* a = ref.channel[0].slots[k];
+                                const opl3_slot* b = skip.channel[0].slots[k];
+                                assert(a->eg_rout == b->eg_rout);
+                                assert(a->eg_gen == b->eg_gen);
+                                assert(a->pg_phase == b->pg_phase);
+                            }
+                            // The modulator feeding back is rendered
+                            if (ref.channel[0].fb) {
+                                const opl3_slot* a = ref.channel[0].slots[0];
+                                const opl3_slot* b = skip.channel[0].slots[0];
+                                assert(a->out == b->out && a->prout == b->prout);
+                            }
+
+                            OPL3_Reset(&timers, TEST_RATE);
+                            OPL3_SetTime(&timers, time);
+                            assert(timers.timer == ref.timer);
+                            assert(timers.eg_timer == ref.eg_timer);
+                            assert(timers.eg_state == ref.eg_state);
+                            assert(timers.eg_add == ref.eg_add);
+                            assert(timers.tremolopos == ref.tremolopos);
+                            assert(timers.tremolo == ref.tremolo);
+                            assert(timers.vibpos == ref.vibpos);
+                            assert(timers.noise == ref.noise);
+                            assert(timers.writebuf_samplecnt == ref.writebuf_samplecnt);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    printf("OK\n");
+}
+
+void test_copy(void) {
+    static opl3_chip ref, chip, copy;
+    Bit16s a[2 * 256], b[2 * 256];
+    int ch;
+
+    printf("Testing chip copy... ");
+
+    setup_chip(&ref);
+    setup_chip(&chip);
+    for (ch = 0; ch < 9; ch++) {
+        setup_voice(&ref, 0, ch, ch * 5 + 1);
+        setup_voice(&ref, 1, ch, ch * 3 + 2);
+        setup_voice(&chip, 0, ch, ch * 5 + 1);
+        setup_voice(&chip, 1, ch, ch * 3 + 2);
+    }
+    OPL3_GenerateBlock(&ref, a, 256);
+    OPL3_GenerateBlock(&chip, b, 256);
+
+    // The copy renders on its own once the original is gone
+    OPL3_Copy(&copy, &chip);
+    memset(&chip, 0x55, sizeof(chip));
+    OPL3_GenerateBlock(&ref, a, 256);
+    OPL3_GenerateBlock(&copy, b, 256);
+    assert(memcmp(a, b, sizeof(a)) == 0);
+
+    printf("OK\n");
+}
+
+void test_waveforms(void) {
+    Bit32u phase;
+    Bit16u envelope;
+    Bit8u wf;
+
+    printf("Testing waveform generator... ");
+
+    // Every waveform, phase (including the ignored high bits) and envelope
+    for (wf = 0; wf < 8; wf++) {
+        for (phase = 0; phase < 0x10000; phase += (phase < 0x400) ? 1 : 0x3ff) {
+            for (envelope = 0; envelope < 0x200; envelope++) {
+                Bit16s ref = ref_calc_wave((Bit16u)phase, envelope, wf);
+                assert(OPL3_EnvelopeCalcWave((Bit16u)phase, envelope, wf) == ref);
+                if (envelope >= OPL3_ENVELOPE_SILENT) {
+                    assert(OPL3_EnvelopeCalcSign((Bit16u)phase, wf) == ref);
+                }
+            }
+        }
+    }
+
+    printf("OK\n");
+}
+
+// Offsets into a chip state blob: 36 slots of 38 bytes and 18 channels of
+// 16 bytes, then the chip fields up to the LFO state
+#define STATE_VIBSHIFT      1673
+#define STATE_TREMOLOSHIFT  1676
+
+void test_state(void) {
+    static opl3_chip ref, chip, loaded;
+    static Bit8u data[8192];
+    Bit16s a[2 * 512], b[2 * 512];
+    state_writer_t w;
+    state_reader_t r;
+    size_t size;
+    Bit8u saved;
+    int ch;
+
+    printf("Testing chip state... ");
+
+    // 4-op pairs, rhythm mode and buffered writes still pending
+    setup_chip(&ref);
+    OPL3_WriteReg(&ref, 0x104, 0x09);
+    for (ch = 0; ch < 9; ch++) {
+        setup_voice(&ref, 0, ch, ch * 5 + 1);
+        setup_voice(&ref, 1, ch, ch * 3 + 2);
+    }
+    OPL3_WriteReg(&ref, 0xbd, 0xff);
+    OPL3_GenerateBlock(&ref, a, 300);
+    OPL3_WriteRegBuffered(&ref, 0xb0, 0x00);
+    OPL3_WriteRegBuffered(&ref, 0x1b3, 0x00);
+    OPL3_Copy(&chip, &ref);
+
+    w.data = data;
+    w.size = sizeof(data);
+    w.pos = 0;
+    OPL3_SaveState(&chip, &w);
+    size = w.pos;
+    assert(size < sizeof(data));
+
+    OPL3_Reset(&loaded, TEST_RATE);
+    r.data = data;
+    r.size = size;
+    r.pos = 0;
+    r.error = 0;
+    assert(OPL3_LoadState(&loaded, &r) == 0);
+    assert(r.pos == size);
+    OPL3_GenerateBlock(&ref, a, 512);
+    OPL3_GenerateBlock(&loaded, b, 512);
+    assert(memcmp(a, b, sizeof(a)) == 0);
+
+    // Truncated or damaged snapshots are refused
+    OPL3_Reset(&loaded, TEST_RATE);
+    r.size = size - 1;
+    r.pos = 0;
+    assert(OPL3_LoadState(&loaded, &r) != 0);
+    saved = data[4];
+    data[4] = 0xff;
+    r.size = size;
+    r.pos = 0;
+    r.error = 0;
+    assert(OPL3_LoadState(&loaded, &r) != 0);
+
+    // LFO shifts that no register write can produce are refused
+    data[4] = saved;
+    data[STATE_VIBSHIFT] = 2;
+    r.pos = 0;
+    assert(OPL3_LoadState(&loaded, &r) != 0);
+    data[STATE_VIBSHIFT] = 1;
+    data[STATE_TREMOLOSHIFT] = 40;
+    r.pos = 0;
+    assert(OPL3_LoadState(&loaded, &r) != 0);
+    data[STATE_TREMOLOSHIFT] = 3;
+    r.pos = 0;
+    assert(OPL3_LoadState(&loaded, &r) != 0);
+    data[STATE_TREMOLOSHIFT] = 2;
+    r.pos = 0;
+    assert(OPL3_LoadState(&loaded, &r) == 0);
+
+    printf("OK\n");
+}
+
+int main(void) {
+    printf("=== libMusDoom OPL3 Tests ===\n\n");
+
+    test_waveforms();
+    test_generate_block();
+    test_idle_slots();
+    test_generate_opl2();
+    test_doom_profile();
+    test_channel_skip();
+    test_copy();
+    test_state();
+
+    printf("\n=== All tests passed! ===\n");
+    return 0;
+}
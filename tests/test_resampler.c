@@ -0,0 +1,235 @@
+/**
+ * Resampler tests for libMusDoom
+ *
+ * Checks that linear mode matches OPL3_GenerateResampled exactly and that
+ * the filtered modes pass the audio band while rejecting content above
+ * the output Nyquist frequency.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "opl3.h"
+#include "resampler.h"
+
+#define TEST_RATE 44100
+#define TEST_FRAMES 8192
+
+static int16_t native_buf[2 * 2 * TEST_FRAMES];
+static int16_t out_buf[2 * TEST_FRAMES];
+
+// Play one sustained voice on the chip
+static void setup_chip(opl3_chip* chip, Bit32u rate) {
+    OPL3_Reset(chip, rate);
+    OPL3_WriteReg(chip, 0x01, 0x20);
+    OPL3_WriteReg(chip, 0x20, 0x01);
+    OPL3_WriteReg(chip, 0x23, 0x01);
+    OPL3_WriteReg(chip, 0x40, 0x10);
+    OPL3_WriteReg(chip, 0x43, 0x00);
+    OPL3_WriteReg(chip, 0x60, 0xf0);
+    OPL3_WriteReg(chip, 0x63, 0xf0);
+    OPL3_WriteReg(chip, 0x80, 0x07);
+    OPL3_WriteReg(chip, 0x83, 0x07);
+    OPL3_WriteReg(chip, 0xc0, 0x3e);
+    OPL3_WriteReg(chip, 0xa0, 0x98);
+    OPL3_WriteReg(chip, 0xb0, 0x31);
+}
+
+// RMS of a resampled sine at `freq` Hz and amplitude 16384
+static double sine_rms(opl_resampler_quality_t quality, double freq) {
+    opl_resampler_t* rs = opl_resampler_create(quality, TEST_RATE);
+    size_t in_frames, i;
+    double sum = 0.0;
+
+    assert(rs != NULL);
+    in_frames = opl_resampler_input_frames(rs, TEST_FRAMES);
+    assert(in_frames <= 2 * TEST_FRAMES);
+    for (i = 0; i < in_frames; i++) {
+        int16_t v = (int16_t)(16384.0 * sin(2.0 * 3.14159265358979 * freq * i / OPL_NATIVE_RATE));
+        native_buf[2 * i] = v;
+        native_buf[2 * i + 1] = v;
+    }
+    opl_resampler_process(rs, native_buf, out_buf, TEST_FRAMES);
+    opl_resampler_destroy(rs);
+
+    // Skip the filter warm-up
+    for (i = 256; i < TEST_FRAMES; i++) {
+        sum += (double)out_buf[2 * i] * out_buf[2 * i];
+    }
+    return sqrt(sum / (TEST_FRAMES - 256));
+}
+
+void test_linear_exact(void) {
+    static opl3_chip ref, chip;
+    static int16_t ref_buf[2 * TEST_FRAMES];
+    opl_resampler_t* rs;
+    size_t i;
+
+    printf("Testing linear resampler... ");
+
+    setup_chip(&ref, TEST_RATE);
+    setup_chip(&chip, TEST_RATE);
+    for (i = 0; i < TEST_FRAMES; i++) {
+        OPL3_GenerateResampled(&ref, &ref_buf[2 * i]);
+    }
+
+    // Render in uneven spans to cross chunk boundaries
+    rs = opl_resampler_create(opl_resampler_linear, TEST_RATE);
+    assert(rs != NULL);
+    for (i = 0; i < TEST_FRAMES; ) {
+        size_t n = 1 + (i * 7) % 3000;
+        if (n > TEST_FRAMES - i) n = TEST_FRAMES - i;
+        opl_resampler_render(rs, &chip, OPL3_GenerateBlock, &out_buf[2 * i], n);
+        i += n;
+    }
+    opl_resampler_destroy(rs);
+
+    assert(memcmp(ref_buf, out_buf, sizeof(ref_buf)) == 0);
+    printf("OK\n");
+}
+
+void test_filtered(void) {
+    double pass, stop, linear_stop;
+
+    printf("Testing filtered resamplers... ");
+
+    // 1 kHz passes at close to unity gain (RMS of the input is ~11585)
+    pass = sine_rms(opl_resampler_sinc, 1000.0);
+    assert(pass > 11000.0 && pass < 12200.0);
+    pass = sine_rms(opl_resampler_halfband, 1000.0);
+    assert(pass > 11000.0 && pass < 12200.0);
+
+    // 23 kHz lies above the 22.05 kHz output Nyquist and would alias
+    linear_stop = sine_rms(opl_resampler_linear, 23000.0);
+    stop = sine_rms(opl_resampler_sinc, 23000.0);
+    assert(stop < 50.0 && stop < linear_stop / 20.0);
+    stop = sine_rms(opl_resampler_halfband, 23000.0);
+    assert(stop < 50.0 && stop < linear_stop / 20.0);
+
+    // Invalid parameters
+    assert(opl_resampler_create(opl_resampler_sinc, 0) == NULL);
+    assert(opl_resampler_create((opl_resampler_quality_t)7, TEST_RATE) == NULL);
+
+    printf("OK\n");
+}
+
+void test_render_span(void) {
+    static opl3_chip ref, chip;
+    static int16_t ref_buf[2 * TEST_FRAMES];
+    opl_resampler_t* ref_rs;
+    opl_resampler_t* rs;
+    size_t i;
+
+    printf("Testing span rendering... ");
+
+    // Native spans match the per-sample generator
+    setup_chip(&ref, OPL_NATIVE_RATE);
+    setup_chip(&chip, OPL_NATIVE_RATE);
+    for (i = 0; i < TEST_FRAMES; i++) {
+        OPL3_Generate(&ref, &ref_buf[2 * i]);
+    }
+    for (i = 0; i < TEST_FRAMES; ) {
+        size_t n = 1 + (i * 11) % 2500;
+        if (n > TEST_FRAMES - i) n = TEST_FRAMES - i;
+        opl_render_span(&chip, OPL3_GenerateBlock, NULL, &out_buf[2 * i], n);
+        i += n;
+    }
+    assert(memcmp(ref_buf, out_buf, sizeof(ref_buf)) == 0);
+
+    // Resampled spans match rendering one frame at a time
+    setup_chip(&ref, TEST_RATE);
+    setup_chip(&chip, TEST_RATE);
+    ref_rs = opl_resampler_create(opl_resampler_sinc, TEST_RATE);
+    rs = opl_resampler_create(opl_resampler_sinc, TEST_RATE);
+    assert(ref_rs != NULL && rs != NULL);
+    for (i = 0; i < TEST_FRAMES; i++) {
+        opl_resampler_render(ref_rs, &ref, OPL3_GenerateBlock, &ref_buf[2 * i], 1);
+    }
+    for (i = 0; i < TEST_FRAMES; ) {
+        size_t n = 1 + (i * 11) % 2500;
+        if (n > TEST_FRAMES - i) n = TEST_FRAMES - i;
+        opl_render_span(&chip, OPL3_GenerateBlock, rs, &out_buf[2 * i], n);
+        i += n;
+    }
+    assert(memcmp(ref_buf, out_buf, sizeof(ref_buf)) == 0);
+    opl_resampler_destroy(ref_rs);
+    opl_resampler_destroy(rs);
+
+    printf("OK\n");
+}
+
+void test_set_position(void) {
+    static const int rates[3] = { TEST_RATE, 32000, 96000 };
+    static int16_t ref_buf[2 * TEST_FRAMES];
+    static opl3_chip chip;
+    int quality, r;
+
+    printf("Testing resampler positioning... ");
+
+    setup_chip(&chip, OPL_NATIVE_RATE);
+    OPL3_GenerateBlock(&chip, native_buf, 2 * TEST_FRAMES);
+
+    for (quality = opl_resampler_linear; quality <= opl_resampler_halfband; quality++) {
+        for (r = 0; r < 3; r++) {
+            opl_resampler_t* ref = opl_resampler_create((opl_resampler_quality_t)quality, rates[r]);
+            opl_resampler_t* rs = opl_resampler_create((opl_resampler_quality_t)quality, rates[r]);
+            opl_resampler_t* copy;
+            size_t consumed = 0;
+            size_t frames = 0;
+            size_t at = 0;
+            size_t in;
+            size_t i;
+
+            assert(ref != NULL && rs != NULL);
+
+            // The consumed count follows rendering one frame at a time
+            for (i = 0; i < TEST_FRAMES; i++) {
+                assert(opl_resampler_native_position(ref, i) == consumed);
+                if (i == TEST_FRAMES / 3) {
+                    at = consumed;
+                }
+                in = opl_resampler_input_frames(ref, 1);
+                opl_resampler_process(ref, &native_buf[2 * consumed], &ref_buf[2 * i], 1);
+                consumed += in;
+            }
+
+            // A resampler moved to a frame matches once its history refills,
+            // and a clone matches at once
+            opl_resampler_reset(ref);
+            frames = TEST_FRAMES / 3;
+            in = opl_resampler_input_frames(ref, frames);
+            opl_resampler_process(ref, native_buf, out_buf, frames);
+            assert(in == at);
+            copy = opl_resampler_clone(ref);
+            assert(copy != NULL);
+            opl_resampler_set_position(rs, frames);
+            frames = TEST_FRAMES - frames;
+            opl_resampler_process(rs, &native_buf[2 * at], out_buf, frames);
+            assert(memcmp(&out_buf[2 * 200], &ref_buf[2 * (TEST_FRAMES / 3 + 200)],
+                          2 * (frames - 200) * sizeof(int16_t)) == 0);
+            opl_resampler_process(copy, &native_buf[2 * at], out_buf, frames);
+            assert(memcmp(out_buf, &ref_buf[2 * (TEST_FRAMES / 3)],
+                          2 * frames * sizeof(int16_t)) == 0);
+
+            opl_resampler_destroy(ref);
+            opl_resampler_destroy(rs);
+            opl_resampler_destroy(copy);
+        }
+    }
+
+    printf("OK\n");
+}
+
+int main(void) {
+    printf("=== libMusDoom Resampler Tests ===\n\n");
+
+    test_linear_exact();
+    test_filtered();
+    test_render_span();
+    test_set_position();
+
+    printf("\n=== All tests passed! ===\n");
+    return 0;
+}